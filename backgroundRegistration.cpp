@@ -0,0 +1,236 @@
+#include "backgroundRegistration.h"
+#include "registrationGraph.h"
+#include "profiler.h"
+#include "threadPool.h"
+// --- POSIX ---
+#include <pthread.h>
+#include <sched.h>
+#include <sys/resource.h>
+// --- C++ ---
+#include <math.h>
+#include <algorithm>
+
+// Whatever the scheduler has to spare. Threads this one starts inherit it.
+static void lowerPriority() {
+#ifdef SCHED_IDLE
+    sched_param sp;
+    sp.sched_priority = 0;
+    if( pthread_setschedparam( pthread_self(), SCHED_IDLE, &sp ) == 0 )
+        return;
+#endif
+    // Per thread on Linux
+    setpriority( PRIO_PROCESS, 0, 19 );
+}
+
+BackgroundRegistration::BackgroundRegistration( const std::vector< DepthModel >& models,
+                                                const BackgroundParams& params )
+    : params( params ), models( models ), seen( 0 ), epoch( 0 ), 
+      depth( models.size(), std::vector< uint16_t >( KINECT_PIXELS ) ),
+      frameTime( 0 ), lastSubmit( 0 ), busy( false ), stopping( false ), best( -1 ), 
+      drift( false ), swapped( 0 ) {
+
+    PoseSet* start = new PoseSet;
+    start->poses.resize( models.size() );
+    start->version = 0;
+    current.reset( start );
+    parents.assign( models.size(), -2 );
+    worker = std::thread( &BackgroundRegistration::run, this );
+}
+
+BackgroundRegistration::~BackgroundRegistration() {
+    {
+        std::lock_guard< std::mutex > guard( lock );
+        stopping = true;
+    }
+    wake.notify_all();
+    worker.join();
+}
+
+void BackgroundRegistration::reset( const RegistrationGraph& graph ) {
+
+    std::shared_ptr< const PoseSet > old = std::atomic_load( &current );
+    PoseSet* next = new PoseSet;
+    for( int cam = 0; cam < graph.numCameras(); cam++ )
+        next->poses.push_back( graph.pose( cam ) );
+    next->version = old->version + 1;
+    seen = next->version;
+
+    std::lock_guard< std::mutex > guard( lock );
+    epoch++;
+    parents.resize( graph.numCameras() );
+    for( int cam = 0; cam < graph.numCameras(); cam++ )
+        parents[cam] = graph.parent( cam );
+    order = graph.placementOrder();
+    best = -1;
+    drift = false;
+    std::atomic_store( &current, std::shared_ptr< const PoseSet >( next ) );
+}
+
+bool BackgroundRegistration::wantsFrames( double now ) {
+    std::lock_guard< std::mutex > guard( lock );
+    return !busy && order.size() > 1 && now - lastSubmit >= params.interval;
+}
+
+void BackgroundRegistration::submit( const std::vector< const uint16_t* >& frames, double now ) {
+    {
+        std::lock_guard< std::mutex > guard( lock );
+        if( busy )
+            return;
+        for( int cam = 0; cam < (int)depth.size() && cam < (int)frames.size(); cam++ )
+            std::copy( frames[cam], frames[cam] + KINECT_PIXELS, depth[cam].begin() );
+        frameTime = lastSubmit = now;
+        busy = true;
+    }
+    wake.notify_all();
+}
+
+bool BackgroundRegistration::update( RegistrationGraph& graph ) {
+    std::shared_ptr< const PoseSet > p = std::atomic_load( &current );
+    if( p->version == seen )
+        return false;
+    seen = p->version;
+    for( int cam = 0; cam < graph.numCameras() && cam < (int)p->poses.size(); cam++ )
+        if( graph.placed( cam ) )
+            graph.setPose( cam, p->poses[cam] );
+    return true;
+}
+
+bool BackgroundRegistration::drifting() {
+    std::lock_guard< std::mutex > guard( lock );
+    return drift;
+}
+
+int BackgroundRegistration::swaps() {
+    std::lock_guard< std::mutex > guard( lock );
+    return swapped;
+}
+
+void BackgroundRegistration::history( std::vector< RegistrationCheck >& out ) {
+    std::lock_guard< std::mutex > guard( lock );
+    out = checks;
+}
+
+void BackgroundRegistration::run() {
+
+    if( params.idle )
+        lowerPriority();
+    Profiler::shared().setThreadName( "reregister" );
+    ThreadPool pool;
+    ProjectiveIcp projective( params.projectiveIcp, &pool );
+
+    for( ;; ) {
+        std::vector< int > treeParents, treeOrder;
+        unsigned long startEpoch;
+        double taken;
+        {
+            std::unique_lock< std::mutex > guard( lock );
+            wake.wait( guard, [this] { return stopping || busy; } );
+            if( stopping )
+                return;
+            treeParents = parents;
+            treeOrder = order;
+            startEpoch = epoch;
+            taken = frameTime;
+        }
+        // depth is ours until busy is cleared
+        std::shared_ptr< const PoseSet > from = std::atomic_load( &current );
+        RegistrationCheck result;
+        std::vector< RigidTransform > refined;
+        check( from, treeParents, treeOrder, pool, projective, result, refined );
+        result.time = taken;
+
+        std::lock_guard< std::mutex > guard( lock );
+        busy = false;
+        if( epoch != startEpoch )
+            continue;
+
+        if( result.valid ) {
+            if( best < 0 || result.rmsBefore < best )
+                best = result.rmsBefore;
+            drift = result.rmsBefore > best + params.driftMargin;
+            if( result.rmsAfter < result.rmsBefore*( 1 - params.minImprovement ) ) {
+                PoseSet* next = new PoseSet;
+                next->poses = refined;
+                next->version = from->version + 1;
+                std::atomic_store( &current, std::shared_ptr< const PoseSet >( next ) );
+                result.swapped = true;
+                best = result.rmsAfter;
+                drift = false;
+                swapped++;
+            }
+        }
+        checks.push_back( result );
+        if( (int)checks.size() > params.history )
+            checks.erase( checks.begin() );
+    }
+}
+
+void BackgroundRegistration::check( const std::shared_ptr< const PoseSet >& from, 
+                                    const std::vector< int >& treeParents,
+                                    const std::vector< int >& treeOrder, ThreadPool& pool, 
+                                    ProjectiveIcp& projective, RegistrationCheck& out,
+                                    std::vector< RigidTransform >& refined ) {
+
+    PROFILE_SCOPE( "reregister" );
+    double start = monotonicSeconds();
+    out.rmsBefore = out.rmsAfter = 0;
+    out.valid = true;
+    out.swapped = false;
+
+    int n = (int)models.size();
+    std::vector< PointCloud > clouds( n );
+    for( int cam = 0; cam < n; cam++ )
+        models[cam].unprojectFrame( &depth[cam][0], clouds[cam] );
+
+    // Parents first, so every camera lines up with its refined parent
+    refined = from->poses;
+    double before = 0, after = 0;
+    int cameras = 0;
+    for( int k = 0; k < (int)treeOrder.size(); k++ ) {
+        int cam = treeOrder[k], parent = treeParents[cam];
+        if( parent < 0 )
+            continue;
+        RigidTransform guess = from->poses[parent].inverse()*from->poses[cam];
+        RigidTransform result;
+        int first, last;
+        float rmsBefore, rmsAfter;
+        if( params.projective ) {
+            // Its iterations start on the coarsest level, so both residuals
+            // are taken again at full resolution
+            projective.setTarget( clouds[parent], models[parent].intrinsics() );
+            result = projective.align( clouds[cam], guess ).transform;
+            rmsBefore = projective.residual( guess, &first );
+            rmsAfter = projective.residual( result, &last );
+        }
+        else {
+            Icp icp( params.icp, &pool );
+            icp.setTarget( clouds[parent], models[parent].intrinsics() );
+            IcpResult r = icp.align( clouds[cam], guess );
+            if( r.iterations.empty() ) {
+                out.valid = false;
+                break;
+            }
+            // The first iteration's residual is the one before any update
+            result = r.transform;
+            first = r.iterations[0].correspondences;
+            last = r.iterations.back().correspondences;
+            rmsBefore = r.iterations[0].rms;
+            rmsAfter = r.rms;
+        }
+        if( first < params.minCorrespondences || last < params.minCorrespondences ) {
+            out.valid = false;
+            break;
+        }
+        before += rmsBefore*rmsBefore;
+        after += rmsAfter*rmsAfter;
+        cameras++;
+        refined[cam] = refined[parent]*result;
+    }
+    if( !cameras )
+        out.valid = false;
+    if( out.valid ) {
+        out.rmsBefore = (float)sqrt( before/cameras );
+        out.rmsAfter = (float)sqrt( after/cameras );
+    }
+    out.ms = 1000*( monotonicSeconds() - start );
+}
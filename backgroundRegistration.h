@@ -0,0 +1,139 @@
+#ifndef KINREG_BACKGROUND_REGISTRATION_H
+#define KINREG_BACKGROUND_REGISTRATION_H
+
+#include "kinect.h"
+#include "depthModel.h"
+#include "icp.h"
+#include "projectiveIcp.h"
+#include "rigidTransform.h"
+// --- C++ ---
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class RegistrationGraph;
+
+struct BackgroundParams {
+    BackgroundParams() : interval( 2.0 ), minImprovement( 0.1f ), driftMargin( 0.003f ), 
+                         minCorrespondences( 500 ), history( 256 ), projective( false ),
+                         idle( true ) {}
+
+    // Tracking every frame: projective ICP on each frame it can get, any
+    // improvement taken, at normal priority so it isn't starved by the
+    // capture and render threads
+    static BackgroundParams continuous() {
+        BackgroundParams p;
+        p.interval = 0;
+        p.minImprovement = 0.01f;
+        p.projective = true;
+        p.idle = false;
+        return p;
+    }
+
+    double interval;        // seconds between checks, at least
+    float minImprovement;   // fraction the rms has to drop by for new poses to go in
+    float driftMargin;      // rms this far above the best seen with the poses in use is drift, meters
+    int minCorrespondences; // per camera, fewer and the check doesn't count
+    int history;            // checks kept
+    bool projective;        // ProjectiveIcp instead of Icp, fast enough for every frame
+    bool idle;              // worker and its pool only get what the scheduler has to spare
+    IcpParams icp;
+    ProjectiveIcpParams projectiveIcp;
+};
+
+// One check: every placed camera ICP'd against its parent from the poses
+// in use. rms is over the cameras, each camera's point to plane rms.
+struct RegistrationCheck {
+    double time;            // monotonicSeconds() when the frames were taken
+    float rmsBefore;        // with the poses in use
+    float rmsAfter;         // with the refined ones
+    bool valid;             // enough overlap on every camera to trust it
+    bool swapped;           // the refined poses went in
+    double ms;
+};
+
+/*
+ * Keeps the registration up to date while the program runs, for cameras
+ * that get bumped or drift as they warm up.
+ *
+ * A worker thread at idle priority (with its own idle priority pool for
+ * ICP, unless idle is cleared) takes depth frames every interval and
+ * refines every camera against the one it was chained from, starting
+ * from the poses in use, parents first like refineICP(). If that brings
+ * the rms down by minImprovement the new poses replace the old ones in
+ * one atomic pointer swap. Either way the check goes into the history,
+ * and the rms with the poses in use rising driftMargin above the best it
+ * has been is reported as drift.
+ *
+ * With projective set the checks use ProjectiveIcp, cheap enough that
+ * interval 0 tracks the poses as often as the worker gets through a
+ * check (see continuous()). That worker competes with capture and
+ * render for the cores instead of waiting for them to idle.
+ *
+ * The render thread only ever copies depth in wantsFrames()/submit() and
+ * picks poses up in update(), neither waits on the worker.
+ */
+class BackgroundRegistration {
+public:
+    BackgroundRegistration( const std::vector< DepthModel >& models,
+                            const BackgroundParams& params = BackgroundParams() );
+    // Stops the worker, waiting for a check in progress
+    ~BackgroundRegistration();
+
+    // Starts over from graph's poses and tree, e.g. after registering by
+    // hand. A check already running is thrown away.
+    void reset( const RegistrationGraph& graph );
+
+    // True if the worker is idle, it's been interval since the last frames
+    // and there is something to register
+    bool wantsFrames( double now );
+    // Copies one depth frame per camera and wakes the worker
+    void submit( const std::vector< const uint16_t* >& depth, double now );
+
+    // Puts the newest poses into graph. Returns true if they changed since
+    // the last call.
+    bool update( RegistrationGraph& graph );
+
+    bool drifting();
+    int swaps();
+    void history( std::vector< RegistrationCheck >& out );
+
+private:
+    BackgroundRegistration( const BackgroundRegistration& );
+    BackgroundRegistration& operator=( const BackgroundRegistration& );
+
+    struct PoseSet {
+        std::vector< RigidTransform > poses;
+        unsigned long version;
+    };
+
+    void run();
+    void check( const std::shared_ptr< const PoseSet >& from, const std::vector< int >& parents,
+                const std::vector< int >& order, ThreadPool& pool, ProjectiveIcp& projective,
+                RegistrationCheck& out, std::vector< RigidTransform >& refined );
+
+    BackgroundParams params;
+    std::vector< DepthModel > models;
+
+    // Swapped whole, read without the lock
+    std::shared_ptr< const PoseSet > current;
+    unsigned long seen;             // render thread's last version
+
+    std::mutex lock;                // guards everything below
+    std::condition_variable wake;
+    std::vector< int > parents, order;
+    unsigned long epoch;            // bumped by reset()
+    std::vector< std::vector< uint16_t > > depth;
+    double frameTime, lastSubmit;
+    bool busy, stopping;
+    float best;                     // lowest rms seen with the poses in use, < 0 for none yet
+    bool drift;
+    int swapped;
+    std::vector< RegistrationCheck > checks;
+
+    std::thread worker;
+};
+
+#endif
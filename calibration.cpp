@@ -0,0 +1,314 @@
+#include "calibration.h"
+#include "log.h"
+#include "registrationGraph.h"
+// --- C++ ---
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+
+static const char CALIBRATION_MAGIC[8] = "KINCALB";
+static const char* TEXT_MAGIC = "# kinreg calibration";
+static const int TABLE_FLOATS = 2048 + 2*KINECT_PIXELS;
+static const uint32_t MAX_CAMERAS = 64;
+
+static bool sameIntrinsics( const Intrinsics& p, const Intrinsics& q ) {
+    return p.fx == q.fx && p.fy == q.fy && p.cx == q.cx && p.cy == q.cy && p.a == q.a && p.b == q.b;
+}
+
+static CameraCalibration unregistered() {
+    CameraCalibration c;
+    c.intrinsics = defaultIntrinsics();
+    c.parent = -2;
+    c.centroid = cv::Vec3f( 0, 0, 0 );
+    return c;
+}
+
+void captureCalibration( const RegistrationGraph& graph, const std::vector< DepthModel >& models,
+                         Calibration& out ) {
+    out.reference = graph.reference();
+    out.cameras.resize( graph.numCameras() );
+    for( int cam = 0; cam < graph.numCameras(); cam++ ) {
+        CameraCalibration& c = out.cameras[cam];
+        c.intrinsics = cam < (int)models.size() ? models[cam].intrinsics() : defaultIntrinsics();
+        c.pose = graph.pose( cam );
+        c.parent = graph.parent( cam );
+        c.centroid = graph.centroid( cam );
+    }
+}
+
+bool applyCalibration( const Calibration& calibration, RegistrationGraph& graph,
+                       std::vector< DepthModel >& models, const std::vector< DepthModel >* tables ) {
+
+    // The poses are relative to the reference, without it they mean nothing
+    if( calibration.reference < 0 || calibration.reference >= graph.numCameras() ) {
+        LOG_ERROR( "the calibration's reference, camera %d, isn't one of the %d cameras", 
+                   calibration.reference, graph.numCameras() );
+        return false;
+    }
+    int n = std::min( graph.numCameras(), (int)calibration.cameras.size() );
+    if( calibration.reference != graph.reference() )
+        graph = RegistrationGraph( graph.numCameras(), calibration.reference );
+
+    std::vector< RigidTransform > poses( n );
+    std::vector< int > parents( n );
+    std::vector< cv::Vec3f > centroids( n );
+    for( int cam = 0; cam < n; cam++ ) {
+        const CameraCalibration& c = calibration.cameras[cam];
+        poses[cam] = c.pose;
+        parents[cam] = c.parent;
+        centroids[cam] = c.centroid;
+        if( cam >= (int)models.size() )
+            continue;
+        if( tables && cam < (int)tables->size() && sameIntrinsics( (*tables)[cam].intrinsics(), c.intrinsics ) )
+            models[cam] = (*tables)[cam];
+        else if( !sameIntrinsics( models[cam].intrinsics(), c.intrinsics ) )
+            models[cam] = DepthModel( c.intrinsics );
+    }
+    graph.restore( poses, parents, centroids );
+    return true;
+}
+
+// ---------------------------------------------------------------------------
+// Binary
+
+bool saveCalibration( const std::string& path, const Calibration& calibration,
+                      const std::vector< DepthModel >* models ) {
+
+    int n = (int)calibration.cameras.size();
+    bool tables = models && (int)models->size() == n;
+
+    // Written beside it and renamed over it, so a crash can't leave half a
+    // calibration behind
+    std::string tmp = path + ".tmp";
+    FILE* f = fopen( tmp.c_str(), "wb" );
+    if( !f )
+        return false;
+
+    CalibrationHeader h;
+    memset( &h, 0, sizeof( h ) );
+    memcpy( h.magic, CALIBRATION_MAGIC, sizeof( h.magic ) );
+    h.version = CALIBRATION_VERSION;
+    h.numCams = n;
+    h.reference = calibration.reference;
+    h.flags = tables ? CALIBRATION_HAS_TABLES : 0;
+    h.created = (int64_t)time( 0 );
+    bool ok = fwrite( &h, sizeof( h ), 1, f ) == 1;
+
+    for( int cam = 0; cam < n; cam++ ) {
+        const CameraCalibration& c = calibration.cameras[cam];
+        CalibrationCamera out;
+        memset( &out, 0, sizeof( out ) );
+        out.fx = c.intrinsics.fx;
+        out.fy = c.intrinsics.fy;
+        out.cx = c.intrinsics.cx;
+        out.cy = c.intrinsics.cy;
+        out.a = c.intrinsics.a;
+        out.b = c.intrinsics.b;
+        for( int r = 0; r < 3; r++ ) {
+            for( int col = 0; col < 3; col++ )
+                out.R[3*r + col] = c.pose.R(r,col);
+            out.t[r] = c.pose.t[r];
+            out.centroid[r] = c.centroid[r];
+        }
+        out.parent = c.parent;
+        ok = ok && fwrite( &out, sizeof( out ), 1, f ) == 1;
+    }
+
+    for( int cam = 0; tables && cam < n; cam++ ) {
+        const DepthModel& m = (*models)[cam];
+        ok = ok && fwrite( m.depthTable(), sizeof( float ), 2048, f ) == 2048 &&
+                   fwrite( m.rayTableX(), sizeof( float ), KINECT_PIXELS, f ) == KINECT_PIXELS &&
+                   fwrite( m.rayTableY(), sizeof( float ), KINECT_PIXELS, f ) == KINECT_PIXELS;
+    }
+
+    ok = fclose( f ) == 0 && ok;
+    if( ok )
+        ok = rename( tmp.c_str(), path.c_str() ) == 0;
+    if( !ok )
+        remove( tmp.c_str() );
+    return ok;
+}
+
+static bool loadBinary( FILE* f, const std::string& path, Calibration& out, 
+                        std::vector< DepthModel >* tables ) {
+
+    CalibrationHeader h;
+    if( fread( &h, sizeof( h ), 1, f ) != 1 || memcmp( h.magic, CALIBRATION_MAGIC, sizeof( h.magic ) ) != 0 ) {
+        LOG_ERROR( "%s isn't a calibration file", path.c_str() );
+        return false;
+    }
+    if( h.version != CALIBRATION_VERSION ) {
+        LOG_ERROR( "%s is calibration version %u, this build reads %u", path.c_str(), 
+                h.version, CALIBRATION_VERSION );
+        return false;
+    }
+    if( h.numCams == 0 || h.numCams > MAX_CAMERAS || h.reference < 0 || h.reference >= (int32_t)h.numCams ) {
+        LOG_ERROR( "%s is damaged", path.c_str() );
+        return false;
+    }
+
+    out.reference = h.reference;
+    out.cameras.assign( h.numCams, unregistered() );
+    for( uint32_t cam = 0; cam < h.numCams; cam++ ) {
+        CalibrationCamera in;
+        if( fread( &in, sizeof( in ), 1, f ) != 1 ) {
+            LOG_ERROR( "%s is truncated", path.c_str() );
+            return false;
+        }
+        CameraCalibration& c = out.cameras[cam];
+        c.intrinsics.fx = in.fx;
+        c.intrinsics.fy = in.fy;
+        c.intrinsics.cx = in.cx;
+        c.intrinsics.cy = in.cy;
+        c.intrinsics.a = in.a;
+        c.intrinsics.b = in.b;
+        c.pose = RigidTransform( cv::Matx33f( in.R ), cv::Vec3f( in.t[0], in.t[1], in.t[2] ) );
+        c.parent = in.parent;
+        c.centroid = cv::Vec3f( in.centroid[0], in.centroid[1], in.centroid[2] );
+    }
+
+    // Missing or short tables only cost the time to rebuild them
+    if( tables && ( h.flags & CALIBRATION_HAS_TABLES ) ) {
+        std::vector< float > buffer( TABLE_FLOATS );
+        tables->clear();
+        for( uint32_t cam = 0; cam < h.numCams; cam++ ) {
+            if( fread( &buffer[0], sizeof( float ), TABLE_FLOATS, f ) != (size_t)TABLE_FLOATS ) {
+                tables->clear();
+                break;
+            }
+            tables->push_back( DepthModel( out.cameras[cam].intrinsics, &buffer[0], 
+                                           &buffer[2048], &buffer[2048 + KINECT_PIXELS] ) );
+        }
+    }
+    return true;
+}
+
+// ---------------------------------------------------------------------------
+// Text
+
+bool saveCalibrationText( const std::string& path, const Calibration& calibration ) {
+
+    FILE* f = fopen( path.c_str(), "w" );
+    if( !f )
+        return false;
+
+    fprintf( f, "%s\n", TEXT_MAGIC );
+    fprintf( f, "# intrinsics are fx fy cx cy in pixels and a b of depth = 1/(a*disparity + b)\n" );
+    fprintf( f, "# rotation (row major) and translation take the camera's points into the\n" );
+    fprintf( f, "# reference camera's space, parent is the camera it was registered against\n" );
+    fprintf( f, "# (-1 for the reference, -2 for not registered) and centroid the mean\n" );
+    fprintf( f, "# of its click points in its own space\n" );
+    fprintf( f, "version %u\ncameras %d\nreference %d\n", CALIBRATION_VERSION, 
+             (int)calibration.cameras.size(), calibration.reference );
+    for( int cam = 0; cam < (int)calibration.cameras.size(); cam++ ) {
+        const CameraCalibration& c = calibration.cameras[cam];
+        const Intrinsics& k = c.intrinsics;
+        const RigidTransform& T = c.pose;
+        fprintf( f, "\ncamera %d\n", cam );
+        fprintf( f, "intrinsics %.9g %.9g %.9g %.9g %.9g %.9g\n", k.fx, k.fy, k.cx, k.cy, k.a, k.b );
+        fprintf( f, "parent %d\n", c.parent );
+        fprintf( f, "rotation %.9g %.9g %.9g  %.9g %.9g %.9g  %.9g %.9g %.9g\n",
+                 T.R(0,0), T.R(0,1), T.R(0,2), T.R(1,0), T.R(1,1), T.R(1,2), 
+                 T.R(2,0), T.R(2,1), T.R(2,2) );
+        fprintf( f, "translation %.9g %.9g %.9g\n", T.t[0], T.t[1], T.t[2] );
+        fprintf( f, "centroid %.9g %.9g %.9g\n", c.centroid[0], c.centroid[1], c.centroid[2] );
+    }
+    return fclose( f ) == 0;
+}
+
+static bool loadText( FILE* f, const std::string& path, Calibration& out ) {
+
+    out.reference = 0;
+    out.cameras.clear();
+    char line[512];
+    int lineNo = 0, cam = -1;
+    while( fgets( line, sizeof( line ), f ) ) {
+        lineNo++;
+        char key[32];
+        if( line[0] == '#' || sscanf( line, "%31s", key ) != 1 )
+            continue;
+        const char* rest = line + strlen( key ) + ( line[strlen( key )] ? 1 : 0 );
+        while( *rest == ' ' || *rest == '\t' )
+            rest++;
+
+        bool ok = true;
+        int value;
+        if( strcmp( key, "version" ) == 0 ) {
+            ok = sscanf( rest, "%d", &value ) == 1;
+            if( ok && value != (int)CALIBRATION_VERSION ) {
+                LOG_ERROR( "%s is calibration version %d, this build reads %u", path.c_str(), 
+                        value, CALIBRATION_VERSION );
+                return false;
+            }
+        }
+        else if( strcmp( key, "cameras" ) == 0 ) {
+            ok = sscanf( rest, "%d", &value ) == 1 && value > 0 && value <= (int)MAX_CAMERAS;
+            if( ok )
+                out.cameras.assign( value, unregistered() );
+        }
+        else if( strcmp( key, "reference" ) == 0 )
+            ok = sscanf( rest, "%d", &out.reference ) == 1;
+        else if( strcmp( key, "camera" ) == 0 )
+            ok = sscanf( rest, "%d", &cam ) == 1 && cam >= 0 && cam < (int)out.cameras.size();
+        else if( cam < 0 )
+            ok = false;
+        else if( strcmp( key, "intrinsics" ) == 0 ) {
+            Intrinsics& k = out.cameras[cam].intrinsics;
+            ok = sscanf( rest, "%f %f %f %f %f %f", &k.fx, &k.fy, &k.cx, &k.cy, &k.a, &k.b ) == 6;
+        }
+        else if( strcmp( key, "parent" ) == 0 )
+            ok = sscanf( rest, "%d", &out.cameras[cam].parent ) == 1;
+        else if( strcmp( key, "rotation" ) == 0 ) {
+            float* R = out.cameras[cam].pose.R.val;
+            ok = sscanf( rest, "%f %f %f %f %f %f %f %f %f", R, R+1, R+2, R+3, R+4, R+5, R+6, R+7, R+8 ) == 9;
+        }
+        else if( strcmp( key, "translation" ) == 0 ) {
+            cv::Vec3f& t = out.cameras[cam].pose.t;
+            ok = sscanf( rest, "%f %f %f", &t[0], &t[1], &t[2] ) == 3;
+        }
+        else if( strcmp( key, "centroid" ) == 0 ) {
+            cv::Vec3f& c = out.cameras[cam].centroid;
+            ok = sscanf( rest, "%f %f %f", &c[0], &c[1], &c[2] ) == 3;
+        }
+        else
+            ok = false;
+
+        if( !ok ) {
+            LOG_ERROR( "%s line %d doesn't make sense: %s", path.c_str(), lineNo, line );
+            return false;
+        }
+    }
+    if( out.cameras.empty() || out.reference < 0 || out.reference >= (int)out.cameras.size() ) {
+        LOG_ERROR( "%s has no cameras or a bad reference", path.c_str() );
+        return false;
+    }
+    return true;
+}
+
+bool loadCalibration( const std::string& path, Calibration& out, std::vector< DepthModel >* tables ) {
+
+    FILE* f = fopen( path.c_str(), "rb" );
+    if( !f )
+        return false;
+
+    char start[8] = { 0 };
+    size_t got = fread( start, 1, sizeof( start ), f );
+    rewind( f );
+    bool ok;
+    if( got == sizeof( start ) && memcmp( start, CALIBRATION_MAGIC, sizeof( start ) ) == 0 )
+        ok = loadBinary( f, path, out, tables );
+    else {
+        char first[64] = "";
+        ok = fgets( first, sizeof( first ), f ) && strncmp( first, TEXT_MAGIC, strlen( TEXT_MAGIC ) ) == 0;
+        if( ok ) {
+            if( tables )
+                tables->clear();
+            ok = loadText( f, path, out );
+        }
+        else
+            LOG_ERROR( "%s isn't a calibration file", path.c_str() );
+    }
+    fclose( f );
+    return ok;
+}
@@ -0,0 +1,88 @@
+#ifndef KINREG_CALIBRATION_H
+#define KINREG_CALIBRATION_H
+
+#include "depthModel.h"
+#include "rigidTransform.h"
+// --- C++ ---
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+class RegistrationGraph;
+
+/*
+ * Saved calibration: every camera's intrinsics, pose and click centroid,
+ * so kinect_reg can start from the last registration instead of clicking
+ * again.
+ *
+ * Two formats, loadCalibration() tells them apart by their first bytes:
+ *
+ *  - binary, for startup: a 64 byte CalibrationHeader, one
+ *    CalibrationCamera per camera and, if the header says so, every
+ *    camera's DepthModel tables (2048 floats of disparity -> meters, then
+ *    the x and y rays, KINECT_PIXELS floats each), so they're read back
+ *    instead of rebuilt. Host byte order.
+ *
+ *  - text, for people: "# kinreg calibration" and then one keyword per
+ *    line, see saveCalibrationText(). Editing it by hand is fine.
+ */
+
+const uint32_t CALIBRATION_VERSION = 1;
+
+enum CalibrationFlags {
+    CALIBRATION_HAS_TABLES = 1
+};
+
+struct CalibrationHeader {
+    char magic[8];              // "KINCALB\0"
+    uint32_t version;
+    uint32_t numCams;
+    int32_t reference;
+    uint32_t flags;             // CalibrationFlags
+    int64_t created;            // unix time
+    uint8_t reserved[32];
+};
+
+struct CalibrationCamera {
+    float fx, fy, cx, cy, a, b; // Intrinsics
+    float R[9];                 // camera to world, row major
+    float t[3];
+    int32_t parent;             // as RegistrationGraph::parent()
+    float centroid[3];          // as RegistrationGraph::centroid(), zero in older files
+    uint8_t reserved[20];
+};
+
+struct CameraCalibration {
+    Intrinsics intrinsics;
+    RigidTransform pose;        // camera to world
+    int parent;                 // -1 for the reference, -2 if it isn't registered
+    cv::Vec3f centroid;         // of its click points, its own space
+};
+
+struct Calibration {
+    int reference;
+    std::vector< CameraCalibration > cameras;
+};
+
+// From the models and the graph's current poses, and back. applyCalibration()
+// only touches the cameras both have; tables are the DepthModels loaded
+// along with the calibration, if any. It logs why and changes nothing if
+// the calibration's reference camera isn't one of the graph's.
+void captureCalibration( const RegistrationGraph& graph, const std::vector< DepthModel >& models,
+                         Calibration& out );
+bool applyCalibration( const Calibration& calibration, RegistrationGraph& graph,
+                       std::vector< DepthModel >& models,
+                       const std::vector< DepthModel >* tables = 0 );
+
+// models, if given, have their tables saved too (one per camera)
+bool saveCalibration( const std::string& path, const Calibration& calibration,
+                      const std::vector< DepthModel >* models = 0 );
+bool saveCalibrationText( const std::string& path, const Calibration& calibration );
+
+// Either format. If the file has tables and tables isn't 0, it gets one
+// DepthModel per camera built from them. Prints why and returns false if
+// the file can't be used.
+bool loadCalibration( const std::string& path, Calibration& out,
+                      std::vector< DepthModel >* tables = 0 );
+
+#endif
@@ -0,0 +1,134 @@
+#include "capture.h"
+#include "profiler.h"
+#include "sessionFile.h"
+// --- C++ ---
+#include <stdio.h>
+#include <string.h>
+
+void FrameSignal::notify() {
+    {
+        // Bumped under the lock so a waiter can't miss it between checking
+        // and going to sleep
+        std::lock_guard< std::mutex > hold( lock );
+        published++;
+    }
+    arrived.notify_all();
+}
+
+bool FrameSignal::wait( unsigned long seen, double timeout ) {
+    std::unique_lock< std::mutex > hold( lock );
+    return arrived.wait_for( hold, std::chrono::duration< double >( timeout ),
+                             [&]() { return published.load() != seen; } );
+}
+
+CaptureThread::CaptureThread( FrameSource* source, int cam ) 
+    : source( source ), cam( cam ), running( false ), 
+      captured( 0 ), failures( 0 ), filterMode( DEPTH_FILTER_HOLE_FILL ),
+      raw( KINECT_PIXELS ), recorder( 0 ), signal( 0 ), haveFrame( false ), 
+      lastSequence( 0 ), dropped( 0 ) {}
+
+CaptureThread::~CaptureThread() {
+    stop();
+}
+
+void CaptureThread::start() {
+    if( running.exchange( true ) )
+        return;
+    worker = std::thread( &CaptureThread::run, this );
+}
+
+void CaptureThread::stop() {
+    running = false;
+    if( worker.joinable() )
+        worker.join();
+}
+
+void CaptureThread::run() {
+
+    char name[32];
+    snprintf( name, sizeof( name ), "capture %d", cam );
+    Profiler::shared().setThreadName( name );
+
+    uint32_t sequence = 0;
+    while( running ) {
+        Frame& f = buffers.writeBuffer();
+
+        // depth is wherever the unfiltered depth ended up: in f for grab(),
+        // in the source's memory for view(), where the filter reads it
+        // without another copy
+        const uint16_t* depth = f.depth;
+        bool ok;
+        {
+            PROFILE_SCOPE( "grab", cam );
+            if( source->canView() ) {
+                FrameView v;
+                ok = source->view( cam, v );
+                if( ok ) {
+                    memcpy( f.rgb, v.rgb, sizeof( f.rgb ) );
+                    f.deviceTimestamp = v.deviceTimestamp;
+                    depth = v.depth;
+                }
+            }
+            else
+                ok = source->grab( cam, f );
+        }
+        if( !ok ) {
+            // Don't spin on a dead sensor
+            failures++;
+            std::this_thread::sleep_for( std::chrono::milliseconds( 10 ) );
+            continue;
+        }
+        f.timestamp = monotonicSeconds();
+        f.sequence = sequence++;
+
+        if( recorder ) {
+            PROFILE_SCOPE( "record", cam );
+            recorder->write( cam, f.rgb, depth, f.timestamp, f.deviceTimestamp, f.sequence );
+        }
+
+        {
+            PROFILE_SCOPE( "depth_filter", cam );
+            DepthFilterMode mode = filterMode;
+            if( mode == DEPTH_FILTER_NONE ) {
+                if( depth != f.depth )
+                    memcpy( f.depth, depth, sizeof( f.depth ) );
+            }
+            else {
+                if( depth == f.depth ) {
+                    memcpy( &raw[0], f.depth, sizeof( f.depth ) );
+                    depth = &raw[0];
+                }
+                filter.setMode( mode );
+                filter.apply( depth, f.depth );
+            }
+        }
+
+        buffers.publish();
+        captured++;
+        if( signal )
+            signal->notify();
+    }
+}
+
+bool CaptureThread::latest() {
+    if( !buffers.update() )
+        return false;
+    // Anything published between two pickups was overwritten unseen
+    uint32_t sequence = buffers.readBuffer().sequence;
+    if( haveFrame && sequence > lastSequence + 1 )
+        dropped += sequence - lastSequence - 1;
+    lastSequence = sequence;
+    haveFrame = true;
+    return true;
+}
+
+bool CaptureThread::waitForFirstFrame( double timeout ) {
+
+    double giveUp = monotonicSeconds() + timeout;
+    while( !latest() && !haveFrame ) {
+        if( monotonicSeconds() > giveUp )
+            return false;
+        std::this_thread::sleep_for( std::chrono::milliseconds( 5 ) );
+    }
+    return true;
+}
@@ -0,0 +1,113 @@
+#ifndef KINREG_CAPTURE_H
+#define KINREG_CAPTURE_H
+
+#include "kinect.h"
+#include "frameSource.h"
+#include "tripleBuffer.h"
+#include "depthFilter.h"
+// --- C++ ---
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+ * Counts frames published by any number of capture threads so a consumer
+ * can sleep until there's something new instead of polling.
+ */
+class FrameSignal {
+public:
+    FrameSignal() : published( 0 ) {}
+
+    void notify();
+    unsigned long count() const { return published.load(); }
+
+    // Waits until count() passes seen or timeout seconds go by. Returns
+    // true if there are frames newer than seen.
+    bool wait( unsigned long seen, double timeout );
+
+private:
+    std::atomic< unsigned long > published;
+    std::mutex lock;
+    std::condition_variable arrived;
+};
+
+/*
+ * One producer thread per camera. The thread sits in FrameSource::grab()
+ * (which is where the USB latency goes) and publishes every completed frame
+ * into a triple buffer (sources that can lend frames out, see
+ * FrameSource::view(), are read in place instead). Depth preprocessing
+ * (see DepthFilter) runs here too, so it overlaps with rendering instead of
+ * adding to it. The render and registration code only ever picks up the
+ * newest completed frame and never waits on the sensor.
+ *
+ * CaptureThread is big (three full frames), allocate it with new.
+ */
+class SessionWriter;
+
+class CaptureThread {
+public:
+    CaptureThread( FrameSource* source, int cam );
+    ~CaptureThread();
+
+    void start();
+    void stop();
+
+    // Consumer side, call from one thread only. Swaps in the newest frame
+    // if one was captured since the last call and returns true if so. The
+    // frame returned by frame() stays valid and unchanged until the next
+    // call to latest().
+    bool latest();
+    const Frame& frame() const { return buffers.readBuffer(); }
+    Frame& frame() { return buffers.readBuffer(); }
+
+    // True once latest() has picked up at least one frame
+    bool hasFrame() const { return haveFrame; }
+
+    // Frames that were captured but replaced by a newer one before
+    // latest() got to them. Consumer side like latest().
+    unsigned long framesDropped() const { return dropped; }
+
+    // Blocks until the first frame arrives or timeout seconds pass
+    bool waitForFirstFrame( double timeout );
+
+    // Takes effect from the next captured frame. Safe to call from any thread.
+    void setDepthFilter( DepthFilterMode mode ) { filterMode = mode; }
+    DepthFilterMode depthFilter() const { return filterMode.load(); }
+
+    // Every captured frame also goes to recorder, before any filtering.
+    // Set it before start().
+    void setRecorder( SessionWriter* writer ) { recorder = writer; }
+
+    // Notified after every published frame, set it before start()
+    void setFrameSignal( FrameSignal* s ) { signal = s; }
+
+    int camera() const { return cam; }
+    unsigned long framesCaptured() const { return captured.load(); }
+    unsigned long grabFailures() const { return failures.load(); }
+
+private:
+    CaptureThread( const CaptureThread& );
+    CaptureThread& operator=( const CaptureThread& );
+
+    void run();
+
+    FrameSource* source;
+    int cam;
+    TripleBuffer< Frame > buffers;
+    std::thread worker;
+    std::atomic< bool > running;
+    std::atomic< unsigned long > captured;
+    std::atomic< unsigned long > failures;
+    std::atomic< DepthFilterMode > filterMode;
+    DepthFilter filter;             // only touched by the capture thread
+    std::vector< uint16_t > raw;    // unfiltered depth of the current frame
+    SessionWriter* recorder;
+    FrameSignal* signal;
+    bool haveFrame;
+    uint32_t lastSequence;          // of the frame latest() last picked up
+    unsigned long dropped;
+};
+
+#endif
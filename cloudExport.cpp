@@ -0,0 +1,417 @@
+#include "cloudExport.h"
+#include "kinect.h"
+#include "log.h"
+#include "profiler.h"
+// --- C++ ---
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+
+static const char CLOUD_MAGIC[8] = "KINCLDS";
+static const char CHUNK_MAGIC[4] = { 'C', 'H', 'N', 'K' };
+
+static bool littleEndian() {
+    uint16_t one = 1;
+    return *(uint8_t*)&one == 1;
+}
+
+static int finitePoints( const PointCloud& cloud ) {
+    int n = 0;
+    for( int i = 0; i < cloud.size(); i++ )
+        n += cloud.finite( i );
+    return n;
+}
+
+// Finite points as interleaved records, what PLY and PCD both want: x y z,
+// then nx ny nz, then colour as three bytes (PLY) or PCL's packed float
+// (PCD). Returns the number of points.
+static int packRecords( const PointCloud& cloud, bool pcd, std::vector< uint8_t >& out ) {
+
+    bool normals = cloud.has( POINT_NORMAL ), color = cloud.has( POINT_COLOR );
+    size_t stride = 12 + ( normals ? 12 : 0 ) + ( color ? ( pcd ? 4 : 3 ) : 0 );
+    int n = finitePoints( cloud );
+    out.resize( n*stride );
+
+    uint8_t* p = n ? &out[0] : 0;
+    for( int i = 0; i < cloud.size(); i++ ) {
+        if( !cloud.finite( i ) )
+            continue;
+        float xyz[3] = { cloud.x()[i], cloud.y()[i], cloud.z()[i] };
+        memcpy( p, xyz, 12 );
+        p += 12;
+        if( normals ) {
+            float nxyz[3] = { cloud.nx()[i], cloud.ny()[i], cloud.nz()[i] };
+            memcpy( p, nxyz, 12 );
+            p += 12;
+        }
+        if( color && pcd ) {
+            uint32_t rgb = (uint32_t)cloud.r()[i] << 16 | (uint32_t)cloud.g()[i] << 8 | cloud.b()[i];
+            memcpy( p, &rgb, 4 );
+            p += 4;
+        }
+        else if( color ) {
+            p[0] = cloud.r()[i];
+            p[1] = cloud.g()[i];
+            p[2] = cloud.b()[i];
+            p += 3;
+        }
+    }
+    return n;
+}
+
+static bool writePly( FILE* f, const PointCloud& cloud, std::vector< uint8_t >& scratch, uint64_t& bytes ) {
+
+    int n = packRecords( cloud, false, scratch );
+    char header[512];
+    int length = snprintf( header, sizeof( header ),
+        "ply\nformat %s 1.0\ncomment kinreg\nelement vertex %d\n"
+        "property float x\nproperty float y\nproperty float z\n%s%send_header\n",
+        littleEndian() ? "binary_little_endian" : "binary_big_endian", n,
+        cloud.has( POINT_NORMAL ) ? "property float nx\nproperty float ny\nproperty float nz\n" : "",
+        cloud.has( POINT_COLOR ) ? "property uchar red\nproperty uchar green\nproperty uchar blue\n" : "" );
+    bytes = length + scratch.size();
+    return fwrite( header, 1, length, f ) == (size_t)length &&
+           ( scratch.empty() || fwrite( &scratch[0], 1, scratch.size(), f ) == scratch.size() );
+}
+
+static bool writePcd( FILE* f, const PointCloud& cloud, std::vector< uint8_t >& scratch, uint64_t& bytes ) {
+
+    int n = packRecords( cloud, true, scratch );
+    bool normals = cloud.has( POINT_NORMAL ), color = cloud.has( POINT_COLOR );
+    int fields = 3 + ( normals ? 3 : 0 ) + ( color ? 1 : 0 );
+    std::string size, type, count;
+    for( int k = 0; k < fields; k++ ) {
+        size += " 4";
+        type += " F";
+        count += " 1";
+    }
+    char header[512];
+    int length = snprintf( header, sizeof( header ),
+        "# .PCD v0.7 - Point Cloud Data file format\nVERSION 0.7\nFIELDS x y z%s%s\n"
+        "SIZE%s\nTYPE%s\nCOUNT%s\nWIDTH %d\nHEIGHT 1\nVIEWPOINT 0 0 0 1 0 0 0\nPOINTS %d\nDATA binary\n",
+        normals ? " normal_x normal_y normal_z" : "", color ? " rgb" : "",
+        size.c_str(), type.c_str(), count.c_str(), n, n );
+    bytes = length + scratch.size();
+    return fwrite( header, 1, length, f ) == (size_t)length &&
+           ( scratch.empty() || fwrite( &scratch[0], 1, scratch.size(), f ) == scratch.size() );
+}
+
+// One array's finite entries, padded to 64 bytes
+template< typename T >
+static bool writeColumn( FILE* f, const PointCloud& cloud, const T* column, int n,
+                         std::vector< uint8_t >& scratch, uint64_t& bytes ) {
+
+    size_t length = n*sizeof( T ), padded = ( length + 63 ) & ~(size_t)63;
+    scratch.resize( padded );
+    T* out = (T*)&scratch[0];
+    for( int i = 0, k = 0; i < cloud.size(); i++ )
+        if( cloud.finite( i ) )
+            out[k++] = column[i];
+    memset( &scratch[length], 0, padded - length );
+    bytes += padded;
+    return fwrite( &scratch[0], 1, padded, f ) == padded;
+}
+
+static bool writeChunk( FILE* f, const PointCloud& cloud, int cam, double time, uint64_t sequence,
+                        std::vector< uint8_t >& scratch, uint64_t& bytes ) {
+
+    CloudChunk c;
+    memset( &c, 0, sizeof( c ) );
+    memcpy( c.magic, CHUNK_MAGIC, sizeof( c.magic ) );
+    c.cam = cam;
+    c.points = finitePoints( cloud );
+    c.channels = cloud.channels() & ( POINT_COLOR | POINT_NORMAL );
+    c.time = time;
+    c.sequence = sequence;
+    bytes = sizeof( c );
+    bool ok = fwrite( &c, sizeof( c ), 1, f ) == 1;
+
+    const float* xyz[3] = { cloud.x(), cloud.y(), cloud.z() };
+    for( int a = 0; a < 3; a++ )
+        ok = ok && writeColumn( f, cloud, xyz[a], c.points, scratch, bytes );
+    if( c.channels & POINT_NORMAL ) {
+        const float* n[3] = { cloud.nx(), cloud.ny(), cloud.nz() };
+        for( int a = 0; a < 3; a++ )
+            ok = ok && writeColumn( f, cloud, n[a], c.points, scratch, bytes );
+    }
+    if( c.channels & POINT_COLOR ) {
+        const uint8_t* rgb[3] = { cloud.r(), cloud.g(), cloud.b() };
+        for( int a = 0; a < 3; a++ )
+            ok = ok && writeColumn( f, cloud, rgb[a], c.points, scratch, bytes );
+    }
+    // Every chunk ends on a 64 byte boundary, so the next one starts on one
+    return ok && fflush( f ) == 0;
+}
+
+bool saveCloud( const std::string& path, const PointCloud& cloud ) {
+
+    bool pcd = path.size() >= 4 && path.compare( path.size() - 4, 4, ".pcd" ) == 0;
+    FILE* f = fopen( path.c_str(), "wb" );
+    if( !f )
+        return false;
+    std::vector< uint8_t > scratch;
+    uint64_t bytes;
+    bool ok = pcd ? writePcd( f, cloud, scratch, bytes ) : writePly( f, cloud, scratch, bytes );
+    return fclose( f ) == 0 && ok;
+}
+
+// ---------------------------------------------------------------------------
+// CloudExporter
+
+const char* CloudExporter::formatName( ExportFormat format ) {
+    static const char* names[] = { "ply", "pcd", "kcl" };
+    return names[format];
+}
+
+bool CloudExporter::parseFormat( const char* name, ExportFormat& format ) {
+    for( int k = EXPORT_PLY; k <= EXPORT_CHUNKS; k++ )
+        if( strcmp( name, formatName( (ExportFormat)k ) ) == 0 ) {
+            format = (ExportFormat)k;
+            return true;
+        }
+    return false;
+}
+
+CloudExporter::CloudExporter( const std::string& prefix, ExportFormat format, int queueDepth,
+                              ExportDropPolicy policy )
+    : prefix( prefix ), format( format ), policy( policy ), depth( std::max( 1, queueDepth ) ),
+      open( true ), chunks( 0 ), sequence( 0 ), stopping( false ) {
+
+    memset( &counters, 0, sizeof( counters ) );
+    for( int k = 0; k < depth + 1; k++ ) {
+        buffers.push_back( new PointCloud() );
+        spare.push_back( buffers.back() );
+    }
+
+    if( format == EXPORT_CHUNKS ) {
+        std::string path = prefix + ".kcl";
+        chunks = fopen( path.c_str(), "wb" );
+        CloudFileHeader h;
+        memset( &h, 0, sizeof( h ) );
+        memcpy( h.magic, CLOUD_MAGIC, sizeof( h.magic ) );
+        h.version = CLOUD_FILE_VERSION;
+        h.created = (int64_t)time( 0 );
+        open = chunks && fwrite( &h, sizeof( h ), 1, chunks ) == 1;
+    }
+    worker = std::thread( &CloudExporter::run, this );
+}
+
+CloudExporter::~CloudExporter() {
+    {
+        std::lock_guard< std::mutex > hold( lock );
+        stopping = true;
+    }
+    wake.notify_all();
+    worker.join();
+    if( chunks )
+        fclose( chunks );
+    for( int k = 0; k < (int)buffers.size(); k++ )
+        delete buffers[k];
+}
+
+PointCloud* CloudExporter::acquire() {
+
+    std::unique_lock< std::mutex > hold( lock );
+    if( policy == EXPORT_BLOCK )
+        returned.wait( hold, [this] { return !spare.empty(); } );
+    if( !spare.empty() ) {
+        PointCloud* cloud = spare.back();
+        spare.pop_back();
+        return cloud;
+    }
+    counters.dropped++;
+    if( policy == EXPORT_DROP_OLDEST && !queue.empty() ) {
+        PointCloud* cloud = queue.front().cloud;
+        queue.pop_front();
+        return cloud;
+    }
+    return 0;
+}
+
+void CloudExporter::submit( PointCloud* cloud, int cam, double time ) {
+    {
+        std::lock_guard< std::mutex > hold( lock );
+        Item item = { cloud, cam, time, sequence++ };
+        queue.push_back( item );
+        counters.submitted++;
+    }
+    wake.notify_one();
+}
+
+void CloudExporter::release( PointCloud* cloud ) {
+    {
+        std::lock_guard< std::mutex > hold( lock );
+        spare.push_back( cloud );
+    }
+    returned.notify_one();
+}
+
+bool CloudExporter::push( const PointCloud& cloud, int cam, double time ) {
+    PointCloud* buffer = acquire();
+    if( !buffer )
+        return false;
+    *buffer = cloud;
+    submit( buffer, cam, time );
+    return true;
+}
+
+ExportStats CloudExporter::stats() {
+    std::lock_guard< std::mutex > hold( lock );
+    ExportStats s = counters;
+    s.pending = (int)queue.size();
+    return s;
+}
+
+bool CloudExporter::write( const Item& item, uint64_t& bytes ) {
+
+    if( format == EXPORT_CHUNKS )
+        return open && writeChunk( chunks, *item.cloud, item.cam, item.time, item.sequence, scratch, bytes );
+
+    char name[64];
+    if( item.cam < 0 )
+        snprintf( name, sizeof( name ), "-%06llu-fused.", (unsigned long long)item.sequence );
+    else
+        snprintf( name, sizeof( name ), "-%06llu-cam%d.", (unsigned long long)item.sequence, item.cam );
+    std::string path = prefix + name + formatName( format );
+    FILE* f = fopen( path.c_str(), "wb" );
+    if( !f )
+        return false;
+    bool ok = format == EXPORT_PCD ? writePcd( f, *item.cloud, scratch, bytes )
+                                   : writePly( f, *item.cloud, scratch, bytes );
+    return fclose( f ) == 0 && ok;
+}
+
+void CloudExporter::run() {
+
+    Profiler::shared().setThreadName( "export" );
+    std::unique_lock< std::mutex > hold( lock );
+    for( ;; ) {
+        wake.wait( hold, [this] { return stopping || !queue.empty(); } );
+        // Drains the queue before stopping
+        if( queue.empty() )
+            return;
+        Item item = queue.front();
+        queue.pop_front();
+        hold.unlock();
+
+        uint64_t bytes = 0;
+        double start = monotonicSeconds();
+        bool ok;
+        {
+            PROFILE_SCOPE( "export", item.cam );
+            ok = write( item, bytes );
+        }
+        double seconds = monotonicSeconds() - start;
+        int points = ok ? finitePoints( *item.cloud ) : 0;
+
+        hold.lock();
+        spare.push_back( item.cloud );
+        counters.writeSeconds += seconds;
+        counters.maxWriteMs = std::max( counters.maxWriteMs, 1000*seconds );
+        if( ok ) {
+            counters.written++;
+            counters.bytes += bytes;
+            counters.points += points;
+        }
+        else {
+            counters.failed++;
+            // A full disk would otherwise say so every frame
+            LOG_EVERY( 5.0, LOG_LEVEL_ERROR, "couldn't export to %s", prefix.c_str() );
+        }
+        returned.notify_one();
+    }
+}
+
+// ---------------------------------------------------------------------------
+// FrameExporter
+
+FrameExporter::FrameExporter( CloudExporter& out, const std::vector< DepthModel >& models,
+                              bool perCamera, const FusionParams& params )
+    : out( out ), models( models ), perCamera( perCamera ), fusion( params ),
+      frames( models.size() ), poses( models.size() ), placed( models.size(), 0 ),
+      time( 0 ), skipped( 0 ), busy( false ), stopping( false ) {
+
+    worker = std::thread( &FrameExporter::run, this );
+}
+
+FrameExporter::~FrameExporter() {
+    {
+        std::lock_guard< std::mutex > hold( lock );
+        stopping = true;
+    }
+    wake.notify_all();
+    worker.join();
+}
+
+bool FrameExporter::submit( const std::vector< const Frame* >& in,
+                            const std::vector< RigidTransform >& inPoses,
+                            const std::vector< uint8_t >& inPlaced, double now ) {
+    {
+        std::lock_guard< std::mutex > hold( lock );
+        if( busy ) {
+            skipped += perCamera ? frames.size() : 1;
+            return false;
+        }
+        int n = (int)std::min( frames.size(), in.size() );
+        for( int cam = 0; cam < n; cam++ ) {
+            frames[cam] = *in[cam];
+            poses[cam] = cam < (int)inPoses.size() ? inPoses[cam] : RigidTransform();
+            placed[cam] = cam < (int)inPlaced.size() && inPlaced[cam];
+        }
+        for( int cam = n; cam < (int)frames.size(); cam++ )
+            placed[cam] = 0;
+        time = now;
+        busy = true;
+    }
+    wake.notify_one();
+    return true;
+}
+
+unsigned long FrameExporter::dropped() {
+    std::lock_guard< std::mutex > hold( lock );
+    return skipped;
+}
+
+// frames, poses and placed are the worker's while busy, no lock needed
+void FrameExporter::convert() {
+
+    int n = (int)frames.size();
+    if( perCamera ) {
+        for( int cam = 0; cam < n; cam++ )
+            if( PointCloud* cloud = out.acquire() ) {
+                cloud->addChannels( POINT_COLOR );
+                models[cam].unprojectFrame( frames[cam].depth, *cloud, frames[cam].rgb );
+                out.submit( cloud, cam, time );
+            }
+        return;
+    }
+    PointCloud* fused = out.acquire();
+    if( !fused )
+        return;
+    arena.reset();
+    std::vector< PointCloud > clouds( n, PointCloud( POINT_COLOR, &arena ) );
+    for( int cam = 0; cam < n; cam++ )
+        if( placed[cam] )
+            models[cam].unprojectFrame( frames[cam].depth, clouds[cam], frames[cam].rgb );
+    fusion.fuse( clouds, poses, *fused );
+    out.submit( fused, -1, time );
+}
+
+void FrameExporter::run() {
+
+    Profiler::shared().setThreadName( "export_frames" );
+    for( ;; ) {
+        {
+            std::unique_lock< std::mutex > hold( lock );
+            wake.wait( hold, [this] { return stopping || busy; } );
+            if( !busy )
+                return;
+        }
+        {
+            PROFILE_SCOPE( "export_frame" );
+            convert();
+        }
+        std::lock_guard< std::mutex > hold( lock );
+        busy = false;
+    }
+}
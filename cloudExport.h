@@ -0,0 +1,212 @@
+#ifndef KINREG_CLOUD_EXPORT_H
+#define KINREG_CLOUD_EXPORT_H
+
+#include "pointCloud.h"
+#include "depthModel.h"
+#include "fusion.h"
+#include "kinect.h"
+#include "rigidTransform.h"
+// --- C++ ---
+#include <stdint.h>
+#include <stdio.h>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/*
+ * Point clouds out to disk for offline processing.
+ *
+ *      ply     one binary PLY per cloud, x y z, normals and colour if the
+ *              cloud has them
+ *      pcd     one binary PCD per cloud (PCL's format), colour packed
+ *              into an "rgb" float the way PCL does
+ *      kcl     every cloud appended to one file as chunks:
+ *
+ *          header  64 bytes, see CloudFileHeader
+ *          chunks  one per cloud, each starting on a 64 byte boundary: a
+ *                  64 byte CloudChunk, then the points structure of
+ *                  arrays, x[], y[], z[], nx[] ny[] nz[] and r[] g[] b[]
+ *                  if channels says so, every array padded to 64 bytes
+ *
+ * Only finite points are written, organised clouds lose their layout.
+ * Host byte order (PLY and PCD say which in their headers).
+ */
+
+enum ExportFormat {
+    EXPORT_PLY,
+    EXPORT_PCD,
+    EXPORT_CHUNKS
+};
+
+const uint32_t CLOUD_FILE_VERSION = 1;
+
+struct CloudFileHeader {
+    char magic[8];              // "KINCLDS\0"
+    uint32_t version;
+    uint32_t reserved0;
+    int64_t created;            // unix time
+    uint8_t reserved[40];
+};
+
+struct CloudChunk {
+    char magic[4];              // "CHNK"
+    int32_t cam;                // -1 for a fused cloud
+    uint32_t points;
+    uint32_t channels;          // PointChannel bits, POINT_COLOR and POINT_NORMAL
+    double time;                // monotonicSeconds() of the frames
+    uint64_t sequence;          // clouds submitted before this one
+    uint8_t reserved[32];
+};
+
+// Single clouds, written straight away. The format goes by the extension
+// (.ply or .pcd). Returns false if the file can't be written.
+bool saveCloud( const std::string& path, const PointCloud& cloud );
+
+// What to do with a cloud when the queue is full
+enum ExportDropPolicy {
+    EXPORT_DROP_NEWEST,         // acquire() returns 0, the new cloud is skipped
+    EXPORT_DROP_OLDEST,         // the oldest queued cloud is thrown away for it
+    EXPORT_BLOCK                // acquire() waits for the writer, for offline tools
+};
+
+struct ExportStats {
+    unsigned long submitted;
+    unsigned long written;
+    unsigned long dropped;
+    unsigned long failed;       // couldn't be written
+    int pending;                // queued right now
+    uint64_t bytes, points;     // written
+    double writeSeconds;        // the writer spent in I/O
+    double maxWriteMs;          // slowest single cloud
+};
+
+/*
+ * Streams clouds to disk on a writer thread of its own.
+ *
+ * The producer (a FrameExporter, say) takes a buffer with acquire(),
+ * fills it and hands it over with submit(). Buffers come from a pool of
+ * queueDepth + 1 clouds that's reused forever, so nothing is allocated
+ * per frame once they've grown to the clouds' size and no more than that
+ * many clouds are ever waiting or being written. When they're all taken
+ * the policy decides who loses, and every loss is counted. A disk stall
+ * only ever costs dropped clouds, never a wait in capture or render
+ * (except with EXPORT_BLOCK).
+ *
+ * Per file formats are named <prefix>-<sequence>-fused.<ext> or
+ * <prefix>-<sequence>-cam<N>.<ext>, kcl goes to <prefix>.kcl.
+ */
+class CloudExporter {
+public:
+    CloudExporter( const std::string& prefix, ExportFormat format, int queueDepth = 4,
+                   ExportDropPolicy policy = EXPORT_DROP_OLDEST );
+    // Writes what's still queued, then stops the writer
+    ~CloudExporter();
+
+    // False if the kcl file couldn't be created
+    bool isOpen() const { return open; }
+
+    // A free buffer to fill, or 0 if this cloud should be skipped. Each one
+    // has to come back through submit() or release().
+    PointCloud* acquire();
+    // Queues an acquired buffer, cam -1 for a fused cloud
+    void submit( PointCloud* cloud, int cam, double time );
+    void release( PointCloud* cloud );
+
+    // acquire(), copy, submit(). False if the cloud was dropped.
+    bool push( const PointCloud& cloud, int cam, double time );
+
+    ExportStats stats();
+
+    static const char* formatName( ExportFormat format );
+    // "ply", "pcd" or "kcl". False for anything else.
+    static bool parseFormat( const char* name, ExportFormat& format );
+
+private:
+    CloudExporter( const CloudExporter& );
+    CloudExporter& operator=( const CloudExporter& );
+
+    struct Item {
+        PointCloud* cloud;
+        int cam;
+        double time;
+        uint64_t sequence;
+    };
+
+    void run();
+    bool write( const Item& item, uint64_t& bytes );
+
+    std::string prefix;
+    ExportFormat format;
+    ExportDropPolicy policy;
+    int depth;
+    bool open;
+    FILE* chunks;                   // kcl only, touched by the writer
+
+    std::vector< PointCloud* > buffers;
+    std::vector< uint8_t > scratch; // writer's packing buffer
+
+    std::mutex lock;                // guards everything below
+    std::condition_variable wake, returned;
+    std::deque< Item > queue;
+    std::vector< PointCloud* > spare;
+    uint64_t sequence;
+    ExportStats counters;
+    bool stopping;
+
+    std::thread worker;
+};
+
+/*
+ * The unprojection and fusion in front of a CloudExporter, on a thread of
+ * their own, so all the render loop does per frame is copy the cameras'
+ * frames. Like the writer it never makes the caller wait: a frame
+ * submitted while the last one is still being turned into clouds is
+ * skipped and counted.
+ */
+class FrameExporter {
+public:
+    // Clouds go to out, each camera's own (perCamera) or every placed one
+    // fused. models, one per camera, are copied.
+    FrameExporter( CloudExporter& out, const std::vector< DepthModel >& models, bool perCamera,
+                   const FusionParams& params = FusionParams() );
+    // Finishes the frame in progress, out still has to be flushed
+    ~FrameExporter();
+
+    // Copies one frame per camera and wakes the worker. poses take each
+    // camera to the world, placed ones (nonzero) are fused. False if the
+    // frame was skipped.
+    bool submit( const std::vector< const Frame* >& frames, const std::vector< RigidTransform >& poses,
+                 const std::vector< uint8_t >& placed, double time );
+
+    // Clouds lost to skipped frames
+    unsigned long dropped();
+
+private:
+    FrameExporter( const FrameExporter& );
+    FrameExporter& operator=( const FrameExporter& );
+
+    void run();
+    void convert();
+
+    CloudExporter& out;
+    std::vector< DepthModel > models;
+    bool perCamera;
+    CloudFusion fusion;                 // touched by the worker only
+    PointArena arena;                   // the fused cameras' clouds
+
+    std::mutex lock;                    // guards everything below
+    std::condition_variable wake;
+    std::vector< Frame > frames;        // the worker's while busy
+    std::vector< RigidTransform > poses;
+    std::vector< uint8_t > placed;
+    double time;
+    unsigned long skipped;
+    bool busy, stopping;
+
+    std::thread worker;
+};
+
+#endif
@@ -0,0 +1,207 @@
+#include "depthFilter.h"
+// --- C++ ---
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+#include <algorithm>
+
+static inline bool valid( uint16_t d ) {
+    return d < KINECT_DEPTH_INVALID;
+}
+
+DepthFilter::DepthFilter( DepthFilterMode mode, const DepthFilterParams& params ) 
+    : filterMode( mode ), params( params ) {
+
+    int r = params.radius;
+    for( int k = -r; k <= r; k++ )
+        spaceWeights.push_back( expf( -k*k/( 2*params.sigmaSpace*params.sigmaSpace ) ) );
+    for( int d = 0; d < 2048; d++ )
+        rangeWeights.push_back( expf( -d*d/( 2*params.sigmaRange*params.sigmaRange ) ) );
+}
+
+const char* DepthFilter::modeName( DepthFilterMode mode ) {
+    switch( mode ) {
+        case DEPTH_FILTER_NONE:      return "none";
+        case DEPTH_FILTER_HOLE_FILL: return "hole-fill";
+        case DEPTH_FILTER_MEDIAN3:   return "median3";
+        case DEPTH_FILTER_MEDIAN5:   return "median5";
+        case DEPTH_FILTER_BILATERAL: return "bilateral";
+        default:                     return "?";
+    }
+}
+
+void DepthFilter::apply( const uint16_t* in, uint16_t* out ) {
+
+    switch( filterMode ) {
+        case DEPTH_FILTER_HOLE_FILL: holeFill( in, out ); break;
+        case DEPTH_FILTER_MEDIAN3:   median( in, out, 1 ); break;
+        case DEPTH_FILTER_MEDIAN5:   median( in, out, 2 ); break;
+        case DEPTH_FILTER_BILATERAL: bilateral( in, out ); break;
+        default:
+            memcpy( out, in, KINECT_PIXELS*sizeof( uint16_t ) );
+    }
+}
+
+void DepthFilter::holeFill( const uint16_t* in, uint16_t* out ) {
+
+    const int W = KINECT_WIDTH;
+    for( int y = 0; y < KINECT_HEIGHT; y++ ) {
+        const uint16_t* src = in + y*W;
+        uint16_t* dst = out + y*W;
+        memcpy( dst, src, W*sizeof( uint16_t ) );
+
+        // Horizontal runs bounded by valid readings on both sides
+        int x = 0;
+        while( x < W ) {
+            if( valid( src[x] ) ) {
+                x++;
+                continue;
+            }
+            int start = x;
+            while( x < W && !valid( src[x] ) )
+                x++;
+            int len = x - start;
+            if( start == 0 || x == W || len > params.maxGap )
+                continue;
+
+            int L = src[start-1], R = src[x];
+            if( abs( L - R ) <= params.edgeThreshold ) {
+                for( int k = 0; k < len; k++ )
+                    dst[start+k] = (uint16_t)( L + ( R - L )*( k + 1 )/( len + 1 ) );
+            }
+            else {
+                // Across an edge the hole is most likely the shadow of the
+                // foreground on the background, so use the far side
+                // (larger disparity is further away)
+                uint16_t far = (uint16_t)std::max( L, R );
+                for( int k = 0; k < len; k++ )
+                    dst[start+k] = far;
+            }
+        }
+
+        // Whatever is left, try the pixels directly above and below
+        if( y == 0 || y == KINECT_HEIGHT - 1 )
+            continue;
+        const uint16_t* up = src - W;
+        const uint16_t* down = src + W;
+        for( x = 0; x < W; x++ ) {
+            if( valid( dst[x] ) || !valid( up[x] ) || !valid( down[x] ) )
+                continue;
+            if( abs( up[x] - down[x] ) <= params.edgeThreshold )
+                dst[x] = (uint16_t)( ( up[x] + down[x] + 1 )/2 );
+        }
+    }
+}
+
+// Median of 9 with a fixed compare/exchange network (Paeth / Devillard),
+// no branches and no memory traffic beyond the nine loads
+#define SORT2(a,b) { uint16_t t = std::min( p[a], p[b] ); p[b] = std::max( p[a], p[b] ); p[a] = t; }
+static inline uint16_t median9( uint16_t* p ) {
+    SORT2(1,2); SORT2(4,5); SORT2(7,8); SORT2(0,1); SORT2(3,4); SORT2(6,7);
+    SORT2(1,2); SORT2(4,5); SORT2(7,8); SORT2(0,3); SORT2(5,8); SORT2(4,7);
+    SORT2(3,6); SORT2(1,4); SORT2(2,5); SORT2(4,7); SORT2(4,2); SORT2(6,4);
+    SORT2(4,2);
+    return p[4];
+}
+#undef SORT2
+
+void DepthFilter::median( const uint16_t* in, uint16_t* out, int r ) {
+
+    const int W = KINECT_WIDTH, H = KINECT_HEIGHT;
+    const int window = ( 2*r + 1 )*( 2*r + 1 );
+    uint16_t buf[25];
+
+    for( int y = 0; y < H; y++ ) {
+        int ya = std::max( y - r, 0 ), yb = std::min( y + r, H - 1 );
+        for( int x = 0; x < W; x++ ) {
+            // Fast path for the usual case, a 3x3 window inside the frame
+            // with all nine readings valid
+            if( r == 1 && y > 0 && y < H - 1 && x > 0 && x < W - 1 ) {
+                const uint16_t* a = in + ( y - 1 )*W + x - 1;
+                const uint16_t* b = a + W;
+                const uint16_t* c = b + W;
+                uint16_t p[9] = { a[0], a[1], a[2], b[0], b[1], b[2], c[0], c[1], c[2] };
+                uint16_t hi = std::max( std::max( std::max( p[0], p[1] ), std::max( p[2], p[3] ) ),
+                                        std::max( std::max( p[4], p[5] ), std::max( std::max( p[6], p[7] ), p[8] ) ) );
+                if( valid( hi ) ) {
+                    out[y*W + x] = median9( p );
+                    continue;
+                }
+            }
+
+            int xa = std::max( x - r, 0 ), xb = std::min( x + r, W - 1 );
+            int n = 0;
+            for( int yy = ya; yy <= yb; yy++ ) {
+                const uint16_t* src = in + yy*W;
+                for( int xx = xa; xx <= xb; xx++ ) {
+                    buf[n] = src[xx];
+                    n += valid( src[xx] );
+                }
+            }
+
+            // A hole only gets filled if most of its neighbours agree it
+            // shouldn't be one
+            bool center = valid( in[y*W + x] );
+            if( n == 0 || ( !center && 2*n <= window ) ) {
+                out[y*W + x] = in[y*W + x];
+                continue;
+            }
+            std::nth_element( buf, buf + n/2, buf + n );
+            out[y*W + x] = buf[n/2];
+        }
+    }
+}
+
+void DepthFilter::bilateral( const uint16_t* in, uint16_t* out ) {
+
+    const int W = KINECT_WIDTH, H = KINECT_HEIGHT;
+    const int r = params.radius;
+    const float* sw = &spaceWeights[r];
+    const float* rw = &rangeWeights[0];
+
+    // Horizontal pass over the whole frame. 0 marks a hole (a real reading
+    // of 0 is closer than the sensor can see anyway).
+    scratch.resize( KINECT_PIXELS );
+    for( int y = 0; y < H; y++ ) {
+        const uint16_t* src = in + y*W;
+        float* dst = &scratch[y*W];
+        for( int x = 0; x < W; x++ ) {
+            int c = src[x];
+            if( !valid( c ) ) {
+                dst[x] = 0;
+                continue;
+            }
+            int xa = std::max( x - r, 0 ), xb = std::min( x + r, W - 1 );
+            float sum = 0, norm = 0;
+            for( int xx = xa; xx <= xb; xx++ ) {
+                int d = src[xx];
+                float w = valid( d ) ? sw[xx - x]*rw[abs( d - c )] : 0;
+                sum += w*d;
+                norm += w;
+            }
+            dst[x] = sum/norm;
+        }
+    }
+
+    // Vertical pass on the horizontally smoothed rows
+    for( int y = 0; y < H; y++ ) {
+        int ya = std::max( y - r, 0 ), yb = std::min( y + r, H - 1 );
+        const float* mid = &scratch[y*W];
+        uint16_t* dst = out + y*W;
+        for( int x = 0; x < W; x++ ) {
+            float c = mid[x];
+            if( c <= 0 ) {
+                dst[x] = in[y*W + x];
+                continue;
+            }
+            float sum = 0, norm = 0;
+            for( int yy = ya; yy <= yb; yy++ ) {
+                float d = scratch[yy*W + x];
+                float w = d > 0 ? sw[yy - y]*rw[std::min( (int)fabsf( d - c ), 2047 )] : 0;
+                sum += w*d;
+                norm += w;
+            }
+            dst[x] = (uint16_t)( sum/norm + 0.5f );
+        }
+    }
+}
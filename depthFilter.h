@@ -0,0 +1,67 @@
+#ifndef KINREG_DEPTH_FILTER_H
+#define KINREG_DEPTH_FILTER_H
+
+#include "kinect.h"
+// --- C++ ---
+#include <vector>
+
+/*
+ * Full frame depth preprocessing on raw disparity.
+ *
+ *  HOLE_FILL  - closes short horizontal runs of missing depth, interpolating
+ *               when both ends agree and taking the far side when they
+ *               don't, so holes don't get bridged across object edges.
+ *               Single missing pixels between two agreeing rows are closed
+ *               vertically.
+ *  MEDIAN3/5  - median of the valid readings in a 3x3 / 5x5 window. Holes
+ *               with mostly valid neighbours are filled too.
+ *  BILATERAL  - separable bilateral smoothing, holes stay holes.
+ *
+ * All of them make one pass over the frame with bounded work per pixel and
+ * never read outside it.
+ */
+enum DepthFilterMode { 
+    DEPTH_FILTER_NONE, 
+    DEPTH_FILTER_HOLE_FILL, 
+    DEPTH_FILTER_MEDIAN3, 
+    DEPTH_FILTER_MEDIAN5, 
+    DEPTH_FILTER_BILATERAL,
+    DEPTH_FILTER_MODES 
+};
+
+struct DepthFilterParams {
+    DepthFilterParams() : maxGap( 8 ), edgeThreshold( 12 ), 
+                          radius( 3 ), sigmaSpace( 2 ), sigmaRange( 6 ) {}
+
+    int maxGap;         // longest run HOLE_FILL closes, in pixels
+    int edgeThreshold;  // disparity jump treated as an object edge
+    int radius;         // BILATERAL window half width
+    float sigmaSpace;   // BILATERAL spatial sigma, pixels
+    float sigmaRange;   // BILATERAL range sigma, raw disparity
+};
+
+class DepthFilter {
+public:
+    DepthFilter( DepthFilterMode mode = DEPTH_FILTER_HOLE_FILL, 
+                 const DepthFilterParams& params = DepthFilterParams() );
+
+    DepthFilterMode mode() const { return filterMode; }
+    void setMode( DepthFilterMode mode ) { filterMode = mode; }
+    static const char* modeName( DepthFilterMode mode );
+
+    // Filters a whole frame. in and out must not overlap.
+    void apply( const uint16_t* in, uint16_t* out );
+
+private:
+    void holeFill( const uint16_t* in, uint16_t* out );
+    void median( const uint16_t* in, uint16_t* out, int r );
+    void bilateral( const uint16_t* in, uint16_t* out );
+
+    DepthFilterMode filterMode;
+    DepthFilterParams params;
+    std::vector< float > spaceWeights;  // 2*radius + 1 taps
+    std::vector< float > rangeWeights;  // by |disparity difference|
+    std::vector< float > scratch;       // horizontal bilateral pass
+};
+
+#endif
@@ -0,0 +1,182 @@
+#include "depthKernel.h"
+// --- SIMD ---
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define KINREG_X86 1
+#endif
+// --- C++ ---
+#include <string.h>
+
+// Writes pixel i unconditionally and only advances n when it's valid. With
+// no branch per pixel the partly valid blocks cost the same as the full ones.
+static inline int emit( int n, int i, int col, int row, const uint16_t* depth, 
+                        const uint8_t* rgb, short* xyz, uint8_t* colors, int valid ) {
+    short* v = xyz + 3*n;
+    uint8_t* c = colors + 3*n;
+    v[0] = (short)col;
+    v[1] = (short)row;
+    v[2] = (short)depth[i];
+    c[0] = rgb[3*i];
+    c[1] = rgb[3*i+1];
+    c[2] = rgb[3*i+2];
+    return n + valid;
+}
+
+// Copies a run of pixels that are all known to be valid
+static inline int emitRun( int n, int i, int col, int row, int count, 
+                           const uint16_t* depth, const uint8_t* rgb, 
+                           short* xyz, uint8_t* colors ) {
+    short* v = xyz + 3*n;
+    for( int k = 0; k < count; k++ ) {
+        v[3*k]   = (short)( col + k );
+        v[3*k+1] = (short)row;
+        v[3*k+2] = (short)depth[i+k];
+    }
+    memcpy( colors + 3*n, rgb + 3*i, 3*count );
+    return n + count;
+}
+
+int packVerticesScalar( const uint16_t* depth, const uint8_t* rgb, 
+                        short* xyz, uint8_t* colors ) {
+    int n = 0;
+    for( int row = 0, i = 0; row < KINECT_HEIGHT; row++ )
+        for( int col = 0; col < KINECT_WIDTH; col++, i++ )
+            n = emit( n, i, col, row, depth, rgb, xyz, colors, 
+                      depth[i] < KINECT_DEPTH_INVALID );
+    return n;
+}
+
+#ifdef KINREG_X86
+
+// Blocks never straddle a row since 640 is a multiple of both 8 and 16.
+
+int packVerticesSSE2( const uint16_t* depth, const uint8_t* rgb, 
+                      short* xyz, uint8_t* colors ) {
+
+    const __m128i limit = _mm_set1_epi16( KINECT_DEPTH_INVALID );
+    int n = 0;
+    for( int row = 0, i = 0; row < KINECT_HEIGHT; row++ ) {
+        for( int col = 0; col < KINECT_WIDTH; col += 8, i += 8 ) {
+            // Raw disparity is 11 bits so a signed compare is fine
+            __m128i d = _mm_loadu_si128( (const __m128i*)( depth + i ) );
+            __m128i valid = _mm_cmplt_epi16( d, limit );
+            int mask = _mm_movemask_epi8( _mm_packs_epi16( valid, valid ) ) & 0xFF;
+
+            if( mask == 0 )
+                continue;
+            if( mask == 0xFF ) {
+                n = emitRun( n, i, col, row, 8, depth, rgb, xyz, colors );
+                continue;
+            }
+            for( int k = 0; k < 8; k++ )
+                n = emit( n, i + k, col + k, row, depth, rgb, xyz, colors, 
+                          ( mask >> k ) & 1 );
+        }
+    }
+    return n;
+}
+
+// Byte shuffles that interleave 8 columns and 8 disparities (already
+// unpacked into c0 d0 c1 d1 ... pairs) into (col, row, disparity) triples,
+// leaving zeros where the row goes. -1 zeroes a byte.
+#define S(w) (char)(2*(w)), (char)(2*(w)+1)
+#define Z    (char)-1, (char)-1
+
+__attribute__(( target( "avx2" ) ))
+int packVerticesAVX2( const uint16_t* depth, const uint8_t* rgb, 
+                      short* xyz, uint8_t* colors ) {
+
+    const __m256i limit = _mm256_set1_epi16( KINECT_DEPTH_INVALID );
+    const __m128i ramp = _mm_setr_epi16( 0, 1, 2, 3, 4, 5, 6, 7 );
+    // lo = c0 d0 c1 d1 c2 d2 c3 d3, hi = c4 d4 c5 d5 c6 d6 c7 d7
+    const __m128i out0 = _mm_setr_epi8( S(0), Z, S(1), S(2), Z, S(3), S(4), Z );
+    const __m128i out1lo = _mm_setr_epi8( S(5), S(6), Z, S(7), Z, Z, Z, Z );
+    const __m128i out1hi = _mm_setr_epi8( Z, Z, Z, Z, S(0), Z, S(1), S(2) );
+    const __m128i out2 = _mm_setr_epi8( Z, S(3), S(4), Z, S(5), S(6), Z, S(7) );
+
+    int n = 0;
+    for( int row = 0, i = 0; row < KINECT_HEIGHT; row++ ) {
+        const __m128i r = _mm_set1_epi16( (short)row );
+        const __m128i row0 = _mm_and_si128( r, _mm_setr_epi16( 0, -1, 0, 0, -1, 0, 0, -1 ) );
+        const __m128i row1 = _mm_and_si128( r, _mm_setr_epi16( 0, 0, -1, 0, 0, -1, 0, 0 ) );
+        const __m128i row2 = _mm_and_si128( r, _mm_setr_epi16( -1, 0, 0, -1, 0, 0, -1, 0 ) );
+
+        for( int col = 0; col < KINECT_WIDTH; col += 16, i += 16 ) {
+            __m256i d = _mm256_loadu_si256( (const __m256i*)( depth + i ) );
+            __m256i valid = _mm256_cmpgt_epi16( limit, d );
+            // Two mask bits per 16 bit lane, keep the low one of each
+            unsigned mask = (unsigned)_mm256_movemask_epi8( valid ) & 0x55555555u;
+
+            if( mask == 0 )
+                continue;
+            if( mask != 0x55555555u ) {
+                for( int k = 0; k < 16; k++ )
+                    n = emit( n, i + k, col + k, row, depth, rgb, xyz, colors, 
+                              ( mask >> 2*k ) & 1 );
+                continue;
+            }
+
+            // All 16 valid: build the triples with shuffles, 8 at a time
+            for( int half = 0; half < 2; half++ ) {
+                __m128i c = _mm_add_epi16( _mm_set1_epi16( (short)( col + 8*half ) ), ramp );
+                __m128i dh = half ? _mm256_extracti128_si256( d, 1 ) 
+                                  : _mm256_castsi256_si128( d );
+                __m128i lo = _mm_unpacklo_epi16( c, dh );
+                __m128i hi = _mm_unpackhi_epi16( c, dh );
+                __m128i* v = (__m128i*)( xyz + 3*( n + 8*half ) );
+                _mm_storeu_si128( v, _mm_or_si128( _mm_shuffle_epi8( lo, out0 ), row0 ) );
+                _mm_storeu_si128( v + 1, _mm_or_si128( _mm_or_si128( 
+                            _mm_shuffle_epi8( lo, out1lo ), _mm_shuffle_epi8( hi, out1hi ) ), row1 ) );
+                _mm_storeu_si128( v + 2, _mm_or_si128( _mm_shuffle_epi8( hi, out2 ), row2 ) );
+            }
+            memcpy( colors + 3*n, rgb + 3*i, 48 );
+            n += 16;
+        }
+    }
+    return n;
+}
+
+#undef S
+#undef Z
+
+#else
+
+int packVerticesSSE2( const uint16_t* depth, const uint8_t* rgb, 
+                      short* xyz, uint8_t* colors ) {
+    return packVerticesScalar( depth, rgb, xyz, colors );
+}
+
+int packVerticesAVX2( const uint16_t* depth, const uint8_t* rgb, 
+                      short* xyz, uint8_t* colors ) {
+    return packVerticesScalar( depth, rgb, xyz, colors );
+}
+
+#endif
+
+typedef int (*PackFn)( const uint16_t*, const uint8_t*, short*, uint8_t* );
+
+static PackFn choosePack( const char** name ) {
+#ifdef KINREG_X86
+    if( __builtin_cpu_supports( "avx2" ) ) {
+        *name = "avx2";
+        return packVerticesAVX2;
+    }
+    *name = "sse2";
+    return packVerticesSSE2;
+#else
+    *name = "scalar";
+    return packVerticesScalar;
+#endif
+}
+
+static const char* packName = 0;
+static const PackFn packFn = choosePack( &packName );
+
+int packVertices( const uint16_t* depth, const uint8_t* rgb, 
+                  short* xyz, uint8_t* colors ) {
+    return packFn( depth, rgb, xyz, colors );
+}
+
+const char* packVerticesKernel() {
+    return packName;
+}
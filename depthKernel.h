@@ -0,0 +1,31 @@
+#ifndef KINREG_DEPTH_KERNEL_H
+#define KINREG_DEPTH_KERNEL_H
+
+#include "kinect.h"
+
+/*
+ * Turns one raw frame into the vertex and color arrays handed to OpenGL.
+ *
+ * Every valid pixel (disparity < 2047) becomes one (col, row, disparity)
+ * short triple in xyz and one RGB triple in colors, in scan order. Invalid
+ * pixels are skipped, so the return value is the number of points written
+ * and the thing to pass to glDrawArrays. xyz and colors need room for
+ * KINECT_PIXELS*3 entries.
+ *
+ * packVertices() picks the widest kernel the CPU supports (AVX2, SSE2,
+ * plain C++); the others are exposed for benchmarking and checking.
+ */
+int packVertices( const uint16_t* depth, const uint8_t* rgb, 
+                  short* xyz, uint8_t* colors );
+
+int packVerticesScalar( const uint16_t* depth, const uint8_t* rgb, 
+                        short* xyz, uint8_t* colors );
+int packVerticesSSE2( const uint16_t* depth, const uint8_t* rgb, 
+                      short* xyz, uint8_t* colors );
+int packVerticesAVX2( const uint16_t* depth, const uint8_t* rgb, 
+                      short* xyz, uint8_t* colors );
+
+// Which kernel packVertices() ended up using ("avx2", "sse2" or "scalar")
+const char* packVerticesKernel();
+
+#endif
@@ -0,0 +1,119 @@
+#include "depthModel.h"
+// --- C++ ---
+#include <string.h>
+#include <algorithm>
+#include <limits>
+
+Intrinsics defaultIntrinsics() {
+    Intrinsics k;
+    k.fx = 594.21f;
+    k.fy = 591.04f;
+    k.cx = 339.5f;
+    k.cy = 242.7f;
+    k.a = -0.0030711f;
+    k.b = 3.3309495f;
+    return k;
+}
+
+DepthModel::DepthModel( const Intrinsics& k ) 
+    : k( k ), raysX( KINECT_PIXELS ), raysY( KINECT_PIXELS ) {
+
+    // Past d ~ 1084 the fit goes negative, those are as good as no reading
+    for( int d = 0; d < 2048; d++ ) {
+        float w = k.a*d + k.b;
+        lut[d] = ( d < KINECT_DEPTH_INVALID && w > 0 ) ? 1/w : 0;
+    }
+
+    for( int row = 0, i = 0; row < KINECT_HEIGHT; row++ )
+        for( int col = 0; col < KINECT_WIDTH; col++, i++ ) {
+            raysX[i] = ( col - k.cx )/k.fx;
+            raysY[i] = ( k.cy - row )/k.fy;
+        }
+}
+
+DepthModel::DepthModel( const Intrinsics& k, const float* table, const float* x, const float* y )
+    : k( k ), raysX( x, x + KINECT_PIXELS ), raysY( y, y + KINECT_PIXELS ) {
+    memcpy( lut, table, sizeof( lut ) );
+    // Every out of range reading looks up this entry
+    lut[KINECT_DEPTH_INVALID] = 0;
+}
+
+bool DepthModel::unproject( float col, float row, uint16_t raw, float xyz[3] ) const {
+    float z = meters( raw );
+    if( z <= 0 )
+        return false;
+    xyz[0] = ( col - k.cx )/k.fx*z;
+    xyz[1] = ( k.cy - row )/k.fy*z;
+    xyz[2] = -z;
+    return true;
+}
+
+int DepthModel::unproject( const float* cols, const float* rows, const uint16_t* raw, int n,
+                           float* xyz ) const {
+
+    const float nan = std::numeric_limits< float >::quiet_NaN();
+    const float ifx = 1/k.fx, ify = 1/k.fy;
+    int valid = 0;
+    for( int i = 0; i < n; i++ ) {
+        float z = lut[std::min( raw[i], KINECT_DEPTH_INVALID )];
+        float hole = z > 0 ? 0.f : nan;
+        xyz[3*i]   = ( cols[i] - k.cx )*ifx*z + hole;
+        xyz[3*i+1] = ( k.cy - rows[i] )*ify*z + hole;
+        xyz[3*i+2] = -z + hole;
+        valid += z > 0;
+    }
+    return valid;
+}
+
+int DepthModel::unprojectFrame( const uint16_t* depth, float* xyz ) const {
+
+    const float nan = std::numeric_limits< float >::quiet_NaN();
+    const float* rx = &raysX[0];
+    const float* ry = &raysY[0];
+    int valid = 0;
+    for( int i = 0; i < KINECT_PIXELS; i++ ) {
+        float z = lut[std::min( depth[i], KINECT_DEPTH_INVALID )];
+        // Keep this branch free so it vectorizes, z == 0 marks a hole
+        float hole = z > 0 ? 0.f : nan;
+        xyz[3*i]   = rx[i]*z + hole;
+        xyz[3*i+1] = ry[i]*z + hole;
+        xyz[3*i+2] = -z + hole;
+        valid += z > 0;
+    }
+    return valid;
+}
+
+int DepthModel::unprojectFrame( const uint16_t* depth, PointCloud& cloud, const uint8_t* rgb ) const {
+
+    cloud.resize( KINECT_WIDTH, KINECT_HEIGHT );
+    const float nan = std::numeric_limits< float >::quiet_NaN();
+    const float* rx = &raysX[0];
+    const float* ry = &raysY[0];
+    float* x = cloud.x();
+    float* y = cloud.y();
+    float* z = cloud.z();
+    int valid = 0;
+    for( int i = 0; i < KINECT_PIXELS; i++ ) {
+        float d = lut[std::min( depth[i], KINECT_DEPTH_INVALID )];
+        float hole = d > 0 ? 0.f : nan;
+        x[i] = rx[i]*d + hole;
+        y[i] = ry[i]*d + hole;
+        z[i] = -d + hole;
+        valid += d > 0;
+    }
+
+    if( uint8_t* mask = cloud.valid() )
+        for( int i = 0; i < KINECT_PIXELS; i++ )
+            mask[i] = lut[std::min( depth[i], KINECT_DEPTH_INVALID )] > 0;
+    if( rgb && cloud.has( POINT_COLOR ) ) {
+        uint8_t* r = cloud.r();
+        uint8_t* g = cloud.g();
+        uint8_t* b = cloud.b();
+        for( int i = 0; i < KINECT_PIXELS; i++ ) {
+            r[i] = rgb[3*i];
+            g[i] = rgb[3*i+1];
+            b[i] = rgb[3*i+2];
+        }
+    }
+    return valid;
+}
@@ -0,0 +1,81 @@
+#ifndef KINREG_DEPTH_MODEL_H
+#define KINREG_DEPTH_MODEL_H
+
+#include "kinect.h"
+#include "pointCloud.h"
+// --- C++ ---
+#include <vector>
+
+/*
+ * Per-camera calibration. fx, fy, cx, cy are the usual pinhole intrinsics
+ * in pixels, a and b map raw disparity d to metric depth as 1/(a*d + b).
+ */
+struct Intrinsics {
+    float fx, fy;
+    float cx, cy;
+    float a, b;
+};
+
+// These numbers come from a combination of the ros kinect_node wiki, and
+// nicolas burrus' posts. Good enough for any Kinect until it's calibrated.
+Intrinsics defaultIntrinsics();
+
+/*
+ * Turns raw depth frames into metric XYZ on the CPU.
+ *
+ * Points use the same convention the GL path always had: x right, y up and
+ * the camera looking down -z, in meters. Building a DepthModel precomputes
+ * a 2048 entry disparity -> meters table and a unit ray per pixel, so
+ * unprojecting a frame costs one table lookup and a multiply per coordinate.
+ */
+class DepthModel {
+public:
+    DepthModel( const Intrinsics& k = defaultIntrinsics() );
+    // Copies tables saved from a model with the same k (see calibration.h)
+    // instead of computing them. lut has 2048 entries, the rays
+    // KINECT_PIXELS each.
+    DepthModel( const Intrinsics& k, const float* lut, const float* raysX, const float* raysY );
+
+    const Intrinsics& intrinsics() const { return k; }
+
+    // Depth along the optical axis in meters, 0 for readings with no depth.
+    // Anything past KINECT_DEPTH_INVALID counts as no depth too, rather
+    // than wrapping around the table.
+    float meters( uint16_t raw ) const { 
+        return lut[raw < KINECT_DEPTH_INVALID ? raw : KINECT_DEPTH_INVALID]; 
+    }
+    const float* depthTable() const { return lut; }
+
+    // Camera space ray through pixel i (z component is always -1)
+    float rayX( int i ) const { return raysX[i]; }
+    float rayY( int i ) const { return raysY[i]; }
+    const float* rayTableX() const { return &raysX[0]; }
+    const float* rayTableY() const { return &raysY[0]; }
+
+    // Unprojects one pixel, works for sub-pixel (col, row) too. Returns
+    // false (and leaves xyz alone) if raw has no depth.
+    bool unproject( float col, float row, uint16_t raw, float xyz[3] ) const;
+
+    // Unprojects n pixels, (cols[i], rows[i]) with raw depth raw[i], into
+    // xyz triples. The ones without depth become NaN. Doesn't allocate and
+    // vectorizes, for batches of clicks or matches. Returns how many had
+    // depth.
+    int unproject( const float* cols, const float* rows, const uint16_t* raw, int n, float* xyz ) const;
+
+    // Unprojects a whole frame into an organised cloud of KINECT_PIXELS
+    // xyz triples. Pixels without depth become NaN so the cloud stays
+    // aligned with the image. Returns the number of valid points.
+    int unprojectFrame( const uint16_t* depth, float* xyz ) const;
+
+    // Same into an organised KINECT_WIDTH x KINECT_HEIGHT PointCloud.
+    // Fills the valid channel if the cloud has one, and the colour one
+    // from rgb (packed rgb bytes, registered to depth) if both are there.
+    int unprojectFrame( const uint16_t* depth, PointCloud& cloud, const uint8_t* rgb = 0 ) const;
+
+private:
+    Intrinsics k;
+    float lut[2048];
+    std::vector< float > raysX, raysY;
+};
+
+#endif
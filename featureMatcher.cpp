@@ -0,0 +1,170 @@
+#include "featureMatcher.h"
+#include "registrationGraph.h"
+#include "profiler.h"
+#include "threadPool.h"
+// --- C++ ---
+#include <math.h>
+#include <algorithm>
+#include <limits>
+
+void detectFeatures( const Frame& frame, const DepthModel& model, const FeatureParams& params,
+                     FeatureFrame& out ) {
+
+    const int W = KINECT_WIDTH, H = KINECT_HEIGHT;
+    cv::Mat rgb( H, W, CV_8UC3, (void*)frame.rgb );
+    cv::Mat grey, mask( H, W, CV_8UC1 );
+    cv::cvtColor( rgb, grey, CV_RGB2GRAY );
+    // No point describing what can't be lifted to 3D
+    for( int row = 0; row < H; row++ ) {
+        uint8_t* m = mask.ptr( row );
+        for( int col = 0; col < W; col++ )
+            m[col] = model.meters( frame.depth[row*W + col] ) > 0 ? 255 : 0;
+    }
+
+    cv::ORB orb( params.features );
+    orb( grey, mask, out.keypoints, out.descriptors );
+
+    // Corners are often depth edges too, where the depth under a keypoint
+    // could belong to either side. Only keep ones on a smooth surface.
+    const float nan = std::numeric_limits< float >::quiet_NaN();
+    out.points.assign( out.keypoints.size(), cv::Vec3f( nan, nan, nan ) );
+    for( int k = 0; k < (int)out.keypoints.size(); k++ ) {
+        const cv::Point2f& pt = out.keypoints[k].pt;
+        int col = (int)( pt.x + 0.5f ), row = (int)( pt.y + 0.5f );
+        if( col < 1 || row < 1 || col >= W - 1 || row >= H - 1 )
+            continue;
+        float lo = 1e9f, hi = 0;
+        for( int dr = -1; dr <= 1; dr++ )
+            for( int dc = -1; dc <= 1; dc++ ) {
+                float z = model.meters( frame.depth[( row + dr )*W + col + dc] );
+                lo = std::min( lo, z );
+                hi = std::max( hi, z );
+            }
+        if( !( lo > 0 ) || hi - lo > params.maxJump )
+            continue;
+        model.unproject( pt.x, pt.y, frame.depth[row*W + col], &out.points[k][0] );
+    }
+}
+
+int matchFeatures( const FeatureFrame& a, const FeatureFrame& b, const FeatureParams& params,
+                   PointCloud& A, PointCloud& B ) {
+
+    if( a.descriptors.empty() || b.descriptors.empty() )
+        return 0;
+
+    cv::BFMatcher matcher( cv::NORM_HAMMING );
+    std::vector< std::vector< cv::DMatch > > ab;
+    std::vector< cv::DMatch > ba;
+    matcher.knnMatch( a.descriptors, b.descriptors, ab, 2 );
+    matcher.match( b.descriptors, a.descriptors, ba );
+
+    int added = 0;
+    for( int i = 0; i < (int)ab.size(); i++ ) {
+        if( ab[i].empty() )
+            continue;
+        const cv::DMatch& m = ab[i][0];
+        if( m.distance > params.maxDistance )
+            continue;
+        // Repeated texture matches several places about as well, skip it
+        if( ab[i].size() > 1 && m.distance > params.ratio*ab[i][1].distance )
+            continue;
+        // b's best match in a has to be this one too
+        if( m.trainIdx >= (int)ba.size() || ba[m.trainIdx].trainIdx != m.queryIdx )
+            continue;
+        const cv::Vec3f& p = a.points[m.queryIdx];
+        const cv::Vec3f& q = b.points[m.trainIdx];
+        if( p[0] != p[0] || q[0] != q[0] )
+            continue;
+        A.push_back( p );
+        B.push_back( q );
+        added++;
+    }
+    return added;
+}
+
+// ---------------------------------------------------------------------------
+// FeatureMatcher
+
+FeatureMatcher::FeatureMatcher( const FeatureParams& params, ThreadPool* pool )
+    : params( params ), pool( pool ? pool : &ThreadPool::shared() ), running( false ), ready( false ) {}
+
+FeatureMatcher::~FeatureMatcher() {
+    std::unique_lock< std::mutex > guard( lock );
+    finished.wait( guard, [this] { return !running; } );
+}
+
+bool FeatureMatcher::start( const std::vector< const Frame* >& current, 
+                            const std::vector< DepthModel >& cameraModels ) {
+    {
+        std::lock_guard< std::mutex > guard( lock );
+        if( running )
+            return false;
+        running = true;
+    }
+    // Nothing else touches these until run() clears running
+    frames.resize( current.size() );
+    for( int cam = 0; cam < (int)current.size(); cam++ )
+        frames[cam] = *current[cam];
+    models = cameraModels;
+    pool->submit( [this] { run(); } );
+    return true;
+}
+
+bool FeatureMatcher::busy() {
+    std::lock_guard< std::mutex > guard( lock );
+    return running;
+}
+
+void FeatureMatcher::run() {
+
+    int n = (int)frames.size();
+    std::vector< FeatureFrame > features( n );
+    pool->parallelFor( n, [&]( int cam ) {
+        PROFILE_SCOPE( "features", cam );
+        detectFeatures( frames[cam], models[cam], params, features[cam] );
+    } );
+
+    std::vector< PairMatches > pairs;
+    for( int a = 0; a < n; a++ )
+        for( int b = a + 1; b < n; b++ ) {
+            PairMatches m;
+            m.a = a;
+            m.b = b;
+            pairs.push_back( m );
+        }
+    pool->parallelFor( (int)pairs.size(), [&]( int k ) {
+        PROFILE_SCOPE( "match" );
+        PairMatches& m = pairs[k];
+        matchFeatures( features[m.a], features[m.b], params, m.A, m.B );
+    } );
+
+    // Notified under the lock: the destructor may return (and free
+    // finished) as soon as it sees running clear
+    std::lock_guard< std::mutex > guard( lock );
+    found.swap( pairs );
+    ready = true;
+    running = false;
+    finished.notify_all();
+}
+
+int FeatureMatcher::collect( RegistrationGraph& graph, int maxPerPair ) {
+
+    std::vector< PairMatches > batch;
+    {
+        std::lock_guard< std::mutex > guard( lock );
+        if( !ready )
+            return 0;
+        batch.swap( found );
+        ready = false;
+    }
+
+    int added = 0;
+    for( int k = 0; k < (int)batch.size(); k++ ) {
+        const PairMatches& m = batch[k];
+        for( int i = 0; i < m.A.size() && graph.correspondences( m.a, m.b ) < maxPerPair; i++ ) {
+            graph.addCorrespondence( m.a, m.A.point( i ), m.b, m.B.point( i ) );
+            added++;
+        }
+    }
+    return added;
+}
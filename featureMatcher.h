@@ -0,0 +1,95 @@
+#ifndef KINREG_FEATURE_MATCHER_H
+#define KINREG_FEATURE_MATCHER_H
+
+#include "kinect.h"
+#include "depthModel.h"
+#include "pointCloud.h"
+// ---- OpenCV -----
+#include <cv.h>
+// --- C++ ---
+#include <condition_variable>
+#include <mutex>
+#include <vector>
+
+class ThreadPool;
+class RegistrationGraph;
+
+struct FeatureParams {
+    FeatureParams() : features( 1000 ), ratio( 0.8f ), maxDistance( 64 ), maxJump( 0.05f ) {}
+
+    int features;       // ORB keypoints per image, at most
+    float ratio;        // the best match has to beat the second best by this much
+    int maxDistance;    // Hamming, out of 256 bits
+    float maxJump;      // keypoints whose 3x3 depth spans more than this sit on an edge, meters
+};
+
+// One camera's ORB features. points[i] is keypoint i in the camera's
+// metric space, NaN if it had no (or unreliable) depth.
+struct FeatureFrame {
+    std::vector< cv::KeyPoint > keypoints;
+    cv::Mat descriptors;
+    std::vector< cv::Vec3f > points;
+};
+
+// ORB on the grey RGB image, only where there is depth (the RGB and depth
+// images are registered, like the clicks assume)
+void detectFeatures( const Frame& frame, const DepthModel& model, const FeatureParams& params,
+                     FeatureFrame& out );
+
+// Mutual nearest neighbours that pass the ratio test, both ends with
+// depth, appended to A and B as metric pairs. Returns how many.
+int matchFeatures( const FeatureFrame& a, const FeatureFrame& b, const FeatureParams& params,
+                   PointCloud& A, PointCloud& B );
+
+/*
+ * Automatic correspondences between every pair of cameras, in the
+ * background.
+ *
+ * start() copies the cameras' current frames and hands detection and
+ * matching to the thread pool, then returns. The renderer calls it as
+ * often as it likes; while a batch is still running it does nothing, so
+ * slow matching lowers the match rate, never the frame rate. collect()
+ * moves a finished batch into the registration graph, where the matches
+ * are treated like clicks (RANSAC sorts out the wrong ones).
+ */
+class FeatureMatcher {
+public:
+    FeatureMatcher( const FeatureParams& params = FeatureParams(), ThreadPool* pool = 0 );
+    // Waits for a running batch
+    ~FeatureMatcher();
+
+    // False (and nothing copied) if the last batch isn't done yet
+    bool start( const std::vector< const Frame* >& frames, const std::vector< DepthModel >& models );
+    bool busy();
+
+    // Adds the last finished batch to graph, leaving pairs that already
+    // have maxPerPair correspondences alone. Returns how many were added.
+    int collect( RegistrationGraph& graph, int maxPerPair );
+
+    const FeatureParams& parameters() const { return params; }
+
+private:
+    FeatureMatcher( const FeatureMatcher& );
+    FeatureMatcher& operator=( const FeatureMatcher& );
+
+    struct PairMatches {
+        int a, b;
+        PointCloud A, B;
+    };
+
+    void run();
+
+    FeatureParams params;
+    ThreadPool* pool;
+    // Owned by the batch while running is set
+    std::vector< Frame > frames;
+    std::vector< DepthModel > models;
+    std::vector< PairMatches > found;
+
+    std::mutex lock;
+    std::condition_variable finished;
+    bool running;
+    bool ready;         // found holds a batch collect() hasn't taken
+};
+
+#endif
@@ -0,0 +1,96 @@
+#include "frameSource.h"
+// -- libfreenect --
+#include <libfreenect.h>
+#include <libfreenect_sync.h>
+// --- C++ ---
+#include <string.h>
+#include <algorithm>
+#include <thread>
+
+FreenectSource::FreenectSource( int numCams ) : numCams( numCams ) {}
+
+FreenectSource::~FreenectSource() {
+    freenect_sync_stop();
+}
+
+bool FreenectSource::grab( int cam, Frame& frame ) {
+
+    void* rgb = 0;
+    void* depth = 0;
+    uint32_t rgbTime, depthTime;
+
+    // The sync wrapper hands back its own buffers which it reuses on the
+    // next call, so the data has to be copied out before returning
+    if( freenect_sync_get_video( &rgb, &rgbTime, cam, FREENECT_VIDEO_RGB ) )
+        return false;
+    memcpy( frame.rgb, rgb, sizeof( frame.rgb ) );
+
+    if( freenect_sync_get_depth( &depth, &depthTime, cam, FREENECT_DEPTH_11BIT ) )
+        return false;
+    memcpy( frame.depth, depth, sizeof( frame.depth ) );
+
+    frame.deviceTimestamp = depthTime;
+    return true;
+}
+
+FileSource::FileSource( const std::string& dir, int numCams, double fps ) {
+
+    period = fps > 0 ? 1.0/fps : 0;
+    for( int cam = 0; cam < numCams; cam++ ) {
+        char name[32];
+        Stream s;
+        snprintf( name, sizeof( name ), "/cam%d.rgb", cam );
+        s.rgb = fopen( (dir + name).c_str(), "rb" );
+        snprintf( name, sizeof( name ), "/cam%d.depth", cam );
+        s.depth = fopen( (dir + name).c_str(), "rb" );
+        s.nextDue = 0;
+        s.served = 0;
+        streams.push_back( s );
+    }
+}
+
+FileSource::~FileSource() {
+    for( int cam = 0; cam < (int)streams.size(); cam++ ) {
+        if( streams[cam].rgb ) fclose( streams[cam].rgb );
+        if( streams[cam].depth ) fclose( streams[cam].depth );
+    }
+}
+
+bool FileSource::isOpen() const {
+    for( int cam = 0; cam < (int)streams.size(); cam++ )
+        if( !streams[cam].rgb || !streams[cam].depth )
+            return false;
+    return !streams.empty();
+}
+
+// Reads one frame worth of bytes, rewinding once if we hit the end
+static bool readLooped( FILE* f, void* dst, size_t bytes ) {
+    if( fread( dst, 1, bytes, f ) == bytes )
+        return true;
+    rewind( f );
+    return fread( dst, 1, bytes, f ) == bytes;
+}
+
+bool FileSource::grab( int cam, Frame& frame ) {
+
+    if( cam < 0 || cam >= (int)streams.size() )
+        return false;
+    Stream& s = streams[cam];
+    if( !s.rgb || !s.depth )
+        return false;
+
+    // Pace like the real device would
+    if( period > 0 ) {
+        double now = monotonicSeconds();
+        if( s.nextDue > now )
+            std::this_thread::sleep_for( std::chrono::duration< double >( s.nextDue - now ) );
+        s.nextDue = std::max( s.nextDue, now ) + period;
+    }
+
+    if( !readLooped( s.rgb, frame.rgb, sizeof( frame.rgb ) ) ||
+        !readLooped( s.depth, frame.depth, sizeof( frame.depth ) ) )
+        return false;
+
+    frame.deviceTimestamp = s.served++;
+    return true;
+}
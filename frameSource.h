@@ -0,0 +1,86 @@
+#ifndef KINREG_FRAME_SOURCE_H
+#define KINREG_FRAME_SOURCE_H
+
+#include "kinect.h"
+// --- C++ ---
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+// A frame that lives in the source's own memory, see FrameSource::view()
+struct FrameView {
+    const uint8_t* rgb;
+    const uint16_t* depth;
+    uint32_t deviceTimestamp;
+};
+
+/*
+ * Where frames come from. Capture threads only ever talk to a FrameSource,
+ * so the rest of the pipeline can't tell a live Kinect from a file on disk.
+ *
+ * grab() is called from one capture thread per camera, so implementations
+ * must tolerate concurrent calls for *different* cameras. Calls for the
+ * same camera are never concurrent.
+ */
+class FrameSource {
+public:
+    virtual ~FrameSource() {}
+
+    virtual int numCameras() const = 0;
+
+    // Blocks until the next frame of camera cam is available and fills
+    // rgb, depth and deviceTimestamp of frame. Returns false on failure.
+    virtual bool grab( int cam, Frame& frame ) = 0;
+
+    // Sources that already hold frames in memory can lend them out instead
+    // of copying. view() blocks and paces like grab(), the pointers stay
+    // valid until the next call for the same camera.
+    virtual bool canView() const { return false; }
+    virtual bool view( int, FrameView& ) { return false; }
+};
+
+// Live sensors through libfreenect's sync wrapper
+class FreenectSource : public FrameSource {
+public:
+    FreenectSource( int numCams );
+    ~FreenectSource();
+
+    int numCameras() const { return numCams; }
+    bool grab( int cam, Frame& frame );
+
+private:
+    int numCams;
+};
+
+/*
+ * Fake device backed by raw frame dumps, for running without sensors.
+ * For camera N the directory holds
+ *
+ *      camN.rgb    - back to back 640x480x3 byte frames
+ *      camN.depth  - back to back 640x480 uint16 frames (host byte order)
+ *
+ * Frames are served at fps (0 means as fast as they can be read) and the
+ * streams loop when they run out.
+ */
+class FileSource : public FrameSource {
+public:
+    FileSource( const std::string& dir, int numCams, double fps = 30 );
+    ~FileSource();
+
+    // False if any of the camera files couldn't be opened
+    bool isOpen() const;
+    int numCameras() const { return (int)streams.size(); }
+    bool grab( int cam, Frame& frame );
+
+private:
+    struct Stream {
+        FILE* rgb;
+        FILE* depth;
+        double nextDue;
+        uint32_t served;
+    };
+    std::vector< Stream > streams;
+    double period;
+};
+
+#endif
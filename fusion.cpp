@@ -0,0 +1,261 @@
+#include "fusion.h"
+#include "kinect.h"
+#include "profiler.h"
+#include "threadPool.h"
+// --- SIMD ---
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define KINREG_SSE2 1
+#endif
+// --- C++ ---
+#include <math.h>
+#include <algorithm>
+
+// Points per binning task, and shards (a power of two) the voxels are
+// split into for summing
+static const int CHUNK = 16384;
+static const int SHARD_BITS = 6;
+static const int SHARDS = 1 << SHARD_BITS;
+
+// Cell coordinates packed 21 bits each, as voxelGrid.cpp does
+static inline uint64_t packCell( int cx, int cy, int cz ) {
+    const int bias = 1 << 20;
+    return (uint64_t)( ( cx + bias ) & 0x1FFFFF ) |
+           ( (uint64_t)( ( cy + bias ) & 0x1FFFFF ) << 21 ) |
+           ( (uint64_t)( ( cz + bias ) & 0x1FFFFF ) << 42 );
+}
+
+static inline uint64_t mixKey( uint64_t key ) {
+    key ^= key >> 29;
+    return key*0x9E3779B97F4A7C15ull;
+}
+
+CloudFusion::CloudFusion( const FusionParams& params, ThreadPool* pool )
+    : params( params ), leaf( params.leaf ), shards( SHARDS ) {
+    ownPool = !pool && params.threads > 0;
+    this->pool = pool ? pool : ownPool ? new ThreadPool( params.threads ) : &ThreadPool::shared();
+    stats.inputPoints = stats.cells = stats.points = 0;
+    stats.leaf = leaf;
+    stats.ms = 0;
+}
+
+CloudFusion::~CloudFusion() {
+    if( ownPool )
+        delete pool;
+}
+
+// Transforms chunk's points into the world and files each finite one under
+// the shard of its voxel
+void CloudFusion::bin( const Chunk& chunk, const PointCloud& cloud, const RigidTransform& T, float inv,
+                       std::vector< std::vector< Entry > >& out, int& finite ) {
+
+    for( int s = 0; s < SHARDS; s++ )
+        out[s].clear();
+    finite = 0;
+
+    const float* x = cloud.x();
+    const float* y = cloud.y();
+    const float* z = cloud.z();
+    const uint8_t* r = cloud.r();
+    const uint8_t* g = cloud.g();
+    const uint8_t* b = cloud.b();
+    uint8_t colored = r ? 1 : 0;
+
+    Entry e;
+    e.r = e.g = e.b = 0;
+    e.colored = colored;
+    int i = chunk.begin;
+#ifdef KINREG_SSE2
+    __m128 R[9], t[3];
+    for( int k = 0; k < 9; k++ )
+        R[k] = _mm_set1_ps( T.R.val[k] );
+    for( int a = 0; a < 3; a++ )
+        t[a] = _mm_set1_ps( T.t[a] );
+    const __m128 vinv = _mm_set1_ps( inv );
+    for( ; i + 4 <= chunk.end; i += 4 ) {
+        __m128 px = _mm_load_ps( x + i ), py = _mm_load_ps( y + i ), pz = _mm_load_ps( z + i );
+        __m128 ok = _mm_and_ps( _mm_and_ps( _mm_cmpord_ps( px, px ), _mm_cmpord_ps( py, py ) ),
+                                _mm_cmpord_ps( pz, pz ) );
+        int lanes = _mm_movemask_ps( ok );
+        if( !lanes )
+            continue;
+        __m128 w[3];
+        int cell[3][4];
+        float world[3][4];
+        for( int a = 0; a < 3; a++ ) {
+            w[a] = _mm_add_ps( _mm_add_ps( _mm_mul_ps( R[3*a], px ), _mm_mul_ps( R[3*a + 1], py ) ),
+                               _mm_add_ps( _mm_mul_ps( R[3*a + 2], pz ), t[a] ) );
+            // floor() as truncate, then one less where that rounded up
+            __m128 s = _mm_mul_ps( w[a], vinv );
+            __m128i c = _mm_cvttps_epi32( s );
+            c = _mm_add_epi32( c, _mm_castps_si128( _mm_cmpgt_ps( _mm_cvtepi32_ps( c ), s ) ) );
+            _mm_storeu_si128( (__m128i*)cell[a], c );
+            _mm_storeu_ps( world[a], w[a] );
+        }
+        for( int l = 0; l < 4; l++ ) {
+            if( !( lanes & ( 1 << l ) ) )
+                continue;
+            e.key = packCell( cell[0][l], cell[1][l], cell[2][l] );
+            e.x = world[0][l];
+            e.y = world[1][l];
+            e.z = world[2][l];
+            if( colored ) {
+                e.r = r[i + l];
+                e.g = g[i + l];
+                e.b = b[i + l];
+            }
+            out[mixKey( e.key ) >> ( 64 - SHARD_BITS )].push_back( e );
+            finite++;
+        }
+    }
+#endif
+    for( ; i < chunk.end; i++ ) {
+        if( !cloud.finite( i ) )
+            continue;
+        cv::Vec3f p = T( cloud.point( i ) );
+        e.key = packCell( (int)floorf( p[0]*inv ), (int)floorf( p[1]*inv ), (int)floorf( p[2]*inv ) );
+        e.x = p[0];
+        e.y = p[1];
+        e.z = p[2];
+        if( colored ) {
+            e.r = r[i];
+            e.g = g[i];
+            e.b = b[i];
+        }
+        out[mixKey( e.key ) >> ( 64 - SHARD_BITS )].push_back( e );
+        finite++;
+    }
+}
+
+// Sums one shard's points into its voxels, chunks in order so the cells
+// come out in the same order every time
+void CloudFusion::accumulate( int s ) {
+
+    Shard& shard = shards[s];
+    size_t n = 0;
+    for( int c = 0; c < (int)chunks.size(); c++ )
+        n += bins[c][s].size();
+
+    size_t size = 16;
+    while( size < 2*n )
+        size *= 2;
+    shard.slots.assign( size, 0 );
+    shard.cells.clear();
+    size_t mask = size - 1;
+
+    for( int c = 0; c < (int)chunks.size(); c++ ) {
+        const std::vector< Entry >& entries = bins[c][s];
+        for( int k = 0; k < (int)entries.size(); k++ ) {
+            const Entry& e = entries[k];
+            // The top bits picked the shard, probe with the rest
+            size_t h = (size_t)( mixKey( e.key ) >> 16 ) & mask;
+            while( shard.slots[h] && shard.cells[shard.slots[h] - 1].key != e.key )
+                h = ( h + 1 ) & mask;
+            if( !shard.slots[h] ) {
+                Cell cell = { e.key, 0, 0, 0, 0, 0, 0, 0, 0 };
+                shard.cells.push_back( cell );
+                shard.slots[h] = (uint32_t)shard.cells.size();
+            }
+            Cell& cell = shard.cells[shard.slots[h] - 1];
+            cell.x += e.x;
+            cell.y += e.y;
+            cell.z += e.z;
+            cell.count++;
+            cell.r += e.r;
+            cell.g += e.g;
+            cell.b += e.b;
+            cell.colored += e.colored;
+        }
+    }
+}
+
+int CloudFusion::fuse( const std::vector< PointCloud >& clouds, const std::vector< RigidTransform >& poses,
+                       PointCloud& out ) {
+
+    PROFILE_SCOPE( "fuse" );
+    double start = monotonicSeconds();
+
+    chunks.clear();
+    bool color = false;
+    int cams = std::min( (int)clouds.size(), (int)poses.size() );
+    for( int cam = 0; cam < cams; cam++ ) {
+        color = color || clouds[cam].has( POINT_COLOR );
+        for( int begin = 0; begin < clouds[cam].size(); begin += CHUNK ) {
+            Chunk c = { cam, begin, std::min( begin + CHUNK, clouds[cam].size() ) };
+            chunks.push_back( c );
+        }
+    }
+    if( bins.size() < chunks.size() )
+        bins.resize( chunks.size(), std::vector< std::vector< Entry > >( SHARDS ) );
+    finite.assign( chunks.size(), 0 );
+
+    float used = leaf;
+    float inv = 1/used;
+    pool->parallelFor( (int)chunks.size(), [&]( int c ) {
+        const Chunk& chunk = chunks[c];
+        bin( chunk, clouds[chunk.cam], poses[chunk.cam], inv, bins[c], finite[c] );
+    } );
+    pool->parallelFor( SHARDS, [&]( int s ) { accumulate( s ); } );
+
+    int offsets[SHARDS + 1];
+    offsets[0] = 0;
+    for( int s = 0; s < SHARDS; s++ )
+        offsets[s + 1] = offsets[s] + (int)shards[s].cells.size();
+    int cells = offsets[SHARDS];
+
+    // Over the bound, cell g (in shard order) lands in slot g*max/cells and
+    // only the first of each slot is kept, an even thinning
+    bool thin = params.maxPoints > 0 && cells > params.maxPoints;
+    int points = thin ? params.maxPoints : cells;
+    if( color )
+        out.addChannels( POINT_COLOR );
+    out.resize( points );
+    float* x = out.x();
+    float* y = out.y();
+    float* z = out.z();
+    uint8_t* r = out.r();
+    uint8_t* g = out.g();
+    uint8_t* b = out.b();
+    pool->parallelFor( SHARDS, [&]( int s ) {
+        const std::vector< Cell >& sc = shards[s].cells;
+        for( int k = 0; k < (int)sc.size(); k++ ) {
+            int64_t global = offsets[s] + k;
+            int slot = (int)global;
+            if( thin ) {
+                slot = (int)( global*params.maxPoints/cells );
+                if( global && (int)( ( global - 1 )*params.maxPoints/cells ) == slot )
+                    continue;
+            }
+            const Cell& c = sc[k];
+            float w = 1.f/c.count;
+            x[slot] = c.x*w;
+            y[slot] = c.y*w;
+            z[slot] = c.z*w;
+            if( r ) {
+                int k = std::max( c.colored, 1 );
+                r[slot] = (uint8_t)( ( c.r + k/2 )/k );
+                g[slot] = (uint8_t)( ( c.g + k/2 )/k );
+                b[slot] = (uint8_t)( ( c.b + k/2 )/k );
+            }
+        }
+    } );
+
+    // Occupied voxels of a surface go as 1/leaf^2. Grow straight to where
+    // this frame would have fitted, shrink back gently.
+    if( params.maxPoints > 0 ) {
+        float target = 0.9f*params.maxPoints;
+        if( cells > params.maxPoints )
+            leaf = std::min( params.maxLeaf, leaf*std::min( 2.f, sqrtf( cells/target ) ) );
+        else if( cells < 0.6f*params.maxPoints && leaf > params.leaf )
+            leaf = std::max( params.leaf, leaf*std::max( 0.8f, sqrtf( cells/target ) ) );
+    }
+
+    stats.inputPoints = 0;
+    for( int c = 0; c < (int)chunks.size(); c++ )
+        stats.inputPoints += finite[c];
+    stats.cells = cells;
+    stats.points = points;
+    stats.leaf = used;
+    stats.ms = 1000*( monotonicSeconds() - start );
+    return points;
+}
@@ -0,0 +1,107 @@
+#ifndef KINREG_FUSION_H
+#define KINREG_FUSION_H
+
+#include "pointCloud.h"
+#include "rigidTransform.h"
+// --- C++ ---
+#include <stdint.h>
+#include <vector>
+
+class ThreadPool;
+
+struct FusionParams {
+    FusionParams() : leaf( 0.005f ), maxPoints( 200000 ), maxLeaf( 0.05f ), threads( 0 ) {}
+
+    float leaf;         // voxel size, meters
+    int maxPoints;      // bound on the fused cloud, 0 for none
+    float maxLeaf;      // how far leaf may grow to stay under maxPoints
+    int threads;        // 0 uses the shared pool
+};
+
+struct FusionStats {
+    int inputPoints;    // finite points over every camera
+    int cells;          // occupied voxels
+    int points;         // in the fused cloud, cells thinned to maxPoints
+    float leaf;         // voxel size this frame was fused with
+    double ms;
+};
+
+/*
+ * Merges every camera's cloud into one world frame cloud.
+ *
+ * Each camera's points go through its pose (SSE2, four points at a time)
+ * and straight into a voxel grid, so overlap between cameras collapses to
+ * one point per leaf: the centroid of whatever fell in it, with the mean
+ * colour of the coloured points.
+ *
+ * Both halves run on the pool. The clouds are cut into chunks that each
+ * transform their points and sort them by a hash of their voxel into
+ * shards, then every shard sums its voxels in its own open addressing
+ * table, so nothing is shared or locked. Output order only depends on the
+ * input, not on the threads.
+ *
+ * With maxPoints set the output never goes over it. A frame with more
+ * occupied voxels is thinned evenly and the leaf grows for the next frame
+ * (up to maxLeaf), then shrinks back towards params.leaf once the scene
+ * allows. All buffers are kept between calls, a steady stream of frames
+ * doesn't allocate.
+ */
+class CloudFusion {
+public:
+    // pool, if given, is used instead of params.threads
+    CloudFusion( const FusionParams& params = FusionParams(), ThreadPool* pool = 0 );
+    ~CloudFusion();
+
+    // clouds[cam] is in camera space (holes NaN), poses[cam] takes it into
+    // the world. Empty clouds are skipped, that's how to leave out an
+    // unplaced camera. out becomes unorganised xyz, plus colour if any
+    // input has it. Returns the number of points.
+    int fuse( const std::vector< PointCloud >& clouds, const std::vector< RigidTransform >& poses,
+              PointCloud& out );
+
+    // Voxel size the next fuse() will use
+    float leafSize() const { return leaf; }
+    const FusionStats& lastStats() const { return stats; }
+    const FusionParams& parameters() const { return params; }
+
+private:
+    CloudFusion( const CloudFusion& );
+    CloudFusion& operator=( const CloudFusion& );
+
+    struct Entry {
+        uint64_t key;
+        float x, y, z;
+        uint8_t r, g, b, colored;
+    };
+    struct Cell {
+        uint64_t key;
+        float x, y, z;
+        int count;
+        uint32_t r, g, b;
+        int colored;
+    };
+    struct Chunk {
+        int cam, begin, end;
+    };
+    struct Shard {
+        std::vector< uint32_t > slots;  // cell index + 1, 0 empty
+        std::vector< Cell > cells;
+    };
+
+    void bin( const Chunk& chunk, const PointCloud& cloud, const RigidTransform& T, float inv,
+              std::vector< std::vector< Entry > >& bins, int& finite );
+    void accumulate( int shard );
+
+    FusionParams params;
+    ThreadPool* pool;
+    bool ownPool;
+    float leaf;
+    FusionStats stats;
+
+    std::vector< Chunk > chunks;
+    std::vector< int > finite;                                  // per chunk
+    std::vector< std::vector< std::vector< Entry > > > bins;    // [chunk][shard]
+    std::vector< Shard > shards;
+};
+
+#endif
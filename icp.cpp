@@ -0,0 +1,168 @@
+#include "icp.h"
+#include "kinect.h"
+#include "normals.h"
+#include "voxelGrid.h"
+#include "threadPool.h"
+// --- C++ ---
+#include <math.h>
+#include <string.h>
+#include <algorithm>
+
+// Voxel hash cells. Much bigger and a dense target piles thousands of
+// points into each one, the shell search copes fine with a wider radius.
+static const float MAX_VOXEL_CELL = 0.02f;
+
+Icp::Icp( const IcpParams& params, ThreadPool* pool ) : params( params ), 
+                                       voxels( std::min( params.maxDistance, MAX_VOXEL_CELL ) ), 
+                                       index( &tree ), indexed( 0 ) {
+    ownPool = !pool && params.threads > 0;
+    this->pool = pool ? pool : ownPool ? new ThreadPool( params.threads ) : &ThreadPool::shared();
+}
+
+Icp::~Icp() {
+    if( ownPool )
+        delete pool;
+}
+
+void Icp::setTarget( const PointCloud& cloud, const Intrinsics& k ) {
+
+    target = cloud;
+    computeNormals( target, 0.05f, pool );
+
+    // Only points with a normal are any use for point to plane, so hide
+    // the rest from the index
+    float* x = target.x();
+    const float* nx = target.nx();
+    indexed = 0;
+    for( int i = 0; i < target.size(); i++ ) {
+        if( nx[i] != nx[i] )
+            x[i] = NAN;
+        else
+            indexed++;
+    }
+
+    switch( params.search ) {
+    case ICP_SEARCH_VOXEL_HASH:
+        voxels.build( target );
+        index = &voxels;
+        break;
+    case ICP_SEARCH_PROJECTIVE:
+        projective.build( target, k );
+        index = &projective;
+        break;
+    default:
+        tree.build( target, pool );
+        index = &tree;
+        break;
+    }
+}
+
+void Normals6::clear() {
+    memset( this, 0, sizeof( *this ) );
+}
+
+void Normals6::add( const Normals6& o ) {
+    for( int k = 0; k < 21; k++ ) A[k] += o.A[k];
+    for( int k = 0; k < 6; k++ ) b[k] += o.b[k];
+    err += o.err;
+    count += o.count;
+}
+
+bool Normals6::solve( double x[6], double damping ) const {
+    cv::Matx66d M;
+    cv::Matx61d rhs, sol;
+    for( int a = 0, k = 0; a < 6; a++ ) {
+        for( int c = a; c < 6; c++, k++ )
+            M(a,c) = M(c,a) = A[k];
+        M(a,a) += damping;
+        rhs(a) = -b[a];
+    }
+    if( !cv::solve( M, rhs, sol, cv::DECOMP_CHOLESKY ) )
+        return false;
+    for( int k = 0; k < 6; k++ )
+        x[k] = sol(k);
+    return true;
+}
+
+IcpResult Icp::align( const PointCloud& source, const RigidTransform& guess ) {
+
+    IcpResult result;
+    result.transform = guess;
+    result.converged = false;
+    result.rms = 0;
+
+    scratch.reset();
+    PointCloud src( POINT_XYZ, &scratch );
+    int n = voxelDownsample( source, params.voxelSize, src );
+    if( n < 6 || indexed < 6 )
+        return result;
+
+    const float* sx = src.x();
+    const float* sy = src.y();
+    const float* sz = src.z();
+    const float* tx = target.x();
+    const float* ty = target.y();
+    const float* tz = target.z();
+    const float* tnx = target.nx();
+    const float* tny = target.ny();
+    const float* tnz = target.nz();
+
+    const int CHUNK = 2048;
+    int chunks = ( n + CHUNK - 1 )/CHUNK;
+    std::vector< Normals6 > partial( chunks );
+    float maxDist2 = params.maxDistance*params.maxDistance;
+
+    for( int it = 0; it < params.maxIterations; it++ ) {
+        double start = monotonicSeconds();
+        const RigidTransform T = result.transform;
+
+        pool->parallelFor( chunks, [&]( int c ) {
+            Normals6& s = partial[c];
+            s.clear();
+            int end = std::min( n, ( c + 1 )*CHUNK );
+            for( int i = c*CHUNK; i < end; i++ ) {
+                cv::Vec3f p = T( cv::Vec3f( sx[i], sy[i], sz[i] ) );
+                int j = index->nearest( &p[0], maxDist2 );
+                if( j < 0 )
+                    continue;
+                const float q[3] = { tx[j], ty[j], tz[j] };
+                const float nq[3] = { tnx[j], tny[j], tnz[j] };
+                s.add( &p[0], q, nq );
+            }
+        } );
+
+        Normals6 sum;
+        sum.clear();
+        for( int c = 0; c < chunks; c++ )
+            sum.add( partial[c] );
+
+        IcpIteration step;
+        step.level = 0;
+        step.correspondences = sum.count;
+        step.rms = sum.count ? (float)sqrt( sum.err/sum.count ) : 0;
+        result.rms = step.rms;
+        if( sum.count < 6 ) {
+            step.ms = 1000*( monotonicSeconds() - start );
+            result.iterations.push_back( step );
+            break;
+        }
+
+        double x[6];
+        bool solved = sum.solve( x );
+        step.ms = 1000*( monotonicSeconds() - start );
+        result.iterations.push_back( step );
+        if( !solved )
+            break;
+
+        result.transform = RigidTransform::fromTwist( x )*result.transform;
+
+        double update = 0;
+        for( int k = 0; k < 6; k++ )
+            update += x[k]*x[k];
+        if( sqrt( update ) < params.minUpdate ) {
+            result.converged = true;
+            break;
+        }
+    }
+    return result;
+}
@@ -0,0 +1,116 @@
+#ifndef KINREG_ICP_H
+#define KINREG_ICP_H
+
+#include "rigidTransform.h"
+#include "pointIndex.h"
+// --- C++ ---
+#include <vector>
+
+class ThreadPool;
+
+// How the target is searched for correspondences, see pointIndex.h
+enum IcpSearch {
+    ICP_SEARCH_KDTREE,
+    ICP_SEARCH_VOXEL_HASH,
+    ICP_SEARCH_PROJECTIVE
+};
+
+struct IcpParams {
+    IcpParams() : voxelSize( 0.01f ), maxDistance( 0.05f ), maxIterations( 30 ), 
+                  minUpdate( 1e-5f ), threads( 0 ), search( ICP_SEARCH_KDTREE ) {}
+
+    float voxelSize;    // source downsampling leaf, meters
+    float maxDistance;  // correspondences further apart are ignored, meters
+    int maxIterations;
+    float minUpdate;    // stop once an update moves less than this
+    int threads;        // 0 uses the shared pool
+    IcpSearch search;
+};
+
+struct IcpIteration {
+    int level;          // pyramid level, 0 is full resolution (always for Icp)
+    int correspondences;
+    float rms;          // point to plane residual before the update, meters
+    double ms;          // correspondence search + solve
+};
+
+struct IcpResult {
+    RigidTransform transform;
+    bool converged;
+    float rms;
+    std::vector< IcpIteration > iterations;
+};
+
+// Normal equations of point to plane alignment, J^T J (upper triangle)
+// and J^T r with J = [ p x n, n ] and r = n.(p - q). Each thread sums its
+// own and they're added up at the end.
+struct Normals6 {
+    double A[21];
+    double b[6];
+    double err;
+    int count;
+
+    void clear();
+    void add( const Normals6& o );
+    // p (already moved) against q on the plane with normal n
+    void add( const float p[3], const float q[3], const float n[3] ) {
+        double r = n[0]*( p[0] - q[0] ) + n[1]*( p[1] - q[1] ) + n[2]*( p[2] - q[2] );
+        double J[6] = { p[1]*n[2] - p[2]*n[1],
+                        p[2]*n[0] - p[0]*n[2],
+                        p[0]*n[1] - p[1]*n[0],
+                        n[0], n[1], n[2] };
+        for( int a = 0, k = 0; a < 6; a++ ) {
+            for( int c = a; c < 6; c++ )
+                A[k++] += J[a]*J[c];
+            b[a] += J[a]*r;
+        }
+        err += r*r;
+        count++;
+    }
+    // The twist x of ( J^T J + damping I ) x = -J^T r, false if that's
+    // singular
+    bool solve( double x[6], double damping = 0 ) const;
+};
+
+/*
+ * Point to plane ICP between two dense Kinect clouds.
+ *
+ * The target (fixed camera) is an organised cloud, it gets normals from the
+ * image grid and a search index once in setTarget(). The source is voxel
+ * downsampled and pulled onto the target's tangent planes starting from a
+ * guess, normally the Procrustes result. Correspondence search and the
+ * normal equations are split across threads.
+ */
+class Icp {
+public:
+    // pool, if given, is used instead of params.threads
+    Icp( const IcpParams& params = IcpParams(), ThreadPool* pool = 0 );
+    ~Icp();
+
+    // target is an organised cloud with NaN holes (it gets copied), k the
+    // intrinsics it was unprojected with (only projective search uses them)
+    void setTarget( const PointCloud& target, const Intrinsics& k = defaultIntrinsics() );
+
+    // Refines guess so that guess(source) lands on the target. source may
+    // have NaN holes.
+    IcpResult align( const PointCloud& source, const RigidTransform& guess );
+
+    const IcpParams& parameters() const { return params; }
+
+private:
+    Icp( const Icp& );
+    Icp& operator=( const Icp& );
+
+    IcpParams params;
+    ThreadPool* pool;
+    bool ownPool;
+    PointCloud target;
+    PointArena scratch;     // downsampled source, reset every align()
+    PointIndex tree;
+    VoxelHashIndex voxels;
+    ProjectiveIndex projective;
+    const NeighbourIndex* index;
+    int indexed;
+};
+
+#endif
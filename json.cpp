@@ -0,0 +1,24 @@
+#include "json.h"
+// --- C++ ---
+#include <stdio.h>
+
+std::string jsonEscape( const std::string& s ) {
+
+    std::string out;
+    out.reserve( s.size() );
+    for( size_t i = 0; i < s.size(); i++ ) {
+        unsigned char c = s[i];
+        if( c == '"' || c == '\\' ) {
+            out += '\\';
+            out += c;
+        }
+        else if( c < 0x20 ) {
+            char code[8];
+            snprintf( code, sizeof( code ), "\\u%04x", c );
+            out += code;
+        }
+        else
+            out += c;
+    }
+    return out;
+}
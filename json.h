@@ -0,0 +1,11 @@
+#ifndef KINREG_JSON_H
+#define KINREG_JSON_H
+
+// --- C++ ---
+#include <string>
+
+// s escaped for use inside a JSON string: quotes, backslashes and control
+// characters. For names and paths that come from the user.
+std::string jsonEscape( const std::string& s );
+
+#endif
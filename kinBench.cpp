@@ -0,0 +1,415 @@
+// ---- OpenCV -----
+#include <cv.h>
+// --- KinReg ---
+#include "kinect.h"
+#include "frameSource.h"
+#include "depthKernel.h"
+#include "depthModel.h"
+#include "depthFilter.h"
+#include "pointIndex.h"
+#include "rigidTransform.h"
+#include "sessionFile.h"
+#include "threadPool.h"
+#include "voxelGrid.h"
+// --- C++ ---
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+/*
+ * Micro-benchmarks for the per-frame CPU stages, run on recorded frames.
+ *
+ *      kinect_bench [recording] [frames]
+ *
+ * recording is a session file or a FileSource directory (cam0.rgb /
+ * cam0.depth), camera 0's frames are used. Without one a
+ * synthetic frame with Kinect-like holes is used instead.
+ */
+
+// The per-pixel loop loadBuffers() used to run, kept here as the baseline.
+// getDepth() probed the 3x3 neighbourhood of invalid pixels one at a time.
+static float referenceGetDepth( const uint16_t* depth, int row, int col ) {
+
+    static const int probe[8][2] = { {0,1}, {0,-1}, {1,0}, {-1,0}, 
+                                     {-1,-1}, {-1,1}, {1,-1}, {1,1} };
+    float d = depth[row*KINECT_WIDTH + col];
+    for( int k = 0; k < 8 && d >= 2047; k++ ) {
+        int r = row + probe[k][0], c = col + probe[k][1];
+        if( r >= 0 && r < KINECT_HEIGHT && c >= 0 && c < KINECT_WIDTH )
+            d = depth[r*KINECT_WIDTH + c];
+    }
+    return d;
+}
+
+static int referencePack( const uint16_t* depth, const uint8_t* rgb,
+                          short* xyz, uint8_t* colors ) {
+    for( int row = 0; row < KINECT_HEIGHT; row++ ) {
+        for( int col = 0; col < KINECT_WIDTH; col++ ) {
+            int i = row*KINECT_WIDTH + col;
+            xyz[3*i]   = col;
+            xyz[3*i+1] = row;
+            xyz[3*i+2] = referenceGetDepth( depth, row, col );
+            colors[3*i]   = rgb[3*i];
+            colors[3*i+1] = rgb[3*i+1];
+            colors[3*i+2] = rgb[3*i+2];
+        }
+    }
+    return KINECT_PIXELS;
+}
+
+// A tilted plane with a shadow band and speckle, roughly what the sensor
+// gives looking at a wall
+static void syntheticFrame( Frame& f ) {
+    srand( 1 );
+    for( int row = 0; row < KINECT_HEIGHT; row++ )
+        for( int col = 0; col < KINECT_WIDTH; col++ ) {
+            int i = row*KINECT_WIDTH + col;
+            bool hole = ( col > 300 && col < 330 ) || rand() % 20 == 0;
+            f.depth[i] = hole ? KINECT_DEPTH_INVALID : 700 + col/4 + row/8;
+            f.rgb[3*i] = col; f.rgb[3*i+1] = row; f.rgb[3*i+2] = col ^ row;
+        }
+}
+
+static std::vector< Frame* > loadFrames( int argc, char** argv ) {
+
+    std::vector< Frame* > frames;
+    int count = argc > 2 ? atoi( argv[2] ) : 30;
+    if( argc > 1 ) {
+        FrameSource* files = openRecording( argv[1], 1, 0 );
+        if( !files ) {
+            printf( "Error: couldn't open recorded frames in %s\n", argv[1] );
+            exit( 1 );
+        }
+        for( int i = 0; i < count; i++ ) {
+            Frame* f = new Frame;
+            if( !files->grab( 0, *f ) ) {
+                delete f;
+                break;
+            }
+            frames.push_back( f );
+        }
+        delete files;
+    }
+    else {
+        Frame* f = new Frame;
+        syntheticFrame( *f );
+        frames.push_back( f );
+    }
+    return frames;
+}
+
+// What transformPoint() used to do for every pixel: a 4x4 matrix times
+// (u, v, d, 1) followed by the perspective division
+static int referenceUnproject( const Intrinsics& k, const uint16_t* depth, float* xyz ) {
+    float m[16] = {
+        1/k.fx,     0,  0, -k.cx/k.fx,
+        0,    -1/k.fy,  0,  k.cy/k.fy,
+        0,          0,  0,        -1,
+        0,          0, k.a,       k.b
+    };
+    int valid = 0;
+    for( int row = 0, i = 0; row < KINECT_HEIGHT; row++ )
+        for( int col = 0; col < KINECT_WIDTH; col++, i++ ) {
+            float p[4] = { (float)col, (float)row, (float)depth[i], 1 }, r[4];
+            for( int a = 0; a < 4; a++ )
+                r[a] = m[4*a]*p[0] + m[4*a+1]*p[1] + m[4*a+2]*p[2] + m[4*a+3]*p[3];
+            xyz[3*i]   = r[0]/r[3];
+            xyz[3*i+1] = r[1]/r[3];
+            xyz[3*i+2] = r[2]/r[3];
+            valid += depth[i] < KINECT_DEPTH_INVALID;
+        }
+    return valid;
+}
+
+static void benchUnproject( const std::vector< Frame* >& frames ) {
+
+    DepthModel model;
+    std::vector< float > xyz( KINECT_PIXELS*3 );
+    PointCloud cloud;
+    const char* names[3] = { "matrix", "lut", "lut soa" };
+    double ms[3];
+    for( int pass = 0; pass < 3; pass++ ) {
+        long points = 0;
+        int runs = 0;
+        double start = monotonicSeconds(), elapsed = 0;
+        while( elapsed < 1.0 ) {
+            for( int f = 0; f < (int)frames.size(); f++ )
+                points += pass == 0 ? referenceUnproject( model.intrinsics(), frames[f]->depth, &xyz[0] )
+                        : pass == 1 ? model.unprojectFrame( frames[f]->depth, &xyz[0] )
+                                    : model.unprojectFrame( frames[f]->depth, cloud );
+            runs += frames.size();
+            elapsed = monotonicSeconds() - start;
+        }
+        ms[pass] = 1000*elapsed/runs;
+        printf( "  %-10s %8.3f ms/frame  %8ld points/frame", names[pass], ms[pass], points/runs );
+        if( pass > 0 )
+            printf( "  %5.1fx", ms[0]/ms[pass] );
+        printf( "\n" );
+    }
+}
+
+// Speed of every filter over whole frames, then quality:
+// punch short holes into valid depth, filter, and see how much comes back
+// and how close it is. "drift" is how far untouched valid pixels moved.
+static void benchFilters( const std::vector< Frame* >& frames ) {
+
+    std::vector< uint16_t > out( KINECT_PIXELS ), holed( KINECT_PIXELS );
+    std::vector< char > punched( KINECT_PIXELS );
+
+    for( int m = DEPTH_FILTER_HOLE_FILL; m < DEPTH_FILTER_MODES; m++ ) {
+        DepthFilter filter( (DepthFilterMode)m );
+        int runs = 0;
+        double start = monotonicSeconds(), elapsed = 0;
+        while( elapsed < 0.5 ) {
+            for( int f = 0; f < (int)frames.size(); f++ )
+                filter.apply( frames[f]->depth, &out[0] );
+            runs += frames.size();
+            elapsed = monotonicSeconds() - start;
+        }
+        double ms = 1000*elapsed/runs;
+
+        long holes = 0, filled = 0, kept = 0;
+        double fillErr = 0, drift = 0;
+        srand( 2 );
+        for( int f = 0; f < (int)frames.size(); f++ ) {
+            const uint16_t* truth = frames[f]->depth;
+            memcpy( &holed[0], truth, KINECT_PIXELS*sizeof( uint16_t ) );
+            memset( &punched[0], 0, KINECT_PIXELS );
+            for( int i = 0; i < KINECT_PIXELS; i++ ) {
+                if( rand() % 100 >= 3 )
+                    continue;
+                for( int k = 0, len = 1 + rand() % 4; k < len && i + k < KINECT_PIXELS; k++ )
+                    if( truth[i+k] < KINECT_DEPTH_INVALID ) {
+                        holed[i+k] = KINECT_DEPTH_INVALID;
+                        punched[i+k] = 1;
+                    }
+            }
+            filter.apply( &holed[0], &out[0] );
+            for( int i = 0; i < KINECT_PIXELS; i++ ) {
+                if( punched[i] ) {
+                    holes++;
+                    if( out[i] < KINECT_DEPTH_INVALID ) {
+                        filled++;
+                        fillErr += abs( out[i] - truth[i] );
+                    }
+                }
+                else if( truth[i] < KINECT_DEPTH_INVALID && out[i] < KINECT_DEPTH_INVALID ) {
+                    kept++;
+                    drift += abs( out[i] - truth[i] );
+                }
+            }
+        }
+        printf( "  %-10s %8.3f ms/frame  filled %5.1f%%  error %6.2f  drift %6.2f\n",
+                DepthFilter::modeName( (DepthFilterMode)m ), ms,
+                holes ? 100.0*filled/holes : 0.0, filled ? fillErr/filled : 0.0, 
+                kept ? drift/kept : 0.0 );
+    }
+}
+
+// One ICP correspondence pass: the last frame, voxel downsampled and
+// nudged by a small motion, searched for in the first frame. "flann" is
+// what the old flann_knn() did every iteration, two randomized trees built
+// on the compacted cloud and 64 checks per query. Agreement is against the
+// exact k-d tree.
+static void benchSearch( const std::vector< Frame* >& frames ) {
+
+    const float maxDist = 0.05f;
+    const float maxDist2 = maxDist*maxDist;
+    DepthModel model;
+    ThreadPool& pool = ThreadPool::shared();
+
+    std::vector< float > target( KINECT_PIXELS*3 ), cloud( KINECT_PIXELS*3 ), queries;
+    model.unprojectFrame( frames[0]->depth, &target[0] );
+    model.unprojectFrame( frames.back()->depth, &cloud[0] );
+    int n = voxelDownsample( &cloud[0], KINECT_PIXELS, 0.01f, queries );
+    double twist[6] = { 0.005, -0.01, 0.005, 0.01, 0.005, -0.01 };
+    RigidTransform nudge = RigidTransform::fromTwist( twist );
+    for( int i = 0; i < n; i++ ) {
+        cv::Vec3f p = nudge( cv::Vec3f( queries[3*i], queries[3*i+1], queries[3*i+2] ) );
+        for( int a = 0; a < 3; a++ )
+            queries[3*i + a] = p[a];
+    }
+
+    std::vector< float > packed;
+    std::vector< int > packedIds;
+    for( int i = 0; i < KINECT_PIXELS; i++ )
+        if( target[3*i] == target[3*i] ) {
+            packed.insert( packed.end(), &target[3*i], &target[3*i] + 3 );
+            packedIds.push_back( i );
+        }
+    printf( "  %d target points, %d queries, %.0f mm radius, %d threads\n", 
+            (int)packedIds.size(), n, 1000*maxDist, pool.size() + 1 );
+    if( packedIds.empty() || !n )
+        return;
+
+    PointIndex tree;
+    VoxelHashIndex voxels( 0.02f );
+    ProjectiveIndex projective;
+    std::vector< int > exact( n ), found( n );
+    std::vector< float > exactD2( n ), foundD2( n );
+    tree.build( &target[0], KINECT_PIXELS, 3, &pool );
+    for( int i = 0; i < n; i++ )
+        exact[i] = tree.nearest( &queries[3*i], maxDist2, &exactD2[i] );
+
+    const char* names[] = { "flann", "kdtree", "kdtree-mt", "voxelhash", "voxhash-mt", "projective" };
+    for( int method = 0; method < 6; method++ ) {
+        double buildMs = 0, queryMs = 0;
+        int runs = 0;
+        double start = monotonicSeconds();
+        while( monotonicSeconds() - start < 1.0 ) {
+            double t0 = monotonicSeconds(), t1 = t0;
+            switch( method ) {
+            case 0: {
+                cv::Mat features( (int)packedIds.size(), 3, CV_32F, &packed[0] );
+                cv::Mat q( n, 3, CV_32F, &queries[0] );
+                cv::Mat indices( n, 1, CV_32S ), dists( n, 1, CV_32F );
+                cv::flann::Index flannIndex( features, cv::flann::KDTreeIndexParams( 2 ) );
+                t1 = monotonicSeconds();
+                flannIndex.knnSearch( q, indices, dists, 1, cv::flann::SearchParams( 64 ) );
+                for( int i = 0; i < n; i++ ) {
+                    int j = indices.at< int >( i, 0 );
+                    float d2 = dists.at< float >( i, 0 );
+                    bool hit = j >= 0 && d2 < maxDist2;
+                    found[i] = hit ? packedIds[j] : -1;
+                    foundD2[i] = d2;
+                }
+                break;
+            }
+            case 1:
+            case 2:
+                tree.build( &target[0], KINECT_PIXELS, 3, &pool );
+                t1 = monotonicSeconds();
+                if( method == 2 )
+                    tree.nearestBatch( &queries[0], n, maxDist2, &found[0], &foundD2[0], &pool );
+                else
+                    for( int i = 0; i < n; i++ )
+                        found[i] = tree.nearest( &queries[3*i], maxDist2, &foundD2[i] );
+                break;
+            case 3:
+            case 4:
+                voxels.build( &target[0], KINECT_PIXELS );
+                t1 = monotonicSeconds();
+                if( method == 4 )
+                    voxels.nearestBatch( &queries[0], n, maxDist2, &found[0], &foundD2[0], &pool );
+                else
+                    for( int i = 0; i < n; i++ )
+                        found[i] = voxels.nearest( &queries[3*i], maxDist2, &foundD2[i] );
+                break;
+            default:
+                projective.build( &target[0], model.intrinsics() );
+                t1 = monotonicSeconds();
+                projective.nearestBatch( &queries[0], n, maxDist2, &found[0], &foundD2[0], &pool );
+                break;
+            }
+            double t2 = monotonicSeconds();
+            buildMs += 1000*( t1 - t0 );
+            queryMs += 1000*( t2 - t1 );
+            runs++;
+        }
+
+        // Ties are fine, so compare distances rather than indices
+        int matched = 0, agree = 0;
+        for( int i = 0; i < n; i++ ) {
+            matched += found[i] >= 0;
+            if( found[i] < 0 ? exact[i] < 0 : exact[i] >= 0 && foundD2[i] <= exactD2[i]*1.0001f + 1e-12f )
+                agree++;
+        }
+        printf( "  %-10s build %8.3f ms  query %8.3f ms  matched %5.1f%%  agree %5.1f%%\n", 
+                names[method], buildMs/runs, queryMs/runs, 100.0*matched/n, 100.0*agree/n );
+    }
+
+    // k nearest and radius queries, one at a time and batched on the pool
+    const int K = 8;
+    const float radius2 = 0.01f*0.01f;
+    std::vector< int > knnIds( n*K ), counts( n ), offsets, hits, one;
+    std::vector< float > knnD2( n*K );
+    for( int batched = 0; batched < 2; batched++ ) {
+        double knnMs = 0, radiusMs = 0;
+        int runs = 0;
+        long total = 0;
+        double start = monotonicSeconds();
+        while( monotonicSeconds() - start < 1.0 ) {
+            double t0 = monotonicSeconds();
+            if( batched )
+                tree.knnBatch( &queries[0], n, K, maxDist2, &knnIds[0], &knnD2[0], &counts[0], &pool );
+            else
+                for( int i = 0; i < n; i++ )
+                    counts[i] = tree.knn( &queries[3*i], K, maxDist2, &knnIds[i*K], &knnD2[i*K] );
+            double t1 = monotonicSeconds();
+            total = 0;
+            if( batched ) {
+                tree.radiusBatch( &queries[0], n, radius2, offsets, hits, &pool );
+                total = offsets[n];
+            }
+            else
+                for( int i = 0; i < n; i++ ) {
+                    tree.radius( &queries[3*i], radius2, one );
+                    total += one.size();
+                }
+            double t2 = monotonicSeconds();
+            knnMs += 1000*( t1 - t0 );
+            radiusMs += 1000*( t2 - t1 );
+            runs++;
+        }
+        printf( "  %-10s knn %d %8.3f ms  radius 10 mm %8.3f ms  (%.1f points each)\n", 
+                batched ? "batch-mt" : "one by one", K, knnMs/runs, radiusMs/runs, (double)total/n );
+    }
+}
+
+typedef int (*PackFn)( const uint16_t*, const uint8_t*, short*, uint8_t* );
+
+// Runs fn over all frames repeatedly for about a second, reports ms/frame
+static void benchPack( const char* name, PackFn fn, const std::vector< Frame* >& frames,
+                       short* xyz, uint8_t* colors, double baseline, double* result ) {
+
+    long points = 0;
+    int runs = 0;
+    double start = monotonicSeconds(), elapsed = 0;
+    while( elapsed < 1.0 ) {
+        for( int f = 0; f < (int)frames.size(); f++ )
+            points += fn( frames[f]->depth, frames[f]->rgb, xyz, colors );
+        runs += frames.size();
+        elapsed = monotonicSeconds() - start;
+    }
+    double ms = 1000*elapsed/runs;
+    printf( "  %-10s %8.3f ms/frame  %8ld points/frame", name, ms, points/runs );
+    if( baseline > 0 )
+        printf( "  %5.1fx", baseline/ms );
+    printf( "\n" );
+    if( result )
+        *result = ms;
+}
+
+int main( int argc, char** argv ) {
+
+    std::vector< Frame* > frames = loadFrames( argc, argv );
+    if( frames.empty() ) {
+        printf( "Error: no frames\n" );
+        return 1;
+    }
+    printf( "%d frame(s), %s\n\n", (int)frames.size(), argc > 1 ? argv[1] : "synthetic" );
+
+    std::vector< short > xyz( KINECT_PIXELS*3 );
+    std::vector< uint8_t > colors( KINECT_PIXELS*3 );
+
+    printf( "Vertex/color packing (packVertices uses %s)\n", packVerticesKernel() );
+    double base;
+    benchPack( "loop", referencePack, frames, &xyz[0], &colors[0], 0, &base );
+    benchPack( "scalar", packVerticesScalar, frames, &xyz[0], &colors[0], base, 0 );
+    benchPack( "sse2", packVerticesSSE2, frames, &xyz[0], &colors[0], base, 0 );
+    benchPack( "avx2", packVerticesAVX2, frames, &xyz[0], &colors[0], base, 0 );
+
+    printf( "\nMetric unprojection\n" );
+    benchUnproject( frames );
+
+    printf( "\nDepth filters (error and drift in raw disparity)\n" );
+    benchFilters( frames );
+
+    printf( "\nNearest neighbour search\n" );
+    benchSearch( frames );
+
+    for( int f = 0; f < (int)frames.size(); f++ )
+        delete frames[f];
+    return 0;
+}
@@ -0,0 +1,512 @@
+// ---- OpenCV -----
+#include <cv.h>
+// --- KinReg ---
+#include "kinect.h"
+#include "frameSource.h"
+#include "depthKernel.h"
+#include "depthModel.h"
+#include "depthFilter.h"
+#include "previewCompositor.h"
+#include "procrustes.h"
+#include "registrationGraph.h"
+#include "icp.h"
+#include "normals.h"
+#include "projectiveIcp.h"
+#include "featureMatcher.h"
+#include "fusion.h"
+#include "json.h"
+#include "sessionFile.h"
+#include "threadPool.h"
+// --- C++ ---
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+/*
+ * Times every per-frame stage of the pipeline in isolation, at one camera
+ * and at N, on recorded frames.
+ *
+ *      kinect_pipeline_bench [recording] [--cams N] [--frames K]
+ *                            [--seconds S] [-o results.json]
+ *
+ * recording is a session file or a FileSource directory; cameras beyond
+ * the ones recorded reuse their frames. Without one a synthetic scene is
+ * used. Each stage runs for about S seconds (default 1) and every run is
+ * timed on its own, the median, p99 and mean go out as JSON (stdout
+ * unless -o) and as a table on stderr. One run covers every camera:
+ *
+ *      depth_fixup     the capture thread's depth filter, cameras in
+ *                      parallel like their capture threads
+ *      unproject       organised metric cloud per camera
+ *      normals_cross   normals from the image grid per camera, central
+ *                      differences
+ *      normals_integral
+ *                      the same from integral images, radius 3
+ *      pyramid         640x480, 320x240 and 160x120 copies per camera,
+ *                      integral normals on each
+ *      pack            vertex/color packing for the GL draw, per camera
+ *      preview         colour conversion into the preview canvas
+ *      transform_point image to metric for a batch of clicked pixels
+ *      procrustes      one pair's solve at 1 camera, the whole
+ *                      RegistrationGraph solve at N
+ *      procrustes_inc  one more pair into a sliding ProcrustesWindow
+ *                      and a solve, what live feedback costs per click
+ *      ransac          robust solve of automatic matches, a third of
+ *                      them wrong, for every neighbouring pair
+ *      features        ORB detection on every camera in parallel and
+ *                      matching of neighbouring pairs, one FeatureMatcher
+ *                      batch
+ *      icp             point to plane ICP of every camera against its
+ *                      neighbour (itself, nudged, at 1 camera)
+ *      projective_icp  the same pairs by projective association, coarse
+ *                      to fine, target pyramid included
+ *      fuse            every camera's coloured cloud into one world
+ *                      cloud, voxel deduplicated and bounded
+ */
+
+static const int CLICKS = 1024;         // transform_point batch
+static const int CORRESPONDENCES = 32;  // per camera pair
+static const int MATCHES = 2000;        // ransac, per camera pair
+static const int MIN_SAMPLES = 5;
+static const int MAX_SAMPLES = 100000;
+
+struct StageResult {
+    std::string stage;
+    int cameras;
+    int samples;
+    double medianMs, p99Ms, meanMs;
+    double throughput;  // units per second
+    const char* unit;
+};
+
+// A tilted wall with a box in front of it, a shadow band and speckle. The
+// box moves a little from frame to frame and camera to camera so ICP has
+// something to lock on to.
+static void syntheticFrame( Frame& f, int cam, int k ) {
+    srand( 1 + 31*cam + k );
+    int shift = 3*k + 10*cam;
+    for( int row = 0; row < KINECT_HEIGHT; row++ )
+        for( int col = 0; col < KINECT_WIDTH; col++ ) {
+            int i = row*KINECT_WIDTH + col;
+            bool box = col > 200 + shift && col < 360 + shift && row > 150 && row < 330;
+            bool hole = ( col > 360 + shift && col < 380 + shift ) || rand() % 20 == 0;
+            f.depth[i] = hole ? KINECT_DEPTH_INVALID : ( box ? 600 : 750 ) + col/4 + row/8;
+            f.rgb[3*i] = col; f.rgb[3*i+1] = row; f.rgb[3*i+2] = ( col ^ row ) + k;
+        }
+    f.sequence = k;
+}
+
+// frames[cam][k]. Cameras past the recorded ones share their frames.
+static bool loadFrames( const char* path, int cams, int count,
+                        std::vector< std::vector< Frame* > >& frames ) {
+
+    frames.assign( cams, std::vector< Frame* >() );
+    if( !path ) {
+        for( int cam = 0; cam < cams; cam++ )
+            for( int k = 0; k < count; k++ ) {
+                frames[cam].push_back( new Frame );
+                syntheticFrame( *frames[cam].back(), cam, k );
+            }
+        return true;
+    }
+
+    // A session knows its cameras, a dump directory only opens with as many
+    // as it has files for
+    FrameSource* source = 0;
+    for( int n = cams; n >= 1 && !source; n-- )
+        source = openRecording( path, n, 0 );
+    if( !source )
+        return false;
+    int recorded = std::min( cams, source->numCameras() );
+    for( int cam = 0; cam < recorded; cam++ )
+        for( int k = 0; k < count; k++ ) {
+            Frame* f = new Frame;
+            if( !source->grab( cam, *f ) ) {
+                delete f;
+                break;
+            }
+            f->sequence = k;
+            frames[cam].push_back( f );
+        }
+    delete source;
+    for( int cam = recorded; cam < cams; cam++ )
+        frames[cam] = frames[cam % std::max( recorded, 1 )];
+    for( int cam = 0; cam < cams; cam++ )
+        if( frames[cam].empty() )
+            return false;
+    return true;
+}
+
+// Runs fn( run ) for about seconds (at least MIN_SAMPLES times), timing
+// each run. units is how much work one run is.
+template< typename Fn >
+static StageResult measure( const char* stage, int cams, double seconds,
+                            double units, const char* unit, Fn fn ) {
+
+    std::vector< double > ms;
+    double start = monotonicSeconds(), total = 0;
+    for( int run = 0; run < MAX_SAMPLES; run++ ) {
+        double t0 = monotonicSeconds();
+        fn( run );
+        double t1 = monotonicSeconds();
+        ms.push_back( 1000*( t1 - t0 ) );
+        total += t1 - t0;
+        if( run + 1 >= MIN_SAMPLES && t1 - start >= seconds )
+            break;
+    }
+
+    StageResult r;
+    r.stage = stage;
+    r.cameras = cams;
+    r.samples = (int)ms.size();
+    r.meanMs = 1000*total/ms.size();
+    r.throughput = total > 0 ? units*ms.size()/total : 0;
+    r.unit = unit;
+    std::sort( ms.begin(), ms.end() );
+    int n = (int)ms.size();
+    r.medianMs = n % 2 ? ms[n/2] : 0.5*( ms[n/2 - 1] + ms[n/2] );
+    r.p99Ms = ms[std::max( 0, (int)ceil( 0.99*n ) - 1 )];
+    return r;
+}
+
+// Keeps the optimiser from dropping work whose result nobody reads
+static volatile double sink;
+
+static void benchCameras( const std::vector< std::vector< Frame* > >& all, int cams,
+                          double seconds, std::vector< StageResult >& results ) {
+
+    ThreadPool& pool = ThreadPool::shared();
+    DepthModel model;
+    const int K = (int)all[0].size();
+    #define FRAME( cam, run ) ( *all[cam][( run ) % all[cam].size()] )
+
+    // depth_fixup: one filter and output per camera, as in CaptureThread
+    {
+        std::vector< DepthFilter > filters( cams );
+        std::vector< std::vector< uint16_t > > out( cams, std::vector< uint16_t >( KINECT_PIXELS ) );
+        results.push_back( measure( "depth_fixup", cams, seconds, cams, "frames/s", [&]( int run ) {
+            pool.parallelFor( cams, [&]( int cam ) {
+                filters[cam].apply( FRAME( cam, run ).depth, &out[cam][0] );
+            } );
+        } ) );
+    }
+
+    std::vector< PointCloud > clouds( cams );
+    results.push_back( measure( "unproject", cams, seconds, cams, "frames/s", [&]( int run ) {
+        for( int cam = 0; cam < cams; cam++ )
+            sink = model.unprojectFrame( FRAME( cam, run ).depth, clouds[cam] );
+    } ) );
+
+    // Normals and pyramids on the organised clouds, rows split across the
+    // pool one camera after another
+    {
+        std::vector< PointCloud > organised( clouds );
+        NormalParams params;
+        NormalEstimator cross( params, &pool );
+        params.method = NORMALS_INTEGRAL;
+        NormalEstimator integral( params, &pool );
+        results.push_back( measure( "normals_cross", cams, seconds, cams, "frames/s", [&]( int ) {
+            for( int cam = 0; cam < cams; cam++ )
+                sink = cross.compute( organised[cam] );
+        } ) );
+        results.push_back( measure( "normals_integral", cams, seconds, cams, "frames/s", [&]( int ) {
+            for( int cam = 0; cam < cams; cam++ )
+                sink = integral.compute( organised[cam] );
+        } ) );
+        // From clouds without normals, fresh off unprojectFrame() like the
+        // real callers' are
+        CloudPyramid pyramid( params, &pool );
+        results.push_back( measure( "pyramid", cams, seconds, cams, "frames/s", [&]( int ) {
+            for( int cam = 0; cam < cams; cam++ ) {
+                pyramid.build( clouds[cam], model.intrinsics(), 3 );
+                sink = pyramid.level( 2 ).size();
+            }
+        } ) );
+    }
+
+    {
+        std::vector< short > xyz( KINECT_PIXELS*3 );
+        std::vector< uint8_t > colors( KINECT_PIXELS*3 );
+        results.push_back( measure( "pack", cams, seconds, cams, "frames/s", [&]( int run ) {
+            for( int cam = 0; cam < cams; cam++ ) {
+                const Frame& f = FRAME( cam, run );
+                sink = packVertices( f.depth, f.rgb, &xyz[0], &colors[0] );
+            }
+        } ) );
+    }
+
+    // put() skips frames it has shown, so every run needs a new sequence.
+    // Frames can be shared between cameras, hence the copies.
+    {
+        PreviewCompositor preview( cams );
+        std::vector< Frame* > latest( cams );
+        for( int cam = 0; cam < cams; cam++ ) {
+            latest[cam] = new Frame;
+            *latest[cam] = FRAME( cam, 0 );
+        }
+        results.push_back( measure( "preview", cams, seconds, cams, "frames/s", [&]( int run ) {
+            for( int cam = 0; cam < cams; cam++ ) {
+                latest[cam]->sequence = run + 1;
+                preview.put( cam, *latest[cam] );
+            }
+        } ) );
+        for( int cam = 0; cam < cams; cam++ )
+            delete latest[cam];
+    }
+
+    // Clicks land on valid depth, pick them up front
+    std::vector< std::vector< cv::Vec3f > > clicks( cams );
+    srand( 3 );
+    for( int cam = 0; cam < cams; cam++ ) {
+        const Frame& f = FRAME( cam, 0 );
+        for( int tries = 0; (int)clicks[cam].size() < CLICKS && tries < 100*CLICKS; tries++ ) {
+            int col = rand() % KINECT_WIDTH, row = rand() % KINECT_HEIGHT;
+            uint16_t d = f.depth[row*KINECT_WIDTH + col];
+            if( d < KINECT_DEPTH_INVALID )
+                clicks[cam].push_back( cv::Vec3f( (float)col, (float)row, d ) );
+        }
+    }
+    // Through the batch unprojection, as columns like a matcher would have them
+    std::vector< std::vector< float > > clickCols( cams ), clickRows( cams );
+    std::vector< std::vector< uint16_t > > clickRaw( cams );
+    for( int cam = 0; cam < cams; cam++ )
+        for( int i = 0; i < (int)clicks[cam].size(); i++ ) {
+            clickCols[cam].push_back( clicks[cam][i][0] );
+            clickRows[cam].push_back( clicks[cam][i][1] );
+            clickRaw[cam].push_back( (uint16_t)clicks[cam][i][2] );
+        }
+    std::vector< float > clickXyz( 3*CLICKS );
+    results.push_back( measure( "transform_point", cams, seconds, cams*CLICKS, "points/s", [&]( int ) {
+        int valid = 0;
+        for( int cam = 0; cam < cams; cam++ )
+            if( !clicks[cam].empty() )
+                valid += model.unproject( &clickCols[cam][0], &clickRows[cam][0], &clickRaw[cam][0],
+                                          (int)clicks[cam].size(), &clickXyz[0] );
+        sink = valid + clickXyz[2];
+    } ) );
+
+    // Correspondences between neighbouring cameras: the same clicked
+    // points seen through a known offset, plus a millimetre of noise
+    PointCloud P, Q;
+    double twist[6] = { 0.02, -0.05, 0.01, 0.1, 0.02, -0.05 };
+    RigidTransform offset = RigidTransform::fromTwist( twist );
+    for( int i = 0; i < (int)clicks[0].size() && (int)P.size() < CORRESPONDENCES; i++ ) {
+        float xyz[3];
+        if( !model.unproject( clicks[0][i][0], clicks[0][i][1], (uint16_t)clicks[0][i][2], xyz ) )
+            continue;
+        cv::Vec3f p( xyz[0], xyz[1], xyz[2] ), q = offset( p );
+        for( int a = 0; a < 3; a++ )
+            q[a] += 0.001f*( rand() % 2001 - 1000 )/1000;
+        P.push_back( p );
+        Q.push_back( q );
+    }
+    if( cams == 1 ) {
+        results.push_back( measure( "procrustes", cams, seconds, 1, "solves/s", [&]( int ) {
+            ProcrustesResult r;
+            solveProcrustes( P, Q, r );
+            sink = r.rms;
+        } ) );
+    }
+    else {
+        RegistrationGraph graph( cams );
+        for( int cam = 1; cam < cams; cam++ )
+            for( int i = 0; i < (int)P.size(); i++ )
+                graph.addCorrespondence( cam - 1, P.point( i ), cam, Q.point( i ) );
+        results.push_back( measure( "procrustes", cams, seconds, 1, "solves/s", [&]( int ) {
+            sink = graph.solve( &pool );
+        } ) );
+    }
+    {
+        ProcrustesWindow window( 256 );
+        results.push_back( measure( "procrustes_inc", cams, seconds, 1, "solves/s", [&]( int run ) {
+            int i = run % P.size();
+            window.add( P.point( i ), Q.point( i ) );
+            ProcrustesResult r;
+            window.solve( r );
+            sink = r.rms;
+        } ) );
+    }
+
+    // What feature matching would hand over: points off the first camera's
+    // cloud through the same offset, every third one thrown somewhere else
+    {
+        PointCloud A, B;
+        const PointCloud& c = clouds[0];
+        for( int i = 0; i < c.size() && A.size() < MATCHES; i += 97 ) {
+            if( !c.finite( i ) )
+                continue;
+            cv::Vec3f p = c.point( i ), q = offset( p );
+            if( A.size() % 3 == 0 )
+                for( int a = 0; a < 3; a++ )
+                    q[a] += 0.5f*( rand() % 2001 - 1000 )/1000;
+            A.push_back( p );
+            B.push_back( q );
+        }
+        int pairs = cams == 1 ? 1 : cams - 1;
+        RansacParams params;
+        results.push_back( measure( "ransac", cams, seconds, pairs, "solves/s", [&]( int ) {
+            RansacResult r;
+            for( int k = 0; k < pairs; k++ )
+                ransacProcrustes( A, B, 0, params, r, &pool );
+            sink = r.inliers;
+        } ) );
+    }
+
+    {
+        FeatureParams params;
+        std::vector< FeatureFrame > features( cams );
+        results.push_back( measure( "features", cams, seconds, cams, "frames/s", [&]( int run ) {
+            pool.parallelFor( cams, [&]( int cam ) {
+                detectFeatures( FRAME( cam, run ), model, params, features[cam] );
+            } );
+            PointCloud A, B;
+            for( int cam = 0; cam + 1 < cams; cam++ )
+                matchFeatures( features[cam], features[cam + 1], params, A, B );
+            sink = A.size();
+        } ) );
+    }
+
+    // Every camera's first frame against its neighbour's (its own last
+    // frame at one camera), targets set up front like refineICP() would
+    // hold them
+    {
+        int pairs = cams == 1 ? 1 : cams - 1;
+        std::vector< Icp* > icps( pairs );
+        std::vector< PointCloud > targets( pairs );
+        for( int cam = 0; cam < pairs; cam++ ) {
+            icps[cam] = new Icp();
+            const Frame& target = cams == 1 ? FRAME( 0, K - 1 ) : FRAME( cam + 1, 0 );
+            model.unprojectFrame( target.depth, targets[cam] );
+            icps[cam]->setTarget( targets[cam], model.intrinsics() );
+            model.unprojectFrame( FRAME( cam, 0 ).depth, clouds[cam] );
+        }
+        double nudge[6] = { 0.005, -0.01, 0.005, 0.01, 0.005, -0.01 };
+        RigidTransform guess = RigidTransform::fromTwist( nudge );
+        results.push_back( measure( "icp", cams, seconds, pairs, "alignments/s", [&]( int ) {
+            for( int cam = 0; cam < pairs; cam++ )
+                sink = icps[cam]->align( clouds[cam], guess ).rms;
+        } ) );
+        for( int cam = 0; cam < pairs; cam++ )
+            delete icps[cam];
+    }
+
+    // The same pairs the way continuous tracking runs them: both clouds
+    // are new every frame, so the target's pyramid is rebuilt every run
+    {
+        int pairs = cams == 1 ? 1 : cams - 1;
+        std::vector< PointCloud > targets( pairs );
+        for( int cam = 0; cam < pairs; cam++ ) {
+            const Frame& target = cams == 1 ? FRAME( 0, K - 1 ) : FRAME( cam + 1, 0 );
+            model.unprojectFrame( target.depth, targets[cam] );
+        }
+        double nudge[6] = { 0.005, -0.01, 0.005, 0.01, 0.005, -0.01 };
+        RigidTransform guess = RigidTransform::fromTwist( nudge );
+        ProjectiveIcp projective( ProjectiveIcpParams(), &pool );
+        results.push_back( measure( "projective_icp", cams, seconds, pairs, "alignments/s", [&]( int ) {
+            for( int cam = 0; cam < pairs; cam++ ) {
+                projective.setTarget( targets[cam], model.intrinsics() );
+                sink = projective.align( clouds[cam], guess ).rms;
+            }
+        } ) );
+    }
+
+    // Cameras chained through the correspondence offset, unprojected with
+    // colour up front like the render loop would have them
+    {
+        std::vector< PointCloud > colored( cams, PointCloud( POINT_COLOR ) );
+        std::vector< RigidTransform > poses( cams );
+        for( int cam = 0; cam < cams; cam++ ) {
+            const Frame& f = FRAME( cam, 0 );
+            model.unprojectFrame( f.depth, colored[cam], f.rgb );
+            if( cam )
+                poses[cam] = poses[cam - 1]*offset;
+        }
+        CloudFusion fusion( FusionParams(), &pool );
+        PointCloud fused;
+        results.push_back( measure( "fuse", cams, seconds, cams, "frames/s", [&]( int ) {
+            sink = fusion.fuse( colored, poses, fused );
+        } ) );
+    }
+    #undef FRAME
+}
+
+static void writeJson( FILE* out, const char* recording, int frames,
+                       const std::vector< StageResult >& results ) {
+
+    fprintf( out, "{\n  \"recording\": \"%s\",\n  \"frames\": %d,\n", 
+             jsonEscape( recording ).c_str(), frames );
+    fprintf( out, "  \"threads\": %d,\n  \"pack_kernel\": \"%s\",\n  \"stages\": [\n",
+             ThreadPool::shared().size() + 1, packVerticesKernel() );
+    for( int i = 0; i < (int)results.size(); i++ ) {
+        const StageResult& r = results[i];
+        fprintf( out, "    { \"stage\": \"%s\", \"cameras\": %d, \"samples\": %d, "
+                      "\"median_ms\": %.4f, \"p99_ms\": %.4f, \"mean_ms\": %.4f, "
+                      "\"throughput\": %.2f, \"unit\": \"%s\" }%s\n",
+                 r.stage.c_str(), r.cameras, r.samples, r.medianMs, r.p99Ms, r.meanMs,
+                 r.throughput, r.unit, i + 1 < (int)results.size() ? "," : "" );
+    }
+    fprintf( out, "  ]\n}\n" );
+}
+
+int main( int argc, char** argv ) {
+
+    const char* recording = 0;
+    const char* output = 0;
+    int cams = 4, count = 10;
+    double seconds = 1;
+    for( int i = 1; i < argc; i++ ) {
+        if( strcmp( argv[i], "--cams" ) == 0 && i + 1 < argc )
+            cams = std::max( 1, atoi( argv[++i] ) );
+        else if( strcmp( argv[i], "--frames" ) == 0 && i + 1 < argc )
+            count = std::max( 1, atoi( argv[++i] ) );
+        else if( strcmp( argv[i], "--seconds" ) == 0 && i + 1 < argc )
+            seconds = atof( argv[++i] );
+        else if( strcmp( argv[i], "-o" ) == 0 && i + 1 < argc )
+            output = argv[++i];
+        else
+            recording = argv[i];
+    }
+
+    std::vector< std::vector< Frame* > > frames;
+    if( !loadFrames( recording, cams, count, frames ) ) {
+        printf( "Error: couldn't read frames from %s\n", recording );
+        return 1;
+    }
+
+    std::vector< StageResult > results;
+    benchCameras( frames, 1, seconds, results );
+    if( cams > 1 )
+        benchCameras( frames, cams, seconds, results );
+
+    // Table to stderr so the JSON can go to stdout
+    fprintf( stderr, "%-16s %4s %7s %10s %10s %10s %14s\n",
+             "stage", "cams", "runs", "median ms", "p99 ms", "mean ms", "throughput" );
+    for( int i = 0; i < (int)results.size(); i++ ) {
+        const StageResult& r = results[i];
+        fprintf( stderr, "%-16s %4d %7d %10.3f %10.3f %10.3f %14.1f %s\n", r.stage.c_str(),
+                 r.cameras, r.samples, r.medianMs, r.p99Ms, r.meanMs, r.throughput, r.unit );
+    }
+
+    FILE* out = output ? fopen( output, "w" ) : stdout;
+    if( !out ) {
+        printf( "Error: couldn't write %s\n", output );
+        return 1;
+    }
+    writeJson( out, recording ? recording : "synthetic", (int)frames[0].size(), results );
+    if( output )
+        fclose( out );
+
+    // Cameras past the recorded ones share frames, free each once
+    std::vector< Frame* > owned;
+    for( int cam = 0; cam < cams; cam++ )
+        owned.insert( owned.end(), frames[cam].begin(), frames[cam].end() );
+    std::sort( owned.begin(), owned.end() );
+    owned.erase( std::unique( owned.begin(), owned.end() ), owned.end() );
+    for( int i = 0; i < (int)owned.size(); i++ )
+        delete owned[i];
+    return 0;
+}
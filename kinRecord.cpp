@@ -0,0 +1,118 @@
+// --- KinReg ---
+#include "kinect.h"
+#include "frameSource.h"
+#include "capture.h"
+#include "sessionFile.h"
+// --- C++ ---
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+/*
+ * Records a session from the sensors without the GUI.
+ *
+ *      kinect_record <out> [--cams N] [--seconds S] [--compress]
+ *                          [--from recording]
+ *
+ * Runs until S seconds have passed (forever without --seconds) or Ctrl-C.
+ * --compress packs the depth losslessly, see compressDepth(). --from reads
+ * an existing recording at its own pace instead of the sensors, handy for
+ * turning a FileSource directory into a session.
+ */
+
+static std::atomic< bool > interrupted( false );
+
+static void onInterrupt( int ) {
+    interrupted = true;
+}
+
+int main( int argc, char** argv ) {
+
+    const char* output = 0;
+    const char* from = 0;
+    int numCams = 2;
+    double seconds = 0;
+    bool compress = false, camsGiven = false;
+    for( int i = 1; i < argc; i++ ) {
+        if( strcmp( argv[i], "--cams" ) == 0 && i + 1 < argc ) {
+            numCams = std::max( 1, atoi( argv[++i] ) );
+            camsGiven = true;
+        }
+        else if( strcmp( argv[i], "--seconds" ) == 0 && i + 1 < argc )
+            seconds = atof( argv[++i] );
+        else if( strcmp( argv[i], "--from" ) == 0 && i + 1 < argc )
+            from = argv[++i];
+        else if( strcmp( argv[i], "--compress" ) == 0 )
+            compress = true;
+        else
+            output = argv[i];
+    }
+    if( !output ) {
+        printf( "Usage: %s <out> [--cams N] [--seconds S] [--compress] [--from recording]\n", argv[0] );
+        return 1;
+    }
+
+    FrameSource* source;
+    if( from ) {
+        source = openRecording( from, numCams );
+        if( !source ) {
+            printf( "Error: couldn't open recorded frames in %s\n", from );
+            return 1;
+        }
+        if( !camsGiven )
+            numCams = source->numCameras();
+    }
+    else
+        source = new FreenectSource( numCams );
+
+    SessionWriter writer( output, numCams, compress );
+    if( !writer.isOpen() ) {
+        printf( "Error: couldn't create %s\n", output );
+        return 1;
+    }
+
+    // Nothing looks at the depth, don't bother filtering it
+    std::vector< CaptureThread* > captures;
+    for( int cam = 0; cam < numCams; cam++ ) {
+        captures.push_back( new CaptureThread( source, cam ) );
+        captures[cam]->setDepthFilter( DEPTH_FILTER_NONE );
+        captures[cam]->setRecorder( &writer );
+        captures[cam]->start();
+    }
+
+    signal( SIGINT, onInterrupt );
+    double start = monotonicSeconds();
+    double lastReport = start;
+    while( !interrupted && ( seconds <= 0 || monotonicSeconds() - start < seconds ) ) {
+        std::this_thread::sleep_for( std::chrono::milliseconds( 50 ) );
+        double now = monotonicSeconds();
+        if( now - lastReport >= 1 ) {
+            printf( "%6.1f s  %6d frames  %8.1f MB\n", now - start, writer.records(),
+                    writer.bytesWritten()/( 1024.0*1024.0 ) );
+            fflush( stdout );
+            lastReport = now;
+        }
+    }
+
+    unsigned long failures = 0;
+    for( int cam = 0; cam < numCams; cam++ ) {
+        failures += captures[cam]->grabFailures();
+        delete captures[cam];
+    }
+    delete source;
+    writer.close();
+
+    double elapsed = monotonicSeconds() - start;
+    printf( "Recorded %d frames from %d cameras in %.1f s, %.1f MB", writer.records(), numCams,
+            elapsed, writer.bytesWritten()/( 1024.0*1024.0 ) );
+    if( failures )
+        printf( ", %lu grab failures", failures );
+    printf( "\n" );
+    return 0;
+}
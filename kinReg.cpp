@@ -7,11 +7,31 @@
 #include <libfreenect.h>
 #include <libfreenect_sync.h>
 #include <libfreenect_cv.h>
+// --- KinReg ---
+#include "capture.h"
+#include "depthKernel.h"
+#include "depthModel.h"
+#include "pointRenderer.h"
+#include "icp.h"
+#include "featureMatcher.h"
+#include "log.h"
+#include "backgroundRegistration.h"
+#include "calibration.h"
+#include "cloudExport.h"
+#include "registrationGraph.h"
+#include "previewCompositor.h"
+#include "profiler.h"
+#include "sessionFile.h"
 // --- C++ ---
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
 #include <fstream>
+#include <string>
 #include <vector>
 #include <math.h>
+#include <time.h>
 
 /*
  * Kinect registration program
@@ -28,32 +48,30 @@
 
 using namespace cv;
 
-// Store the correspondences and centroids
-// Vec3f is an OpenCV data structure
-typedef std::pair< Vec3f, Vec3f > match;
-
 // Used for interactive transformations 
 // see transformation() and KeyPressed()
 enum Transform_Mode{ rotation, translation, full_transform, none };
 Transform_Mode transform_mode = none;
 
 // Variables for Calculations and Loops
-const int NUM_CAMS = 2;
+int numCams = 2;        // --cams N
 int GLwindow;
 int mx=-1,my=-1;        // Prevous mouse coordinates
 int rotangles[2] = {0}; // Panning angles
 float zoom = 1;         // zoom factor
-match centroids;
-Mat P, Q, trans, rot; // P and Q store the points for procrustes analysis
-vector< Vec3f > P_pts, Q_pts; // This is how they're collected
-// NOTE: Simplify correspondence containers above
 
-// This is used for collecting Correspondences. It keeps track of where the points were just collected from.
-enum Points{ P_POINTS, Q_POINTS, NONE };
-Points POINTS = NONE;
+// Correspondences for every camera pair and the poses solved from them.
+// Camera 0 is the world frame.
+RegistrationGraph graph;
+
+// This is used for collecting Correspondences. A click leaves its camera
+// and pixel here until a click in another camera completes the pair.
+int pendingCam = -1;
+Vec3f pendingPt;
 
 // Window Size and Position
 const int window_width = 640, window_height = 480;
+const char* previewWindow = "Cameras";
 int window_xpos = 1000, window_ypos = 100;
 
 // OpenGL Callback Functions
@@ -61,7 +79,7 @@ void cbRender();
 void cbReSizeGLScene( int Width, int Height);
 void cbMouseMoved( int x, int y);
 void cbMousePress( int button, int state, int x, int y);
-void cbTimer( int ms );
+void cbIdle();
 void cbKeyPressed( unsigned char key, int x, int y);
 
 // OpenCV Callback Functions
@@ -69,46 +87,104 @@ void cbMouseEvent( int event, int x, int y, int flags, void* param );
 
 // Handy functions to call in the render function
 void transformation( int cam ); // This applies the procrustes transformations
-void loadVertexMatrix(); // This applies the projection transformation
+void loadVertexMatrix( int cam ); // This applies the projection transformation
 void noKinectQuit();
 void draw_axes();
 void draw_line(Vec3b v1, Vec3b v2);
+void drawHud(); // Frame rates and stage timings over the GL view ('h')
+void dumpTrace(); // Writes the profiler's events for chrome://tracing ('j')
 
 // Computer Vision functions
-void displayCVcams(); // Calls joinFrames and displays the RGB images
-Mat joinFrames( const Mat& img1, const Mat& img2 ); // Puts images side by side
-Mat convert_vector2Mat( const vector< Vec3f > vec );
-Vec3f transformPoint( const Vec3f& pt ); // Transforms pt from image space
-										 // to Kinect space
-match calculateCentroids( const Mat& verts1, const Mat& verts2 );
-void procrustes( const vector< Vec3f >&, const vector< Vec3f >&, Mat&, Mat& );
-
-// Collects the information from a (cameraIndx) Kinect
-void loadBuffers( int cameraIndx, 
-        unsigned int indices[window_height][window_width], 
-        short xyz[window_height][window_width][3], 
-        unsigned char rgb[window_height][window_width][3] );
-
-// getDepth (poorly) attempts to ameliorate the bad depth measurements
-// by checking the neighbors in a 3x3 grid around a pixel which got a 
-// depth measurement > 2047
+void displayCVcams(); // Tiles the RGB images into the preview window
+void pumpCVEvents(); // Lets HighGUI draw and forwards its keys to cbKeyPressed
+Vec3f transformPoint( int cam, const Vec3f& pt ); // Transforms pt from image space
+										          // to Kinect space
+void registerCameras(); // Solves the graph from the clicked correspondences
+void refineICP(); // Refines every pose on the live clouds
+
+// Picks up the newest frame of a (cameraIndx) Kinect, and wraps it in
+// depthCV
+Frame& fetchFrame( int cameraIndx );
+// Collects the information from a (cameraIndx) Kinect and packs the valid
+// pixels into xyz/rgb. Returns how many points were packed.
+int loadBuffers( int cameraIndx, short xyz[][3], unsigned char rgb[][3] );
+void drawCamera( int cam ); // Uploads and draws one camera's cloud
+
+// Depth of pixel (x = row, y = col) in the current frame of cam. Frames
+// are already hole filled on the capture threads (see DepthFilter), 
+// anything off the image reads as no depth (2047)
 float getDepth( int cam, int x, int y );
-void printMat( const Mat& A );
 
-// Store the matrices from all cameras here
-vector<Mat> rgbCV;
+// Store the matrices from all cameras here. These are just headers on
+// top of the newest frame each capture thread handed us
 vector<Mat> depthCV;
 
-int main( int argc, char** argv ) {
+// The OpenCV window's canvas, every camera's RGB image tiled
+PreviewCompositor* preview = 0;
+
+// Intrinsics and lookup tables for every camera
+vector< DepthModel > depthModels;
+
+// Streams the clouds to the GPU (created once the GL window exists).
+// depthOnly draws the raw depth through the shader path instead ('d').
+PointRenderer* renderer = 0;
+bool depthOnly = false;
+
+// The timing overlay, refreshed a couple of times a second (see drawHud())
+bool showHud = false;
+
+// Frames come off the sensors (or a recording) on their own threads, and
+// can be recorded on the way in. Rendering follows the frames: cbIdle()
+// sleeps on frameSignal and redraws once any camera has published past
+// drawnFrames, the signal's count when the last redraw started.
+FrameSource* source = 0;
+vector< CaptureThread* > captures;
+FrameSignal frameSignal;
+unsigned long drawnFrames = 0;
+const double IDLE_WAIT = 0.005;
+SessionWriter* recorder = 0;
+void startCapture( int argc, char** argv );
+void stopCapture();
+
+// Automatic correspondences ('m'), see FeatureMatcher
+FeatureMatcher* matcher = 0;
+bool autoMatch = false;
+double lastMatch = 0;
+const double AUTO_MATCH_INTERVAL = 0.5;
+const int AUTO_MATCH_MAX = 2000;   // per camera pair
+void findMatches();
+
+// Keeps refining the poses on live frames, every couple of seconds ('b')
+// or every frame with projective ICP ('c'), see BackgroundRegistration
+BackgroundRegistration* rereg = 0;
+bool tracking = false;  // rereg is the 'c' kind
+void toggleReregister( bool continuous );
+void reregister();
+
+// Saved registration, reloaded at startup ('s' saves, --calib <file>)
+const char* calibPath = "kinreg.kcal";
+void loadSavedCalibration();
+void saveCurrentCalibration();
+
+// Registered clouds to disk ('e'), fused into one unless --export-cams
+CloudExporter* exporter = 0;
+FrameExporter* exportFrames = 0;
+std::string exportPrefix = "kinreg-cloud";
+ExportFormat exportFormat = EXPORT_PLY;
+bool exportCams = false;
+void toggleExport();
+void exportFrame();
 
-    // load the first frames (OpenCV gets upset otherwise)
-    for( int cam = 0; cam < NUM_CAMS; cam++ ) {
-        rgbCV.push_back( freenect_sync_get_rgb_cv(cam) );
-        depthCV.push_back( freenect_sync_get_depth_cv(cam) );
-    }
+int main( int argc, char** argv ) {
 
     // Initialize Display Mode
     glutInit( &argc, argv );
+    Profiler::shared().setThreadName( "render" );
+
+    // Start pulling frames and wait for the first ones (OpenCV gets upset
+    // otherwise)
+    startCapture( argc, argv );
+    loadSavedCalibration();
     glutInitDisplayMode( GLUT_RGBA | GLUT_DOUBLE | GLUT_ALPHA | GLUT_DEPTH );
 
     // Initialize OpenGL Window
@@ -116,9 +192,12 @@ int main( int argc, char** argv ) {
     glutInitWindowPosition( window_xpos, window_ypos );
     GLwindow = glutCreateWindow("Kinect Registration");
     glClearColor( 0.0f, 0.0f, 0.0f, 0.0f );
+    renderer = new PointRenderer();
+    printf( "Streaming points with %s VBOs\n", renderer->streamingMode() );
 
     // Initialize OpenCV Window
-    namedWindow( "Camera 0 | Camera 1", CV_WINDOW_AUTOSIZE );
+    namedWindow( previewWindow, CV_WINDOW_AUTOSIZE );
+    preview = new PreviewCompositor( numCams );
 
     // Setup The GL Callbacks
     glutDisplayFunc( cbRender );
@@ -126,10 +205,10 @@ int main( int argc, char** argv ) {
     glutKeyboardFunc( cbKeyPressed );
     glutMotionFunc( cbMouseMoved );
     glutMouseFunc( cbMousePress );
-    glutTimerFunc( 10, cbTimer, 10 );
+    glutIdleFunc( cbIdle );
 
     // Setup The CV Callbacks
-    cvSetMouseCallback( "Camera 0 | Camera 1", cbMouseEvent );
+    cvSetMouseCallback( previewWindow, cbMouseEvent );
 
     glutMainLoop();
 
@@ -137,13 +216,10 @@ int main( int argc, char** argv ) {
 }
 
 void cbRender() {
-    short xyz[window_height][window_width][3];
-    unsigned char rgb[window_height][window_width][3];
-    unsigned int indices[window_height][window_width];
 
-    // Flush the OpenCV Mat's from last frame
-    rgbCV.clear();
-    depthCV.clear();
+    PROFILE_SCOPE( "frame" );
+    // Anything published from here on gets its own redraw
+    drawnFrames = frameSignal.count();
     glClear( GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT );
     glEnable( GL_DEPTH_TEST );
     glPushMatrix();
@@ -153,53 +229,94 @@ void cbRender() {
         glRotatef( rotangles[1], 0,1,0 );
         draw_axes();
 
-        glEnableClientState( GL_VERTEX_ARRAY );
-        glEnableClientState( GL_COLOR_ARRAY );
         glPointSize( 2 );
-        //--------Camera 0 (P)-----------
-        loadBuffers( 0, indices, xyz, rgb ); 
-        glVertexPointer( 3, GL_SHORT, 0, xyz );
-        glColorPointer( 3, GL_UNSIGNED_BYTE, 0, rgb );
-    glPushMatrix();
-        // transform centroid of P to origin and rotate
-        transformation( 0 );
-		// projection matrix (camera specific - Can be improved)
-        loadVertexMatrix();
-        glDrawArrays(GL_POINTS, 0, window_width*window_height);
-    glPopMatrix();
-        //--------Camera 1 (Q)-----------
-        loadBuffers( 1, indices, xyz, rgb ); 
-        glVertexPointer( 3, GL_SHORT, 0, xyz );
-        glColorPointer( 3, GL_UNSIGNED_BYTE, 0, rgb );
-    glPushMatrix();
-		// translate centroid of Q to origin
-        transformation( 1 );
-        loadVertexMatrix();
-        glDrawArrays( GL_POINTS, 0, window_width*window_height );
-    glPopMatrix();
+        for( int cam = 0; cam < numCams; cam++ )
+            drawCamera( cam );
     glPopMatrix();
 
+    if( exporter )
+        exportFrame();
+
     displayCVcams();
+    if( showHud )
+        drawHud();
     glFlush();
-    glutSwapBuffers();
+    {
+        PROFILE_SCOPE( "swap" );
+        glutSwapBuffers();
+    }
     glDisable( GL_DEPTH_TEST );
 }
 
+void drawCamera( int cam ) {
+    // Too big for the stack, and there's only ever one render thread
+    static short xyz[KINECT_PIXELS][3];
+    static unsigned char rgb[KINECT_PIXELS][3];
+
+    glPushMatrix();
+        // Place the camera in the world (see transformation())
+        transformation( cam );
+        if( depthOnly && renderer->canDrawDepth() ) {
+            // The shader does the projection itself
+            Frame& frame = fetchFrame( cam );
+            PROFILE_SCOPE( "draw", cam );
+            renderer->drawDepth( frame.depth, depthModels[cam].intrinsics() );
+        }
+        else {
+            int points;
+            {
+                PROFILE_SCOPE( "pack", cam );
+                points = loadBuffers( cam, xyz, rgb ); 
+            }
+            // projection matrix (camera specific)
+            loadVertexMatrix( cam );
+            PROFILE_SCOPE( "draw", cam );
+            renderer->drawPacked( &xyz[0][0], &rgb[0][0], points );
+        }
+    glPopMatrix();
+}
+
 void cbKeyPressed( unsigned char key, int x, int y ) {
 
     // Press esc to exit
     if ( key == 27 ) {
+        delete renderer;
+        delete preview;
+        delete matcher;
+        delete rereg;
+        if( exporter )
+            toggleExport();
         glutDestroyWindow( GLwindow );
+        stopCapture();
         exit( 0 );
     }
     else if( key == 'p' ) {
-        procrustes( P_pts, Q_pts, trans, rot ); 
-		// The correspondence arrays are flushed after the transformations
+        registerCameras();
+		// The correspondences are flushed after the transformations
 		// are calculated. Just in case the registration attempt is poor 
 		// and you want to try again, you can just start collecting
 		// correspondences again without restarting the program
-        P_pts.clear();
-        Q_pts.clear();
+        graph.clearCorrespondences();
+        pendingCam = -1;
+        if( rereg )
+            rereg->reset( graph );
+    }
+    else if( key == 'i' ) {
+        refineICP();
+        if( rereg )
+            rereg->reset( graph );
+    }
+    else if( key == 'b' || key == 'c' )
+        toggleReregister( key == 'c' );
+    else if( key == 's' )
+        saveCurrentCalibration();
+    else if( key == 'e' )
+        toggleExport();
+    else if( key == 'm' ) {
+        if( !matcher )
+            matcher = new FeatureMatcher();
+        autoMatch = !autoMatch;
+        printf( "Automatic matching %s\n", autoMatch ? "on" : "off" );
     }
     else if( key == 'r' ) 
         transform_mode = rotation;
@@ -213,6 +330,24 @@ void cbKeyPressed( unsigned char key, int x, int y ) {
         zoom *= 1.1f;
     else if ( key == 'x' )
         zoom /= 1.1f;
+    else if ( key == 'd' )
+        depthOnly = !depthOnly;
+    else if ( key == 'h' )
+        showHud = !showHud;
+    else if ( key == 'j' )
+        dumpTrace();
+    else if ( key == 'f' ) {
+        // Cycle through the depth filters
+        DepthFilterMode mode = (DepthFilterMode)
+            ( ( captures[0]->depthFilter() + 1 ) % DEPTH_FILTER_MODES );
+        for( int cam = 0; cam < numCams; cam++ )
+            captures[cam]->setDepthFilter( mode );
+        printf( "Depth filter: %s\n", DepthFilter::modeName( mode ) );
+    }
+
+    // Most keys change the view, and nothing else redraws until the next
+    // frame arrives
+    glutPostWindowRedisplay( GLwindow );
 
 }
 
@@ -225,6 +360,7 @@ void cbMouseMoved( int x, int y) {
 
     mx = x;
     my = y;
+    glutPostWindowRedisplay( GLwindow );
 
 }
 
@@ -242,12 +378,19 @@ void cbMousePress( int button, int state, int x, int y) {
 
 }
 
-// This ensures that OpenGL and OpenCV play nicely together
-// ms needs to be the same time as OpenCV's waitKey( ms )
-void cbTimer( int ms ) {
+// GLUT calls this whenever it runs out of events. Let the OpenCV window
+// handle its own, then sleep until some camera publishes a frame and only
+// redraw if one did. The timeout keeps both windows responsive while the
+// cameras are quiet, it doesn't pace anything.
+void cbIdle() {
 
-    glutTimerFunc( ms, cbTimer, ms );
-    glutPostRedisplay();
+    pumpCVEvents();
+    if( autoMatch )
+        findMatches();
+    if( rereg )
+        reregister();
+    if( frameSignal.wait( drawnFrames, IDLE_WAIT ) )
+        glutPostWindowRedisplay( GLwindow );
 
 }
 
@@ -262,45 +405,129 @@ void cbReSizeGLScene( int Width, int Height) {
 
 void noKinectQuit() {
     printf( "Error: Kinect not connected?\n" );
+    stopCapture();
     exit( 1 );
 }
 
-void loadBuffers( int cameraIndx, 
-        unsigned int indices[window_height][window_width], 
-        short xyz[window_height][window_width][3], 
-        unsigned char rgb[window_height][window_width][3] ) {
+// Pass --replay <path> to run from a recorded session or raw frame dumps
+// instead of live sensors (see sessionFile.h and FileSource), --speed to
+// replay faster or slower (0 for flat out), and --cams N for more than two
+// cameras. --record <file> saves everything captured as a session,
+// --compress packs its depth losslessly. --calib <file> is where the
+// registration is saved and loaded from. --log-level N (0 errors only
+// .. 3 debug) sets how chatty it is. --export <prefix>,
+// --export-format ply|pcd|kcl and --export-cams set up 'e'.
+void startCapture( int argc, char** argv ) {
+
+    const char* replayPath = 0;
+    const char* recordPath = 0;
+    bool compress = false, camsGiven = false;
+    double speed = 1;
+    for( int i = 1; i < argc; i++ ) {
+        if( strcmp( argv[i], "--compress" ) == 0 )
+            compress = true;
+        else if( strcmp( argv[i], "--export-cams" ) == 0 )
+            exportCams = true;
+        else if( i == argc - 1 )
+            break;
+        else if( strcmp( argv[i], "--replay" ) == 0 )
+            replayPath = argv[i+1];
+        else if( strcmp( argv[i], "--record" ) == 0 )
+            recordPath = argv[i+1];
+        else if( strcmp( argv[i], "--log-level" ) == 0 )
+            setLogLevel( atoi( argv[i+1] ) );
+        else if( strcmp( argv[i], "--calib" ) == 0 )
+            calibPath = argv[i+1];
+        else if( strcmp( argv[i], "--export" ) == 0 )
+            exportPrefix = argv[i+1];
+        else if( strcmp( argv[i], "--export-format" ) == 0 && 
+                 !CloudExporter::parseFormat( argv[i+1], exportFormat ) ) {
+            printf( "Error: unknown export format %s (ply, pcd or kcl)\n", argv[i+1] );
+            exit( 1 );
+        }
+        else if( strcmp( argv[i], "--speed" ) == 0 )
+            speed = atof( argv[i+1] );
+        else if( strcmp( argv[i], "--cams" ) == 0 ) {
+            numCams = std::max( 1, atoi( argv[i+1] ) );
+            camsGiven = true;
+        }
+    }
 
-    rgbCV.push_back( freenect_sync_get_rgb_cv(cameraIndx) );
-    depthCV.push_back( freenect_sync_get_depth_cv(cameraIndx) );
+    if( replayPath ) {
+        source = openRecording( replayPath, numCams, speed );
+        if( !source ) {
+            printf( "Error: couldn't open recorded frames in %s\n", replayPath );
+            exit( 1 );
+        }
+        // A session knows how many cameras it has
+        if( !camsGiven )
+            numCams = source->numCameras();
+    }
+    else
+        source = new FreenectSource( numCams );
+    graph = RegistrationGraph( numCams );
+
+    if( recordPath ) {
+        recorder = new SessionWriter( recordPath, numCams, compress );
+        if( !recorder->isOpen() ) {
+            printf( "Error: couldn't create %s\n", recordPath );
+            exit( 1 );
+        }
+    }
 
-    if( rgbCV[cameraIndx].empty() || depthCV[cameraIndx].empty() ) 
-        noKinectQuit();
+    for( int cam = 0; cam < numCams; cam++ ) {
+        captures.push_back( new CaptureThread( source, cam ) );
+        captures[cam]->setRecorder( recorder );
+        captures[cam]->setFrameSignal( &frameSignal );
+        captures[cam]->start();
+        depthCV.push_back( Mat() );
+        depthModels.push_back( DepthModel( defaultIntrinsics() ) );
+    }
+    for( int cam = 0; cam < numCams; cam++ ) {
+        if( !captures[cam]->waitForFirstFrame( 5 ) )
+            noKinectQuit();
+    }
+}
 
-    for ( int row = 0; row < window_height; row++ ) {
-        for ( int col = 0; col < window_width; col++ ) {
-            xyz[row][col][0] = col;
-            xyz[row][col][1] = row;
-            xyz[row][col][2] = getDepth( cameraIndx, row, col );
-            indices[row][col] = (window_height + row)*window_width + col; 
-            Vec3b color = rgbCV[cameraIndx].at<Vec3b>(row,col); 
-            rgb[row][col][0] = color[0];
-            rgb[row][col][1] = color[1];
-            rgb[row][col][2] = color[2];
-        }
+void stopCapture() {
+    for( int cam = 0; cam < (int)captures.size(); cam++ )
+        delete captures[cam];
+    captures.clear();
+    delete source;
+    source = 0;
+    if( recorder ) {
+        printf( "Recorded %d frames\n", recorder->records() );
+        delete recorder;
+        recorder = 0;
     }
 }
 
+Frame& fetchFrame( int cameraIndx ) {
+
+    // Never blocks, if the camera hasn't finished a new frame since last
+    // time we just draw the one we already have
+    captures[cameraIndx]->latest();
+    Frame& frame = captures[cameraIndx]->frame();
+    depthCV[cameraIndx] = Mat( window_height, window_width, CV_16UC1, frame.depth );
+    return frame;
+}
+
+int loadBuffers( int cameraIndx, short xyz[][3], unsigned char rgb[][3] ) {
+
+    Frame& frame = fetchFrame( cameraIndx );
+
+    // Only the pixels with a depth reading get drawn
+    return packVertices( frame.depth, frame.rgb, &xyz[0][0], &rgb[0][0] );
+}
+
 // Do the projection from u,v,depth to X,Y,Z directly in an opengl matrix
-// These numbers come from a combination of the ros kinect_node wiki, and
-// nicolas burrus' posts.
-void loadVertexMatrix() {
-
-    float fx = 594.21f;
-    float fy = 591.04f;
-    float a = -0.0030711f;
-    float b = 3.3309495f;
-    float cx = 339.5f;
-    float cy = 242.7f;
+// using the camera's intrinsics (see DepthModel for the CPU version)
+void loadVertexMatrix( int cam ) {
+
+    const Intrinsics& k = depthModels[cam].intrinsics();
+    float fx = k.fx, fy = k.fy;
+    float cx = k.cx, cy = k.cy;
+    float a = k.a, b = k.b;
     GLfloat mat[16] = {
         1/fx,     0,  0, 0,
         0,    -1/fy,  0, 0,
@@ -310,52 +537,11 @@ void loadVertexMatrix() {
     glMultMatrixf( mat);
 }
 
-void printMat( const Mat& A ) {
-
-    printf("| ");
-    for(int i = 0; i < A.rows; i++) {
-        if(i > 0 && i < A.rows) {
-            printf("|\n");
-            printf("| ");
-        }
-        for(int j = 0; j < A.cols; j++) {
-            printf( "%f ", A.at<float>(i,j) );
-        }
-    }
-    printf("|\n");
-}
-
-// Definitely need to come up with a better
-// way to find good depth measurements...
 float getDepth( int cam, int x, int y ) {
 
-    float d = (float)(depthCV[cam].at<short>(x,y));
-
-    if( d >= 2047 ) 
-        d = (float)(depthCV[cam].at<short>(x,y+1));
-
-    if( d >= 2047 ) 
-        d = (float)(depthCV[cam].at<short>(x,y-1));
-
-    if( d >= 2047 ) 
-        d = (float)(depthCV[cam].at<short>(x+1,y));
-
-    if( d >= 2047 ) 
-        d = (float)(depthCV[cam].at<short>(x-1,y));
-
-    if( d >= 2047 )
-        d = (float)(depthCV[cam].at<short>(x-1,y-1));
-
-    if( d >= 2047 )
-        d = (float)(depthCV[cam].at<short>(x-1,y+1));
-
-    if( d >= 2047 )
-        d = (float)(depthCV[cam].at<short>(x+1,y-1));
-
-    if( d >= 2047 )
-        d = (float)(depthCV[cam].at<short>(x+1,y+1));
-
-    return d;
+    if( x < 0 || x >= window_height || y < 0 || y >= window_width )
+        return KINECT_DEPTH_INVALID;
+    return (float)(depthCV[cam].at<unsigned short>(x,y));
 }
 
 void draw_line( Vec3b v1, Vec3b v2) {
@@ -392,36 +578,28 @@ void draw_axes() {
 
 }
 
-// Puts two RGB images side by side in one Mat
-Mat joinFrames( const Mat& img1, const Mat& img2 ) {
-
-    Mat rslt = Mat::zeros( img1.rows, img1.cols*2, img1.type());
-    for( int i = 0; i < img1.rows; i++ )
-        for( int j = 0; j < img1.cols; j++ ) {
-            Vec3b p = img1.at<Vec3b>( i,j);
-            Vec3b q = img2.at<Vec3b>(i,j);
-            rslt.at<Vec3b>(i,j) = p;
-            rslt.at<Vec3b>(i,j+window_width) = q;
-        }
-
-    return rslt;
-}
-
-// Display the joined frames in one window
+// Display the tiled frames in one window. Only frames that changed since
+// the last tick get converted, straight into their tile.
 void displayCVcams() {
 
-    Mat tmp = Mat::zeros( window_width, window_height, CV_8U );
-    for( int cam = 0; cam < NUM_CAMS; cam++ ) {
-        cvtColor( rgbCV[cam], tmp, CV_RGB2BGR );
-        rgbCV[cam] = tmp.clone();
+    {
+        PROFILE_SCOPE( "preview" );
+        for( int cam = 0; cam < numCams; cam++ )
+            preview->put( cam, captures[cam]->frame() );
+        imshow( previewWindow, preview->canvas() );
     }
+}
 
-    Mat rgb = joinFrames( rgbCV[0], rgbCV[1] );
-    imshow( "Camera 0 | Camera 1", rgb );
+// HighGUI only draws and delivers events from inside waitKey(), 1 ms is
+// the shortest wait it has
+void pumpCVEvents() {
 
-    // Time here needs to be the same as cbTimer
     // returns -1 if no key pressed
-    char key = waitKey( 10 );
+    char key;
+    {
+        PROFILE_SCOPE( "wait_key" );
+        key = waitKey( 1 );
+    }
 
     // If someone presses a button while a cv window 
     // is in the foreground we want the behavior to
@@ -432,360 +610,426 @@ void displayCVcams() {
 
 }
 
-match calculateCentroids( const Mat& verts1, const Mat& verts2 ) {
-
-    Vec3f centroid1(0,0,0), centroid2(0,0,0);    
+// Moves whatever the matcher finished into the graph and hands it the
+// current frames every AUTO_MATCH_INTERVAL. Never waits for it, a slow
+// batch just means fewer batches.
+void findMatches() {
+
+    int added = matcher->collect( graph, AUTO_MATCH_MAX );
+    if( added ) {
+        // Every batch would be twice a second per pair, the totals say enough
+        char pairs[256] = "";
+        for( int a = 0, length = 0; a < numCams; a++ )
+            for( int b = a + 1; b < numCams && length < (int)sizeof( pairs ); b++ )
+                length += snprintf( pairs + length, sizeof( pairs ) - length, ", %d-%d: %d", 
+                                    a, b, graph.correspondences( a, b ) );
+        LOG_EVERY( 2.0, LOG_LEVEL_INFO, "auto matches: %d new%s", added, pairs );
+    }
 
-    for( int i = 0; i < verts1.cols; i++ ) {
+    double now = monotonicSeconds();
+    if( now - lastMatch < AUTO_MATCH_INTERVAL )
+        return;
+    vector< const Frame* > frames( numCams );
+    for( int cam = 0; cam < numCams; cam++ )
+        frames[cam] = &captures[cam]->frame();
+    if( matcher->start( frames, depthModels ) )
+        lastMatch = now;
+}
 
-        // Sum of components of first point cloud
-        centroid1[0] += verts1.at<float>(0,i);
-        centroid1[1] += verts1.at<float>(1,i);
-        centroid1[2] += verts1.at<float>(2,i);
+// Turns the kind asked for on, or off if it's the one running. The other
+// kind is stopped first, only one runs at a time.
+void toggleReregister( bool continuous ) {
 
-        // Sum of components of second point cloud
-        centroid2[0] += verts2.at<float>(0,i);
-        centroid2[1] += verts2.at<float>(1,i);
-        centroid2[2] += verts2.at<float>(2,i);
+    bool running = rereg && tracking == continuous;
+    if( rereg ) {
+        delete rereg;
+        rereg = 0;
+        printf( tracking ? "Continuous tracking off\n" : "Background registration off\n" );
     }
+    if( running )
+        return;
+    if( graph.placementOrder().size() < 2 ) {
+        printf( "Register the cameras first ('p')\n" );
+        return;
+    }
+    tracking = continuous;
+    rereg = new BackgroundRegistration( depthModels, continuous ? BackgroundParams::continuous() 
+                                                                : BackgroundParams() );
+    rereg->reset( graph );
+    printf( tracking ? "Continuous tracking on\n" : "Background registration on\n" );
+}
 
-    // First centroid
-    centroid1[0] /= verts1.cols;
-    centroid1[1] /= verts1.cols;
-    centroid1[2] /= verts1.cols;
-    printf(" First centroid = (%f,%f,%f)\n", centroid1[0], centroid1[1], centroid1[2] );
-    
-    // Second centroid
-    centroid2[0] /= verts1.cols;
-    centroid2[1] /= verts1.cols;
-    centroid2[2] /= verts1.cols;
-    printf(" Second centroid = (%f,%f,%f)\n", centroid2[0], centroid2[1], centroid2[2] );
+// Hands the background registration depth when it wants some and picks
+// up its poses when it swaps new ones in. Both are copies, no waiting.
+void reregister() {
 
-    match centroids( centroid1, centroid2 );
+    double now = monotonicSeconds();
+    if( rereg->wantsFrames( now ) ) {
+        vector< const uint16_t* > depth( numCams );
+        for( int cam = 0; cam < numCams; cam++ )
+            depth[cam] = captures[cam]->frame().depth;
+        rereg->submit( depth, now );
+    }
+
+    static bool drifting = false;
+    if( rereg->drifting() != drifting ) {
+        drifting = !drifting;
+        printf( drifting ? "Registration is drifting\n" : "Registration recovered\n" );
+    }
 
-    return centroids;
+    if( rereg->update( graph ) ) {
+        vector< RegistrationCheck > checks;
+        rereg->history( checks );
+        // Tracking swaps poses most frames, so this is rate limited
+        if( !checks.empty() )
+            LOG_EVERY( 2.0, LOG_LEVEL_INFO, "Re-registered in the background: rms %.4f m -> %.4f m (%.0f ms)",
+                       checks.back().rmsBefore, checks.back().rmsAfter, checks.back().ms );
+        glutPostWindowRedisplay( GLwindow );
+    }
 }
 
-void procrustes( const vector< Vec3f >& P_pts,
-                 const vector< Vec3f >& Q_pts,
-                 Mat& trans, Mat& rot ) {
-    printf("\n\n------------ENTERING procrustes()------------\n");
+void registerCameras() {
 
-    if( P_pts.size() == 0 || Q_pts.size() == 0 ) {
+    int pairs = 0;
+    for( int a = 0; a < numCams; a++ )
+        for( int b = a + 1; b < numCams; b++ )
+            pairs += graph.correspondences( a, b ) > 0;
+    if( !pairs ) {
         printf("There are no correspondences for Registration...\n");
         return;
     }
 
-    P = convert_vector2Mat( P_pts );
-    printf("P:\n");
-    printMat( P );
-    Q = convert_vector2Mat( Q_pts );
-    printf("Q:\n");
-    printMat( Q );
-    centroids = calculateCentroids( P, Q );
-
-    // To calculate the rotation we assume the centroids of their
-	// correspondences are aligned. So move the centroids of each
-	// collection of correspondences to the origin.
-    for( int pt = 0; pt < P.cols; pt++ ) {
-        P.at<float>(0,pt) -= centroids.first[0]; 
-        P.at<float>(1,pt) -= centroids.first[1]; 
-        P.at<float>(2,pt) -= centroids.first[2]; 
-    }
-    for( int pt = 0; pt < Q.cols; pt++ ) {
-        Q.at<float>(0,pt) -= centroids.second[0]; 
-        Q.at<float>(1,pt) -= centroids.second[1]; 
-        Q.at<float>(2,pt) -= centroids.second[2]; 
-    }
-	// Procrustes in 3 lines baby
-    Mat PQt = P*Q.t();
-    SVD svd( PQt );
-    Mat rotMat = svd.u*svd.vt;
-
-	// change the rotMat to column major (OpenGL stores matrices in column
-	// major order, while OpenCV row major, and add the extra column and row)
-    float rotCpy[16] = { rotMat.at<float>(0,0), rotMat.at<float>(0,1), rotMat.at<float>(0,2), 0,
-                       	 rotMat.at<float>(1,0), rotMat.at<float>(1,1), rotMat.at<float>(1,2), 0,
-                       	 rotMat.at<float>(2,0), rotMat.at<float>(2,1), rotMat.at<float>(2,2), 0,
-                       	 0, 0, 0, 1 }; 
-    rot = Mat( 4, 4, CV_32F, rotCpy ).clone();
-    printf(" rot:\n");
-    printMat( rot );
-
-    printf("\n\n------------LEAVING procrustes()------------\n");
-}
-
-// Apply certain transformations to each camera
-void transformation( int cam ) {
+    double start = monotonicSeconds();
+    int placed = graph.solve();
+    printf( "Registered %d of %d cameras in %.2f ms, rms %.4f m\n", placed, numCams,
+            1000*( monotonicSeconds() - start ), graph.rms() );
+
+    for( int k = 0; k < (int)graph.edges().size(); k++ ) {
+        const RegistrationEdge& e = graph.edges()[k];
+        if( e.A.empty() )
+            continue;
+        if( e.solved )
+            printf( " %d-%d: %2d pairs, %2d inliers  rms %.4f m alone, %.4f m in the graph\n", 
+                    e.a, e.b, (int)e.A.size(), e.result.count, e.result.rms, e.rms );
+        else
+            printf( " %d-%d: %2d pairs, need at least 3 that agree\n", e.a, e.b, (int)e.A.size() );
+    }
+    for( int cam = 0; cam < numCams; cam++ ) {
+        if( !graph.placed( cam ) ) {
+            printf( " Camera %d: not connected to camera %d\n", cam, graph.reference() );
+            continue;
+        }
+        const RigidTransform& T = graph.pose( cam );
+        printf( " Camera %d (via %d):\n", cam, graph.parent( cam ) );
+        for( int r = 0; r < 3; r++ )
+            printf( "  | %9.5f %9.5f %9.5f  %9.5f |\n", T.R(r,0), T.R(r,1), T.R(r,2), T.t[r] );
+    }
+}
 
-    if( transform_mode == none )
+// Picks up where the last run left off, if it saved a calibration
+void loadSavedCalibration() {
+
+    FILE* f = fopen( calibPath, "rb" );
+    if( !f )
+        return;
+    fclose( f );
+
+    double start = monotonicSeconds();
+    Calibration calibration;
+    vector< DepthModel > tables;
+    if( !loadCalibration( calibPath, calibration, &tables ) )
+        return;
+    if( (int)calibration.cameras.size() != numCams )
+        printf( "%s has %d cameras, using it for the first %d\n", calibPath, 
+                (int)calibration.cameras.size(), std::min( numCams, (int)calibration.cameras.size() ) );
+    if( !applyCalibration( calibration, graph, depthModels, &tables ) )
+        return;
+    transform_mode = full_transform;
+    printf( "Loaded %s in %.2f ms, %d cameras placed%s\n", calibPath, 1000*( monotonicSeconds() - start ),
+            (int)graph.placementOrder().size(), tables.empty() ? "" : " (cached tables)" );
+}
+
+// Binary with the depth tables for the next startup, and a text copy next
+// to it for reading or editing by hand
+void saveCurrentCalibration() {
+
+    if( graph.placementOrder().size() < 2 ) {
+        printf( "Register the cameras first ('p')\n" );
         return;
-    else if( transform_mode == rotation && cam == 0 ) {
-        glMultMatrixf( (GLfloat*)rot.data );
-    }
-    else if( transform_mode == translation && cam == 0 ) {
-        glTranslatef( -centroids.first[0], -centroids.first[1], -centroids.first[2] );
     }
-    else if( transform_mode == translation && cam == 1 ) {
-        glTranslatef( -centroids.second[0], -centroids.second[1], -centroids.second[2] );
+    Calibration calibration;
+    captureCalibration( graph, depthModels, calibration );
+    std::string text = std::string( calibPath ) + ".txt";
+    if( saveCalibration( calibPath, calibration, &depthModels ) && saveCalibrationText( text, calibration ) )
+        printf( "Saved the calibration to %s and %s\n", calibPath, text.c_str() );
+    else
+        printf( "Error: couldn't write %s\n", calibPath );
+}
+
+void toggleExport() {
+
+    if( exporter ) {
+        // Waits for the frame in progress, then for the queue to drain
+        unsigned long skipped = exportFrames->dropped();
+        delete exportFrames;
+        exportFrames = 0;
+        ExportStats es = exporter->stats();
+        printf( "Export off, writing the last %d: %lu clouds written, %lu dropped, %.1f MB/s\n",
+                es.pending, es.written, es.dropped + skipped,
+                es.writeSeconds > 0 ? es.bytes/es.writeSeconds/1e6 : 0.0 );
+        delete exporter;
+        exporter = 0;
+        return;
     }
-    else if( transform_mode == full_transform && cam == 0 ) {
-        glMultMatrixf( (GLfloat*)rot.data );
-        glTranslatef( -centroids.first[0], -centroids.first[1], -centroids.first[2] );
+    exporter = new CloudExporter( exportPrefix, exportFormat );
+    if( !exporter->isOpen() ) {
+        printf( "Error: couldn't create %s.%s\n", exportPrefix.c_str(), 
+                CloudExporter::formatName( exportFormat ) );
+        delete exporter;
+        exporter = 0;
+        return;
     }
-    else if( transform_mode == full_transform && cam == 1 ) {
-        glTranslatef( -centroids.second[0], -centroids.second[1], -centroids.second[2] );
+    exportFrames = new FrameExporter( *exporter, depthModels, exportCams );
+    printf( "Exporting %s clouds as %s to %s\n", exportCams ? "camera" : "fused", 
+            CloudExporter::formatName( exportFormat ), exportPrefix.c_str() );
+}
+
+// Every drawn frame goes to the exporter: each camera's own cloud, or
+// with the poses in use all placed cameras fused into one. Only the
+// frames are copied here, unprojecting and fusing happen on the
+// exporter's thread, and if it or the writer has fallen behind clouds
+// are dropped rather than making the render loop wait.
+void exportFrame() {
+
+    vector< const Frame* > frames( numCams );
+    vector< RigidTransform > poses( numCams );
+    vector< uint8_t > placed( numCams );
+    for( int cam = 0; cam < numCams; cam++ ) {
+        frames[cam] = &captures[cam]->frame();
+        poses[cam] = graph.pose( cam );
+        placed[cam] = graph.placed( cam );
     }
+    exportFrames->submit( frames, poses, placed, monotonicSeconds() );
+}
 
+// ICP every placed camera against the one it was chained from, parents
+// first so each one lines up with an already refined neighbour
+void refineICP() {
+
+    PointArena arena;
+    vector< PointCloud > clouds( numCams, PointCloud( POINT_XYZ, &arena ) );
+    for( int cam = 0; cam < numCams; cam++ )
+        depthModels[cam].unprojectFrame( captures[cam]->frame().depth, clouds[cam] );
+
+    const vector< int >& order = graph.placementOrder();
+    for( int k = 0; k < (int)order.size(); k++ ) {
+        int cam = order[k], parent = graph.parent( cam );
+        if( parent < 0 )
+            continue;
+
+        Icp icp;
+        double start = monotonicSeconds();
+        icp.setTarget( clouds[parent], depthModels[parent].intrinsics() );
+        printf( "ICP %d -> %d: target ready in %.2f ms\n", cam, parent, 
+                1000*( monotonicSeconds() - start ) );
+
+        // Relative guess from the current poses, cam's space into parent's
+        RigidTransform toParent = graph.pose( parent ).inverse()*graph.pose( cam );
+        IcpResult result = icp.align( clouds[cam], toParent );
+        for( int it = 0; it < (int)result.iterations.size(); it++ )
+            printf( "ICP %2d: %6d pts  rms %.5f m  %7.2f ms\n", it, 
+                    result.iterations[it].correspondences,
+                    result.iterations[it].rms, result.iterations[it].ms );
+        printf( "ICP %s, rms %.5f m\n", result.converged ? "converged" : "stopped", result.rms );
+
+        if( !result.iterations.empty() && result.iterations.back().correspondences >= 6 )
+            graph.setPose( cam, graph.pose( parent )*result.transform );
+    }
 }
 
-// Callback function
-void cbMouseEvent( int event, int col, int row, int flags, void* param ) {
+// Apply certain transformations to each camera. The world is camera 0's
+// space, centred on its clicked points.
+void transformation( int cam ) {
 
-    switch( event ) {
-        case CV_EVENT_LBUTTONDOWN:
-			if( col <= 640 ) { // This is how it know which points you're
-							   // collecting (images side by side)
-                printf(" Click in P ( %d, %d, %f )\n", col, row, getDepth(0,row,col) );
-                if( POINTS == NONE ) {
-						// If first click, grab the point and
-                    P_pts.push_back( Vec3f( col, row, getDepth(0,row,col) ) );
-						//  state that the last point grabbed was a point in P
-                    POINTS = P_POINTS;
-                    break;
-                }
-                if( POINTS == P_POINTS ) {
-                    printf("Can't match to the same image! Erasing previous point...\n");
-                    P_pts.pop_back();
-                    POINTS = NONE;
-                    break;
-                }
-				// If not NONE and not P_POINTS must be Q_POINTS
-                P_pts.push_back( Vec3f( col, row, getDepth(0,row,col) ) );
-                float Pz = P_pts.back()[2];
-                float Qz = Q_pts.back()[2];
-				// Check if the depth measurements are bad, if so remove them
-                if( Pz >= 2047 || Pz <= 0 || Qz >= 2047 || Qz <= 0 ) {
-                    printf( "\nDepths are bad! Erasing correspondence...\n");
-                    P_pts.pop_back();
-                    Q_pts.pop_back();
-                    POINTS = NONE;
-                    break;
-                }
-                else {
-					// If the depths are good, transform the points and store them!
-                    Vec3f transP_pt = transformPoint( P_pts.back() );
-                    P_pts.pop_back();
-                    P_pts.push_back( transP_pt );
-                    Vec3f transQ_pt = transformPoint( Q_pts.back() );
-                    Q_pts.pop_back();
-                    Q_pts.push_back( transQ_pt );
-                    printf(" P_pts: \n" );
-                    for( int i = 0; i < (int)P_pts.size(); i++ )
-                        printf( "%d - (%f,%f,%f)\n",i,P_pts[i][0],P_pts[i][1],P_pts[i][2] );
-                    printf(" Q_pts: \n" );
-                    for( int i = 0; i < (int)Q_pts.size(); i++ ) 
-                        printf( "%d - (%f,%f,%f)\n",i,Q_pts[i][0],Q_pts[i][1],Q_pts[i][2] );
-                }
-                POINTS = NONE;
-            }
-            else {
-				// SAME AS ABOVE JUST FOR OTHER SIDE OF WINDOW ( Q POINTS )
-                printf(" Click in Q ( %d, %d, %f )\n", col-640, row, getDepth(1,row,col-640) );
-                if( POINTS == NONE ) {
-                    Q_pts.push_back( Vec3f( col-640, row, getDepth(1,row,col-640) ) );
-                    POINTS = Q_POINTS;
-                    break;
-                }
-                if( POINTS == Q_POINTS ) {
-                    printf("Can't match to the same image! Erasing previous point...\n");
-                    Q_pts.pop_back();
-                    POINTS = NONE;
-                    break;
-                }
-                Q_pts.push_back( Vec3f( col-640, row, getDepth(1,row,col-640) ) );
-                float Pz = P_pts.back()[2];
-                float Qz = Q_pts.back()[2];
-                if( Pz >= 2047 || Pz <= 0 || Qz >= 2047 || Qz <= 0 ) {
-                    P_pts.pop_back();
-                    Q_pts.pop_back();
-                    printf( "\nDepths are bad! Erasing correspondence...\n");
-                    POINTS = NONE;
-                    break;
-                }
-                else {
-                    Vec3f transP_pt = transformPoint( P_pts.back() );
-                    P_pts.pop_back();
-                    P_pts.push_back( transP_pt );
-                    Vec3f transQ_pt = transformPoint( Q_pts.back() );
-                    Q_pts.pop_back();
-                    Q_pts.push_back( transQ_pt );
-                    printf("\n P_pts: \n" );
-                    for( int i = 0; i < (int)P_pts.size(); i++ )
-                        printf( "%d - (%f,%f,%f)\n",i,P_pts[i][0],P_pts[i][1],P_pts[i][2] );
-                    printf(" Q_pts: \n" );
-                    for( int i = 0; i < (int)Q_pts.size(); i++ ) 
-                        printf( "%d - (%f,%f,%f)\n",i,Q_pts[i][0],Q_pts[i][1],Q_pts[i][2] );    
-                }
-
-                POINTS = NONE;
-            }
+    if( transform_mode == none )
+        return;
+
+    float m[16];
+    const RigidTransform& T = graph.pose( cam );
+    if( transform_mode == rotation ) {
+        RigidTransform( T.R, Vec3f( 0, 0, 0 ) ).toGL( m );
+        glMultMatrixf( m );
+    }
+    else if( transform_mode == translation ) {
+        const Vec3f& c = graph.centroid( cam );
+        glTranslatef( -c[0], -c[1], -c[2] );
+    }
+    else if( transform_mode == full_transform ) {
+        const Vec3f& c = graph.centroid( graph.reference() );
+        glTranslatef( -c[0], -c[1], -c[2] );
+        T.toGL( m );
+        glMultMatrixf( m );
     }
-}
 
-Mat convert_vector2Mat( const vector< Vec3f > vec ) {
+}
 
-    printf("\n\n---------- ENTERING convert_vector2Mat() ----------\n ");
-    printf(" Incoming vector \n");
-    for( int i = 0; i < (int)vec.size(); i++ )
-        printf( " vec[%d] - ( %f, %f, %f )\n",i,vec[i][0],vec[i][1],vec[i][2] );
+// Callback function
+void cbMouseEvent( int event, int col, int row, int flags, void* param ) {
 
-    Mat m( 3, vec.size(), CV_32F );
+    if( event != CV_EVENT_LBUTTONDOWN )
+        return;
 
-    for( int i = 0; i < (int)vec.size(); i++ ) {
-        m.at<float>(0,i) = vec[i][0];
-        m.at<float>(1,i) = vec[i][1];
-        m.at<float>(2,i) = vec[i][2];
+	// This is how it knows which camera you're clicking in (images
+	// tiled)
+    int cam = preview->cameraAt( col, row, &col, &row );
+    if( cam < 0 )
+        return;
+    Vec3f pt( col, row, getDepth( cam, row, col ) );
+    LOG_DEBUG( "click in camera %d ( %d, %d, %.0f )", cam, col, row, pt[2] );
+
+    if( pendingCam < 0 ) {
+		// If first click, grab the point and remember which camera it
+		// came from
+        pendingCam = cam;
+        pendingPt = pt;
+        return;
+    }
+    if( pendingCam == cam ) {
+        printf("Can't match to the same image! Erasing previous point...\n");
+        pendingCam = -1;
+        return;
     }
-    
-    printf(" Mat version of vec:\n");
-    printMat( m );
 
-    printf("--------- LEAVING convert_vector2Mat() ---------\n\n");
-    return m;
+	// Check if the depth measurements are bad, if so drop the pair
+    int first = pendingCam;
+    pendingCam = -1;
+    if( pt[2] >= 2047 || pt[2] <= 0 || pendingPt[2] >= 2047 || pendingPt[2] <= 0 ) {
+        printf( "\nDepths are bad! Erasing correspondence...\n");
+        return;
+    }
 
+	// If the depths are good, transform the points and store them!
+    graph.addCorrespondence( first, transformPoint( first, pendingPt ), 
+                             cam, transformPoint( cam, pt ) );
+    ProcrustesResult fit;
+    int a = std::min( first, cam ), b = std::max( first, cam );
+    if( graph.fitPair( a, b, fit ) )
+        printf( " Cameras %d-%d: %d correspondences, rms %.4f m so far\n", a, b, 
+                graph.correspondences( a, b ), fit.rms );
+    else
+        printf( " Cameras %d-%d: %d correspondences\n", a, b, graph.correspondences( a, b ) );
 }
 
-Vec3f transformPoint( const Vec3f& pt ) {
+Vec3f transformPoint( int cam, const Vec3f& pt ) {
 
-    printf("\n\n----- ENTERING transformPoint() -------\n");
-    printf(" Incoming Point = ( %f, %f, %f )\n", pt[0], pt[1], pt[2] );
-    Mat point( pt );
-    point.resize( 4 );
-    point.at<float>(0,3) = 1;
-    printf(" Mat version of point\n");
-    printMat( point );
+    // Same projection as loadVertexMatrix(), done by the camera's DepthModel
+    Vec3f transformedPoint( 0, 0, 0 );
+    depthModels[cam].unproject( pt[0], pt[1], (uint16_t)pt[2], &transformedPoint[0] );
+    LOG_TRACE( "camera %d: ( %.1f, %.1f, %.0f ) -> ( %f, %f, %f )", cam, pt[0], pt[1], pt[2],
+               transformedPoint[0], transformedPoint[1], transformedPoint[2] );
+    return transformedPoint;
+}
 
-    float fx = 594.21f;
-    float fy = 591.04f;
-    float a = -0.0030711f;
-    float b = 3.3309495f;
-    float cx = 339.5f;
-    float cy = 242.7f;
-    float data[16] = {
-        1/fx,     0,  0, -cx/fx,
-        0,    -1/fy,  0,  cy/fy,
-        0,       0,   0,   -1,
-        0,       0,   a,    b
-    };
+// Text in window pixels, (0, 0) top left
+static void drawText( int x, int y, const std::string& text ) {
+    glRasterPos2i( x, y );
+    for( size_t i = 0; i < text.size(); i++ )
+        glutBitmapCharacter( GLUT_BITMAP_8_BY_13, text[i] );
+}
 
-    Mat transform( 4, 4, CV_32F, data );
-    printf("Transformation Matrix:\n");
-    printMat( transform );
-    Mat tmp = transform*point;
-    printf("Transformation Matrx * Point:\n");
-    printMat( tmp );
-    float w = tmp.at<float>(0,3);
-    float x = tmp.at<float>(0,0) / w;
-    float y = tmp.at<float>(0,1) / w;
-    float z = tmp.at<float>(0,2) / w;
-    Vec3f transformedPoint( x, y, z );
-    printf(" Perspective Division = ( %f, %f, %f )", transformedPoint[0],
-                                                 transformedPoint[1], 
-                                                 transformedPoint[2] );
-    
-    printf("\n----- LEAVING transformPoint() -------\n\n");
-    return transformedPoint;
+void drawHud() {
+
+    // Summarising the rings isn't free, the text only changes every half
+    // second. Rates are over the time since the last refresh.
+    static vector< std::string > lines;
+    static double lastRefresh = 0;
+    static unsigned long frames = 0;
+    static vector< unsigned long > lastCaptured;
+    frames++;
+
+    double now = monotonicSeconds();
+    double elapsed = now - lastRefresh;
+    if( elapsed >= 0.5 || lines.empty() ) {
+        char line[128];
+        lines.clear();
+        snprintf( line, sizeof( line ), "render %6.1f fps", lastRefresh ? frames/elapsed : 0.0 );
+        lines.push_back( line );
+
+        lastCaptured.resize( numCams, 0 );
+        for( int cam = 0; cam < numCams; cam++ ) {
+            unsigned long captured = captures[cam]->framesCaptured();
+            snprintf( line, sizeof( line ), "cam %d  %6.1f fps  dropped %lu  failed %lu", cam,
+                      lastRefresh ? ( captured - lastCaptured[cam] )/elapsed : 0.0,
+                      captures[cam]->framesDropped(), captures[cam]->grabFailures() );
+            lines.push_back( line );
+            lastCaptured[cam] = captured;
+        }
 
-float flann_knn(Mat& m_destinations, Mat& m_object, vector<int>& ptpairs, vector<float>& dists = vector<float>()) {
-    // find nearest neighbors using FLANN
-    Mat m_indices(m_object.rows, 1, CV_32S);
-    Mat m_dists(m_object.rows, 1, CV_32F);
- 
-    Mat dest_32f; m_destinations.convertTo(dest_32f,CV_32FC2);
-    Mat obj_32f; m_object.convertTo(obj_32f,CV_32FC2);
- 
-    assert(dest_32f.type() == CV_32F);
- 
-    cv::flann::Index flann_index(dest_32f, cv::flann::KDTreeIndexParams(2));  // using 2 randomized kdtrees
-    flann_index.knnSearch(obj_32f, m_indices, m_dists, 1, cv::flann::SearchParams(64) ); 
- 
-    int* indices_ptr = m_indices.ptr<int>(0);
-    //float* dists_ptr = m_dists.ptr<float>(0);
-    for (int i=0;i<m_indices.rows;++i) {
-        ptpairs.push_back(indices_ptr[i]);
-    }
- 
-    dists.resize(m_dists.rows);
-    m_dists.copyTo(Mat(dists));
- 
-    return cv::sum(m_dists)[0];
-}
-
-void findBestReansformSVD(Mat& _m, Mat& _d) {
-    Mat m; _m.convertTo(m,CV_32F);
-    Mat d; _d.convertTo(d,CV_32F);
- 
-    Scalar d_bar = mean(d);
-    Scalar m_bar = mean(m);
-    Mat mc = m - m_bar;
-    Mat dc = d - d_bar;
- 
-    mc = mc.reshape(1); dc = dc.reshape(1);
-     
-    Mat H(2,2,CV_32FC1);
-    for(int i=0;i<mc.rows;i++) {
-        Mat mci = mc(Range(i,i+1),Range(0,2));
-        Mat dci = dc(Range(i,i+1),Range(0,2));
-        H = H + mci.t() * dci;
-    }
- 
-    cv::SVD svd(H);
- 
-    Mat R = svd.vt.t() * svd.u.t();
-    double det_R = cv::determinant(R);
-    if(abs(det_R + 1.0) < 0.0001) {
-        float _tmp[4] = {1,0,0,cv::determinant(svd.vt*svd.u)};
-        R = svd.u * Mat(2,2,CV_32FC1,_tmp) * svd.vt;
-    }
-    float* _R = R.ptr<float>(0);
-    Scalar T(d_bar[0] - (m_bar[0]*_R[0] + m_bar[1]*_R[1]),d_bar[1] - (m_bar[0]*_R[2] + m_bar[1]*_R[3]));
- 
-    m = m.reshape(1);
-    m = m * R;
-    m = m.reshape(2);
-    m = m + T;// + m_bar;
-    m.convertTo(_m,CV_32S);
-}
-
-void icp() {
-    vector<int> pair;
-    vector<float> dists;
-
-    while(true) {
-        pair.clear(); dists.clear();
-        double dist = flann_knn(destination, X, pair, dists);
-     
-        if(lastDist <= dist) {
-            X = lastGood;
-            break;  //converged?
+        vector< ProfileStats > stats;
+        Profiler::shared().stats( 1.0, stats );
+        lines.push_back( "" );
+        lines.push_back( "stage         cam  mean ms   max ms  per s" );
+        for( int k = 0; k < (int)stats.size(); k++ ) {
+            const ProfileStats& st = stats[k];
+            char cam[16] = "";
+            if( st.arg >= 0 )
+                snprintf( cam, sizeof( cam ), "%d", st.arg );
+            snprintf( line, sizeof( line ), "%-13s %3s %8.2f %8.2f %6d",
+                      st.name, cam, st.meanMs, st.maxMs, st.count );
+            lines.push_back( line );
+        }
+        if( exporter ) {
+            ExportStats es = exporter->stats();
+            lines.push_back( "" );
+            snprintf( line, sizeof( line ), "export %lu written  %lu dropped  %d queued  %.1f MB/s",
+                      es.written, es.dropped + exportFrames->dropped(), es.pending, 
+                      es.writeSeconds > 0 ? es.bytes/es.writeSeconds/1e6 : 0.0 );
+            lines.push_back( line );
         }
-        lastDist = dist;
-        X.copyTo(lastGood);
-     
-        cout << "distance: " << dist << endl;
-     
-        Mat X_bar(X.size(),X.type());
-        for(int i=0;i<X.rows;i++) {
-            Point p = destination.at<Point>(pair[i],0);
-            X_bar.at<Point>(i,0) = p;
+        if( rereg ) {
+            vector< RegistrationCheck > checks;
+            rereg->history( checks );
+            lines.push_back( "" );
+            const char* kind = tracking ? "track" : "rereg";
+            if( checks.empty() || !checks.back().valid )
+                snprintf( line, sizeof( line ), "%s  waiting  swaps %d", kind, rereg->swaps() );
+            else
+                snprintf( line, sizeof( line ), "%s  rms %5.1f -> %5.1f mm  %5.1f ms  swaps %d%s", kind,
+                          1000*checks.back().rmsBefore, 1000*checks.back().rmsAfter, checks.back().ms,
+                          rereg->swaps(), rereg->drifting() ? "  DRIFT" : "" );
+            lines.push_back( line );
         }
-     
-        ShowQuery(destination,X,X_bar);
-     
-        X = X.reshape(2);
-        X_bar = X_bar.reshape(2);
-        findBestReansformSVD(X,X_bar);
-        X = X.reshape(1); // back to 1-channel
+        frames = 0;
+        lastRefresh = now;
     }
+
+    int width = glutGet( GLUT_WINDOW_WIDTH ), height = glutGet( GLUT_WINDOW_HEIGHT );
+    glMatrixMode( GL_PROJECTION );
+    glPushMatrix();
+    glLoadIdentity();
+    glOrtho( 0, width, height, 0, -1, 1 );
+    glMatrixMode( GL_MODELVIEW );
+    glPushMatrix();
+    glLoadIdentity();
+    glDisable( GL_DEPTH_TEST );
+
+    glColor3f( 1, 1, 0 );
+    for( int i = 0; i < (int)lines.size(); i++ )
+        drawText( 10, 20 + 15*i, lines[i] );
+
+    glEnable( GL_DEPTH_TEST );
+    glPopMatrix();
+    glMatrixMode( GL_PROJECTION );
+    glPopMatrix();
+    glMatrixMode( GL_MODELVIEW );
+}
+
+void dumpTrace() {
+
+    char path[64];
+    snprintf( path, sizeof( path ), "kinreg-trace-%ld.json", (long)time( 0 ) );
+    if( Profiler::shared().dumpTrace( path ) )
+        printf( "Wrote %s, open it in chrome://tracing or ui.perfetto.dev\n", path );
+    else
+        printf( "Error: couldn't write %s\n", path );
 }
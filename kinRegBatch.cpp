@@ -0,0 +1,255 @@
+// ---- OpenCV -----
+#include <cv.h>
+// --- KinReg ---
+#include "kinect.h"
+#include "frameSource.h"
+#include "depthModel.h"
+#include "procrustes.h"
+#include "json.h"
+#include "sessionFile.h"
+#include "threadPool.h"
+// --- C++ ---
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <string>
+#include <thread>
+#include <vector>
+
+/*
+ * Headless registration of many camera pairs.
+ *
+ *      kinect_reg_batch <manifest> [-o extrinsics.json] [-j threads] [-t meters]
+ *
+ * Every non-comment line of the manifest is one pair
+ *
+ *      <name> <camP> <camQ> <correspondences> [recording]
+ *
+ * and every line of a correspondence file is one click pair, either
+ *
+ *      colP rowP dispP colQ rowQ dispQ     (raw disparity given)
+ *      colP rowP colQ rowQ                 (disparity read from recording)
+ *
+ * the latter needs the recording, a session file or FileSource
+ * directory whose first frame of cameras camP and camQ supplies the
+ * depth. Relative paths are relative to the manifest. Pairs are solved
+ * in parallel with RANSAC, click pairs further than -t (default 1 cm)
+ * from the consensus are left out, and the 4x4 transforms taking camP
+ * points into camQ space are written as JSON, along with the inliers,
+ * residual and timing of each pair.
+ */
+
+struct Pair {
+    std::string name;
+    int camP, camQ;
+    std::string correspondences;
+    std::string recording;
+
+    // Filled in by solvePair()
+    bool ok;
+    std::string error;
+    int used, skipped, inliers;
+    ProcrustesResult result;
+    double loadMs, solveMs;
+};
+
+static std::string resolve( const std::string& base, const std::string& path ) {
+    if( path.empty() || path[0] == '/' )
+        return path;
+    return base + path;
+}
+
+static bool readManifest( const char* file, std::vector< Pair >& pairs ) {
+
+    FILE* f = fopen( file, "r" );
+    if( !f )
+        return false;
+
+    std::string base( file );
+    size_t slash = base.rfind( '/' );
+    base = slash == std::string::npos ? "" : base.substr( 0, slash + 1 );
+
+    char line[1024];
+    while( fgets( line, sizeof( line ), f ) ) {
+        char name[256], corr[512], rec[512] = "";
+        Pair p;
+        if( line[0] == '#' )
+            continue;
+        int n = sscanf( line, "%255s %d %d %511s %511s", name, &p.camP, &p.camQ, corr, rec );
+        if( n < 4 )
+            continue;
+        p.name = name;
+        p.correspondences = resolve( base, corr );
+        p.recording = n == 5 ? resolve( base, rec ) : "";
+        p.ok = false;
+        p.used = p.skipped = p.inliers = 0;
+        p.loadMs = p.solveMs = 0;
+        pairs.push_back( p );
+    }
+    fclose( f );
+    return true;
+}
+
+static void solvePair( Pair& p, const DepthModel& model, const RansacParams& ransac, 
+                       ThreadPool* pool ) {
+
+    double start = monotonicSeconds();
+
+    FILE* f = fopen( p.correspondences.c_str(), "r" );
+    if( !f ) {
+        p.error = "can't open " + p.correspondences;
+        return;
+    }
+
+    // Only load frames if some line actually needs them
+    Frame* frameP = 0;
+    Frame* frameQ = 0;
+    PointCloud P, Q;
+    char line[512];
+    while( fgets( line, sizeof( line ), f ) ) {
+        float v[6];
+        if( line[0] == '#' )
+            continue;
+        int n = sscanf( line, "%f %f %f %f %f %f", v, v+1, v+2, v+3, v+4, v+5 );
+        if( n == 4 ) {
+            if( !frameP ) {
+                FrameSource* files = p.recording.empty() ? 0 :
+                    openRecording( p.recording, std::max( p.camP, p.camQ ) + 1, 0 );
+                frameP = new Frame;
+                frameQ = new Frame;
+                bool read = files && files->grab( p.camP, *frameP ) && files->grab( p.camQ, *frameQ );
+                delete files;
+                if( !read ) {
+                    p.error = "pixel-only correspondences need a readable recording";
+                    break;
+                }
+            }
+            // colP rowP colQ rowQ -> colP rowP dispP colQ rowQ dispQ
+            float cq = v[2], rq = v[3];
+            int iP = (int)v[1]*KINECT_WIDTH + (int)v[0];
+            int iQ = (int)rq*KINECT_WIDTH + (int)cq;
+            bool inside = v[0] >= 0 && v[0] < KINECT_WIDTH && v[1] >= 0 && v[1] < KINECT_HEIGHT &&
+                          cq >= 0 && cq < KINECT_WIDTH && rq >= 0 && rq < KINECT_HEIGHT;
+            v[2] = inside ? frameP->depth[iP] : KINECT_DEPTH_INVALID;
+            v[3] = cq;
+            v[4] = rq;
+            v[5] = inside ? frameQ->depth[iQ] : KINECT_DEPTH_INVALID;
+        }
+        else if( n != 6 )
+            continue;
+
+        cv::Vec3f pt, qt;
+        if( v[2] >= KINECT_DEPTH_INVALID || v[5] >= KINECT_DEPTH_INVALID ||
+            !model.unproject( v[0], v[1], (uint16_t)v[2], &pt[0] ) ||
+            !model.unproject( v[3], v[4], (uint16_t)v[5], &qt[0] ) ) {
+            p.skipped++;
+            continue;
+        }
+        P.push_back( pt );
+        Q.push_back( qt );
+    }
+    fclose( f );
+    delete frameP;
+    delete frameQ;
+    if( !p.error.empty() )
+        return;
+
+    double loaded = monotonicSeconds();
+    p.used = (int)P.size();
+    RansacResult r;
+    p.ok = ransacProcrustes( P, Q, 0, ransac, r, pool );
+    p.result = r.fit;
+    p.inliers = r.inliers;
+    if( !p.ok )
+        p.error = "need at least 3 correspondences with depth that agree";
+    p.loadMs = 1000*( loaded - start );
+    p.solveMs = 1000*( monotonicSeconds() - loaded );
+}
+
+static void writeJson( FILE* out, const std::vector< Pair >& pairs, int threads, double totalMs ) {
+
+    fprintf( out, "{\n  \"threads\": %d,\n  \"total_ms\": %.3f,\n  \"pairs\": [\n", threads, totalMs );
+    for( int i = 0; i < (int)pairs.size(); i++ ) {
+        const Pair& p = pairs[i];
+        fprintf( out, "    {\n      \"name\": \"%s\", \"from\": %d, \"to\": %d,\n", 
+                 jsonEscape( p.name ).c_str(), p.camP, p.camQ );
+        fprintf( out, "      \"correspondences\": %d, \"skipped\": %d, \"inliers\": %d,\n", 
+                 p.used, p.skipped, p.inliers );
+        fprintf( out, "      \"load_ms\": %.3f, \"solve_ms\": %.3f,\n", p.loadMs, p.solveMs );
+        if( !p.ok )
+            fprintf( out, "      \"error\": \"%s\"\n", jsonEscape( p.error ).c_str() );
+        else {
+            const RigidTransform& T = p.result.transform;
+            fprintf( out, "      \"rms\": %.6f,\n      \"extrinsics\": [\n", p.result.rms );
+            for( int r = 0; r < 3; r++ )
+                fprintf( out, "        [ %.9f, %.9f, %.9f, %.9f ],\n", T.R(r,0), T.R(r,1), T.R(r,2), T.t[r] );
+            fprintf( out, "        [ 0, 0, 0, 1 ]\n      ]\n" );
+        }
+        fprintf( out, "    }%s\n", i + 1 < (int)pairs.size() ? "," : "" );
+    }
+    fprintf( out, "  ]\n}\n" );
+}
+
+int main( int argc, char** argv ) {
+
+    const char* manifest = 0;
+    const char* output = 0;
+    int threads = 0;
+    RansacParams ransac;
+    for( int i = 1; i < argc; i++ ) {
+        if( strcmp( argv[i], "-o" ) == 0 && i + 1 < argc )
+            output = argv[++i];
+        else if( strcmp( argv[i], "-j" ) == 0 && i + 1 < argc )
+            threads = atoi( argv[++i] );
+        else if( strcmp( argv[i], "-t" ) == 0 && i + 1 < argc )
+            ransac.threshold = (float)atof( argv[++i] );
+        else
+            manifest = argv[i];
+    }
+    if( !manifest ) {
+        printf( "Usage: %s <manifest> [-o extrinsics.json] [-j threads] [-t meters]\n", argv[0] );
+        return 1;
+    }
+
+    std::vector< Pair > pairs;
+    if( !readManifest( manifest, pairs ) ) {
+        printf( "Error: couldn't read %s\n", manifest );
+        return 1;
+    }
+
+    // All cameras share the default intrinsics until they're calibrated
+    DepthModel model;
+    // The caller works on every loop too, so -j N is N - 1 workers
+    if( threads <= 0 )
+        threads = std::max( 1u, std::thread::hardware_concurrency() );
+    ThreadPool pool( threads > 1 ? threads - 1 : -1 );
+    double start = monotonicSeconds();
+    pool.parallelFor( (int)pairs.size(), [&]( int i ) { solvePair( pairs[i], model, ransac, &pool ); } );
+    double totalMs = 1000*( monotonicSeconds() - start );
+
+    // Summary goes to stderr so the JSON can go to stdout
+    int failed = 0;
+    for( int i = 0; i < (int)pairs.size(); i++ ) {
+        const Pair& p = pairs[i];
+        if( p.ok )
+            fprintf( stderr, "%-20s %3d pts  %3d inliers  rms %.4f m  %.3f ms\n", p.name.c_str(), 
+                     p.used, p.inliers, p.result.rms, p.loadMs + p.solveMs );
+        else {
+            fprintf( stderr, "%-20s FAILED: %s\n", p.name.c_str(), p.error.c_str() );
+            failed++;
+        }
+    }
+    fprintf( stderr, "%d pairs in %.3f ms on %d threads\n", (int)pairs.size(), totalMs, threads );
+
+    FILE* out = output ? fopen( output, "w" ) : stdout;
+    if( !out ) {
+        printf( "Error: couldn't write %s\n", output );
+        return 1;
+    }
+    writeJson( out, pairs, threads, totalMs );
+    if( output )
+        fclose( out );
+
+    return failed ? 2 : 0;
+}
@@ -0,0 +1,34 @@
+#ifndef KINREG_KINECT_H
+#define KINREG_KINECT_H
+
+// --- C++ ---
+#include <stdint.h>
+#include <chrono>
+
+/*
+ * Things every module needs to know about the sensor. Both the RGB and the
+ * depth stream come off the Kinect at 640x480, depth as raw 11 bit
+ * disparity where 2047 means "no measurement".
+ */
+
+const int KINECT_WIDTH  = 640;
+const int KINECT_HEIGHT = 480;
+const int KINECT_PIXELS = KINECT_WIDTH*KINECT_HEIGHT;
+const uint16_t KINECT_DEPTH_INVALID = 2047;
+
+// One RGB + depth pair from one camera
+struct Frame {
+    uint8_t  rgb[KINECT_PIXELS*3];  // RGB order, row major
+    uint16_t depth[KINECT_PIXELS];  // raw disparity, row major
+    double   timestamp;             // host monotonic clock in seconds
+    uint32_t deviceTimestamp;       // whatever the source reported
+    uint32_t sequence;              // counts up per camera from 0
+};
+
+// Monotonic clock shared by capture, replay and timing code
+inline double monotonicSeconds() {
+    return std::chrono::duration< double >(
+            std::chrono::steady_clock::now().time_since_epoch() ).count();
+}
+
+#endif
@@ -0,0 +1,52 @@
+#include "log.h"
+#include "kinect.h"
+// --- C++ ---
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+
+static std::atomic< int > threshold( std::min( (int)LOG_LEVEL_INFO, (int)KINREG_LOG_LEVEL ) );
+
+void setLogLevel( int level ) {
+    threshold = level;
+}
+
+int logLevel() {
+    return threshold.load( std::memory_order_relaxed );
+}
+
+void logWrite( int level, int suppressed, const char* format, ... ) {
+
+    static const char* prefixes[] = { "Error: ", "Warning: ", "", "", "" };
+    char line[1024];
+    int length = snprintf( line, sizeof( line ), "%s", prefixes[level] );
+
+    va_list args;
+    va_start( args, format );
+    length += vsnprintf( line + length, sizeof( line ) - length, format, args );
+    va_end( args );
+    length = std::min( length, (int)sizeof( line ) - 1 );
+    while( length > 0 && line[length - 1] == '\n' )
+        line[--length] = 0;
+
+    if( suppressed )
+        length += snprintf( line + length, sizeof( line ) - length, " (%d more like this)", suppressed );
+    length = std::min( length, (int)sizeof( line ) - 2 );
+    line[length] = '\n';
+    line[length + 1] = 0;
+    fputs( line, stdout );
+}
+
+bool LogLimiter::allow( int& suppressed ) {
+
+    double now = monotonicSeconds();
+    double due = next.load( std::memory_order_relaxed );
+    // Only the thread that moves next on gets to print
+    if( now < due || !next.compare_exchange_strong( due, now + interval ) ) {
+        held++;
+        return false;
+    }
+    suppressed = held.exchange( 0 );
+    return true;
+}
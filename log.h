@@ -0,0 +1,81 @@
+#ifndef KINREG_LOG_H
+#define KINREG_LOG_H
+
+// --- C++ ---
+#include <atomic>
+
+/*
+ * Diagnostics with levels, for the messages that aren't the program
+ * talking to its user.
+ *
+ *      LOG_DEBUG( "camera %d: %d matches", cam, n );
+ *      LOG_EVERY( 1.0, LOG_LEVEL_INFO, "dropped frame on camera %d", cam );
+ *
+ * Levels above KINREG_LOG_LEVEL (a compile time define, debug unless
+ * cmake is given -DKINREG_LOG_LEVEL=4 for trace too) compile to nothing,
+ * arguments included, so trace calls in hot loops cost nothing in a
+ * normal build. Below that setLogLevel() picks at run time, info and up
+ * by default.
+ *
+ * LOG_EVERY() lets a call site through at most once per interval seconds
+ * and says how many it held back, for messages that could otherwise fire
+ * every frame. The limiter is per call site and lock free.
+ *
+ * Errors print as "Error: ...", warnings as "Warning: ...", each message
+ * on its own line (a trailing newline in the format is fine) written in
+ * one go, so threads don't interleave.
+ */
+
+enum LogLevel {
+    LOG_LEVEL_ERROR = 0,
+    LOG_LEVEL_WARN,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_DEBUG,
+    LOG_LEVEL_TRACE
+};
+
+#ifndef KINREG_LOG_LEVEL
+#define KINREG_LOG_LEVEL LOG_LEVEL_DEBUG
+#endif
+
+void setLogLevel( int level );
+int logLevel();
+
+void logWrite( int level, int suppressed, const char* format, ... )
+    __attribute__(( format( printf, 3, 4 ) ));
+
+class LogLimiter {
+public:
+    explicit LogLimiter( double interval ) : interval( interval ), next( 0 ), held( 0 ) {}
+
+    // True if a message may go out now, suppressed gets how many were
+    // held back since the last one
+    bool allow( int& suppressed );
+
+private:
+    double interval;
+    std::atomic< double > next;
+    std::atomic< int > held;
+};
+
+#define KINREG_LOG( level, ... ) do { \
+        if( (level) <= KINREG_LOG_LEVEL && (level) <= logLevel() ) \
+            logWrite( (level), 0, __VA_ARGS__ ); \
+    } while( 0 )
+
+#define LOG_EVERY( seconds, level, ... ) do { \
+        if( (level) <= KINREG_LOG_LEVEL && (level) <= logLevel() ) { \
+            static LogLimiter logLimiter( seconds ); \
+            int logSuppressed; \
+            if( logLimiter.allow( logSuppressed ) ) \
+                logWrite( (level), logSuppressed, __VA_ARGS__ ); \
+        } \
+    } while( 0 )
+
+#define LOG_ERROR( ... ) KINREG_LOG( LOG_LEVEL_ERROR, __VA_ARGS__ )
+#define LOG_WARN( ... )  KINREG_LOG( LOG_LEVEL_WARN, __VA_ARGS__ )
+#define LOG_INFO( ... )  KINREG_LOG( LOG_LEVEL_INFO, __VA_ARGS__ )
+#define LOG_DEBUG( ... ) KINREG_LOG( LOG_LEVEL_DEBUG, __VA_ARGS__ )
+#define LOG_TRACE( ... ) KINREG_LOG( LOG_LEVEL_TRACE, __VA_ARGS__ )
+
+#endif
@@ -0,0 +1,366 @@
+#include "normals.h"
+#include "profiler.h"
+#include "threadPool.h"
+// --- C++ ---
+#include <math.h>
+#include <string.h>
+#include <algorithm>
+#include <limits>
+
+// Rows per task, and columns per task of the integral's vertical pass (two
+// cache lines of Sums)
+static const int BAND = 16;
+static const int COLUMNS = 64;
+
+// Unit cross product of the two tangents into normal i, facing the camera
+// at the origin. False if they're parallel (or NaN).
+static inline bool storeNormal( const float dx[3], const float dy[3], const float p[3],
+                                float* nx, float* ny, float* nz, int i ) {
+    float cx = dx[1]*dy[2] - dx[2]*dy[1];
+    float cy = dx[2]*dy[0] - dx[0]*dy[2];
+    float cz = dx[0]*dy[1] - dx[1]*dy[0];
+    float len = sqrtf( cx*cx + cy*cy + cz*cz );
+    if( !( len > 0 ) )
+        return false;
+    if( cx*p[0] + cy*p[1] + cz*p[2] > 0 )
+        len = -len;
+    nx[i] = cx/len;
+    ny[i] = cy/len;
+    nz[i] = cz/len;
+    return true;
+}
+
+// Central differences of the four neighbours over rows [row0, row1)
+static int crossNormals( PointCloud& cloud, float maxJump, int row0, int row1 ) {
+
+    const float nan = std::numeric_limits< float >::quiet_NaN();
+    const int W = cloud.width(), H = cloud.height();
+    const float* x = cloud.x();
+    const float* y = cloud.y();
+    const float* z = cloud.z();
+    float* nx = cloud.nx();
+    float* ny = cloud.ny();
+    float* nz = cloud.nz();
+    int valid = 0;
+
+    for( int row = row0; row < row1; row++ ) {
+        for( int col = 0; col < W; col++ ) {
+            int i = row*W + col;
+            nx[i] = ny[i] = nz[i] = nan;
+            if( row == 0 || row == H - 1 || col == 0 || col == W - 1 )
+                continue;
+
+            int l = i - 1, r = i + 1, u = i - W, d = i + W;
+            // NaN anywhere fails these comparisons too
+            if( !( fabsf( z[l] - z[i] ) < maxJump && fabsf( z[r] - z[i] ) < maxJump &&
+                   fabsf( z[u] - z[i] ) < maxJump && fabsf( z[d] - z[i] ) < maxJump ) )
+                continue;
+
+            float dx[3] = { x[r] - x[l], y[r] - y[l], z[r] - z[l] };
+            float dy[3] = { x[d] - x[u], y[d] - y[u], z[d] - z[u] };
+            float p[3] = { x[i], y[i], z[i] };
+            if( storeNormal( dx, dy, p, nx, ny, nz, i ) )
+                valid++;
+        }
+    }
+    return valid;
+}
+
+// Sum over rows [top, bottom) x columns [c0, c1) of an integral image
+template< typename Sum >
+static inline void rect( const Sum* top, const Sum* bottom, int c0, int c1, Sum& out ) {
+    out.x = bottom[c1].x - bottom[c0].x - top[c1].x + top[c0].x;
+    out.y = bottom[c1].y - bottom[c0].y - top[c1].y + top[c0].y;
+    out.z = bottom[c1].z - bottom[c0].z - top[c1].z + top[c0].z;
+    out.n = bottom[c1].n - bottom[c0].n - top[c1].n + top[c0].n;
+}
+
+NormalEstimator::NormalEstimator( const NormalParams& params, ThreadPool* pool ) : params( params ) {
+    ownPool = !pool && params.threads > 0;
+    this->pool = pool ? pool : ownPool ? new ThreadPool( params.threads ) : &ThreadPool::shared();
+}
+
+NormalEstimator::~NormalEstimator() {
+    if( ownPool )
+        delete pool;
+}
+
+int NormalEstimator::compute( PointCloud& cloud ) {
+    return compute( cloud, params.radius );
+}
+
+int NormalEstimator::compute( PointCloud& cloud, int radius ) {
+
+    PROFILE_SCOPE( "normals" );
+    cloud.addChannels( POINT_NORMAL );
+    if( params.method == NORMALS_INTEGRAL )
+        return integral( cloud, std::max( 1, radius ) );
+
+    int bands = ( cloud.height() + BAND - 1 )/BAND;
+    counts.assign( bands, 0 );
+    pool->parallelFor( bands, [&]( int b ) {
+        counts[b] = crossNormals( cloud, params.maxJump, b*BAND, std::min( cloud.height(), ( b + 1 )*BAND ) );
+    } );
+    int valid = 0;
+    for( int b = 0; b < bands; b++ )
+        valid += counts[b];
+    return valid;
+}
+
+int NormalEstimator::integral( PointCloud& cloud, int k ) {
+
+    const float nan = std::numeric_limits< float >::quiet_NaN();
+    const int W = cloud.width(), H = cloud.height(), S = W + 1;
+    const float* x = cloud.x();
+    const float* y = cloud.y();
+    const float* z = cloud.z();
+    float* nx = cloud.nx();
+    float* ny = cloud.ny();
+    float* nz = cloud.nz();
+    int bands = ( H + BAND - 1 )/BAND;
+    sums.resize( (size_t)S*( H + 1 ) );
+    counts.assign( bands, 0 );
+    Sum* I = &sums[0];
+
+    // Prefix sums along every row, then down every column. Doubles, a
+    // whole frame of floats would lose the millimetres.
+    const Sum zero = { 0, 0, 0, 0 };
+    std::fill( I, I + S, zero );
+    pool->parallelFor( bands, [&]( int b ) {
+        for( int row = b*BAND; row < std::min( H, ( b + 1 )*BAND ); row++ ) {
+            Sum* out = I + (size_t)( row + 1 )*S;
+            Sum run = zero;
+            out[0] = run;
+            for( int col = 0; col < W; col++ ) {
+                int i = row*W + col;
+                if( cloud.finite( i ) ) {
+                    run.x += x[i];
+                    run.y += y[i];
+                    run.z += z[i];
+                    run.n += 1;
+                }
+                out[col + 1] = run;
+            }
+        }
+    } );
+    pool->parallelFor( ( S + COLUMNS - 1 )/COLUMNS, [&]( int b ) {
+        int c0 = b*COLUMNS, c1 = std::min( S, c0 + COLUMNS );
+        for( int row = 2; row <= H; row++ ) {
+            Sum* out = I + (size_t)row*S;
+            const Sum* above = out - S;
+            for( int c = c0; c < c1; c++ ) {
+                out[c].x += above[c].x;
+                out[c].y += above[c].y;
+                out[c].z += above[c].z;
+                out[c].n += above[c].n;
+            }
+        }
+    } );
+
+    // Each half window has to be a quarter full to be trusted, and its mean
+    // (about (k + 1)/2 pixels off) within maxJump per pixel of the centre
+    const double quarter = 0.25*( 2*k + 1 )*k;
+    const float limit = params.maxJump*0.5f*( k + 1 );
+    pool->parallelFor( bands, [&]( int b ) {
+        int valid = 0;
+        for( int row = b*BAND; row < std::min( H, ( b + 1 )*BAND ); row++ ) {
+            for( int col = 0; col < W; col++ )
+                nx[row*W + col] = ny[row*W + col] = nz[row*W + col] = nan;
+            if( row < k || row >= H - k )
+                continue;
+
+            // Integral rows bounding the windows: above is [top, mid0),
+            // below [mid1, bottom), left and right [top, bottom)
+            const Sum* top = I + (size_t)( row - k )*S;
+            const Sum* mid0 = I + (size_t)row*S;
+            const Sum* mid1 = mid0 + S;
+            const Sum* bottom = I + (size_t)( row + k + 1 )*S;
+            for( int col = k; col < W - k; col++ ) {
+                int i = row*W + col;
+                if( !cloud.finite( i ) )
+                    continue;
+                int c0 = col - k, c1 = col + 1, c2 = col + k + 1;
+                Sum m[4];
+                rect( top, bottom, c0, col, m[0] );     // left
+                rect( top, bottom, c1, c2, m[1] );      // right
+                rect( top, mid0, c0, c2, m[2] );        // above
+                rect( mid1, bottom, c0, c2, m[3] );     // below
+                if( m[0].n < quarter || m[1].n < quarter || m[2].n < quarter || m[3].n < quarter )
+                    continue;
+
+                float mean[4][3];
+                bool ok = true;
+                for( int h = 0; h < 4; h++ ) {
+                    double inv = 1/m[h].n;
+                    mean[h][0] = (float)( m[h].x*inv );
+                    mean[h][1] = (float)( m[h].y*inv );
+                    mean[h][2] = (float)( m[h].z*inv );
+                    ok = ok && fabsf( mean[h][2] - z[i] ) < limit;
+                }
+                if( !ok )
+                    continue;
+
+                float dx[3] = { mean[1][0] - mean[0][0], mean[1][1] - mean[0][1], mean[1][2] - mean[0][2] };
+                float dy[3] = { mean[3][0] - mean[2][0], mean[3][1] - mean[2][1], mean[3][2] - mean[2][2] };
+                float p[3] = { x[i], y[i], z[i] };
+                if( storeNormal( dx, dy, p, nx, ny, nz, i ) )
+                    valid++;
+            }
+        }
+        counts[b] = valid;
+    } );
+
+    int valid = 0;
+    for( int b = 0; b < bands; b++ )
+        valid += counts[b];
+    return valid;
+}
+
+int computeNormals( PointCloud& cloud, float maxJump, ThreadPool* pool ) {
+    NormalParams params;
+    params.maxJump = maxJump;
+    NormalEstimator estimator( params, pool );
+    return estimator.compute( cloud );
+}
+
+// ---------------------------------------------------------------------------
+// Pyramids
+
+void downsampleOrganised( const PointCloud& in, PointCloud& out, float maxJump, ThreadPool* pool ) {
+
+    PROFILE_SCOPE( "pyramid" );
+    const float nan = std::numeric_limits< float >::quiet_NaN();
+    const int W = in.width(), w = W/2, h = in.height()/2;
+    out.addChannels( in.channels() & ( POINT_COLOR | POINT_VALID ) );
+    out.resize( w, h );
+
+    const float* x = in.x();
+    const float* y = in.y();
+    const float* z = in.z();
+    const uint8_t* r = in.r();
+    const uint8_t* g = in.g();
+    const uint8_t* b = in.b();
+    float* ox = out.x();
+    float* oy = out.y();
+    float* oz = out.z();
+    uint8_t* or_ = out.r();
+    uint8_t* og = out.g();
+    uint8_t* ob = out.b();
+    uint8_t* ovalid = out.valid();
+    bool color = in.has( POINT_COLOR ) && or_;
+
+    if( !pool )
+        pool = &ThreadPool::shared();
+    pool->parallelFor( ( h + BAND - 1 )/BAND, [&]( int band ) {
+        for( int row = band*BAND; row < std::min( h, ( band + 1 )*BAND ); row++ ) {
+            for( int col = 0; col < w; col++ ) {
+                int o = row*w + col;
+                int block[4] = { 2*row*W + 2*col, 2*row*W + 2*col + 1,
+                                 ( 2*row + 1 )*W + 2*col, ( 2*row + 1 )*W + 2*col + 1 };
+
+                // The nearest finite point decides which surface the block is
+                float nearest = std::numeric_limits< float >::infinity();
+                for( int k = 0; k < 4; k++ )
+                    if( in.finite( block[k] ) )
+                        nearest = std::min( nearest, fabsf( z[block[k]] ) );
+
+                float sx = 0, sy = 0, sz = 0;
+                int sr = 0, sg = 0, sb = 0, n = 0;
+                for( int k = 0; k < 4; k++ ) {
+                    int i = block[k];
+                    // Holes are NaN and fail this
+                    if( !( fabsf( z[i] ) - nearest < maxJump ) || !in.finite( i ) )
+                        continue;
+                    sx += x[i];
+                    sy += y[i];
+                    sz += z[i];
+                    if( color ) {
+                        sr += r[i];
+                        sg += g[i];
+                        sb += b[i];
+                    }
+                    n++;
+                }
+
+                if( ovalid )
+                    ovalid[o] = n > 0;
+                if( !n ) {
+                    ox[o] = oy[o] = oz[o] = nan;
+                    continue;
+                }
+                ox[o] = sx/n;
+                oy[o] = sy/n;
+                oz[o] = sz/n;
+                if( color ) {
+                    or_[o] = (uint8_t)( ( sr + n/2 )/n );
+                    og[o] = (uint8_t)( ( sg + n/2 )/n );
+                    ob[o] = (uint8_t)( ( sb + n/2 )/n );
+                }
+            }
+        }
+    } );
+}
+
+Intrinsics halveIntrinsics( const Intrinsics& k ) {
+    // Pixel c' covers c = 2c' and 2c' + 1, so it sits at c = 2c' + 0.5
+    Intrinsics half = k;
+    half.fx = 0.5f*k.fx;
+    half.fy = 0.5f*k.fy;
+    half.cx = 0.5f*( k.cx - 0.5f );
+    half.cy = 0.5f*( k.cy - 0.5f );
+    return half;
+}
+
+CloudPyramid::CloudPyramid( const NormalParams& params, ThreadPool* pool )
+    : estimator( params, pool ), used( 0 ) {
+}
+
+// Copies cloud's points into base without giving up base's buffers or
+// channels (operator= reallocates whenever the channels differ, and level
+// 0 has normals the input usually doesn't). Colour and validity cloud
+// doesn't have are zeroed, normals are left for build() to redo.
+static void copyPoints( const PointCloud& cloud, PointCloud& base ) {
+
+    base.addChannels( cloud.channels() );
+    base.resize( cloud.width(), cloud.height() );
+    int n = cloud.size();
+    memcpy( base.x(), cloud.x(), n*sizeof( float ) );
+    memcpy( base.y(), cloud.y(), n*sizeof( float ) );
+    memcpy( base.z(), cloud.z(), n*sizeof( float ) );
+    if( base.has( POINT_COLOR ) ) {
+        bool color = cloud.has( POINT_COLOR );
+        uint8_t* to[3] = { base.r(), base.g(), base.b() };
+        const uint8_t* from[3] = { cloud.r(), cloud.g(), cloud.b() };
+        for( int a = 0; a < 3; a++ ) {
+            if( color )
+                memcpy( to[a], from[a], n );
+            else
+                memset( to[a], 0, n );
+        }
+    }
+    if( base.has( POINT_VALID ) ) {
+        if( cloud.has( POINT_VALID ) )
+            memcpy( base.valid(), cloud.valid(), n );
+        else
+            memset( base.valid(), 0, n );
+    }
+}
+
+void CloudPyramid::build( const PointCloud& cloud, const Intrinsics& k, int levels, bool normals ) {
+
+    used = std::max( 1, levels );
+    if( (int)clouds.size() < used ) {
+        clouds.resize( used );
+        ks.resize( used );
+    }
+    copyPoints( cloud, clouds[0] );
+    ks[0] = k;
+    for( int l = 1; l < used; l++ ) {
+        downsampleOrganised( clouds[l - 1], clouds[l], estimator.parameters().maxJump,
+                             estimator.threadPool() );
+        ks[l] = halveIntrinsics( ks[l - 1] );
+    }
+    if( normals )
+        for( int l = 0; l < used; l++ )
+            estimator.compute( clouds[l], estimator.parameters().radius >> l );
+}
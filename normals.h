@@ -0,0 +1,116 @@
+#ifndef KINREG_NORMALS_H
+#define KINREG_NORMALS_H
+
+#include "pointCloud.h"
+#include "depthModel.h"
+// --- C++ ---
+#include <vector>
+
+class ThreadPool;
+
+/*
+ * Normals and pyramids of organised clouds (see DepthModel::unprojectFrame)
+ * straight from the image grid, no neighbour search. Everything is linear
+ * in the number of pixels and split into bands of rows across the pool,
+ * each band only touching its own rows and a few either side.
+ *
+ * Normals are unit length and face the camera. Pixels on the border, next
+ * to a hole, or across a depth jump get NaN.
+ */
+
+enum NormalMethod {
+    NORMALS_CROSS,      // cross product of the central differences, sharp but noisy
+    NORMALS_INTEGRAL    // same on the means of half windows, from integral images
+};
+
+struct NormalParams {
+    NormalParams() : method( NORMALS_CROSS ), radius( 3 ), maxJump( 0.05f ), threads( 0 ) {}
+
+    NormalMethod method;
+    int radius;         // half window in pixels, NORMALS_INTEGRAL only
+    float maxJump;      // largest depth step per pixel of distance, meters
+    int threads;        // 0 uses the shared pool
+};
+
+/*
+ * Keeps the integral images between calls, so a stream of frames doesn't
+ * allocate. NORMALS_INTEGRAL averages the points left, right, above and
+ * below each pixel over a (2 radius + 1) wide half window; the holes in
+ * there are left out of the means rather than spoiling the normal, which
+ * is what makes it hold up on raw Kinect depth.
+ */
+class NormalEstimator {
+public:
+    // pool, if given, is used instead of params.threads
+    NormalEstimator( const NormalParams& params = NormalParams(), ThreadPool* pool = 0 );
+    ~NormalEstimator();
+
+    // Adds the normal channel to cloud if it isn't there and fills it.
+    // Returns the number of valid normals.
+    int compute( PointCloud& cloud );
+    // Same with another radius, the pyramid shrinks it per level
+    int compute( PointCloud& cloud, int radius );
+
+    const NormalParams& parameters() const { return params; }
+    ThreadPool* threadPool() const { return pool; }
+
+private:
+    NormalEstimator( const NormalEstimator& );
+    NormalEstimator& operator=( const NormalEstimator& );
+
+    // Running sums of x, y, z and the count of finite points, one cache
+    // line holds all four of a pixel
+    struct Sum {
+        double x, y, z, n;
+    };
+
+    int integral( PointCloud& cloud, int radius );
+
+    NormalParams params;
+    ThreadPool* pool;
+    bool ownPool;
+    std::vector< Sum > sums;    // (width + 1) x (height + 1), row 0 and column 0 zero
+    std::vector< int > counts;  // valid normals per band
+};
+
+// The cross product method with default parameters, on pool (the shared
+// one if 0)
+int computeNormals( PointCloud& cloud, float maxJump = 0.05f, ThreadPool* pool = 0 );
+
+// Halves an organised cloud: each 2x2 block becomes the mean of its finite
+// points within maxJump of the nearest one, so edges don't blur into
+// points floating between surfaces. Colour is averaged along, normals are
+// not carried (recompute them on the smaller cloud).
+void downsampleOrganised( const PointCloud& in, PointCloud& out, float maxJump = 0.05f,
+                          ThreadPool* pool = 0 );
+
+// Intrinsics of a cloud downsampleOrganised() made from one unprojected with k
+Intrinsics halveIntrinsics( const Intrinsics& k );
+
+/*
+ * Coarse to fine copies of one organised cloud, 640x480, 320x240,
+ * 160x120 and so on, each with normals and the intrinsics that project
+ * onto it. The integral radius halves with every level (never below 1).
+ * Buffers are kept between builds.
+ */
+class CloudPyramid {
+public:
+    // pool, if given, is used instead of params.threads
+    CloudPyramid( const NormalParams& params = NormalParams(), ThreadPool* pool = 0 );
+
+    // levels counts the full resolution one. normals false skips them
+    // (normals left from an earlier build are stale then).
+    void build( const PointCloud& cloud, const Intrinsics& k, int levels = 3, bool normals = true );
+
+    int levels() const { return used; }
+    const PointCloud& level( int i ) const { return clouds[i]; }
+    const Intrinsics& intrinsics( int i ) const { return ks[i]; }
+
+private:
+    NormalEstimator estimator;
+    int used;
+    std::vector< PointCloud > clouds;
+    std::vector< Intrinsics > ks;
+};
+
+#endif
@@ -0,0 +1,305 @@
+#include "pointCloud.h"
+// --- SIMD ---
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define KINREG_SSE2 1
+#endif
+// --- C++ ---
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <new>
+
+static const size_t ALIGN = 64;
+
+static inline size_t alignUp( size_t bytes ) {
+    return ( bytes + ALIGN - 1 ) & ~( ALIGN - 1 );
+}
+
+static uint8_t* alignedAlloc( size_t bytes ) {
+    void* p = 0;
+    if( posix_memalign( &p, ALIGN, std::max( bytes, ALIGN ) ) != 0 )
+        throw std::bad_alloc();
+    return (uint8_t*)p;
+}
+
+// ---------------------------------------------------------------------------
+// PointArena
+
+PointArena::PointArena( size_t blockBytes ) : current( 0 ), blockBytes( blockBytes ) {}
+
+PointArena::~PointArena() {
+    for( int k = 0; k < (int)blocks.size(); k++ )
+        free( blocks[k].data );
+}
+
+void* PointArena::allocate( size_t bytes ) {
+
+    bytes = alignUp( bytes );
+    // Blocks past current are free after a reset(), reuse any that fit
+    for( ; current < (int)blocks.size(); current++ ) {
+        Block& b = blocks[current];
+        if( b.size - b.used >= bytes ) {
+            void* p = b.data + b.used;
+            b.used += bytes;
+            return p;
+        }
+    }
+    Block b;
+    b.size = std::max( bytes, blockBytes );
+    b.data = alignedAlloc( b.size );
+    b.used = bytes;
+    blocks.push_back( b );
+    current = (int)blocks.size() - 1;
+    return b.data;
+}
+
+void PointArena::reset() {
+    for( int k = 0; k < (int)blocks.size(); k++ )
+        blocks[k].used = 0;
+    current = 0;
+}
+
+size_t PointArena::used() const {
+    size_t total = 0;
+    for( int k = 0; k < (int)blocks.size(); k++ )
+        total += blocks[k].used;
+    return total;
+}
+
+// ---------------------------------------------------------------------------
+// PointCloud
+
+PointCloud::PointCloud( int channels, PointArena* arena )
+    : chans( channels ), n( 0 ), w( 0 ), h( 1 ), cap( 0 ), mask( 0 ), storage( 0 ), arena( arena ) {
+    for( int a = 0; a < 3; a++ ) {
+        xs[a] = ns[a] = 0;
+        cs[a] = 0;
+    }
+}
+
+PointCloud::PointCloud( const PointCloud& o )
+    : chans( o.chans ), n( 0 ), w( 0 ), h( 1 ), cap( 0 ), mask( 0 ), storage( 0 ), arena( o.arena ) {
+    for( int a = 0; a < 3; a++ ) {
+        xs[a] = ns[a] = 0;
+        cs[a] = 0;
+    }
+    *this = o;
+}
+
+PointCloud& PointCloud::operator=( const PointCloud& o ) {
+
+    if( this == &o )
+        return *this;
+    n = 0;
+    if( o.n > cap || o.chans != chans )
+        reallocate( o.n, o.chans );
+    n = o.n;
+    w = o.w;
+    h = o.h;
+    for( int a = 0; a < 3; a++ ) {
+        memcpy( xs[a], o.xs[a], n*sizeof( float ) );
+        if( has( POINT_NORMAL ) )
+            memcpy( ns[a], o.ns[a], n*sizeof( float ) );
+        if( has( POINT_COLOR ) )
+            memcpy( cs[a], o.cs[a], n );
+    }
+    if( has( POINT_VALID ) )
+        memcpy( mask, o.mask, n );
+    return *this;
+}
+
+PointCloud::~PointCloud() {
+    release();
+}
+
+void PointCloud::release() {
+    free( storage );
+    storage = 0;
+}
+
+// One block holds every array, each starting on a 64 byte boundary.
+// Existing points survive, new channels start zeroed.
+void PointCloud::reallocate( int capacity, int channels ) {
+
+    capacity = ( std::max( capacity, 16 ) + 15 ) & ~15;
+    size_t floats = alignUp( capacity*sizeof( float ) );
+    size_t bytes = alignUp( capacity );
+    size_t total = 3*floats;
+    if( channels & POINT_NORMAL )
+        total += 3*floats;
+    if( channels & POINT_COLOR )
+        total += 3*bytes;
+    if( channels & POINT_VALID )
+        total += bytes;
+
+    uint8_t* block = arena ? (uint8_t*)arena->allocate( total ) : alignedAlloc( total );
+    memset( block, 0, total );
+
+    uint8_t* p = block;
+    float* nxs[3] = { 0, 0, 0 };
+    float* nns[3] = { 0, 0, 0 };
+    uint8_t* ncs[3] = { 0, 0, 0 };
+    uint8_t* nmask = 0;
+    for( int a = 0; a < 3; a++, p += floats )
+        nxs[a] = (float*)p;
+    if( channels & POINT_NORMAL )
+        for( int a = 0; a < 3; a++, p += floats )
+            nns[a] = (float*)p;
+    if( channels & POINT_COLOR )
+        for( int a = 0; a < 3; a++, p += bytes )
+            ncs[a] = p;
+    if( channels & POINT_VALID )
+        nmask = p;
+
+    int keep = std::min( n, capacity );
+    for( int a = 0; a < 3; a++ ) {
+        if( keep && xs[a] )
+            memcpy( nxs[a], xs[a], keep*sizeof( float ) );
+        if( keep && ns[a] && nns[a] )
+            memcpy( nns[a], ns[a], keep*sizeof( float ) );
+        if( keep && cs[a] && ncs[a] )
+            memcpy( ncs[a], cs[a], keep );
+    }
+    if( keep && mask && nmask )
+        memcpy( nmask, mask, keep );
+
+    release();
+    storage = arena ? 0 : block;
+    for( int a = 0; a < 3; a++ ) {
+        xs[a] = nxs[a];
+        ns[a] = nns[a];
+        cs[a] = ncs[a];
+    }
+    mask = nmask;
+    chans = channels;
+    cap = capacity;
+}
+
+void PointCloud::addChannels( int channels ) {
+    if( ( chans | channels ) != chans )
+        reallocate( cap, chans | channels );
+}
+
+void PointCloud::reserve( int points ) {
+    if( points > cap )
+        reallocate( points, chans );
+}
+
+void PointCloud::resize( int points ) {
+    reserve( points );
+    n = points;
+    w = points;
+    h = 1;
+}
+
+void PointCloud::resize( int width, int height ) {
+    resize( width*height );
+    w = width;
+    h = height;
+}
+
+void PointCloud::push_back( const cv::Vec3f& p ) {
+    if( n == cap )
+        reallocate( 2*cap, chans );
+    setPoint( n, p );
+    if( mask )
+        mask[n] = 1;
+    n++;
+    w = n;
+    h = 1;
+}
+
+// ---------------------------------------------------------------------------
+// Reductions
+
+// Float partial sums over this many points before they go into doubles
+static const int BLOCK = 1024;
+
+int cloudCentroid( const PointCloud& cloud, cv::Vec3d& centroid ) {
+
+    const float* x = cloud.x();
+    const float* y = cloud.y();
+    const float* z = cloud.z();
+    int n = cloud.size();
+    double sum[3] = { 0, 0, 0 };
+    int count = 0;
+
+    int i = 0;
+#ifdef KINREG_SSE2
+    for( ; i + 4 <= n; ) {
+        __m128 sx = _mm_setzero_ps(), sy = _mm_setzero_ps(), sz = _mm_setzero_ps();
+        int end = std::min( n & ~3, i + BLOCK );
+        for( ; i < end; i += 4 ) {
+            __m128 vx = _mm_load_ps( x + i ), vy = _mm_load_ps( y + i ), vz = _mm_load_ps( z + i );
+            // Ordered compares are false for NaN, that's the hole test
+            __m128 ok = _mm_and_ps( _mm_and_ps( _mm_cmpord_ps( vx, vx ), _mm_cmpord_ps( vy, vy ) ),
+                                    _mm_cmpord_ps( vz, vz ) );
+            sx = _mm_add_ps( sx, _mm_and_ps( ok, vx ) );
+            sy = _mm_add_ps( sy, _mm_and_ps( ok, vy ) );
+            sz = _mm_add_ps( sz, _mm_and_ps( ok, vz ) );
+            count += __builtin_popcount( _mm_movemask_ps( ok ) );
+        }
+        float lanes[3][4];
+        _mm_storeu_ps( lanes[0], sx );
+        _mm_storeu_ps( lanes[1], sy );
+        _mm_storeu_ps( lanes[2], sz );
+        for( int a = 0; a < 3; a++ )
+            sum[a] += (double)lanes[a][0] + lanes[a][1] + lanes[a][2] + lanes[a][3];
+    }
+#endif
+    for( ; i < n; i++ )
+        if( cloud.finite( i ) ) {
+            sum[0] += x[i];
+            sum[1] += y[i];
+            sum[2] += z[i];
+            count++;
+        }
+
+    centroid = count ? cv::Vec3d( sum[0]/count, sum[1]/count, sum[2]/count ) : cv::Vec3d( 0, 0, 0 );
+    return count;
+}
+
+cv::Matx33d crossCovariance( const PointCloud& P, const PointCloud& Q,
+                             const cv::Vec3d& cP, const cv::Vec3d& cQ ) {
+
+    const float* p[3] = { P.x(), P.y(), P.z() };
+    const float* q[3] = { Q.x(), Q.y(), Q.z() };
+    int n = std::min( P.size(), Q.size() );
+    double H[9] = { 0 };
+
+    int i = 0;
+#ifdef KINREG_SSE2
+    const __m128 mp[3] = { _mm_set1_ps( (float)cP[0] ), _mm_set1_ps( (float)cP[1] ), _mm_set1_ps( (float)cP[2] ) };
+    const __m128 mq[3] = { _mm_set1_ps( (float)cQ[0] ), _mm_set1_ps( (float)cQ[1] ), _mm_set1_ps( (float)cQ[2] ) };
+    for( ; i + 4 <= n; ) {
+        __m128 acc[9];
+        for( int k = 0; k < 9; k++ )
+            acc[k] = _mm_setzero_ps();
+        int end = std::min( n & ~3, i + BLOCK );
+        for( ; i < end; i += 4 ) {
+            __m128 dp[3], dq[3];
+            for( int a = 0; a < 3; a++ ) {
+                dp[a] = _mm_sub_ps( _mm_load_ps( p[a] + i ), mp[a] );
+                dq[a] = _mm_sub_ps( _mm_load_ps( q[a] + i ), mq[a] );
+            }
+            for( int r = 0; r < 3; r++ )
+                for( int c = 0; c < 3; c++ )
+                    acc[3*r + c] = _mm_add_ps( acc[3*r + c], _mm_mul_ps( dp[r], dq[c] ) );
+        }
+        for( int k = 0; k < 9; k++ ) {
+            float lanes[4];
+            _mm_storeu_ps( lanes, acc[k] );
+            H[k] += (double)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+        }
+    }
+#endif
+    for( ; i < n; i++ ) {
+        double dp[3] = { p[0][i] - cP[0], p[1][i] - cP[1], p[2][i] - cP[2] };
+        double dq[3] = { q[0][i] - cQ[0], q[1][i] - cQ[1], q[2][i] - cQ[2] };
+        for( int r = 0; r < 3; r++ )
+            for( int c = 0; c < 3; c++ )
+                H[3*r + c] += dp[r]*dq[c];
+    }
+    return cv::Matx33d( H );
+}
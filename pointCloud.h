@@ -0,0 +1,144 @@
+#ifndef KINREG_POINT_CLOUD_H
+#define KINREG_POINT_CLOUD_H
+
+// ---- OpenCV -----
+#include <cv.h>
+// --- C++ ---
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+// Optional per-point data on top of the coordinates
+enum PointChannel {
+    POINT_XYZ = 0,      // always there
+    POINT_COLOR = 1,    // r, g, b bytes
+    POINT_NORMAL = 2,   // nx, ny, nz
+    POINT_VALID = 4     // one byte, nonzero where the point is a real reading
+};
+
+/*
+ * Bump allocator for clouds that only live for a frame or one call.
+ * allocate() hands out 64 byte aligned memory from big blocks, reset()
+ * takes it all back at once and keeps the blocks, so a steady state loop
+ * stops allocating after its first pass. Not thread safe, use one per
+ * thread.
+ */
+class PointArena {
+public:
+    explicit PointArena( size_t blockBytes = 16 << 20 );
+    ~PointArena();
+
+    void* allocate( size_t bytes );
+    // Everything allocated so far is gone, clouds using it must be too
+    void reset();
+
+    size_t used() const;
+
+private:
+    PointArena( const PointArena& );
+    PointArena& operator=( const PointArena& );
+
+    struct Block {
+        uint8_t* data;
+        size_t size, used;
+    };
+    std::vector< Block > blocks;
+    int current;
+    size_t blockBytes;
+};
+
+/*
+ * Structure of arrays point cloud: x, y and z (and every optional channel)
+ * in separate 64 byte aligned arrays padded to a multiple of 16 points, so
+ * loops over one coordinate stream through memory and vectorize without
+ * gathers.
+ *
+ * Organised clouds (resize( width, height )) keep the image layout, point
+ * i is pixel i and holes have NaN coordinates. Unorganised ones grow with
+ * push_back().
+ *
+ * Storage comes from arena if one is given (and is never freed by the
+ * cloud), otherwise from the heap. Copies allocate from the same place as
+ * the cloud they copy.
+ */
+class PointCloud {
+public:
+    explicit PointCloud( int channels = POINT_XYZ, PointArena* arena = 0 );
+    PointCloud( const PointCloud& o );
+    PointCloud& operator=( const PointCloud& o );
+    ~PointCloud();
+
+    int channels() const { return chans; }
+    bool has( int channel ) const { return ( chans & channel ) == channel; }
+    // Adds channels, zero filled, keeping the points
+    void addChannels( int channels );
+
+    int size() const { return n; }
+    bool empty() const { return n == 0; }
+    int width() const { return w; }
+    int height() const { return h; }
+    bool organised() const { return h > 1; }
+
+    void resize( int points );
+    void resize( int width, int height );
+    void reserve( int points );
+    void clear() { resize( 0 ); }
+
+    void push_back( const cv::Vec3f& p );
+    cv::Vec3f point( int i ) const { return cv::Vec3f( xs[0][i], xs[1][i], xs[2][i] ); }
+    void setPoint( int i, const cv::Vec3f& p ) { xs[0][i] = p[0]; xs[1][i] = p[1]; xs[2][i] = p[2]; }
+    // False for holes (any NaN coordinate)
+    bool finite( int i ) const { return xs[0][i] == xs[0][i] && xs[1][i] == xs[1][i] && xs[2][i] == xs[2][i]; }
+
+    float* x() { return xs[0]; }
+    float* y() { return xs[1]; }
+    float* z() { return xs[2]; }
+    const float* x() const { return xs[0]; }
+    const float* y() const { return xs[1]; }
+    const float* z() const { return xs[2]; }
+
+    // Only there if the matching channel is
+    float* nx() { return ns[0]; }
+    float* ny() { return ns[1]; }
+    float* nz() { return ns[2]; }
+    const float* nx() const { return ns[0]; }
+    const float* ny() const { return ns[1]; }
+    const float* nz() const { return ns[2]; }
+    uint8_t* r() { return cs[0]; }
+    uint8_t* g() { return cs[1]; }
+    uint8_t* b() { return cs[2]; }
+    const uint8_t* r() const { return cs[0]; }
+    const uint8_t* g() const { return cs[1]; }
+    const uint8_t* b() const { return cs[2]; }
+    uint8_t* valid() { return mask; }
+    const uint8_t* valid() const { return mask; }
+
+private:
+    void reallocate( int capacity, int channels );
+    void release();
+
+    int chans;
+    int n, w, h, cap;
+    float* xs[3];
+    float* ns[3];
+    uint8_t* cs[3];
+    uint8_t* mask;
+    uint8_t* storage;   // heap block, 0 when the arena owns it
+    PointArena* arena;
+};
+
+/*
+ * Reductions over SoA clouds. SSE2 where there is one: float partial sums
+ * over blocks of points, folded into doubles so thousands of points don't
+ * drift.
+ */
+
+// Mean of the finite points. Returns how many there were.
+int cloudCentroid( const PointCloud& cloud, cv::Vec3d& centroid );
+
+// sum (P[i] - cP)(Q[i] - cQ)^T over the pairs P[i] <-> Q[i], the clouds
+// must be the same size and hole free
+cv::Matx33d crossCovariance( const PointCloud& P, const PointCloud& Q,
+                             const cv::Vec3d& cP, const cv::Vec3d& cQ );
+
+#endif
@@ -0,0 +1,658 @@
+#include "pointIndex.h"
+#include "kinect.h"
+#include "threadPool.h"
+// --- C++ ---
+#include <math.h>
+#include <stdlib.h>
+#include <algorithm>
+
+// ---------------------------------------------------------------------------
+// NeighbourIndex
+
+// Queries per task of a batch
+static const int CHUNK = 1024;
+
+void NeighbourIndex::nearestBatch( const float* queries, int n, float maxDist2, 
+                                   int* indices, float* dist2, ThreadPool* pool ) const {
+
+    if( !pool )
+        pool = &ThreadPool::shared();
+    pool->parallelFor( ( n + CHUNK - 1 )/CHUNK, [&]( int c ) {
+        int end = std::min( n, ( c + 1 )*CHUNK );
+        for( int i = c*CHUNK; i < end; i++ )
+            indices[i] = nearest( queries + 3*i, maxDist2, dist2 ? dist2 + i : 0 );
+    } );
+}
+
+// radius() of every query on pool, for the indices that have one. Each
+// chunk collects its hits on its own, then they're copied into place
+// behind each other.
+template< typename Index >
+static void radiusBatchOf( const Index& index, const float* queries, int n, float radius2,
+                           std::vector< int >& offsets, std::vector< int >& indices,
+                           ThreadPool* pool ) {
+
+    if( !pool )
+        pool = &ThreadPool::shared();
+    int chunks = ( n + CHUNK - 1 )/CHUNK;
+    std::vector< std::vector< int > > hits( chunks );
+    offsets.resize( n + 1 );
+    pool->parallelFor( chunks, [&]( int c ) {
+        std::vector< int > found;
+        int end = std::min( n, ( c + 1 )*CHUNK );
+        for( int i = c*CHUNK; i < end; i++ ) {
+            index.radius( queries + 3*i, radius2, found );
+            offsets[i + 1] = (int)found.size();
+            hits[c].insert( hits[c].end(), found.begin(), found.end() );
+        }
+    } );
+
+    std::vector< int > start( chunks + 1, 0 );
+    offsets[0] = 0;
+    for( int c = 0; c < chunks; c++ ) {
+        start[c + 1] = start[c] + (int)hits[c].size();
+        int end = std::min( n, ( c + 1 )*CHUNK );
+        for( int i = c*CHUNK; i < end; i++ )
+            offsets[i + 1] += offsets[i];
+    }
+    indices.resize( start[chunks] );
+    pool->parallelFor( chunks, [&]( int c ) {
+        std::copy( hits[c].begin(), hits[c].end(), indices.begin() + start[c] );
+    } );
+}
+
+// ---------------------------------------------------------------------------
+// PointIndex
+
+// Points per leaf, on average. Small enough to keep the scan cheap, big
+// enough that the tree stays shallow.
+static const int LEAF_SIZE = 16;
+
+// Deep enough for 2^30 leaves
+static const int STACK_SIZE = 64;
+
+static inline bool isValid( const float* p ) {
+    return p[0] == p[0] && p[1] == p[1] && p[2] == p[2];
+}
+
+// nth_element along one axis. A fixed axis per comparator lets the compiler
+// inline a constant offset, about 10% off the build.
+template< int AXIS, typename P >
+static void partitionAxis( P* pts, int begin, int mid, int end ) {
+    std::nth_element( pts + begin, pts + mid, pts + end,
+                      []( const P& x, const P& y ) { return x.v[AXIS] < y.v[AXIS]; } );
+}
+
+template< typename P >
+static void partitionAt( P* pts, int begin, int mid, int end, int axis ) {
+    switch( axis ) {
+    case 0: partitionAxis< 0 >( pts, begin, mid, end ); break;
+    case 1: partitionAxis< 1 >( pts, begin, mid, end ); break;
+    default: partitionAxis< 2 >( pts, begin, mid, end ); break;
+    }
+}
+
+// Splits [begin, end) around the median of a sample, one pass instead of
+// nth_element's two or three. Nodes come out a little uneven, which the
+// leaf offsets don't mind. Returns the first point of the right half,
+// every point left of it is below split and none right of it is.
+static const int SAMPLE = 7;
+
+template< int AXIS, typename P >
+static int splitAxis( P* pts, int begin, int end, float& split ) {
+    float sample[SAMPLE];
+    int step = ( end - begin )/SAMPLE;
+    for( int k = 0; k < SAMPLE; k++ )
+        sample[k] = pts[begin + k*step + step/2].v[AXIS];
+    std::nth_element( sample, sample + SAMPLE/2, sample + SAMPLE );
+    split = sample[SAMPLE/2];
+    const float s = split;
+    return (int)( std::partition( pts + begin, pts + end, 
+                                  [s]( const P& p ) { return p.v[AXIS] < s; } ) - pts );
+}
+
+template< typename P >
+static int splitAt( P* pts, int begin, int end, int axis, float& split ) {
+    int size = end - begin, mid = -1;
+    if( size >= 4*SAMPLE ) {
+        switch( axis ) {
+        case 0: mid = splitAxis< 0 >( pts, begin, end, split ); break;
+        case 1: mid = splitAxis< 1 >( pts, begin, end, split ); break;
+        default: mid = splitAxis< 2 >( pts, begin, end, split ); break;
+        }
+    }
+    // Small nodes, and a sample that missed (a lot of equal coordinates),
+    // get the exact median
+    if( mid < 0 || mid - begin < size/8 || end - mid < size/8 ) {
+        mid = begin + size/2;
+        partitionAt( pts, begin, mid, end, axis );
+        split = pts[mid].v[axis];
+    }
+    return mid;
+}
+
+PointIndex::PointIndex() : leaves( 0 ) {}
+
+void PointIndex::build( const float* xyz, int n, int stride, ThreadPool* pool ) {
+    buildFrom( xyz, xyz + 1, xyz + 2, stride, n, pool );
+}
+
+void PointIndex::build( const PointCloud& cloud, ThreadPool* pool ) {
+    buildFrom( cloud.x(), cloud.y(), cloud.z(), 1, cloud.size(), pool );
+}
+
+void PointIndex::buildFrom( const float* x, const float* y, const float* z, int stride, 
+                            int n, ThreadPool* pool ) {
+
+    pts.clear();
+    pts.reserve( n );
+    float lo[3] = { INFINITY, INFINITY, INFINITY }, hi[3] = { -INFINITY, -INFINITY, -INFINITY };
+    for( int i = 0; i < n; i++ ) {
+        size_t k = (size_t)i*stride;
+        const float p[3] = { x[k], y[k], z[k] };
+        if( !isValid( p ) )
+            continue;
+        Point q = { { p[0], p[1], p[2] }, i };
+        pts.push_back( q );
+        for( int a = 0; a < 3; a++ ) {
+            lo[a] = std::min( lo[a], p[a] );
+            hi[a] = std::max( hi[a], p[a] );
+        }
+    }
+
+    int count = (int)pts.size();
+    leaves = 1;
+    while( leaves*LEAF_SIZE < count )
+        leaves *= 2;
+    splits.resize( leaves - 1 );
+    axes.resize( leaves - 1 );
+    leafStart.resize( leaves + 1 );
+    leafStart[leaves] = count;
+    if( !count ) {
+        leafStart[0] = 0;
+        return;
+    }
+
+    // Split the top levels one level at a time, every node of a level in
+    // parallel, until there are enough subtrees to keep the pool busy. Then
+    // each subtree is finished off depth first by one thread.
+    if( !pool )
+        pool = &ThreadPool::shared();
+    struct Task {
+        int node, begin, end;
+        float lo[3], hi[3];
+    };
+    Task root = { 0, 0, count, { lo[0], lo[1], lo[2] }, { hi[0], hi[1], hi[2] } };
+    std::vector< Task > level( 1, root ), next;
+
+    int wanted = 4*( pool->size() + 1 );
+    while( (int)level.size() < wanted && level[0].node < leaves - 1 ) {
+        next.resize( 2*level.size() );
+        pool->parallelFor( (int)level.size(), [&]( int k ) {
+            const Task& t = level[k];
+            int axis = 0;
+            for( int a = 1; a < 3; a++ )
+                if( t.hi[a] - t.lo[a] > t.hi[axis] - t.lo[axis] )
+                    axis = a;
+            int mid = splitAt( &pts[0], t.begin, t.end, axis, splits[t.node] );
+            axes[t.node] = (uint8_t)axis;
+
+            Task& l = next[2*k];
+            Task& r = next[2*k + 1];
+            l = t;
+            r = t;
+            l.node = 2*t.node + 1;
+            r.node = 2*t.node + 2;
+            l.end = r.begin = mid;
+            l.hi[axis] = r.lo[axis] = splits[t.node];
+        } );
+        level.swap( next );
+    }
+
+    pool->parallelFor( (int)level.size(), [&]( int k ) {
+        const Task& t = level[k];
+        buildNode( t.node, t.begin, t.end, t.lo, t.hi );
+    } );
+}
+
+void PointIndex::buildNode( int node, int begin, int end, const float lo[3], const float hi[3] ) {
+
+    if( node >= leaves - 1 ) {
+        leafStart[node - ( leaves - 1 )] = begin;
+        return;
+    }
+
+    // Median of the widest side of the node's cell. The cell is only an
+    // upper bound on the points' extent, but it's free and good enough.
+    int axis = 0;
+    for( int a = 1; a < 3; a++ )
+        if( hi[a] - lo[a] > hi[axis] - lo[axis] )
+            axis = a;
+
+    float split;
+    int mid = splitAt( &pts[0], begin, end, axis, split );
+    splits[node] = split;
+    axes[node] = (uint8_t)axis;
+
+    float leftHi[3] = { hi[0], hi[1], hi[2] };
+    float rightLo[3] = { lo[0], lo[1], lo[2] };
+    leftHi[axis] = split;
+    rightLo[axis] = split;
+    buildNode( 2*node + 1, begin, mid, lo, leftHi );
+    buildNode( 2*node + 2, mid, end, rightLo, hi );
+}
+
+int PointIndex::nearest( const float q[3], float maxDist2, float* dist2 ) const {
+
+    int best = -1;
+    float bestD2 = maxDist2;
+
+    // (node, squared distance from q to its side of the split)
+    int stack[STACK_SIZE];
+    float bound[STACK_SIZE];
+    int top = 0;
+    if( !pts.empty() ) {
+        stack[top] = 0;
+        bound[top++] = 0;
+    }
+
+    while( top ) {
+        top--;
+        if( bound[top] >= bestD2 )
+            continue;
+        int n = stack[top];
+
+        if( n >= leaves - 1 ) {
+            int leaf = n - ( leaves - 1 );
+            for( int k = leafStart[leaf]; k < leafStart[leaf + 1]; k++ ) {
+                const float* p = pts[k].v;
+                float dx = p[0] - q[0], dy = p[1] - q[1], dz = p[2] - q[2];
+                float d2 = dx*dx + dy*dy + dz*dz;
+                if( d2 < bestD2 ) {
+                    bestD2 = d2;
+                    best = k;
+                }
+            }
+            continue;
+        }
+
+        // Far side goes on the stack first so the near side is popped first
+        float diff = q[axes[n]] - splits[n];
+        stack[top] = diff < 0 ? 2*n + 2 : 2*n + 1;
+        bound[top++] = diff*diff;
+        stack[top] = diff < 0 ? 2*n + 1 : 2*n + 2;
+        bound[top++] = 0;
+    }
+
+    if( best < 0 )
+        return -1;
+    if( dist2 )
+        *dist2 = bestD2;
+    return pts[best].id;
+}
+
+int PointIndex::knn( const float q[3], int k, float maxDist2, int* indices, float* dist2 ) const {
+
+    if( k <= 0 )
+        return 0;
+
+    // indices/dist2 hold the best so far, sorted, in pts positions until
+    // the end. Once full, the k-th distance is the search radius.
+    int found = 0;
+    float limit = maxDist2;
+
+    int stack[STACK_SIZE];
+    float bound[STACK_SIZE];
+    int top = 0;
+    if( !pts.empty() ) {
+        stack[top] = 0;
+        bound[top++] = 0;
+    }
+
+    while( top ) {
+        top--;
+        if( bound[top] >= limit )
+            continue;
+        int n = stack[top];
+
+        if( n >= leaves - 1 ) {
+            int leaf = n - ( leaves - 1 );
+            for( int j = leafStart[leaf]; j < leafStart[leaf + 1]; j++ ) {
+                const float* p = pts[j].v;
+                float dx = p[0] - q[0], dy = p[1] - q[1], dz = p[2] - q[2];
+                float d2 = dx*dx + dy*dy + dz*dz;
+                if( d2 >= limit )
+                    continue;
+                int slot = found < k ? found++ : k - 1;
+                while( slot > 0 && dist2[slot - 1] > d2 ) {
+                    dist2[slot] = dist2[slot - 1];
+                    indices[slot] = indices[slot - 1];
+                    slot--;
+                }
+                dist2[slot] = d2;
+                indices[slot] = j;
+                if( found == k )
+                    limit = dist2[k - 1];
+            }
+            continue;
+        }
+
+        float diff = q[axes[n]] - splits[n];
+        stack[top] = diff < 0 ? 2*n + 2 : 2*n + 1;
+        bound[top++] = diff*diff;
+        stack[top] = diff < 0 ? 2*n + 1 : 2*n + 2;
+        bound[top++] = 0;
+    }
+
+    for( int j = 0; j < found; j++ )
+        indices[j] = pts[indices[j]].id;
+    return found;
+}
+
+void PointIndex::radius( const float q[3], float radius2, std::vector< int >& indices ) const {
+
+    indices.clear();
+
+    int stack[STACK_SIZE];
+    float bound[STACK_SIZE];
+    int top = 0;
+    if( !pts.empty() ) {
+        stack[top] = 0;
+        bound[top++] = 0;
+    }
+
+    while( top ) {
+        top--;
+        if( bound[top] > radius2 )
+            continue;
+        int n = stack[top];
+
+        if( n >= leaves - 1 ) {
+            int leaf = n - ( leaves - 1 );
+            for( int j = leafStart[leaf]; j < leafStart[leaf + 1]; j++ ) {
+                const float* p = pts[j].v;
+                float dx = p[0] - q[0], dy = p[1] - q[1], dz = p[2] - q[2];
+                if( dx*dx + dy*dy + dz*dz <= radius2 )
+                    indices.push_back( pts[j].id );
+            }
+            continue;
+        }
+
+        float diff = q[axes[n]] - splits[n];
+        stack[top] = diff < 0 ? 2*n + 2 : 2*n + 1;
+        bound[top++] = diff*diff;
+        stack[top] = diff < 0 ? 2*n + 1 : 2*n + 2;
+        bound[top++] = 0;
+    }
+}
+
+void PointIndex::knnBatch( const float* queries, int n, int k, float maxDist2, int* indices, 
+                           float* dist2, int* counts, ThreadPool* pool ) const {
+
+    if( !pool )
+        pool = &ThreadPool::shared();
+    pool->parallelFor( ( n + CHUNK - 1 )/CHUNK, [&]( int c ) {
+        int end = std::min( n, ( c + 1 )*CHUNK );
+        for( int i = c*CHUNK; i < end; i++ )
+            counts[i] = knn( queries + 3*i, k, maxDist2, indices + (size_t)i*k, dist2 + (size_t)i*k );
+    } );
+}
+
+void PointIndex::radiusBatch( const float* queries, int n, float radius2, std::vector< int >& offsets,
+                              std::vector< int >& indices, ThreadPool* pool ) const {
+    radiusBatchOf( *this, queries, n, radius2, offsets, indices, pool );
+}
+
+// ---------------------------------------------------------------------------
+// VoxelHashIndex
+
+// Cell coordinates are packed 21 bits per axis, which covers +-1M cells,
+// kilometers at any sensible cell size
+static const int64_t CELL_BIAS = 1 << 20;
+
+static inline int64_t packCell( int64_t x, int64_t y, int64_t z ) {
+    return ( ( x + CELL_BIAS ) << 42 ) | ( ( y + CELL_BIAS ) << 21 ) | ( z + CELL_BIAS );
+}
+
+static inline uint64_t hashCell( int64_t key ) {
+    uint64_t h = (uint64_t)key*0x9E3779B97F4A7C15ull;
+    return h ^ ( h >> 29 );
+}
+
+VoxelHashIndex::VoxelHashIndex( float cell ) : cell( cell ), mask( 0 ) {}
+
+int VoxelHashIndex::findCell( int64_t x, int64_t y, int64_t z ) const {
+
+    if( x < -CELL_BIAS || x >= CELL_BIAS || y < -CELL_BIAS || y >= CELL_BIAS || 
+        z < -CELL_BIAS || z >= CELL_BIAS || slotCell.empty() )
+        return -1;
+    int64_t key = packCell( x, y, z );
+    for( uint64_t s = hashCell( key ) & mask; ; s = ( s + 1 ) & mask ) {
+        int c = slotCell[s];
+        if( c < 0 || keys[c] == key )
+            return c;
+    }
+}
+
+void VoxelHashIndex::build( const float* xyz, int n, int stride ) {
+    buildFrom( xyz, xyz + 1, xyz + 2, stride, n );
+}
+
+void VoxelHashIndex::build( const PointCloud& cloud ) {
+    buildFrom( cloud.x(), cloud.y(), cloud.z(), 1, cloud.size() );
+}
+
+void VoxelHashIndex::buildFrom( const float* x, const float* y, const float* z, int stride, int n ) {
+
+    float inv = 1/cell;
+    keys.clear();
+    cellStart.clear();
+    pts.clear();
+    mask = 1023;
+    slotCell.assign( mask + 1, -1 );
+
+    // First pass: find every point's cell, numbering cells as they turn up
+    // and counting their points. The table is kept at most half full.
+    std::vector< int > cellOf( n, -1 );
+    std::vector< int > counts;
+    int valid = 0;
+    for( int i = 0; i < n; i++ ) {
+        size_t k = (size_t)i*stride;
+        const float p[3] = { x[k], y[k], z[k] };
+        if( !isValid( p ) )
+            continue;
+        int64_t c[3];
+        bool inRange = true;
+        for( int a = 0; a < 3; a++ ) {
+            c[a] = (int64_t)floorf( p[a]*inv );
+            inRange &= c[a] >= -CELL_BIAS && c[a] < CELL_BIAS;
+        }
+        if( !inRange )
+            continue;
+        int64_t key = packCell( c[0], c[1], c[2] );
+
+        uint64_t s = hashCell( key ) & mask;
+        while( slotCell[s] >= 0 && keys[slotCell[s]] != key )
+            s = ( s + 1 ) & mask;
+        int cellIdx = slotCell[s];
+        if( cellIdx < 0 ) {
+            cellIdx = (int)keys.size();
+            slotCell[s] = cellIdx;
+            keys.push_back( key );
+            counts.push_back( 0 );
+            if( 2*keys.size() > mask ) {
+                mask = 2*mask + 1;
+                slotCell.assign( mask + 1, -1 );
+                for( int k = 0; k < (int)keys.size(); k++ ) {
+                    uint64_t t = hashCell( keys[k] ) & mask;
+                    while( slotCell[t] >= 0 )
+                        t = ( t + 1 ) & mask;
+                    slotCell[t] = k;
+                }
+            }
+        }
+        cellOf[i] = cellIdx;
+        counts[cellIdx]++;
+        valid++;
+    }
+
+    // Second pass: counting sort of the points by cell
+    int cells = (int)keys.size();
+    cellStart.resize( cells + 1 );
+    cellStart[0] = 0;
+    for( int c = 0; c < cells; c++ )
+        cellStart[c + 1] = cellStart[c] + counts[c];
+    std::vector< int > fill( cellStart.begin(), cellStart.end() - 1 );
+    pts.resize( valid );
+    for( int i = 0; i < n; i++ ) {
+        if( cellOf[i] < 0 )
+            continue;
+        size_t k = (size_t)i*stride;
+        Point q = { { x[k], y[k], z[k] }, i };
+        pts[fill[cellOf[i]]++] = q;
+    }
+}
+
+int VoxelHashIndex::nearest( const float q[3], float maxDist2, float* dist2 ) const {
+
+    if( pts.empty() )
+        return -1;
+
+    // Cells the search sphere touches, relative to the query's own cell
+    float r = sqrtf( maxDist2 ), inv = 1/cell;
+    int64_t c[3];
+    int lo[3], hi[3];
+    for( int a = 0; a < 3; a++ ) {
+        c[a] = (int64_t)floorf( q[a]*inv );
+        lo[a] = (int)( (int64_t)floorf( ( q[a] - r )*inv ) - c[a] );
+        hi[a] = (int)( (int64_t)floorf( ( q[a] + r )*inv ) - c[a] );
+    }
+    int shells = std::max( std::max( std::max( -lo[0], hi[0] ), std::max( -lo[1], hi[1] ) ), 
+                           std::max( -lo[2], hi[2] ) );
+
+    // Visit them in shells outwards from the query's cell. After shell k
+    // anything left is at least k cells away, so stop as soon as the best
+    // match is closer than that.
+    int best = -1;
+    float bestD2 = maxDist2;
+    for( int k = 0; k <= shells; k++ ) {
+        for( int dx = std::max( -k, lo[0] ); dx <= std::min( k, hi[0] ); dx++ )
+            for( int dy = std::max( -k, lo[1] ); dy <= std::min( k, hi[1] ); dy++ )
+                for( int dz = std::max( -k, lo[2] ); dz <= std::min( k, hi[2] ); dz++ ) {
+                    if( std::max( std::max( abs( dx ), abs( dy ) ), abs( dz ) ) != k )
+                        continue;
+                    int cellIdx = findCell( c[0] + dx, c[1] + dy, c[2] + dz );
+                    if( cellIdx < 0 )
+                        continue;
+                    for( int j = cellStart[cellIdx]; j < cellStart[cellIdx + 1]; j++ ) {
+                        const float* p = pts[j].v;
+                        float ex = p[0] - q[0], ey = p[1] - q[1], ez = p[2] - q[2];
+                        float d2 = ex*ex + ey*ey + ez*ez;
+                        if( d2 < bestD2 ) {
+                            bestD2 = d2;
+                            best = j;
+                        }
+                    }
+                }
+        float reach = k*cell;
+        if( best >= 0 && bestD2 <= reach*reach )
+            break;
+    }
+
+    if( best < 0 )
+        return -1;
+    if( dist2 )
+        *dist2 = bestD2;
+    return pts[best].id;
+}
+
+void VoxelHashIndex::radius( const float q[3], float radius2, std::vector< int >& indices ) const {
+
+    indices.clear();
+    if( pts.empty() )
+        return;
+
+    float r = sqrtf( radius2 ), inv = 1/cell;
+    int64_t lo[3], hi[3];
+    for( int a = 0; a < 3; a++ ) {
+        lo[a] = (int64_t)floorf( ( q[a] - r )*inv );
+        hi[a] = (int64_t)floorf( ( q[a] + r )*inv );
+    }
+
+    for( int64_t x = lo[0]; x <= hi[0]; x++ )
+        for( int64_t y = lo[1]; y <= hi[1]; y++ )
+            for( int64_t z = lo[2]; z <= hi[2]; z++ ) {
+                int c = findCell( x, y, z );
+                if( c < 0 )
+                    continue;
+                for( int k = cellStart[c]; k < cellStart[c + 1]; k++ ) {
+                    const float* p = pts[k].v;
+                    float dx = p[0] - q[0], dy = p[1] - q[1], dz = p[2] - q[2];
+                    if( dx*dx + dy*dy + dz*dz <= radius2 )
+                        indices.push_back( pts[k].id );
+                }
+            }
+}
+
+void VoxelHashIndex::radiusBatch( const float* queries, int n, float radius2, 
+                                  std::vector< int >& offsets, std::vector< int >& indices,
+                                  ThreadPool* pool ) const {
+    radiusBatchOf( *this, queries, n, radius2, offsets, indices, pool );
+}
+
+// ---------------------------------------------------------------------------
+// ProjectiveIndex
+
+ProjectiveIndex::ProjectiveIndex( int window ) : window( window ), stride( 0 ) {
+    xs[0] = xs[1] = xs[2] = 0;
+}
+
+void ProjectiveIndex::build( const float* xyz, const Intrinsics& intrinsics ) {
+    xs[0] = xyz;
+    xs[1] = xyz + 1;
+    xs[2] = xyz + 2;
+    stride = 3;
+    k = intrinsics;
+}
+
+void ProjectiveIndex::build( const PointCloud& cloud, const Intrinsics& intrinsics ) {
+    xs[0] = cloud.x();
+    xs[1] = cloud.y();
+    xs[2] = cloud.z();
+    stride = 1;
+    k = intrinsics;
+}
+
+int ProjectiveIndex::nearest( const float q[3], float maxDist2, float* dist2 ) const {
+
+    // Inverse of DepthModel's rays, the camera looks down -z
+    float z = -q[2];
+    if( !xs[0] || !( z > 0 ) )
+        return -1;
+    int col = (int)floorf( k.fx*q[0]/z + k.cx + 0.5f );
+    int row = (int)floorf( k.cy - k.fy*q[1]/z + 0.5f );
+    if( col < -window || col >= KINECT_WIDTH + window || row < -window || row >= KINECT_HEIGHT + window )
+        return -1;
+
+    int c0 = std::max( 0, col - window ), c1 = std::min( KINECT_WIDTH - 1, col + window );
+    int r0 = std::max( 0, row - window ), r1 = std::min( KINECT_HEIGHT - 1, row + window );
+
+    int best = -1;
+    float bestD2 = maxDist2;
+    for( int r = r0; r <= r1; r++ )
+        for( int c = c0; c <= c1; c++ ) {
+            int i = r*KINECT_WIDTH + c;
+            size_t j = (size_t)i*stride;
+            float dx = xs[0][j] - q[0], dy = xs[1][j] - q[1], dz = xs[2][j] - q[2];
+            float d2 = dx*dx + dy*dy + dz*dz;
+            // NaN holes fail the comparison
+            if( d2 < bestD2 ) {
+                bestD2 = d2;
+                best = i;
+            }
+        }
+
+    if( best >= 0 && dist2 )
+        *dist2 = bestD2;
+    return best;
+}
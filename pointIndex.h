@@ -0,0 +1,157 @@
+#ifndef KINREG_POINT_INDEX_H
+#define KINREG_POINT_INDEX_H
+
+#include "depthModel.h"
+#include "pointCloud.h"
+// --- C++ ---
+#include <stdint.h>
+#include <vector>
+
+class ThreadPool;
+
+/*
+ * Nearest neighbour search over Kinect clouds. Three flavours share this
+ * interface:
+ *
+ *  PointIndex      - exact k-d tree, any cloud
+ *  VoxelHashIndex  - exact too, a hashed grid of cells. Much cheaper to
+ *                    rebuild, queries are slower on sparse clouds
+ *  ProjectiveIndex - no structure at all, projects the query into an
+ *                    organised cloud's image and searches a small window.
+ *                    Approximate, but O(1) and nothing to build.
+ *
+ * Points with a NaN coordinate (holes in an organised cloud) are never
+ * returned. Results are indices into the cloud passed to build(). Queries
+ * are const and safe to run from many threads at once.
+ */
+class NeighbourIndex {
+public:
+    virtual ~NeighbourIndex() {}
+
+    // Index of the closest point within sqrt(maxDist2) of q, or -1. The
+    // squared distance goes to dist2 if given.
+    virtual int nearest( const float q[3], float maxDist2, float* dist2 = 0 ) const = 0;
+
+    // nearest() for n packed xyz queries, split across pool (the shared
+    // one if 0). dist2 may be 0.
+    void nearestBatch( const float* queries, int n, float maxDist2, 
+                       int* indices, float* dist2, ThreadPool* pool = 0 ) const;
+};
+
+/*
+ * Static k-d tree. It's implicit and close to balanced: node i has
+ * children 2i+1 and 2i+2, and every leaf is a contiguous run of points
+ * stored in leaf order, so queries walk memory mostly forwards. Nodes are
+ * split at the median of a small sample in one partitioning pass. The
+ * top of the tree is split level by level in parallel, then the subtrees
+ * are built in parallel. Batches of queries are spread over the pool too.
+ */
+class PointIndex : public NeighbourIndex {
+public:
+    PointIndex();
+
+    // xyz holds n points, stride floats apart (3 for packed xyz)
+    void build( const float* xyz, int n, int stride = 3, ThreadPool* pool = 0 );
+    void build( const PointCloud& cloud, ThreadPool* pool = 0 );
+
+    int size() const { return (int)pts.size(); }
+
+    int nearest( const float q[3], float maxDist2, float* dist2 = 0 ) const;
+
+    // Up to k closest points within sqrt(maxDist2), closest first. Returns
+    // how many were found.
+    int knn( const float q[3], int k, float maxDist2, int* indices, float* dist2 ) const;
+
+    // Every point within sqrt(radius2) of q, in no particular order
+    void radius( const float q[3], float radius2, std::vector< int >& indices ) const;
+
+    // knn() for n packed xyz queries on pool (the shared one if 0). Query
+    // i gets k slots from i*k in indices and dist2, counts[i] of them used.
+    void knnBatch( const float* queries, int n, int k, float maxDist2, int* indices, 
+                   float* dist2, int* counts, ThreadPool* pool = 0 ) const;
+    // radius() for n packed xyz queries on pool, query i's points are
+    // indices[offsets[i]] up to indices[offsets[i + 1]]
+    void radiusBatch( const float* queries, int n, float radius2, std::vector< int >& offsets,
+                      std::vector< int >& indices, ThreadPool* pool = 0 ) const;
+
+private:
+    struct Point {
+        float v[3];
+        int id;
+    };
+
+    void buildFrom( const float* x, const float* y, const float* z, int stride, 
+                    int n, ThreadPool* pool );
+    void buildNode( int node, int begin, int end, const float lo[3], const float hi[3] );
+
+    int leaves;                     // power of two
+    std::vector< float > splits;    // leaves - 1 inner nodes
+    std::vector< uint8_t > axes;
+    std::vector< int > leafStart;   // leaves + 1 offsets into pts
+    std::vector< Point > pts;       // in leaf order
+};
+
+/*
+ * Uniform grid of cells hashed by their integer coordinates. Points are
+ * bucketed with one counting pass, so rebuilding is linear in the cloud.
+ * Queries are exact and only visit cells the search sphere touches,
+ * nearest() working outwards from the query's cell so it can stop early.
+ * A cell about the size of the search radius is usually best.
+ */
+class VoxelHashIndex : public NeighbourIndex {
+public:
+    VoxelHashIndex( float cell = 0.05f );
+
+    void build( const float* xyz, int n, int stride = 3 );
+    void build( const PointCloud& cloud );
+
+    int size() const { return (int)pts.size(); }
+    float cellSize() const { return cell; }
+
+    int nearest( const float q[3], float maxDist2, float* dist2 = 0 ) const;
+    void radius( const float q[3], float radius2, std::vector< int >& indices ) const;
+    // As PointIndex::radiusBatch()
+    void radiusBatch( const float* queries, int n, float radius2, std::vector< int >& offsets,
+                      std::vector< int >& indices, ThreadPool* pool = 0 ) const;
+
+private:
+    struct Point {
+        float v[3];
+        int id;
+    };
+
+    void buildFrom( const float* x, const float* y, const float* z, int stride, int n );
+    int findCell( int64_t x, int64_t y, int64_t z ) const;
+
+    float cell;
+    uint64_t mask;                  // table size - 1
+    std::vector< int64_t > keys;    // packed cell coordinate per slot
+    std::vector< int > slotCell;    // cell number per slot, -1 if empty
+    std::vector< int > cellStart;   // cells + 1 offsets into pts
+    std::vector< Point > pts;       // grouped by cell
+};
+
+/*
+ * Lookup through the image grid of an organised KINECT_PIXELS cloud, in
+ * the camera space the cloud was unprojected in. The query is projected
+ * with the camera's intrinsics and the closest valid point in a
+ * (2*window+1)^2 pixel neighbourhood wins.
+ */
+class ProjectiveIndex : public NeighbourIndex {
+public:
+    ProjectiveIndex( int window = 2 );
+
+    // Keeps a pointer to the cloud, it has to outlive the index
+    void build( const float* xyz, const Intrinsics& k );
+    void build( const PointCloud& cloud, const Intrinsics& k );
+
+    int nearest( const float q[3], float maxDist2, float* dist2 = 0 ) const;
+
+private:
+    int window;
+    const float* xs[3];     // x, y and z of pixel i at xs[a][i*stride]
+    int stride;
+    Intrinsics k;
+};
+
+#endif
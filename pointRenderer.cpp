@@ -0,0 +1,273 @@
+// Buffer objects, sync and shaders are all past GL 1.1, use the prototypes
+// Mesa's libGL exports instead of pulling in an extension loader
+#define GL_GLEXT_PROTOTYPES
+#include "pointRenderer.h"
+#include "log.h"
+#include "profiler.h"
+// --- C++ ---
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+// Vertex shader for drawDepth(). Same math as DepthModel, on the GPU.
+static const char* depthVertexShader =
+    "#version 130\n"
+    "uniform usampler2D depth;\n"
+    "uniform vec4 intrinsics;   // fx fy cx cy\n"
+    "uniform vec2 disparity;    // a b\n"
+    "out vec3 shade;\n"
+    "void main() {\n"
+    "    ivec2 px = ivec2( gl_Vertex.xy );\n"
+    "    float d = float( texelFetch( depth, px, 0 ).r );\n"
+    "    float w = disparity.x*d + disparity.y;\n"
+    "    if( d >= 2047.0 || w <= 0.0 ) {\n"
+    "        gl_Position = vec4( 0.0, 0.0, 2.0, 1.0 ); // clipped\n"
+    "        shade = vec3( 0.0 );\n"
+    "        return;\n"
+    "    }\n"
+    "    float z = 1.0/w;\n"
+    "    vec4 p = vec4( ( px.x - intrinsics.z )/intrinsics.x*z,\n"
+    "                   ( intrinsics.w - px.y )/intrinsics.y*z, -z, 1.0 );\n"
+    "    gl_Position = gl_ModelViewProjectionMatrix*p;\n"
+    "    shade = vec3( clamp( 1.5 - z/3.0, 0.2, 1.0 ) );\n"
+    "}\n";
+
+static const char* depthFragmentShader =
+    "#version 130\n"
+    "in vec3 shade;\n"
+    "void main() {\n"
+    "    gl_FragColor = vec4( shade, 1.0 );\n"
+    "}\n";
+
+// Rounds up to a multiple of 64 so the color part of a section is aligned
+static size_t align64( size_t n ) {
+    return ( n + 63 ) & ~(size_t)63;
+}
+
+static bool hasExtension( const char* name ) {
+    const char* ext = (const char*)glGetString( GL_EXTENSIONS );
+    return ext && strstr( ext, name );
+}
+
+static int glVersion() {
+    const char* v = (const char*)glGetString( GL_VERSION );
+    int major = 0, minor = 0;
+    if( v )
+        sscanf( v, "%d.%d", &major, &minor );
+    return 10*major + minor;
+}
+
+PointRenderer::PointRenderer() 
+    : mapped( 0 ), next( 0 ), program( 0 ), depthTex( 0 ), grid( 0 ) {
+
+    sectionBytes = align64( KINECT_PIXELS*3*sizeof( short ) ) + align64( KINECT_PIXELS*3 );
+    memset( ring, 0, sizeof( ring ) );
+    memset( fences, 0, sizeof( fences ) );
+
+    int version = glVersion();
+    if( version >= 44 || hasExtension( "GL_ARB_buffer_storage" ) )
+        mode = PERSISTENT;
+    else if( version >= 15 )
+        mode = ORPHAN;
+    else
+        mode = CLIENT;
+
+    if( mode == PERSISTENT ) {
+        GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        glGenBuffers( 1, ring );
+        glBindBuffer( GL_ARRAY_BUFFER, ring[0] );
+        glBufferStorage( GL_ARRAY_BUFFER, SECTIONS*sectionBytes, 0, flags );
+        mapped = (uint8_t*)glMapBufferRange( GL_ARRAY_BUFFER, 0, SECTIONS*sectionBytes, flags );
+        if( !mapped ) {
+            glDeleteBuffers( 1, ring );
+            ring[0] = 0;
+            mode = ORPHAN;
+        }
+    }
+    if( mode == ORPHAN ) {
+        glGenBuffers( SECTIONS, ring );
+        for( int s = 0; s < SECTIONS; s++ ) {
+            glBindBuffer( GL_ARRAY_BUFFER, ring[s] );
+            glBufferData( GL_ARRAY_BUFFER, sectionBytes, 0, GL_STREAM_DRAW );
+        }
+    }
+    if( mode != CLIENT )
+        glBindBuffer( GL_ARRAY_BUFFER, 0 );
+
+    if( version >= 30 )
+        initDepthPath();
+}
+
+PointRenderer::~PointRenderer() {
+    for( int s = 0; s < SECTIONS; s++ )
+        if( fences[s] )
+            glDeleteSync( fences[s] );
+    if( mapped ) {
+        glBindBuffer( GL_ARRAY_BUFFER, ring[0] );
+        glUnmapBuffer( GL_ARRAY_BUFFER );
+        glBindBuffer( GL_ARRAY_BUFFER, 0 );
+    }
+    if( mode != CLIENT )
+        glDeleteBuffers( mode == PERSISTENT ? 1 : SECTIONS, ring );
+    if( program ) {
+        glDeleteProgram( program );
+        glDeleteTextures( 1, &depthTex );
+        glDeleteBuffers( 1, &grid );
+    }
+}
+
+const char* PointRenderer::streamingMode() const {
+    switch( mode ) {
+        case PERSISTENT: return "persistent";
+        case ORPHAN:     return "orphan";
+        default:         return "client";
+    }
+}
+
+void PointRenderer::drawPacked( const short* xyz, const uint8_t* colors, int count ) {
+
+    if( count <= 0 )
+        return;
+
+    size_t xyzBytes = count*3*sizeof( short );
+    size_t colorOffset = align64( xyzBytes );
+
+    glEnableClientState( GL_VERTEX_ARRAY );
+    glEnableClientState( GL_COLOR_ARRAY );
+
+    if( mode == CLIENT ) {
+        glVertexPointer( 3, GL_SHORT, 0, xyz );
+        glColorPointer( 3, GL_UNSIGNED_BYTE, 0, colors );
+        glDrawArrays( GL_POINTS, 0, count );
+        return;
+    }
+
+    int s = next;
+    next = ( next + 1 ) % SECTIONS;
+    size_t base = 0;
+
+    PROFILE_SCOPE( "upload" );
+    if( mode == PERSISTENT ) {
+        // Only blocks if the GPU is a whole ring behind us
+        if( fences[s] ) {
+            PROFILE_SCOPE( "fence_wait" );
+            glClientWaitSync( fences[s], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000ull );
+            glDeleteSync( fences[s] );
+            fences[s] = 0;
+        }
+        base = s*sectionBytes;
+        memcpy( mapped + base, xyz, xyzBytes );
+        memcpy( mapped + base + colorOffset, colors, count*3 );
+        glBindBuffer( GL_ARRAY_BUFFER, ring[0] );
+    }
+    else {
+        // Orphan the old storage so the driver never has to wait for the
+        // previous draw from this section
+        glBindBuffer( GL_ARRAY_BUFFER, ring[s] );
+        glBufferData( GL_ARRAY_BUFFER, sectionBytes, 0, GL_STREAM_DRAW );
+        glBufferSubData( GL_ARRAY_BUFFER, 0, xyzBytes, xyz );
+        glBufferSubData( GL_ARRAY_BUFFER, colorOffset, count*3, colors );
+    }
+
+    glVertexPointer( 3, GL_SHORT, 0, (const GLvoid*)base );
+    glColorPointer( 3, GL_UNSIGNED_BYTE, 0, (const GLvoid*)( base + colorOffset ) );
+    glDrawArrays( GL_POINTS, 0, count );
+    glBindBuffer( GL_ARRAY_BUFFER, 0 );
+
+    if( mode == PERSISTENT )
+        fences[s] = glFenceSync( GL_SYNC_GPU_COMMANDS_COMPLETE, 0 );
+}
+
+static GLuint compileShader( GLenum type, const char* src ) {
+    GLuint shader = glCreateShader( type );
+    glShaderSource( shader, 1, &src, 0 );
+    glCompileShader( shader );
+    GLint ok = 0;
+    glGetShaderiv( shader, GL_COMPILE_STATUS, &ok );
+    if( !ok ) {
+        char log[1024];
+        glGetShaderInfoLog( shader, sizeof( log ), 0, log );
+        LOG_ERROR( "shader didn't compile:\n%s", log );
+        glDeleteShader( shader );
+        return 0;
+    }
+    return shader;
+}
+
+void PointRenderer::initDepthPath() {
+
+    GLuint vs = compileShader( GL_VERTEX_SHADER, depthVertexShader );
+    GLuint fs = compileShader( GL_FRAGMENT_SHADER, depthFragmentShader );
+    if( !vs || !fs ) {
+        if( vs ) glDeleteShader( vs );
+        if( fs ) glDeleteShader( fs );
+        return;
+    }
+    program = glCreateProgram();
+    glAttachShader( program, vs );
+    glAttachShader( program, fs );
+    glLinkProgram( program );
+    glDeleteShader( vs );
+    glDeleteShader( fs );
+    GLint ok = 0;
+    glGetProgramiv( program, GL_LINK_STATUS, &ok );
+    if( !ok ) {
+        LOG_ERROR( "depth shader didn't link" );
+        glDeleteProgram( program );
+        program = 0;
+        return;
+    }
+    uIntrinsics = glGetUniformLocation( program, "intrinsics" );
+    uDisparity = glGetUniformLocation( program, "disparity" );
+    uDepth = glGetUniformLocation( program, "depth" );
+
+    glGenTextures( 1, &depthTex );
+    glBindTexture( GL_TEXTURE_2D, depthTex );
+    glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST );
+    glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST );
+    glTexImage2D( GL_TEXTURE_2D, 0, GL_R16UI, KINECT_WIDTH, KINECT_HEIGHT, 0,
+                  GL_RED_INTEGER, GL_UNSIGNED_SHORT, 0 );
+    glBindTexture( GL_TEXTURE_2D, 0 );
+
+    // The pixel grid never changes, upload it once
+    std::vector< short > px( 2*KINECT_PIXELS );
+    for( int row = 0, i = 0; row < KINECT_HEIGHT; row++ )
+        for( int col = 0; col < KINECT_WIDTH; col++, i++ ) {
+            px[2*i] = col;
+            px[2*i+1] = row;
+        }
+    glGenBuffers( 1, &grid );
+    glBindBuffer( GL_ARRAY_BUFFER, grid );
+    glBufferData( GL_ARRAY_BUFFER, px.size()*sizeof( short ), &px[0], GL_STATIC_DRAW );
+    glBindBuffer( GL_ARRAY_BUFFER, 0 );
+}
+
+void PointRenderer::drawDepth( const uint16_t* depth, const Intrinsics& k ) {
+
+    if( !program )
+        return;
+
+    glActiveTexture( GL_TEXTURE0 );
+    glBindTexture( GL_TEXTURE_2D, depthTex );
+    {
+        PROFILE_SCOPE( "upload" );
+        glPixelStorei( GL_UNPACK_ALIGNMENT, 2 );
+        glTexSubImage2D( GL_TEXTURE_2D, 0, 0, 0, KINECT_WIDTH, KINECT_HEIGHT,
+                         GL_RED_INTEGER, GL_UNSIGNED_SHORT, depth );
+    }
+
+    glUseProgram( program );
+    glUniform1i( uDepth, 0 );
+    glUniform4f( uIntrinsics, k.fx, k.fy, k.cx, k.cy );
+    glUniform2f( uDisparity, k.a, k.b );
+
+    glEnableClientState( GL_VERTEX_ARRAY );
+    glDisableClientState( GL_COLOR_ARRAY );
+    glBindBuffer( GL_ARRAY_BUFFER, grid );
+    glVertexPointer( 2, GL_SHORT, 0, 0 );
+    glDrawArrays( GL_POINTS, 0, KINECT_PIXELS );
+    glBindBuffer( GL_ARRAY_BUFFER, 0 );
+
+    glUseProgram( 0 );
+    glBindTexture( GL_TEXTURE_2D, 0 );
+}
@@ -0,0 +1,65 @@
+#ifndef KINREG_POINT_RENDERER_H
+#define KINREG_POINT_RENDERER_H
+
+#include "kinect.h"
+#include "depthModel.h"
+// ---- OpenGL -----
+#include <GL/gl.h>
+#include <GL/glext.h>
+
+/*
+ * Gets point clouds to the GPU without going through client side arrays.
+ *
+ * drawPacked() streams the compacted (col, row, disparity) shorts and RGB
+ * bytes from packVertices() into a ring of VBO sections and draws them with
+ * whatever matrices are current (so loadVertexMatrix() still does the
+ * projection). With GL_ARB_buffer_storage the ring is persistently mapped
+ * and fenced, otherwise every section is orphaned and refilled.
+ *
+ * drawDepth() is the depth only path: the raw 640x480 frame goes up as an
+ * integer texture and a vertex shader unprojects it over a static pixel
+ * grid, so only 600KB cross the bus per camera per frame. Holes are
+ * dropped in the shader.
+ *
+ * Needs a current GL context (2.1 for drawPacked, 3.0 for drawDepth), works
+ * on Mesa's llvmpipe. Create it after the window.
+ */
+class PointRenderer {
+public:
+    PointRenderer();
+    ~PointRenderer();
+
+    void drawPacked( const short* xyz, const uint8_t* colors, int count );
+    void drawDepth( const uint16_t* depth, const Intrinsics& k );
+
+    // "persistent", "orphan" or "client" (no VBOs at all)
+    const char* streamingMode() const;
+    bool canDrawDepth() const { return program != 0; }
+
+private:
+    enum Mode { PERSISTENT, ORPHAN, CLIENT };
+    enum { SECTIONS = 4 };
+
+    PointRenderer( const PointRenderer& );
+    PointRenderer& operator=( const PointRenderer& );
+
+    void initDepthPath();
+
+    Mode mode;
+    size_t sectionBytes;
+
+    // Ring of sections. Persistent mode uses one big mapped buffer and a
+    // fence per section, orphan mode a buffer per section.
+    GLuint ring[SECTIONS];
+    GLsync fences[SECTIONS];
+    uint8_t* mapped;
+    int next;
+
+    // Depth only path
+    GLuint program;
+    GLuint depthTex;
+    GLuint grid;
+    GLint uIntrinsics, uDisparity, uDepth;
+};
+
+#endif
@@ -0,0 +1,43 @@
+#include "previewCompositor.h"
+// --- C++ ---
+#include <algorithm>
+
+PreviewCompositor::PreviewCompositor( int cameras, int cols ) {
+
+    columns = cols > 0 ? cols : std::min( cameras, 4 );
+    columns = std::max( columns, 1 );
+    int rows = ( cameras + columns - 1 )/columns;
+
+    image = cv::Mat::zeros( rows*KINECT_HEIGHT, columns*KINECT_WIDTH, CV_8UC3 );
+    for( int cam = 0; cam < cameras; cam++ ) {
+        int x = ( cam % columns )*KINECT_WIDTH, y = ( cam/columns )*KINECT_HEIGHT;
+        tiles.push_back( image( cv::Rect( x, y, KINECT_WIDTH, KINECT_HEIGHT ) ) );
+    }
+    shown.assign( cameras, 0 );
+    filled.assign( cameras, false );
+}
+
+void PreviewCompositor::put( int cam, const Frame& f ) {
+
+    if( filled[cam] && shown[cam] == f.sequence )
+        return;
+
+    // cvtColor writes into the tile in place, it has the right size and
+    // type so nothing gets reallocated
+    cv::Mat rgb( KINECT_HEIGHT, KINECT_WIDTH, CV_8UC3, (void*)f.rgb );
+    cv::cvtColor( rgb, tiles[cam], CV_RGB2BGR );
+    shown[cam] = f.sequence;
+    filled[cam] = true;
+}
+
+int PreviewCompositor::cameraAt( int x, int y, int* col, int* row ) const {
+
+    if( x < 0 || y < 0 || x >= image.cols || y >= image.rows )
+        return -1;
+    int cam = ( y/KINECT_HEIGHT )*columns + x/KINECT_WIDTH;
+    if( cam >= numCameras() )
+        return -1;
+    *col = x % KINECT_WIDTH;
+    *row = y % KINECT_HEIGHT;
+    return cam;
+}
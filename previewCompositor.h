@@ -0,0 +1,46 @@
+#ifndef KINREG_PREVIEW_COMPOSITOR_H
+#define KINREG_PREVIEW_COMPOSITOR_H
+
+#include "kinect.h"
+// ---- OpenCV -----
+#include <cv.h>
+// --- C++ ---
+#include <vector>
+
+/*
+ * The OpenCV preview of every camera's RGB image, tiled into one BGR
+ * canvas.
+ *
+ * The canvas is allocated once. put() colour converts a frame straight
+ * into its camera's tile and skips frames it has already shown, so a tick
+ * costs one pass over each new frame and no allocations. Cameras go left
+ * to right, wrapping after `columns` tiles.
+ */
+class PreviewCompositor {
+public:
+    // columns 0 picks up to 4 per row
+    PreviewCompositor( int cameras, int columns = 0 );
+
+    int numCameras() const { return (int)tiles.size(); }
+
+    // Copies f into cam's tile unless it's the frame already there
+    void put( int cam, const Frame& f );
+
+    // What to imshow()
+    const cv::Mat& canvas() const { return image; }
+    // Header on cam's part of the canvas
+    const cv::Mat& tile( int cam ) const { return tiles[cam]; }
+
+    // The camera under canvas pixel (x, y) and the pixel in that camera's
+    // image, or -1 if (x, y) isn't on a tile
+    int cameraAt( int x, int y, int* col, int* row ) const;
+
+private:
+    int columns;
+    cv::Mat image;
+    std::vector< cv::Mat > tiles;
+    std::vector< uint32_t > shown;   // sequence of the frame in each tile
+    std::vector< bool > filled;
+};
+
+#endif
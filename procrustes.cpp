@@ -0,0 +1,422 @@
+#include "procrustes.h"
+#include "threadPool.h"
+// --- C++ ---
+#include <float.h>
+#include <math.h>
+#include <algorithm>
+
+// Hypotheses per parallelFor
+static const int ROUND = 32;
+// Refits of the winner on its own inliers, at most
+static const int REFITS = 4;
+
+// H = U S V^T, the rotation taking P onto Q is V U^T. If that comes out a
+// reflection, V diag( 1, 1, -1 ) U^T is the closest proper rotation (the
+// singular values are sorted, so the last one is the least trusted axis).
+static cv::Matx33d rotationFrom( const cv::Matx33d& H ) {
+    cv::Matx31d w;
+    cv::Matx33d u, vt;
+    cv::SVD::compute( H, w, u, vt );
+    cv::Matx33d R = vt.t()*u.t();
+    if( cv::determinant( R ) < 0 ) {
+        for( int c = 0; c < 3; c++ )
+            vt(2,c) = -vt(2,c);
+        R = vt.t()*u.t();
+    }
+    return R;
+}
+
+// Weighted centroids and cross covariance, pairs with w <= 0 skipped.
+// Returns how many took part. These sets are a few thousand pairs at
+// most, plain doubles are fine.
+static int weightedMoments( const PointCloud& P, const PointCloud& Q, const float* w,
+                            cv::Vec3d& cP, cv::Vec3d& cQ, cv::Matx33d& H ) {
+
+    const float* p[3] = { P.x(), P.y(), P.z() };
+    const float* q[3] = { Q.x(), Q.y(), Q.z() };
+    int n = P.size(), count = 0;
+    double sw = 0, sp[3] = { 0, 0, 0 }, sq[3] = { 0, 0, 0 };
+    for( int i = 0; i < n; i++ ) {
+        if( !( w[i] > 0 ) )
+            continue;
+        sw += w[i];
+        for( int a = 0; a < 3; a++ ) {
+            sp[a] += w[i]*p[a][i];
+            sq[a] += w[i]*q[a][i];
+        }
+        count++;
+    }
+    if( !count )
+        return 0;
+    cP = cv::Vec3d( sp[0]/sw, sp[1]/sw, sp[2]/sw );
+    cQ = cv::Vec3d( sq[0]/sw, sq[1]/sw, sq[2]/sw );
+
+    double h[9] = { 0 };
+    for( int i = 0; i < n; i++ ) {
+        if( !( w[i] > 0 ) )
+            continue;
+        double dp[3] = { p[0][i] - cP[0], p[1][i] - cP[1], p[2][i] - cP[2] };
+        double dq[3] = { q[0][i] - cQ[0], q[1][i] - cQ[1], q[2][i] - cQ[2] };
+        for( int r = 0; r < 3; r++ )
+            for( int c = 0; c < 3; c++ )
+                h[3*r + c] += w[i]*dp[r]*dq[c];
+    }
+    H = cv::Matx33d( h );
+    return count;
+}
+
+bool solveProcrustes( const PointCloud& P, const PointCloud& Q,
+                      ProcrustesResult& result, const float* weights ) {
+
+    int n = P.size();
+    if( n < 3 || Q.size() != P.size() )
+        return false;
+
+    cv::Vec3d cP, cQ;
+    cv::Matx33d H;
+    int count = n;
+    if( !weights ) {
+        cloudCentroid( P, cP );
+        cloudCentroid( Q, cQ );
+        // H = sum (p - cP)(q - cQ)^T
+        H = crossCovariance( P, Q, cP, cQ );
+    }
+    else {
+        count = weightedMoments( P, Q, weights, cP, cQ, H );
+        if( count < 3 )
+            return false;
+    }
+
+    cv::Matx33d R = rotationFrom( H );
+    cv::Vec3d t = cQ - R*cP;
+
+    result.transform = RigidTransform( cv::Matx33f( R ), 
+                                       cv::Vec3f( (float)t[0], (float)t[1], (float)t[2] ) );
+    result.centroidP = cv::Vec3f( (float)cP[0], (float)cP[1], (float)cP[2] );
+    result.centroidQ = cv::Vec3f( (float)cQ[0], (float)cQ[1], (float)cQ[2] );
+    result.count = count;
+
+    double err = 0, sw = 0;
+    for( int i = 0; i < n; i++ ) {
+        float w = weights ? weights[i] : 1;
+        if( !( w > 0 ) )
+            continue;
+        cv::Vec3f d = result.transform( P.point( i ) ) - Q.point( i );
+        err += w*d.dot( d );
+        sw += w;
+    }
+    result.rms = (float)sqrt( err/sw );
+    return true;
+}
+
+// ---------------------------------------------------------------------------
+// Running sums
+
+void ProcrustesAccumulator::clear() {
+    n = 0;
+    anchored = false;
+    originP = originQ = cv::Vec3d( 0, 0, 0 );
+    sw = spq2 = 0;
+    sp = sq = cv::Vec3d( 0, 0, 0 );
+    spq = cv::Matx33d::zeros();
+}
+
+void ProcrustesAccumulator::add( const cv::Vec3f& p, const cv::Vec3f& q, double w ) {
+
+    if( !anchored ) {
+        originP = cv::Vec3d( p[0], p[1], p[2] );
+        originQ = cv::Vec3d( q[0], q[1], q[2] );
+        anchored = true;
+    }
+    cv::Vec3d dp( p[0] - originP[0], p[1] - originP[1], p[2] - originP[2] );
+    cv::Vec3d dq( q[0] - originQ[0], q[1] - originQ[1], q[2] - originQ[2] );
+    sw += w;
+    sp += w*dp;
+    sq += w*dq;
+    spq2 += w*( dp.dot( dp ) + dq.dot( dq ) );
+    for( int r = 0; r < 3; r++ )
+        for( int c = 0; c < 3; c++ )
+            spq(r,c) += w*dp[r]*dq[c];
+    n++;
+}
+
+void ProcrustesAccumulator::remove( const cv::Vec3f& p, const cv::Vec3f& q, double w ) {
+    add( p, q, -w );
+    n -= 2;
+    if( n <= 0 )
+        clear();
+}
+
+void ProcrustesAccumulator::decay( double factor ) {
+    sw *= factor;
+    sp *= factor;
+    sq *= factor;
+    spq2 *= factor;
+    spq = spq*factor;
+}
+
+bool ProcrustesAccumulator::solve( ProcrustesResult& result ) const {
+
+    if( n < 3 || !( sw > 0 ) )
+        return false;
+
+    // Centred moments from the raw ones, all still relative to the origins
+    cv::Vec3d cp = sp*( 1/sw ), cq = sq*( 1/sw );
+    cv::Matx33d H;
+    for( int r = 0; r < 3; r++ )
+        for( int c = 0; c < 3; c++ )
+            H(r,c) = spq(r,c) - sw*cp[r]*cq[c];
+    cv::Matx33d R = rotationFrom( H );
+
+    cv::Vec3d cP = cp + originP, cQ = cq + originQ;
+    cv::Vec3d t = cQ - R*cP;
+    result.transform = RigidTransform( cv::Matx33f( R ), 
+                                       cv::Vec3f( (float)t[0], (float)t[1], (float)t[2] ) );
+    result.centroidP = cv::Vec3f( (float)cP[0], (float)cP[1], (float)cP[2] );
+    result.centroidQ = cv::Vec3f( (float)cQ[0], (float)cQ[1], (float)cQ[2] );
+    result.count = n;
+
+    // sum w |R p' - q'|^2 over the centred pairs is
+    // sum w |p'|^2 + sum w |q'|^2 - 2 trace( R H )
+    double centred = spq2 - sw*( cp.dot( cp ) + cq.dot( cq ) );
+    double trace = 0;
+    for( int r = 0; r < 3; r++ )
+        for( int c = 0; c < 3; c++ )
+            trace += R(r,c)*H(c,r);
+    result.rms = (float)sqrt( std::max( 0.0, centred - 2*trace )/sw );
+    return true;
+}
+
+ProcrustesWindow::ProcrustesWindow( int capacity )
+    : ring( std::max( capacity, 3 ) ), head( 0 ), filled( 0 ), removals( 0 ) {}
+
+void ProcrustesWindow::add( const cv::Vec3f& p, const cv::Vec3f& q, float w ) {
+
+    Pair pair = { p, q, w };
+    int cap = (int)ring.size();
+    if( filled < cap ) {
+        ring[filled++] = pair;
+        sums.add( p, q, w );
+        return;
+    }
+    Pair old = ring[head];
+    ring[head] = pair;
+    head = ( head + 1 ) % cap;
+    if( ++removals < cap ) {
+        sums.remove( old.p, old.q, old.w );
+        sums.add( p, q, w );
+    }
+    else {
+        removals = 0;
+        rebuild();
+    }
+}
+
+void ProcrustesWindow::clear() {
+    head = filled = removals = 0;
+    sums.clear();
+}
+
+// Oldest first, so the origin is a pair still in the window
+void ProcrustesWindow::rebuild() {
+    sums.clear();
+    int cap = (int)ring.size();
+    for( int k = 0; k < filled; k++ ) {
+        const Pair& pair = ring[( head + k ) % cap];
+        sums.add( pair.p, pair.q, pair.w );
+    }
+}
+
+// ---------------------------------------------------------------------------
+// RANSAC
+
+struct Hypothesis {
+    RigidTransform T;
+    float cost;
+    int inliers;
+};
+
+static inline uint64_t nextRandom( uint64_t& state ) {
+    // splitmix64
+    uint64_t z = ( state += 0x9E3779B97F4A7C15ull );
+    z = ( z ^ ( z >> 30 ) )*0xBF58476D1CE4E5B9ull;
+    z = ( z ^ ( z >> 27 ) )*0x94D049BB133111EBull;
+    return z ^ ( z >> 31 );
+}
+
+// Exact fit to three pairs. False if they can't be one rigid motion (a
+// side differs by more than slack between P and Q, 0 doesn't check) or
+// the triangle is thinner than thin to pin down the rotation about its
+// long side.
+static bool fitSample( const PointCloud& P, const PointCloud& Q, const int idx[3], 
+                       float slack, float thin, RigidTransform& T ) {
+
+    cv::Vec3d p[3], q[3];
+    for( int k = 0; k < 3; k++ ) {
+        cv::Vec3f a = P.point( idx[k] ), b = Q.point( idx[k] );
+        p[k] = cv::Vec3d( a[0], a[1], a[2] );
+        q[k] = cv::Vec3d( b[0], b[1], b[2] );
+    }
+
+    double longest = 0;
+    for( int k = 0; k < 3; k++ ) {
+        int j = ( k + 1 ) % 3;
+        double dp = cv::norm( p[j] - p[k] ), dq = cv::norm( q[j] - q[k] );
+        if( slack > 0 && fabs( dp - dq ) > slack )
+            return false;
+        longest = std::max( longest, dp );
+    }
+    // |cross| is the longest side times the height over it, roughly
+    cv::Vec3d cross = ( p[1] - p[0] ).cross( p[2] - p[0] );
+    if( cv::norm( cross ) < thin*longest )
+        return false;
+
+    cv::Vec3d cP = ( p[0] + p[1] + p[2] )*( 1.0/3 ), cQ = ( q[0] + q[1] + q[2] )*( 1.0/3 );
+    cv::Matx33d H = cv::Matx33d::zeros();
+    for( int k = 0; k < 3; k++ ) {
+        cv::Vec3d dp = p[k] - cP, dq = q[k] - cQ;
+        for( int r = 0; r < 3; r++ )
+            for( int c = 0; c < 3; c++ )
+                H(r,c) += dp[r]*dq[c];
+    }
+    cv::Matx33d R = rotationFrom( H );
+    cv::Vec3d t = cQ - R*cP;
+    T = RigidTransform( cv::Matx33f( R ), cv::Vec3f( (float)t[0], (float)t[1], (float)t[2] ) );
+    return true;
+}
+
+// Truncated squared residual over every pair (MSAC), straight off the SoA
+// arrays so it vectorizes
+static void score( const PointCloud& P, const PointCloud& Q, const float* w, float th2, 
+                   Hypothesis& h ) {
+
+    const float* px = P.x();
+    const float* py = P.y();
+    const float* pz = P.z();
+    const float* qx = Q.x();
+    const float* qy = Q.y();
+    const float* qz = Q.z();
+    const cv::Matx33f& R = h.T.R;
+    const float r00 = R(0,0), r01 = R(0,1), r02 = R(0,2), t0 = h.T.t[0];
+    const float r10 = R(1,0), r11 = R(1,1), r12 = R(1,2), t1 = h.T.t[1];
+    const float r20 = R(2,0), r21 = R(2,1), r22 = R(2,2), t2 = h.T.t[2];
+    int n = P.size(), inliers = 0;
+    float cost = 0;
+    for( int i = 0; i < n; i++ ) {
+        float dx = r00*px[i] + r01*py[i] + r02*pz[i] + t0 - qx[i];
+        float dy = r10*px[i] + r11*py[i] + r12*pz[i] + t1 - qy[i];
+        float dz = r20*px[i] + r21*py[i] + r22*pz[i] + t2 - qz[i];
+        float e = dx*dx + dy*dy + dz*dz;
+        cost += ( w ? w[i] : 1.f )*std::min( e, th2 );
+        inliers += e < th2;
+    }
+    h.cost = cost;
+    h.inliers = inliers;
+}
+
+static int classify( const PointCloud& P, const PointCloud& Q, const RigidTransform& T, float th2,
+                     std::vector< uint8_t >& inlier, std::vector< float >& residuals ) {
+    int n = P.size(), count = 0;
+    inlier.resize( n );
+    residuals.resize( n );
+    for( int i = 0; i < n; i++ ) {
+        cv::Vec3f d = T( P.point( i ) ) - Q.point( i );
+        float e = d.dot( d );
+        residuals[i] = sqrtf( e );
+        inlier[i] = e < th2;
+        count += inlier[i];
+    }
+    return count;
+}
+
+bool ransacProcrustes( const PointCloud& P, const PointCloud& Q, const float* weights,
+                       const RansacParams& params, RansacResult& result, ThreadPool* pool ) {
+
+    int n = P.size();
+    result.inlier.assign( n, 0 );
+    result.residuals.assign( n, 0 );
+    result.inliers = 0;
+    result.iterations = 0;
+    if( n < 3 || Q.size() != P.size() )
+        return false;
+    if( !pool )
+        pool = &ThreadPool::shared();
+
+    float th2 = params.threshold*params.threshold;
+    double logFail = log( 1 - std::min( (double)params.confidence, 0.999999 ) );
+    Hypothesis best;
+    best.cost = FLT_MAX;
+    best.inliers = 0;
+    std::vector< Hypothesis > round( ROUND );
+    int needed = params.maxIterations;
+
+    while( result.iterations < needed ) {
+        int batch = std::min( ROUND, needed - result.iterations );
+        int first = result.iterations;
+        pool->parallelFor( batch, [&]( int k ) {
+            Hypothesis& h = round[k];
+            h.cost = FLT_MAX;
+            h.inliers = 0;
+            // Seeded per hypothesis, not per thread
+            uint64_t state = (uint64_t)params.seed << 32 | (uint32_t)( first + k );
+            int idx[3];
+            idx[0] = (int)( nextRandom( state ) % n );
+            do idx[1] = (int)( nextRandom( state ) % n ); while( idx[1] == idx[0] );
+            do idx[2] = (int)( nextRandom( state ) % n ); while( idx[2] == idx[0] || idx[2] == idx[1] );
+            if( fitSample( P, Q, idx, params.sampleSlack*params.threshold, 2*params.threshold, h.T ) )
+                score( P, Q, weights, th2, h );
+        } );
+        for( int k = 0; k < batch; k++ )
+            if( round[k].inliers >= 3 && round[k].cost < best.cost )
+                best = round[k];
+        result.iterations += batch;
+
+        // Samples needed to draw an all inlier one with the confidence asked.
+        // Clamped as a double, a few inliers among thousands want more than
+        // an int holds (log1p because 1 - clean rounds to 1 for tiny ones).
+        if( best.inliers ) {
+            double ratio = (double)best.inliers/n;
+            double clean = ratio*ratio*ratio;
+            double k = ceil( logFail/log1p( -clean ) );
+            needed = clean >= 1 ? result.iterations :
+                     !( k < params.maxIterations ) ? params.maxIterations : (int)k;
+        }
+    }
+    if( best.inliers < std::max( 3, params.minInliers ) )
+        return false;
+
+    // Least squares on the inliers, again while that picks up more of them
+    int inliers = classify( P, Q, best.T, th2, result.inlier, result.residuals );
+    std::vector< float > w( n );
+    bool fitted = false;
+    for( int it = 0; it < REFITS; it++ ) {
+        for( int i = 0; i < n; i++ )
+            w[i] = result.inlier[i] ? ( weights ? weights[i] : 1.f ) : 0.f;
+        ProcrustesResult fit;
+        if( !solveProcrustes( P, Q, fit, &w[0] ) )
+            break;
+        result.fit = fit;
+        fitted = true;
+        int count = classify( P, Q, fit.transform, th2, result.inlier, result.residuals );
+        bool grew = count > inliers;
+        inliers = count;
+        if( !grew )
+            break;
+    }
+    if( !fitted )
+        return false;
+
+    // Report the fit over the inliers it ended up with
+    double err = 0, sw = 0;
+    for( int i = 0; i < n; i++ ) {
+        float wi = weights ? weights[i] : 1;
+        if( !result.inlier[i] || !( wi > 0 ) )
+            continue;
+        err += wi*result.residuals[i]*result.residuals[i];
+        sw += wi;
+    }
+    result.fit.rms = sw > 0 ? (float)sqrt( err/sw ) : 0;
+    result.fit.count = inliers;
+    result.inliers = inliers;
+    return inliers >= std::max( 3, params.minInliers );
+}
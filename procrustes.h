@@ -0,0 +1,140 @@
+#ifndef KINREG_PROCRUSTES_H
+#define KINREG_PROCRUSTES_H
+
+#include "rigidTransform.h"
+#include "pointCloud.h"
+// ---- OpenCV -----
+#include <cv.h>
+// --- C++ ---
+#include <vector>
+
+class ThreadPool;
+
+struct ProcrustesResult {
+    RigidTransform transform;   // takes P points onto Q
+    cv::Vec3f centroidP;
+    cv::Vec3f centroidQ;
+    float rms;                  // residual after alignment, same units as input
+    int count;                  // pairs that took part (nonzero weight)
+};
+
+/*
+ * Procrustes analysis on metric correspondences P[i] <-> Q[i]: move both
+ * centroids to the origin, take the SVD of the cross covariance and read
+ * the rotation off it. If the best orthogonal fit is a reflection (nearly
+ * planar or mirrored points) the axis of least variance is flipped, so the
+ * result is always a proper rotation.
+ *
+ * weights, if given, holds one per pair and minimises sum w |R P + t - Q|^2
+ * instead, pairs with weight 0 are left out and rms is weighted too.
+ * Returns false if fewer than 3 pairs take part or the sets don't match up.
+ */
+bool solveProcrustes( const PointCloud& P, const PointCloud& Q,
+                      ProcrustesResult& result, const float* weights = 0 );
+
+/*
+ * Procrustes from running sums instead of point sets. The weight, the
+ * weighted sums of p, q, |p|^2 + |q|^2 and p q^T are all a solve needs, so
+ * a pair goes in (or back out) in O(1) and solve() is one 3x3 SVD however
+ * many pairs there were, a few microseconds. Sums are kept in doubles
+ * relative to the first pair added, so clouds a few meters out don't lose
+ * the residual to cancellation.
+ *
+ * decay( f ) scales everything accumulated so far by f. Called once a
+ * frame it forgets pairs exponentially (0.98 at 30 Hz halves their
+ * weight every second or so). ProcrustesWindow below keeps the last N
+ * pairs instead. There is no outlier rejection, that's ransacProcrustes().
+ */
+class ProcrustesAccumulator {
+public:
+    ProcrustesAccumulator() { clear(); }
+
+    void clear();
+    void add( const cv::Vec3f& p, const cv::Vec3f& q, double w = 1 );
+    // Takes back a pair added earlier with the same weight
+    void remove( const cv::Vec3f& p, const cv::Vec3f& q, double w = 1 );
+    void decay( double factor );
+
+    // Pairs added minus pairs removed, and their total (decayed) weight
+    int count() const { return n; }
+    double weight() const { return sw; }
+
+    // Same result as solveProcrustes() on the pairs (and weights) in the
+    // sums. False with fewer than 3 pairs or no weight left.
+    bool solve( ProcrustesResult& result ) const;
+
+private:
+    int n;
+    bool anchored;
+    cv::Vec3d originP, originQ;     // first pair added, everything is relative to it
+    double sw, spq2;                // sum w, sum w ( |p|^2 + |q|^2 )
+    cv::Vec3d sp, sq;               // sum w p, sum w q
+    cv::Matx33d spq;                // sum w p q^T
+};
+
+/*
+ * The last capacity pairs. Adding one past that takes the oldest out of
+ * the sums, and every capacity removals the sums are rebuilt from the
+ * pairs held, so subtracting can't drift however long it runs.
+ */
+class ProcrustesWindow {
+public:
+    explicit ProcrustesWindow( int capacity );
+
+    void add( const cv::Vec3f& p, const cv::Vec3f& q, float w = 1 );
+    void clear();
+
+    int size() const { return filled; }
+    int capacity() const { return (int)ring.size(); }
+    bool solve( ProcrustesResult& result ) const { return sums.solve( result ); }
+
+private:
+    struct Pair {
+        cv::Vec3f p, q;
+        float w;
+    };
+    void rebuild();
+
+    std::vector< Pair > ring;
+    int head, filled, removals;     // head is the oldest once full
+    ProcrustesAccumulator sums;
+};
+
+struct RansacParams {
+    RansacParams() : threshold( 0.01f ), confidence( 0.999f ), maxIterations( 1000 ),
+                     minInliers( 3 ), sampleSlack( 2 ), seed( 1 ) {}
+
+    float threshold;    // pairs further apart than this after alignment are outliers, meters
+    float confidence;   // stop once an outlier free sample was drawn this surely
+    int maxIterations;  // hypotheses, at most
+    int minInliers;
+    float sampleSlack;  // in thresholds, how much a sample's sides may differ between P
+                        // and Q before it's skipped unsolved. 0 solves every sample.
+    unsigned seed;      // same seed, same answer, whatever the thread count
+};
+
+struct RansacResult {
+    ProcrustesResult fit;           // weighted refit on the inliers
+    std::vector< uint8_t > inlier;  // per pair
+    std::vector< float > residuals; // |T(P[i]) - Q[i]| per pair with the final fit
+    int inliers;
+    int iterations;                 // hypotheses tried
+};
+
+/*
+ * Procrustes that survives bad pairs, a mis-click or a wrong feature match.
+ *
+ * Hypotheses come from random 3 pair samples (samples whose pairwise
+ * distances already disagree, see sampleSlack, are skipped without
+ * solving) and are scored
+ * in parallel on pool, the shared one if 0, by the truncated squared
+ * residual over every pair. The count adapts to the best inlier ratio so
+ * far. The winner is refit on its inliers with the weights (0 for all
+ * ones) until the inlier set stops growing.
+ *
+ * Returns false if there are fewer than 3 pairs or minInliers inliers.
+ */
+bool ransacProcrustes( const PointCloud& P, const PointCloud& Q, const float* weights,
+                       const RansacParams& params, RansacResult& result, ThreadPool* pool = 0 );
+
+#endif
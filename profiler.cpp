@@ -0,0 +1,153 @@
+#include "profiler.h"
+#include "kinect.h"
+#include "json.h"
+// --- C++ ---
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+
+Profiler& Profiler::shared() {
+    static Profiler profiler;
+    return profiler;
+}
+
+// Each thread's ring is made (and registered, under the lock) the first
+// time it records anything, after that it's a thread_local lookup
+Profiler::Ring* Profiler::ring() {
+    static thread_local Ring* mine = 0;
+    if( !mine ) {
+        mine = new Ring;
+        std::lock_guard< std::mutex > hold( lock );
+        char name[32];
+        snprintf( name, sizeof( name ), "thread %d", (int)rings.size() );
+        mine->thread = name;
+        rings.push_back( mine );
+    }
+    return mine;
+}
+
+void Profiler::setThreadName( const std::string& name ) {
+    Ring* r = ring();
+    std::lock_guard< std::mutex > hold( lock );
+    r->thread = name;
+}
+
+void Profiler::record( const char* name, int arg, double start, double end ) {
+    Ring* r = ring();
+    unsigned long h = r->head.load( std::memory_order_relaxed );
+    ProfileEvent& e = r->events[h % RING_EVENTS];
+    e.name = name;
+    e.arg = arg;
+    e.start = start;
+    e.end = end;
+    r->head.store( h + 1, std::memory_order_release );
+}
+
+// Copies every ring. The owner keeps writing meanwhile, so anything it
+// may have started overwriting by the time the copy is done gets dropped.
+void Profiler::snapshot( std::vector< std::vector< ProfileEvent > >& events,
+                         std::vector< std::string >& threads ) {
+
+    std::vector< Ring* > all;
+    {
+        std::lock_guard< std::mutex > hold( lock );
+        all = rings;
+        threads.clear();
+        for( int t = 0; t < (int)all.size(); t++ )
+            threads.push_back( all[t]->thread );
+    }
+
+    events.assign( all.size(), std::vector< ProfileEvent >() );
+    for( int t = 0; t < (int)all.size(); t++ ) {
+        Ring* r = all[t];
+        unsigned long end = r->head.load( std::memory_order_acquire );
+        unsigned long begin = end > RING_EVENTS ? end - RING_EVENTS : 0;
+        std::vector< ProfileEvent >& out = events[t];
+        for( unsigned long i = begin; i < end; i++ )
+            out.push_back( r->events[i % RING_EVENTS] );
+
+        unsigned long now = r->head.load( std::memory_order_acquire );
+        unsigned long safe = now >= RING_EVENTS ? now - RING_EVENTS + 1 : 0;
+        if( safe > begin )
+            out.erase( out.begin(), out.begin() + std::min( safe - begin, (unsigned long)out.size() ) );
+    }
+}
+
+void Profiler::stats( double window, std::vector< ProfileStats >& out ) {
+
+    std::vector< std::vector< ProfileEvent > > events;
+    std::vector< std::string > threads;
+    snapshot( events, threads );
+
+    out.clear();
+    double since = monotonicSeconds() - window;
+    for( int t = 0; t < (int)events.size(); t++ )
+        for( int i = 0; i < (int)events[t].size(); i++ ) {
+            const ProfileEvent& e = events[t][i];
+            if( e.end < since )
+                continue;
+            int k = 0;
+            while( k < (int)out.size() && ( out[k].arg != e.arg || strcmp( out[k].name, e.name ) != 0 ) )
+                k++;
+            if( k == (int)out.size() ) {
+                ProfileStats s = { e.name, e.arg, 0, 0, 0 };
+                out.push_back( s );
+            }
+            double ms = 1000*( e.end - e.start );
+            out[k].count++;
+            out[k].meanMs += ms;
+            out[k].maxMs = std::max( out[k].maxMs, ms );
+        }
+    for( int k = 0; k < (int)out.size(); k++ )
+        out[k].meanMs /= out[k].count;
+}
+
+bool Profiler::dumpTrace( const std::string& path ) {
+
+    std::vector< std::vector< ProfileEvent > > events;
+    std::vector< std::string > threads;
+    snapshot( events, threads );
+
+    FILE* f = fopen( path.c_str(), "w" );
+    if( !f )
+        return false;
+
+    // Timestamps are microseconds from the oldest event
+    double origin = 0;
+    bool first = true;
+    for( int t = 0; t < (int)events.size(); t++ )
+        for( int i = 0; i < (int)events[t].size(); i++ )
+            if( first || events[t][i].start < origin ) {
+                origin = events[t][i].start;
+                first = false;
+            }
+
+    fprintf( f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n" );
+    const char* sep = "";
+    for( int t = 0; t < (int)threads.size(); t++ ) {
+        fprintf( f, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,"
+                    "\"args\":{\"name\":\"%s\"}}", 
+                 sep, t, jsonEscape( threads[t] ).c_str() );
+        sep = ",\n";
+    }
+    for( int t = 0; t < (int)events.size(); t++ )
+        for( int i = 0; i < (int)events[t].size(); i++ ) {
+            const ProfileEvent& e = events[t][i];
+            fprintf( f, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,"
+                        "\"ts\":%.3f,\"dur\":%.3f", 
+                     sep, jsonEscape( e.name ).c_str(), t,
+                     1e6*( e.start - origin ), 1e6*( e.end - e.start ) );
+            if( e.arg >= 0 )
+                fprintf( f, ",\"args\":{\"cam\":%d}", e.arg );
+            fprintf( f, "}" );
+        }
+    fprintf( f, "\n]}\n" );
+    return fclose( f ) == 0;
+}
+
+ProfileScope::ProfileScope( const char* name, int arg )
+    : name( name ), arg( arg ), start( monotonicSeconds() ) {}
+
+ProfileScope::~ProfileScope() {
+    Profiler::shared().record( name, arg, start, monotonicSeconds() );
+}
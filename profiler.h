@@ -0,0 +1,92 @@
+#ifndef KINREG_PROFILER_H
+#define KINREG_PROFILER_H
+
+// --- C++ ---
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/*
+ * Always-on scoped timers.
+ *
+ *      { PROFILE_SCOPE( "pack", cam ); ... }
+ *
+ * records when the block started and ended into the calling thread's own
+ * ring of the last RING_EVENTS events. Writing one costs two clock reads
+ * and no locks or allocations, the thread owns its ring and publishes
+ * each event with a release store. Readers (the HUD, trace dumps) copy
+ * rings out from any thread and drop whatever got overwritten while they
+ * were copying.
+ *
+ * Names must be string literals (or otherwise live forever), arg is
+ * usually the camera and -1 for none.
+ */
+
+struct ProfileEvent {
+    const char* name;
+    int arg;
+    double start, end;      // monotonicSeconds()
+};
+
+// Per-stage summary over a window of recent events
+struct ProfileStats {
+    const char* name;
+    int arg;
+    int count;
+    double meanMs, maxMs;
+};
+
+class Profiler {
+public:
+    enum { RING_EVENTS = 16384 };
+
+    static Profiler& shared();
+
+    // Names the calling thread in traces ("render", "capture 0", ...)
+    void setThreadName( const std::string& name );
+
+    void record( const char* name, int arg, double start, double end );
+
+    // Events that ended in the last window seconds, by name and arg, in
+    // order of first appearance
+    void stats( double window, std::vector< ProfileStats >& out );
+
+    // Writes every event still in the rings as Chrome trace JSON (loads in
+    // chrome://tracing and Perfetto). Returns false if path can't be written.
+    bool dumpTrace( const std::string& path );
+
+private:
+    struct Ring {
+        std::string thread;
+        ProfileEvent events[RING_EVENTS];
+        std::atomic< unsigned long > head;  // events ever written
+        Ring() : head( 0 ) {}
+    };
+
+    Profiler() {}
+    Ring* ring();
+    void snapshot( std::vector< std::vector< ProfileEvent > >& events,
+                   std::vector< std::string >& threads );
+
+    // Rings outlive their threads so their events still show up in dumps
+    std::vector< Ring* > rings;
+    std::mutex lock;    // guards rings, not what's in them
+};
+
+class ProfileScope {
+public:
+    ProfileScope( const char* name, int arg = -1 );
+    ~ProfileScope();
+
+private:
+    const char* name;
+    int arg;
+    double start;
+};
+
+#define PROFILE_CONCAT2( a, b ) a##b
+#define PROFILE_CONCAT( a, b ) PROFILE_CONCAT2( a, b )
+#define PROFILE_SCOPE( ... ) ProfileScope PROFILE_CONCAT( profileScope, __LINE__ )( __VA_ARGS__ )
+
+#endif
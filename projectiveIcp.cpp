@@ -0,0 +1,254 @@
+#include "projectiveIcp.h"
+#include "kinect.h"
+#include "profiler.h"
+#include "threadPool.h"
+// --- SIMD ---
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define KINREG_SSE2 1
+#endif
+// --- C++ ---
+#include <math.h>
+#include <algorithm>
+
+// Source rows per reduction task
+static const int BAND = 8;
+
+ProjectiveIcp::ProjectiveIcp( const ProjectiveIcpParams& params, ThreadPool* pool )
+    : params( params ), ownPool( !pool && params.threads > 0 ),
+      pool( pool ? pool : ownPool ? new ThreadPool( params.threads ) : &ThreadPool::shared() ),
+      levels( std::max( 1, std::min( params.levels, PROJECTIVE_MAX_LEVELS ) ) ),
+      targets( params.normals, this->pool ), sources( params.normals, this->pool ) {
+}
+
+ProjectiveIcp::~ProjectiveIcp() {
+    if( ownPool )
+        delete pool;
+}
+
+void ProjectiveIcp::setTarget( const PointCloud& target, const Intrinsics& k ) {
+    PROFILE_SCOPE( "projective_target" );
+    targets.build( target, k, levels );
+}
+
+void ProjectiveIcp::accumulate( int level, const RigidTransform& T, Normals6& sum ) {
+
+    const PointCloud& src = sources.level( level );
+    const PointCloud& dst = targets.level( level );
+    const Intrinsics& k = targets.intrinsics( level );
+    const int W = dst.width(), H = dst.height();
+    const int SW = src.width(), SH = src.height();
+    const float* sx = src.x();
+    const float* sy = src.y();
+    const float* sz = src.z();
+    const float* tx = dst.x();
+    const float* ty = dst.y();
+    const float* tz = dst.z();
+    const float* tnx = dst.nx();
+    const float* tny = dst.ny();
+    const float* tnz = dst.nz();
+    const float gate = params.maxDistance*( 1 << level );
+    const float maxDist2 = gate*gate;
+
+    // The target pixel at col, row for p if it has a normal and is close
+    // enough. Pixels without a normal are NaN and fail the distance test.
+    auto project = [&]( int col, int row, const float p[3], float q[3], float n[3] ) {
+        if( col < 0 || col >= W || row < 0 || row >= H )
+            return false;
+        int j = row*W + col;
+        q[0] = tx[j];
+        q[1] = ty[j];
+        q[2] = tz[j];
+        n[0] = tnx[j];
+        n[1] = tny[j];
+        n[2] = tnz[j];
+        float dx = p[0] - q[0], dy = p[1] - q[1], dz = p[2] - q[2];
+        return dx*dx + dy*dy + dz*dz < maxDist2 && n[0] == n[0];
+    };
+
+    // One correspondence: source point i moved to p, against the target
+    // pixel it projects onto. False if there's none.
+    auto associate = [&]( int i, float p[3], float q[3], float n[3] ) {
+        // NaN holes fail the depth test
+        for( int a = 0; a < 3; a++ )
+            p[a] = T.R(a,0)*sx[i] + T.R(a,1)*sy[i] + T.R(a,2)*sz[i] + T.t[a];
+        float z = -p[2];
+        if( !( z > 0 ) )
+            return false;
+        float inv = 1/z;
+        int col = (int)floorf( k.fx*p[0]*inv + k.cx + 0.5f );
+        int row = (int)floorf( k.cy - k.fy*p[1]*inv + 0.5f );
+        return project( col, row, p, q, n );
+    };
+
+    int bands = ( SH + BAND - 1 )/BAND;
+    partial.resize( bands );
+    pool->parallelFor( bands, [&]( int b ) {
+        Normals6& s = partial[b];
+        s.clear();
+#ifdef KINREG_SSE2
+        __m128 R[9], t[3];
+        for( int e = 0; e < 9; e++ )
+            R[e] = _mm_set1_ps( T.R.val[e] );
+        for( int a = 0; a < 3; a++ )
+            t[a] = _mm_set1_ps( T.t[a] );
+        const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps( 1 );
+        const __m128 fx = _mm_set1_ps( k.fx ), fy = _mm_set1_ps( k.fy );
+        const __m128 cx = _mm_set1_ps( k.cx + 0.5f ), cy = _mm_set1_ps( k.cy + 0.5f );
+#endif
+        for( int row = b*BAND; row < std::min( SH, ( b + 1 )*BAND ); row++ ) {
+            int i = row*SW, end = i + SW;
+#ifdef KINREG_SSE2
+            // Four points at a time into float sums, folded into s every
+            // row so they never get long enough to lose precision
+            __m128 A[21], rhs[6], err = zero;
+            for( int e = 0; e < 21; e++ )
+                A[e] = zero;
+            for( int e = 0; e < 6; e++ )
+                rhs[e] = zero;
+            int count = 0;
+            for( ; i + 4 <= end; i += 4 ) {
+                __m128 sxv = _mm_loadu_ps( sx + i ), syv = _mm_loadu_ps( sy + i ), szv = _mm_loadu_ps( sz + i );
+                __m128 pv[3];
+                for( int a = 0; a < 3; a++ )
+                    pv[a] = _mm_add_ps( _mm_add_ps( _mm_mul_ps( R[3*a], sxv ), _mm_mul_ps( R[3*a + 1], syv ) ),
+                                        _mm_add_ps( _mm_mul_ps( R[3*a + 2], szv ), t[a] ) );
+                __m128 z = _mm_sub_ps( zero, pv[2] );
+                int lanes = _mm_movemask_ps( _mm_cmpgt_ps( z, zero ) );
+                if( !lanes )
+                    continue;
+                __m128 inv = _mm_div_ps( one, z );
+                __m128 cf = _mm_add_ps( _mm_mul_ps( _mm_mul_ps( fx, pv[0] ), inv ), cx );
+                __m128 rf = _mm_sub_ps( cy, _mm_mul_ps( _mm_mul_ps( fy, pv[1] ), inv ) );
+                // floor() as truncate, then one less where that rounded up
+                __m128i ci = _mm_cvttps_epi32( cf ), ri = _mm_cvttps_epi32( rf );
+                ci = _mm_add_epi32( ci, _mm_castps_si128( _mm_cmpgt_ps( _mm_cvtepi32_ps( ci ), cf ) ) );
+                ri = _mm_add_epi32( ri, _mm_castps_si128( _mm_cmpgt_ps( _mm_cvtepi32_ps( ri ), rf ) ) );
+                int cols[4], rows[4];
+                float ps[3][4], qs[3][4], ns[3][4];
+                int32_t mask[4];
+                _mm_storeu_si128( (__m128i*)cols, ci );
+                _mm_storeu_si128( (__m128i*)rows, ri );
+                for( int a = 0; a < 3; a++ )
+                    _mm_storeu_ps( ps[a], pv[a] );
+
+                // Gathering the target pixels is scalar, lanes without one
+                // get masked out
+                int found = 0;
+                for( int l = 0; l < 4; l++ ) {
+                    float p[3] = { ps[0][l], ps[1][l], ps[2][l] }, q[3], n[3];
+                    bool ok = ( lanes & ( 1 << l ) ) && project( cols[l], rows[l], p, q, n );
+                    for( int a = 0; a < 3; a++ ) {
+                        qs[a][l] = ok ? q[a] : 0;
+                        ns[a][l] = ok ? n[a] : 0;
+                    }
+                    mask[l] = ok ? -1 : 0;
+                    found += ok;
+                }
+                if( !found )
+                    continue;
+                count += found;
+                __m128 m = _mm_castsi128_ps( _mm_loadu_si128( (const __m128i*)mask ) );
+                __m128 nv[3], d[3];
+                for( int a = 0; a < 3; a++ ) {
+                    pv[a] = _mm_and_ps( m, pv[a] );
+                    nv[a] = _mm_loadu_ps( ns[a] );
+                    d[a] = _mm_sub_ps( pv[a], _mm_and_ps( m, _mm_loadu_ps( qs[a] ) ) );
+                }
+                __m128 r = _mm_add_ps( _mm_add_ps( _mm_mul_ps( nv[0], d[0] ), _mm_mul_ps( nv[1], d[1] ) ),
+                                       _mm_mul_ps( nv[2], d[2] ) );
+                __m128 J[6] = { _mm_sub_ps( _mm_mul_ps( pv[1], nv[2] ), _mm_mul_ps( pv[2], nv[1] ) ),
+                                _mm_sub_ps( _mm_mul_ps( pv[2], nv[0] ), _mm_mul_ps( pv[0], nv[2] ) ),
+                                _mm_sub_ps( _mm_mul_ps( pv[0], nv[1] ), _mm_mul_ps( pv[1], nv[0] ) ),
+                                nv[0], nv[1], nv[2] };
+                for( int a = 0, e = 0; a < 6; a++ ) {
+                    for( int c = a; c < 6; c++, e++ )
+                        A[e] = _mm_add_ps( A[e], _mm_mul_ps( J[a], J[c] ) );
+                    rhs[a] = _mm_add_ps( rhs[a], _mm_mul_ps( J[a], r ) );
+                }
+                err = _mm_add_ps( err, _mm_mul_ps( r, r ) );
+            }
+            float lane[4];
+            for( int e = 0; e < 21; e++ ) {
+                _mm_storeu_ps( lane, A[e] );
+                s.A[e] += (double)lane[0] + lane[1] + lane[2] + lane[3];
+            }
+            for( int e = 0; e < 6; e++ ) {
+                _mm_storeu_ps( lane, rhs[e] );
+                s.b[e] += (double)lane[0] + lane[1] + lane[2] + lane[3];
+            }
+            _mm_storeu_ps( lane, err );
+            s.err += (double)lane[0] + lane[1] + lane[2] + lane[3];
+            s.count += count;
+#endif
+            for( ; i < end; i++ ) {
+                float p[3], q[3], n[3];
+                if( associate( i, p, q, n ) )
+                    s.add( p, q, n );
+            }
+        }
+    } );
+
+    sum.clear();
+    for( int b = 0; b < bands; b++ )
+        sum.add( partial[b] );
+}
+
+IcpResult ProjectiveIcp::align( const PointCloud& source, const RigidTransform& guess ) {
+
+    PROFILE_SCOPE( "projective_icp" );
+    IcpResult result;
+    result.transform = guess;
+    result.converged = false;
+    result.rms = 0;
+    if( targets.levels() < levels || !source.organised() )
+        return result;
+    sources.build( source, targets.intrinsics( 0 ), levels, false );
+
+    for( int level = levels - 1; level >= 0; level-- ) {
+        float gate = params.maxDistance*( 1 << level );
+        for( int it = 0; it < params.iterations[level]; it++ ) {
+            double start = monotonicSeconds();
+            Normals6 sum;
+            accumulate( level, result.transform, sum );
+
+            IcpIteration step;
+            step.level = level;
+            step.correspondences = sum.count;
+            step.rms = sum.count ? (float)sqrt( sum.err/sum.count ) : 0;
+            result.rms = step.rms;
+            // A little damping keeps directions nothing constrains (a view
+            // of one wall and a floor, say) where they are
+            double x[6];
+            double trace = sum.A[0] + sum.A[6] + sum.A[11] + sum.A[15] + sum.A[18] + sum.A[20];
+            bool solved = sum.count >= 6 && sum.solve( x, 1e-6*trace );
+            step.ms = 1000*( monotonicSeconds() - start );
+            result.iterations.push_back( step );
+            // Too little overlap at this level, or a step further than any
+            // correspondence could justify. A finer level may still do.
+            if( !solved || !( x[3]*x[3] + x[4]*x[4] + x[5]*x[5] < gate*gate ) )
+                break;
+
+            result.transform = RigidTransform::fromTwist( x )*result.transform;
+
+            double update = 0;
+            for( int k = 0; k < 6; k++ )
+                update += x[k]*x[k];
+            if( sqrt( update ) < params.minUpdate ) {
+                result.converged = level == 0;
+                break;
+            }
+        }
+    }
+    return result;
+}
+
+float ProjectiveIcp::residual( const RigidTransform& T, int* count ) {
+    Normals6 sum;
+    sum.clear();
+    if( sources.levels() && targets.levels() )
+        accumulate( 0, T, sum );
+    if( count )
+        *count = sum.count;
+    return sum.count ? (float)sqrt( sum.err/sum.count ) : 0;
+}
@@ -0,0 +1,80 @@
+#ifndef KINREG_PROJECTIVE_ICP_H
+#define KINREG_PROJECTIVE_ICP_H
+
+#include "icp.h"
+#include "normals.h"
+// --- C++ ---
+#include <vector>
+
+class ThreadPool;
+
+const int PROJECTIVE_MAX_LEVELS = 4;
+
+struct ProjectiveIcpParams {
+    ProjectiveIcpParams() : levels( 3 ), maxDistance( 0.05f ), minUpdate( 1e-5f ), threads( 0 ) {
+        // Most of the work where it's cheap
+        iterations[0] = 2;
+        iterations[1] = 4;
+        iterations[2] = 8;
+        iterations[3] = 8;
+    }
+
+    int levels;         // pyramid levels, 3 is 640x480 down to 160x120
+    int iterations[PROJECTIVE_MAX_LEVELS];  // per level, full resolution first
+    float maxDistance;  // correspondence gate at full resolution, doubles per level, meters
+    float minUpdate;    // a level stops once an update moves less than this
+    int threads;        // 0 uses the shared pool
+    NormalParams normals;   // the target's, on every level
+};
+
+/*
+ * Dense point to plane ICP that finds correspondences by projection
+ * instead of search: every source point, moved by the current guess, is
+ * projected into the target camera's image with its intrinsics and paired
+ * with the target pixel it lands on. That's O(1) per point and touches
+ * memory in order, fast enough to track two cameras every frame.
+ *
+ * Both clouds are organised and go into pyramids (see CloudPyramid).
+ * Gauss-Newton runs coarse to fine, each level starting from the last
+ * one's pose, and the normal equations are summed over bands of source
+ * rows on the pool. Projection only finds the right pixel once the
+ * guess is close, so start it from a registration (a few centimetres
+ * and degrees off at most); it's for keeping poses right, not finding
+ * them.
+ */
+class ProjectiveIcp {
+public:
+    // pool, if given, is used instead of params.threads
+    ProjectiveIcp( const ProjectiveIcpParams& params = ProjectiveIcpParams(), ThreadPool* pool = 0 );
+    ~ProjectiveIcp();
+
+    // target is an organised cloud with NaN holes, k the intrinsics it was
+    // unprojected with. Builds its pyramid and normals.
+    void setTarget( const PointCloud& target, const Intrinsics& k );
+
+    // Refines guess so that guess(source) lands on the target. source is
+    // organised too. The iterations are listed coarse to fine.
+    IcpResult align( const PointCloud& source, const RigidTransform& guess );
+
+    // Point to plane rms of the last source at level 0 moved by T, without
+    // updating anything. count, if given, gets the correspondences.
+    float residual( const RigidTransform& T, int* count = 0 );
+
+    const ProjectiveIcpParams& parameters() const { return params; }
+
+private:
+    ProjectiveIcp( const ProjectiveIcp& );
+    ProjectiveIcp& operator=( const ProjectiveIcp& );
+
+    // Normal equations of level's source moved by T
+    void accumulate( int level, const RigidTransform& T, Normals6& sum );
+
+    ProjectiveIcpParams params;
+    bool ownPool;
+    ThreadPool* pool;
+    int levels;
+    CloudPyramid targets, sources;
+    std::vector< Normals6 > partial;    // per band of source rows
+};
+
+#endif
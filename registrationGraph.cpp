@@ -0,0 +1,298 @@
+#include "registrationGraph.h"
+#include "threadPool.h"
+// --- C++ ---
+#include <math.h>
+#include <algorithm>
+
+// Gauss-Newton over all poses. A handful of clicks per pair converges in
+// two or three steps, the rest is headroom.
+static const int REFINE_ITERATIONS = 10;
+static const double REFINE_MIN_UPDATE = 1e-8;
+
+RegistrationGraph::RegistrationGraph( int cameras, int reference )
+    : ref( reference ), poses( cameras ), parents( cameras, -2 ),
+      centroids( cameras, cv::Vec3f( 0, 0, 0 ) ), residual( 0 ) {
+
+    parents[ref] = -1;
+    order.push_back( ref );
+    // Hand clicks are off by more than a threshold often enough that
+    // checking samples first would throw out pairs plain Procrustes takes
+    ransac.sampleSlack = 0;
+    for( int a = 0; a < cameras; a++ )
+        for( int b = a + 1; b < cameras; b++ ) {
+            RegistrationEdge e;
+            e.a = a;
+            e.b = b;
+            e.solved = false;
+            e.rms = 0;
+            pairs.push_back( e );
+        }
+}
+
+RegistrationEdge& RegistrationGraph::edge( int a, int b ) {
+    int n = numCameras();
+    if( a > b )
+        std::swap( a, b );
+    // Pairs are laid out row by row of the upper triangle
+    return pairs[a*( 2*n - a - 1 )/2 + ( b - a - 1 )];
+}
+
+void RegistrationGraph::addCorrespondence( int camA, const cv::Vec3f& a, int camB, const cv::Vec3f& b ) {
+    if( camA == camB )
+        return;
+    RegistrationEdge& e = edge( camA, camB );
+    e.A.push_back( camA < camB ? a : b );
+    e.B.push_back( camA < camB ? b : a );
+    e.sums.add( camA < camB ? a : b, camA < camB ? b : a );
+}
+
+bool RegistrationGraph::fitPair( int camA, int camB, ProcrustesResult& result ) const {
+    if( camA == camB )
+        return false;
+    const RegistrationEdge& e = const_cast< RegistrationGraph* >( this )->edge( camA, camB );
+    if( !e.sums.solve( result ) )
+        return false;
+    if( camA > camB ) {
+        result.transform = result.transform.inverse();
+        std::swap( result.centroidP, result.centroidQ );
+    }
+    return true;
+}
+
+int RegistrationGraph::correspondences( int camA, int camB ) const {
+    if( camA == camB )
+        return 0;
+    return (int)const_cast< RegistrationGraph* >( this )->edge( camA, camB ).A.size();
+}
+
+void RegistrationGraph::clearCorrespondences() {
+    for( int k = 0; k < (int)pairs.size(); k++ ) {
+        pairs[k].A.clear();
+        pairs[k].B.clear();
+        pairs[k].sums.clear();
+        pairs[k].inlier.clear();
+    }
+}
+
+void RegistrationGraph::restore( const std::vector< RigidTransform >& saved, 
+                                 const std::vector< int >& savedParents,
+                                 const std::vector< cv::Vec3f >& savedCentroids ) {
+
+    int n = numCameras();
+    std::fill( parents.begin(), parents.end(), -2 );
+    parents[ref] = -1;
+    order.assign( 1, ref );
+    // Sweep until nothing else hangs off a placed camera, parents first
+    for( bool grew = true; grew; ) {
+        grew = false;
+        for( int cam = 0; cam < n && cam < (int)savedParents.size(); cam++ ) {
+            int p = savedParents[cam];
+            if( placed( cam ) || p < 0 || p >= n || !placed( p ) )
+                continue;
+            parents[cam] = p;
+            order.push_back( cam );
+            grew = true;
+        }
+    }
+    for( int k = 0; k < (int)order.size(); k++ )
+        if( order[k] < (int)saved.size() )
+            poses[order[k]] = saved[order[k]];
+    for( int cam = 0; cam < n && cam < (int)savedCentroids.size(); cam++ )
+        centroids[cam] = savedCentroids[cam];
+}
+
+int RegistrationGraph::solve( ThreadPool* pool ) {
+
+    if( !pool )
+        pool = &ThreadPool::shared();
+
+    // Every pair is independent. A pair that can't be solved still gets
+    // all its points into refine() if both its cameras end up placed.
+    pool->parallelFor( (int)pairs.size(), [this, pool]( int k ) {
+        RegistrationEdge& e = pairs[k];
+        RansacResult r;
+        e.solved = ransacProcrustes( e.A, e.B, 0, ransac, r, pool );
+        e.result = r.fit;
+        if( e.solved )
+            e.inlier.swap( r.inlier );
+        else
+            e.inlier.assign( e.A.size(), 1 );
+        e.rms = e.solved ? e.result.rms : 0;
+    } );
+
+    std::vector< int > counts( numCameras(), 0 );
+    std::vector< cv::Vec3d > sums( numCameras(), cv::Vec3d( 0, 0, 0 ) );
+    for( int k = 0; k < (int)pairs.size(); k++ ) {
+        const RegistrationEdge& e = pairs[k];
+        cv::Vec3d cA, cB;
+        int nA = cloudCentroid( e.A, cA ), nB = cloudCentroid( e.B, cB );
+        sums[e.a] += cA*(double)nA;
+        sums[e.b] += cB*(double)nB;
+        counts[e.a] += nA;
+        counts[e.b] += nB;
+    }
+    for( int cam = 0; cam < numCameras(); cam++ )
+        if( counts[cam] )
+            centroids[cam] = cv::Vec3f( (float)( sums[cam][0]/counts[cam] ), 
+                                        (float)( sums[cam][1]/counts[cam] ), 
+                                        (float)( sums[cam][2]/counts[cam] ) );
+
+    chain();
+    refine();
+    return (int)order.size();
+}
+
+// Prim's algorithm from the reference: keep adding the unplaced camera
+// with the best solved pair to one that's already placed. Lots of clicks
+// and a low residual make a pair trustworthy, the 5 mm floor stops three
+// lucky clicks beating thirty decent ones.
+void RegistrationGraph::chain() {
+
+    int n = numCameras();
+    std::fill( parents.begin(), parents.end(), -2 );
+    parents[ref] = -1;
+    poses[ref] = RigidTransform();
+    order.assign( 1, ref );
+
+    while( (int)order.size() < n ) {
+        int best = -1;
+        float bestScore = 0;
+        for( int k = 0; k < (int)pairs.size(); k++ ) {
+            const RegistrationEdge& e = pairs[k];
+            if( !e.solved || placed( e.a ) == placed( e.b ) )
+                continue;
+            float score = e.result.count/( e.result.rms + 0.005f );
+            if( score > bestScore ) {
+                bestScore = score;
+                best = k;
+            }
+        }
+        if( best < 0 )
+            break;
+
+        // The edge takes a into b, so a = b o T and b = a o T^-1
+        const RegistrationEdge& e = pairs[best];
+        if( placed( e.b ) ) {
+            poses[e.a] = poses[e.b]*e.result.transform;
+            parents[e.a] = e.b;
+            order.push_back( e.a );
+        }
+        else {
+            poses[e.b] = poses[e.a]*e.result.transform.inverse();
+            parents[e.b] = e.a;
+            order.push_back( e.b );
+        }
+    }
+}
+
+// Joint least squares over every inlier between placed cameras:
+// sum |pose_a(A) - pose_b(B)|^2 with a twist update per camera, the
+// reference held fixed. With a tree of pairs this changes nothing, with
+// loops it spreads the disagreement around them.
+void RegistrationGraph::refine() {
+
+    int n = numCameras();
+    std::vector< int > var( n, -1 );
+    int vars = 0;
+    for( int k = 0; k < (int)order.size(); k++ )
+        if( order[k] != ref )
+            var[order[k]] = vars++;
+
+    for( int it = 0; it < REFINE_ITERATIONS && vars; it++ ) {
+        cv::Mat H = cv::Mat::zeros( 6*vars, 6*vars, CV_64F );
+        cv::Mat g = cv::Mat::zeros( 6*vars, 1, CV_64F );
+
+        for( int k = 0; k < (int)pairs.size(); k++ ) {
+            const RegistrationEdge& e = pairs[k];
+            if( !placed( e.a ) || !placed( e.b ) )
+                continue;
+            int va = var[e.a], vb = var[e.b];
+            for( int i = 0; i < (int)e.A.size(); i++ ) {
+                if( !e.inlier[i] )
+                    continue;
+                cv::Vec3f xa = poses[e.a]( e.A.point( i ) ), xb = poses[e.b]( e.B.point( i ) );
+                double r[3] = { xa[0] - xb[0], xa[1] - xb[1], xa[2] - xb[2] };
+
+                // d(exp(w, v) x)/d(w, v) = [ -[x]x | I ], negated for b
+                double J[2][3][6];
+                const cv::Vec3f* x[2] = { &xa, &xb };
+                for( int s = 0; s < 2; s++ ) {
+                    const cv::Vec3f& p = *x[s];
+                    double sign = s == 0 ? 1 : -1;
+                    double rows[3][6] = { {     0,  p[2], -p[1], 1, 0, 0 },
+                                          { -p[2],     0,  p[0], 0, 1, 0 },
+                                          {  p[1], -p[0],     0, 0, 0, 1 } };
+                    for( int row = 0; row < 3; row++ )
+                        for( int c = 0; c < 6; c++ )
+                            J[s][row][c] = sign*rows[row][c];
+                }
+
+                int v[2] = { va, vb };
+                for( int s = 0; s < 2; s++ ) {
+                    if( v[s] < 0 )
+                        continue;
+                    for( int c = 0; c < 6; c++ ) {
+                        double& gc = g.at< double >( 6*v[s] + c, 0 );
+                        for( int row = 0; row < 3; row++ )
+                            gc += J[s][row][c]*r[row];
+                        for( int t = 0; t < 2; t++ ) {
+                            if( v[t] < 0 )
+                                continue;
+                            for( int d = 0; d < 6; d++ ) {
+                                double sum = 0;
+                                for( int row = 0; row < 3; row++ )
+                                    sum += J[s][row][c]*J[t][row][d];
+                                H.at< double >( 6*v[s] + c, 6*v[t] + d ) += sum;
+                            }
+                        }
+                    }
+                }
+            }
+        }
+
+        // A touch of damping keeps a barely constrained camera from blowing up
+        for( int k = 0; k < 6*vars; k++ ) {
+            H.at< double >( k, k ) += 1e-9;
+            g.at< double >( k, 0 ) = -g.at< double >( k, 0 );
+        }
+        cv::Mat x;
+        if( !cv::solve( H, g, x, cv::DECOMP_CHOLESKY ) )
+            break;
+
+        double update = 0;
+        for( int cam = 0; cam < n; cam++ ) {
+            if( var[cam] < 0 )
+                continue;
+            double twist[6];
+            for( int c = 0; c < 6; c++ ) {
+                twist[c] = x.at< double >( 6*var[cam] + c, 0 );
+                update += twist[c]*twist[c];
+            }
+            poses[cam] = RigidTransform::fromTwist( twist )*poses[cam];
+        }
+        if( sqrt( update ) < REFINE_MIN_UPDATE )
+            break;
+    }
+
+    double total = 0;
+    int count = 0;
+    for( int k = 0; k < (int)pairs.size(); k++ ) {
+        RegistrationEdge& e = pairs[k];
+        if( !placed( e.a ) || !placed( e.b ) )
+            continue;
+        double sum = 0;
+        int used = 0;
+        for( int i = 0; i < (int)e.A.size(); i++ ) {
+            if( !e.inlier[i] )
+                continue;
+            cv::Vec3f d = poses[e.a]( e.A.point( i ) ) - poses[e.b]( e.B.point( i ) );
+            sum += d[0]*d[0] + d[1]*d[1] + d[2]*d[2];
+            used++;
+        }
+        if( used )
+            e.rms = (float)sqrt( sum/used );
+        total += sum;
+        count += used;
+    }
+    residual = count ? (float)sqrt( total/count ) : 0;
+}
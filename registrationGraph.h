@@ -0,0 +1,97 @@
+#ifndef KINREG_REGISTRATION_GRAPH_H
+#define KINREG_REGISTRATION_GRAPH_H
+
+#include "rigidTransform.h"
+#include "procrustes.h"
+// ---- OpenCV -----
+#include <cv.h>
+// --- C++ ---
+#include <vector>
+
+class ThreadPool;
+
+// The correspondences between one pair of cameras, a < b
+struct RegistrationEdge {
+    int a, b;
+    PointCloud A, B;                // point i of A in a's space matches B's in b's
+    ProcrustesAccumulator sums;     // every pair in A and B, for fitPair()
+    bool solved;
+    ProcrustesResult result;        // takes a's points onto b's, inliers only
+    std::vector< uint8_t > inlier;  // per pair, rejected ones are left out of the poses
+    float rms;                      // inlier residual with the final poses, meters
+};
+
+/*
+ * Registration of N cameras into one world frame, the reference camera's.
+ *
+ * Click pairs are collected per camera pair. solve() runs RANSAC
+ * Procrustes on every pair with enough of them in parallel, so a bad click
+ * gets thrown out instead of dragging the pose, chains the most
+ * trustworthy pairs into a spanning tree from the reference camera to get
+ * a first set of poses, then refines all poses together over every inlier
+ * so that loops in the graph agree with each other.
+ *
+ * Nothing here knows about GL or the capture threads, kinReg drives it.
+ */
+class RegistrationGraph {
+public:
+    RegistrationGraph( int cameras = 2, int reference = 0 );
+
+    int numCameras() const { return (int)poses.size(); }
+    int reference() const { return ref; }
+
+    // Metric points a (in camera camA) and b (in camB) are the same spot
+    void addCorrespondence( int camA, const cv::Vec3f& a, int camB, const cv::Vec3f& b );
+    int correspondences( int camA, int camB ) const;
+    // Plain Procrustes on every pair collected so far, camA's points onto
+    // camB's, from running sums: microseconds, but no outlier rejection.
+    // For feedback while collecting, solve() is the real thing.
+    bool fitPair( int camA, int camB, ProcrustesResult& result ) const;
+    // Forgets the click pairs, the poses from the last solve() stay
+    void clearCorrespondences();
+
+    // Solves the pairs on pool (the shared one if 0) and places every
+    // camera reachable from the reference. Returns how many are placed.
+    int solve( ThreadPool* pool = 0 );
+
+    // Outlier rejection used by solve()
+    void setRansac( const RansacParams& params ) { ransac = params; }
+    const RansacParams& ransacParameters() const { return ransac; }
+
+    // Camera to world. Unplaced cameras are left where they are.
+    bool placed( int cam ) const { return parents[cam] != -2; }
+    const RigidTransform& pose( int cam ) const { return poses[cam]; }
+    void setPose( int cam, const RigidTransform& T ) { poses[cam] = T; }
+    // Puts back poses, tree and centroids saved from an earlier solve().
+    // Cameras whose parent chain doesn't reach the reference stay unplaced.
+    void restore( const std::vector< RigidTransform >& poses, const std::vector< int >& parents,
+                  const std::vector< cv::Vec3f >& centroids );
+
+    // The camera cam was chained from (-1 for the reference, -2 unplaced),
+    // and the placed cameras parents first
+    int parent( int cam ) const { return parents[cam]; }
+    const std::vector< int >& placementOrder() const { return order; }
+
+    // Mean of the camera's click points at the last solve(), its own space
+    const cv::Vec3f& centroid( int cam ) const { return centroids[cam]; }
+
+    // RMS over every inlier with the final poses, meters
+    float rms() const { return residual; }
+    const std::vector< RegistrationEdge >& edges() const { return pairs; }
+
+private:
+    RegistrationEdge& edge( int a, int b );
+    void chain();
+    void refine();
+
+    int ref;
+    std::vector< RegistrationEdge > pairs;
+    std::vector< RigidTransform > poses;
+    std::vector< int > parents;
+    std::vector< int > order;
+    std::vector< cv::Vec3f > centroids;
+    float residual;
+    RansacParams ransac;
+};
+
+#endif
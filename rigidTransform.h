@@ -0,0 +1,63 @@
+#ifndef KINREG_RIGID_TRANSFORM_H
+#define KINREG_RIGID_TRANSFORM_H
+
+// ---- OpenCV -----
+#include <cv.h>
+// --- C++ ---
+#include <math.h>
+
+/*
+ * x -> R*x + t. This is what registration produces for a camera pair: it
+ * takes points from one camera's space into the other's.
+ */
+struct RigidTransform {
+    cv::Matx33f R;
+    cv::Vec3f t;
+
+    RigidTransform() : R( cv::Matx33f::eye() ), t( 0, 0, 0 ) {}
+    RigidTransform( const cv::Matx33f& R, const cv::Vec3f& t ) : R( R ), t( t ) {}
+
+    cv::Vec3f operator()( const cv::Vec3f& p ) const {
+        return cv::Vec3f( R(0,0)*p[0] + R(0,1)*p[1] + R(0,2)*p[2] + t[0],
+                          R(1,0)*p[0] + R(1,1)*p[1] + R(1,2)*p[2] + t[1],
+                          R(2,0)*p[0] + R(2,1)*p[1] + R(2,2)*p[2] + t[2] );
+    }
+
+    // (a*b)(x) = a(b(x))
+    RigidTransform operator*( const RigidTransform& b ) const {
+        return RigidTransform( R*b.R, (*this)( b.t ) );
+    }
+
+    RigidTransform inverse() const {
+        cv::Matx33f Rt = R.t();
+        cv::Vec3f ti = RigidTransform( Rt, cv::Vec3f( 0, 0, 0 ) )( t );
+        return RigidTransform( Rt, cv::Vec3f( -ti[0], -ti[1], -ti[2] ) );
+    }
+
+    // Small motion (rx, ry, rz, tx, ty, tz) as a transform, rotation by
+    // Rodrigues' formula. This is how the iterative solvers apply updates.
+    static RigidTransform fromTwist( const double x[6] ) {
+        double theta = sqrt( x[0]*x[0] + x[1]*x[1] + x[2]*x[2] );
+        cv::Matx33d R = cv::Matx33d::eye();
+        if( theta > 1e-12 ) {
+            double k[3] = { x[0]/theta, x[1]/theta, x[2]/theta };
+            cv::Matx33d K( 0, -k[2], k[1], k[2], 0, -k[0], -k[1], k[0], 0 );
+            R = R + K*sin( theta ) + K*K*( 1 - cos( theta ) );
+        }
+        return RigidTransform( cv::Matx33f( R ), 
+                               cv::Vec3f( (float)x[3], (float)x[4], (float)x[5] ) );
+    }
+
+    // 4x4 in OpenGL's column major order, ready for glMultMatrixf
+    void toGL( float m[16] ) const {
+        for( int r = 0; r < 3; r++ ) {
+            for( int c = 0; c < 3; c++ )
+                m[4*c + r] = R(r,c);
+            m[12 + r] = t[r];
+            m[4*r + 3] = 0;
+        }
+        m[15] = 1;
+    }
+};
+
+#endif
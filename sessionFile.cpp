@@ -0,0 +1,382 @@
+#include "sessionFile.h"
+// --- POSIX ---
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+// --- C++ ---
+#include <string.h>
+#include <algorithm>
+#include <thread>
+
+static const char SESSION_MAGIC[8] = "KINSESS";
+static const uint32_t SESSION_RECORD_MAGIC = 0x304d5246;   // "FRM0"
+static const size_t SESSION_ALIGN = 64;
+static const size_t RGB_BYTES = KINECT_PIXELS*3;
+static const size_t DEPTH_BYTES = KINECT_PIXELS*2;
+
+// ---------------------------------------------------------------------------
+// Depth codec
+//
+//  0x00 - 0x7e         value = previous + ( byte - 63 )
+//  0x7f n              n + 1 pixels of KINECT_DEPTH_INVALID
+//  0x80 | hi, lo       value = hi << 8 | lo
+//
+// "previous" is the last valid pixel, carried across rows, 0 at the start.
+
+size_t compressDepth( const uint16_t* depth, uint8_t* out ) {
+
+    uint8_t* o = out;
+    int pred = 0;
+    for( int i = 0; i < KINECT_PIXELS; ) {
+        // Every token is at most two bytes. Once the next one could reach
+        // the raw size compressing is pointless (and the reader only takes
+        // delta records smaller than raw).
+        if( o - out + 2 >= (ptrdiff_t)DEPTH_BYTES )
+            return 0;
+
+        int d = depth[i];
+        if( d == KINECT_DEPTH_INVALID ) {
+            int run = 1;
+            while( run < 256 && i + run < KINECT_PIXELS && depth[i + run] == KINECT_DEPTH_INVALID )
+                run++;
+            *o++ = 0x7f;
+            *o++ = (uint8_t)( run - 1 );
+            i += run;
+            continue;
+        }
+        if( d > 0x7fff )
+            return 0;
+
+        int delta = d - pred;
+        if( delta >= -63 && delta <= 63 )
+            *o++ = (uint8_t)( delta + 63 );
+        else {
+            *o++ = (uint8_t)( 0x80 | d >> 8 );
+            *o++ = (uint8_t)( d & 0xff );
+        }
+        pred = d;
+        i++;
+    }
+    return o - out;
+}
+
+bool decompressDepth( const uint8_t* in, size_t bytes, uint16_t* depth ) {
+
+    const uint8_t* end = in + bytes;
+    int pred = 0;
+    int i = 0;
+    while( in < end && i < KINECT_PIXELS ) {
+        int b = *in++;
+        if( b < 0x7f ) {
+            pred += b - 63;
+            depth[i++] = (uint16_t)pred;
+        }
+        else if( in == end )
+            return false;
+        else if( b == 0x7f ) {
+            int run = *in++ + 1;
+            if( i + run > KINECT_PIXELS )
+                return false;
+            for( int k = 0; k < run; k++ )
+                depth[i++] = KINECT_DEPTH_INVALID;
+        }
+        else {
+            pred = ( b & 0x7f ) << 8 | *in++;
+            depth[i++] = (uint16_t)pred;
+        }
+    }
+    return i == KINECT_PIXELS && in == end;
+}
+
+// ---------------------------------------------------------------------------
+// SessionWriter
+
+SessionWriter::SessionWriter( const std::string& path, int numCams, bool compress )
+    : numCams( numCams ), compress( compress ), scratch( numCams ), written( 0 ) {
+
+    memset( &header, 0, sizeof( header ) );
+    memcpy( header.magic, SESSION_MAGIC, sizeof( header.magic ) );
+    header.version = SESSION_VERSION;
+    header.numCams = numCams;
+    header.width = KINECT_WIDTH;
+    header.height = KINECT_HEIGHT;
+    header.startTime = monotonicSeconds();
+
+    file = fopen( path.c_str(), "wb" );
+    if( file && fwrite( &header, sizeof( header ), 1, file ) != 1 ) {
+        fclose( file );
+        file = 0;
+    }
+    written = sizeof( header );
+
+    if( compress )
+        for( int cam = 0; cam < numCams; cam++ )
+            scratch[cam].resize( DEPTH_BYTES );
+}
+
+SessionWriter::~SessionWriter() {
+    close();
+}
+
+bool SessionWriter::write( int cam, const uint8_t* rgb, const uint16_t* depth,
+                           double timestamp, uint32_t deviceTimestamp, uint32_t sequence ) {
+
+    if( !file || cam < 0 || cam >= numCams )
+        return false;
+
+    SessionRecord r;
+    memset( &r, 0, sizeof( r ) );
+    r.magic = SESSION_RECORD_MAGIC;
+    r.cam = cam;
+    r.sequence = sequence;
+    r.deviceTimestamp = deviceTimestamp;
+    r.timestamp = timestamp;
+    r.depthCodec = SESSION_DEPTH_RAW;
+    r.depthBytes = DEPTH_BYTES;
+
+    // Only this camera's thread touches its scratch buffer
+    const void* depthData = depth;
+    if( compress ) {
+        size_t n = compressDepth( depth, &scratch[cam][0] );
+        if( n ) {
+            r.depthCodec = SESSION_DEPTH_DELTA;
+            r.depthBytes = (uint32_t)n;
+            depthData = &scratch[cam][0];
+        }
+    }
+
+    static const uint8_t zeros[SESSION_ALIGN] = { 0 };
+    size_t size = sizeof( r ) + RGB_BYTES + r.depthBytes;
+    size_t pad = ( SESSION_ALIGN - size % SESSION_ALIGN ) % SESSION_ALIGN;
+
+    std::lock_guard< std::mutex > hold( lock );
+    if( !file )
+        return false;
+    SessionIndexEntry e = { written, timestamp, (uint32_t)cam, sequence };
+    bool ok = fwrite( &r, sizeof( r ), 1, file ) == 1 &&
+              fwrite( rgb, RGB_BYTES, 1, file ) == 1 &&
+              fwrite( depthData, r.depthBytes, 1, file ) == 1 &&
+              ( !pad || fwrite( zeros, pad, 1, file ) == 1 );
+    if( !ok ) {
+        // Disk full or similar. Back up so the next record (or the index)
+        // overwrites whatever half made it out.
+        fseek( file, (long)written, SEEK_SET );
+        return false;
+    }
+    written += size + pad;
+    index.push_back( e );
+    return true;
+}
+
+int SessionWriter::records() const {
+    std::lock_guard< std::mutex > hold( lock );
+    return (int)index.size();
+}
+
+uint64_t SessionWriter::bytesWritten() const {
+    std::lock_guard< std::mutex > hold( lock );
+    return written;
+}
+
+void SessionWriter::close() {
+
+    std::lock_guard< std::mutex > hold( lock );
+    if( !file )
+        return;
+    header.records = (uint32_t)index.size();
+    header.indexOffset = written;
+    if( !index.empty() )
+        fwrite( &index[0], sizeof( SessionIndexEntry ), index.size(), file );
+    fseek( file, 0, SEEK_SET );
+    fwrite( &header, sizeof( header ), 1, file );
+    fclose( file );
+    file = 0;
+}
+
+// ---------------------------------------------------------------------------
+// SessionSource
+
+SessionSource::SessionSource( const std::string& path, double speed )
+    : map( 0 ), mapBytes( 0 ), period( speed > 0 ? 1/speed : 0 ),
+      firstTime( 0 ), duration( 0 ), playbackStart( 0 ) {
+
+    int fd = open( path.c_str(), O_RDONLY );
+    if( fd < 0 )
+        return;
+    struct stat st;
+    if( fstat( fd, &st ) == 0 && st.st_size >= (off_t)sizeof( SessionHeader ) ) {
+        void* p = mmap( 0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+        if( p != MAP_FAILED ) {
+            map = (const uint8_t*)p;
+            mapBytes = st.st_size;
+        }
+    }
+    ::close( fd );
+    if( !map )
+        return;
+    // Playback walks the file front to back
+    madvise( (void*)map, mapBytes, MADV_SEQUENTIAL );
+
+    SessionHeader h;
+    memcpy( &h, map, sizeof( h ) );
+    if( memcmp( h.magic, SESSION_MAGIC, sizeof( h.magic ) ) != 0 || h.version != SESSION_VERSION ||
+        h.width != (uint32_t)KINECT_WIDTH || h.height != (uint32_t)KINECT_HEIGHT || !scan( h ) ) {
+        munmap( (void*)map, mapBytes );
+        map = 0;
+        cams.clear();
+        return;
+    }
+    playbackStart = monotonicSeconds();
+}
+
+SessionSource::~SessionSource() {
+    if( map )
+        munmap( (void*)map, mapBytes );
+}
+
+bool SessionSource::scan( const SessionHeader& h ) {
+
+    if( h.numCams == 0 || h.numCams > 64 )
+        return false;
+    cams.resize( h.numCams );
+    for( int cam = 0; cam < (int)cams.size(); cam++ ) {
+        cams[cam].next = 0;
+        cams[cam].loopOffset = 0;
+    }
+
+    // Anything that doesn't check out ends the scan, a torn last record
+    // from a crash just gets dropped
+    auto recordAt = [&]( uint64_t offset ) -> const SessionRecord* {
+        if( offset % SESSION_ALIGN || offset < sizeof( SessionHeader ) ||
+            offset + sizeof( SessionRecord ) > mapBytes )
+            return 0;
+        const SessionRecord* r = (const SessionRecord*)( map + offset );
+        bool sane = r->magic == SESSION_RECORD_MAGIC && r->cam < h.numCams &&
+                    ( r->depthCodec == SESSION_DEPTH_RAW ? r->depthBytes == DEPTH_BYTES
+                                                         : r->depthCodec == SESSION_DEPTH_DELTA &&
+                                                           r->depthBytes < DEPTH_BYTES );
+        if( !sane || offset + sizeof( SessionRecord ) + RGB_BYTES + r->depthBytes > mapBytes )
+            return 0;
+        return r;
+    };
+
+    std::vector< const SessionRecord* > all;
+    uint64_t indexBytes = (uint64_t)h.records*sizeof( SessionIndexEntry );
+    if( h.indexOffset && h.indexOffset + indexBytes <= mapBytes ) {
+        const SessionIndexEntry* index = (const SessionIndexEntry*)( map + h.indexOffset );
+        for( uint32_t k = 0; k < h.records; k++ ) {
+            const SessionRecord* r = recordAt( index[k].offset );
+            if( !r )
+                break;
+            all.push_back( r );
+        }
+    }
+    else {
+        // No index, the recording didn't get closed. Walk the records.
+        uint64_t offset = sizeof( SessionHeader );
+        while( const SessionRecord* r = recordAt( offset ) ) {
+            all.push_back( r );
+            size_t size = sizeof( SessionRecord ) + RGB_BYTES + r->depthBytes;
+            offset += ( size + SESSION_ALIGN - 1 )/SESSION_ALIGN*SESSION_ALIGN;
+        }
+    }
+    if( all.empty() )
+        return false;
+
+    double lastTime = firstTime = all[0]->timestamp;
+    for( int k = 0; k < (int)all.size(); k++ ) {
+        cams[all[k]->cam].records.push_back( all[k] );
+        firstTime = std::min( firstTime, all[k]->timestamp );
+        lastTime = std::max( lastTime, all[k]->timestamp );
+        if( all[k]->depthCodec != SESSION_DEPTH_RAW )
+            cams[all[k]->cam].decoded.resize( KINECT_PIXELS );
+    }
+    // One frame's worth of gap before looping back to the start
+    duration = lastTime - firstTime + 1/30.0;
+    return true;
+}
+
+bool SessionSource::viewRecord( int cam, const SessionRecord* r, FrameView& v ) {
+
+    v.rgb = (const uint8_t*)( r + 1 );
+    v.deviceTimestamp = r->deviceTimestamp;
+    const uint8_t* depth = v.rgb + RGB_BYTES;
+    if( r->depthCodec == SESSION_DEPTH_RAW ) {
+        v.depth = (const uint16_t*)depth;
+        return true;
+    }
+    std::vector< uint16_t >& out = cams[cam].decoded;
+    v.depth = &out[0];
+    return decompressDepth( depth, r->depthBytes, &out[0] );
+}
+
+bool SessionSource::view( int cam, FrameView& v ) {
+
+    if( cam < 0 || cam >= (int)cams.size() || cams[cam].records.empty() )
+        return false;
+    Camera& c = cams[cam];
+    if( c.next == c.records.size() ) {
+        c.next = 0;
+        c.loopOffset += duration;
+    }
+    const SessionRecord* r = c.records[c.next++];
+
+    // Recorded pace, scaled
+    if( period > 0 ) {
+        double due = playbackStart + ( r->timestamp - firstTime + c.loopOffset )*period;
+        double now = monotonicSeconds();
+        if( due > now )
+            std::this_thread::sleep_for( std::chrono::duration< double >( due - now ) );
+    }
+    return viewRecord( cam, r, v );
+}
+
+bool SessionSource::grab( int cam, Frame& frame ) {
+    FrameView v;
+    if( !view( cam, v ) )
+        return false;
+    memcpy( frame.rgb, v.rgb, sizeof( frame.rgb ) );
+    memcpy( frame.depth, v.depth, sizeof( frame.depth ) );
+    frame.deviceTimestamp = v.deviceTimestamp;
+    return true;
+}
+
+bool SessionSource::read( int cam, int i, Frame& frame ) {
+
+    if( cam < 0 || cam >= (int)cams.size() || i < 0 || i >= frames( cam ) )
+        return false;
+    const SessionRecord* r = cams[cam].records[i];
+    FrameView v;
+    if( !viewRecord( cam, r, v ) )
+        return false;
+    memcpy( frame.rgb, v.rgb, sizeof( frame.rgb ) );
+    memcpy( frame.depth, v.depth, sizeof( frame.depth ) );
+    frame.deviceTimestamp = v.deviceTimestamp;
+    frame.timestamp = r->timestamp;
+    frame.sequence = r->sequence;
+    return true;
+}
+
+// ---------------------------------------------------------------------------
+
+FrameSource* openRecording( const std::string& path, int numCams, double speed ) {
+
+    struct stat st;
+    if( stat( path.c_str(), &st ) != 0 )
+        return 0;
+
+    if( S_ISDIR( st.st_mode ) ) {
+        FileSource* files = new FileSource( path, numCams, speed > 0 ? 30*speed : 0 );
+        if( files->isOpen() )
+            return files;
+        delete files;
+        return 0;
+    }
+
+    SessionSource* session = new SessionSource( path, speed );
+    if( session->isOpen() )
+        return session;
+    delete session;
+    return 0;
+}
@@ -0,0 +1,166 @@
+#ifndef KINREG_SESSION_FILE_H
+#define KINREG_SESSION_FILE_H
+
+#include "kinect.h"
+#include "frameSource.h"
+// --- C++ ---
+#include <stdio.h>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/*
+ * Recorded sessions: every camera's frames in one file, in the order they
+ * were captured.
+ *
+ *      header      64 bytes, see SessionHeader
+ *      records     one per frame, each starting on a 64 byte boundary:
+ *                  64 byte SessionRecord, the RGB image (640x480x3) and
+ *                  the depth, raw uint16 or compressed (see compressDepth)
+ *      index       one SessionIndexEntry per record, header.indexOffset
+ *                  points at it
+ *
+ * Everything is in host byte order. The index is written last, a session
+ * cut short by a crash is still readable, the records get scanned instead.
+ */
+
+const uint32_t SESSION_VERSION = 1;
+
+enum SessionDepthCodec {
+    SESSION_DEPTH_RAW = 0,
+    SESSION_DEPTH_DELTA = 1
+};
+
+struct SessionHeader {
+    char magic[8];              // "KINSESS\0"
+    uint32_t version;
+    uint32_t numCams;
+    uint32_t width, height;
+    uint32_t records;
+    uint32_t reserved0;
+    uint64_t indexOffset;       // 0 until the recording was closed cleanly
+    double startTime;           // monotonicSeconds() when recording started
+    uint8_t reserved[16];
+};
+
+struct SessionRecord {
+    uint32_t magic;             // SESSION_RECORD_MAGIC
+    uint32_t cam;
+    uint32_t sequence;
+    uint32_t deviceTimestamp;
+    double timestamp;           // host monotonic seconds at capture
+    uint32_t depthCodec;
+    uint32_t depthBytes;
+    uint8_t reserved[24];
+};
+
+struct SessionIndexEntry {
+    uint64_t offset;            // of the SessionRecord
+    double timestamp;
+    uint32_t cam;
+    uint32_t sequence;
+};
+
+/*
+ * Lossless depth codec. Each pixel is predicted by the last valid one, a
+ * difference within +-63 costs one byte, anything else two, and runs of
+ * "no depth" two bytes per 256 pixels, roughly halving a typical frame.
+ * out needs room for 2*KINECT_PIXELS bytes. Returns the compressed size,
+ * always less than 2*KINECT_PIXELS, or 0 if the frame can't be encoded (it
+ * won't get smaller, or has values over 15 bits).
+ */
+size_t compressDepth( const uint16_t* depth, uint8_t* out );
+bool decompressDepth( const uint8_t* in, size_t bytes, uint16_t* depth );
+
+/*
+ * Appends frames to a session file. write() may be called from every
+ * capture thread at once as long as each camera is written by one thread,
+ * compression runs outside the file lock.
+ */
+class SessionWriter {
+public:
+    SessionWriter( const std::string& path, int numCams, bool compress = false );
+    ~SessionWriter();
+
+    bool isOpen() const { return file != 0; }
+
+    bool write( int cam, const uint8_t* rgb, const uint16_t* depth,
+                double timestamp, uint32_t deviceTimestamp, uint32_t sequence );
+    bool write( int cam, const Frame& f ) {
+        return write( cam, f.rgb, f.depth, f.timestamp, f.deviceTimestamp, f.sequence );
+    }
+
+    // Writes the index and finishes the header. Called by the destructor.
+    void close();
+
+    // Safe to call while capture threads write
+    int records() const;
+    uint64_t bytesWritten() const;
+
+private:
+    SessionWriter( const SessionWriter& );
+    SessionWriter& operator=( const SessionWriter& );
+
+    FILE* file;
+    int numCams;
+    bool compress;
+    SessionHeader header;
+    std::vector< std::vector< uint8_t > > scratch;  // per camera
+    std::vector< SessionIndexEntry > index;
+    uint64_t written;
+    mutable std::mutex lock;    // guards file, index and written
+};
+
+/*
+ * Replays a session file as if the cameras were attached. The file is
+ * memory mapped and view() hands out pointers straight into it (raw depth)
+ * or into a per-camera decode buffer (compressed depth), so capture copies
+ * each image once, into its triple buffer.
+ *
+ * speed 1 serves frames at the pace they were recorded, 2 twice as fast
+ * and 0 as fast as they're asked for. Every camera loops when it runs out.
+ */
+class SessionSource : public FrameSource {
+public:
+    SessionSource( const std::string& path, double speed = 1 );
+    ~SessionSource();
+
+    bool isOpen() const { return map != 0; }
+    int numCameras() const { return (int)cams.size(); }
+
+    bool grab( int cam, Frame& frame );
+    bool canView() const { return true; }
+    bool view( int cam, FrameView& v );
+
+    // Random access for tools. i counts the camera's own frames.
+    int frames( int cam ) const { return (int)cams[cam].records.size(); }
+    bool read( int cam, int i, Frame& frame );
+
+private:
+    SessionSource( const SessionSource& );
+    SessionSource& operator=( const SessionSource& );
+
+    struct Camera {
+        std::vector< const SessionRecord* > records;
+        std::vector< uint16_t > decoded;
+        size_t next;
+        double loopOffset;      // playback time added by previous loops
+    };
+
+    bool scan( const SessionHeader& h );
+    bool viewRecord( int cam, const SessionRecord* r, FrameView& v );
+
+    const uint8_t* map;
+    size_t mapBytes;
+    double period;              // 1/speed, 0 for as fast as possible
+    double firstTime, duration; // recorded times
+    double playbackStart;
+    std::vector< Camera > cams;
+};
+
+// A SessionSource if path is a file, a FileSource if it's a directory.
+// Returns 0 if neither opens. speed as for SessionSource (FileSource
+// dumps play at 30 fps times speed).
+FrameSource* openRecording( const std::string& path, int numCams, double speed = 1 );
+
+#endif
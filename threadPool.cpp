@@ -0,0 +1,99 @@
+#include "threadPool.h"
+// --- C++ ---
+#include <algorithm>
+#include <atomic>
+#include <memory>
+
+ThreadPool::ThreadPool( int threads ) : stopping( false ) {
+    if( threads == 0 )
+        threads = std::max( 1u, std::thread::hardware_concurrency() );
+    for( int i = 0; i < threads; i++ )
+        workers.push_back( std::thread( &ThreadPool::run, this ) );
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard< std::mutex > guard( lock );
+        stopping = true;
+    }
+    wake.notify_all();
+    for( int i = 0; i < (int)workers.size(); i++ )
+        workers[i].join();
+}
+
+ThreadPool& ThreadPool::shared() {
+    static ThreadPool pool;
+    return pool;
+}
+
+void ThreadPool::run() {
+    for( ;; ) {
+        std::function< void() > task;
+        {
+            std::unique_lock< std::mutex > guard( lock );
+            wake.wait( guard, [this] { return stopping || !tasks.empty(); } );
+            if( tasks.empty() )
+                return;
+            task = tasks.front();
+            tasks.pop_front();
+        }
+        task();
+    }
+}
+
+void ThreadPool::submit( const std::function< void() >& task ) {
+    {
+        std::lock_guard< std::mutex > guard( lock );
+        tasks.push_back( task );
+    }
+    wake.notify_one();
+}
+
+// Shared between the caller and its helpers. Helpers that only get to run
+// after the loop finished find nothing left to do, which is why this lives
+// on the heap rather than the caller's stack.
+struct LoopState {
+    std::function< void( int ) > fn;
+    int n;
+    std::atomic< int > next;
+    std::atomic< int > done;
+    std::mutex lock;
+    std::condition_variable finished;
+
+    void work() {
+        int i, count = 0;
+        while( ( i = next++ ) < n ) {
+            fn( i );
+            count++;
+        }
+        if( count && ( done += count ) == n ) {
+            std::lock_guard< std::mutex > guard( lock );
+            finished.notify_all();
+        }
+    }
+};
+
+void ThreadPool::parallelFor( int n, const std::function< void( int ) >& fn ) {
+
+    if( n <= 0 )
+        return;
+    if( n == 1 || workers.empty() ) {
+        for( int i = 0; i < n; i++ )
+            fn( i );
+        return;
+    }
+
+    std::shared_ptr< LoopState > state( new LoopState );
+    state->fn = fn;
+    state->n = n;
+    state->next = 0;
+    state->done = 0;
+
+    int helpers = std::min( n - 1, size() );
+    for( int h = 0; h < helpers; h++ )
+        submit( [state] { state->work(); } );
+
+    state->work();
+    std::unique_lock< std::mutex > guard( state->lock );
+    state->finished.wait( guard, [&state] { return state->done == state->n; } );
+}
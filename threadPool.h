@@ -0,0 +1,50 @@
+#ifndef KINREG_THREAD_POOL_H
+#define KINREG_THREAD_POOL_H
+
+// --- C++ ---
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+ * Fixed set of worker threads for the CPU heavy stages.
+ *
+ * parallelFor() is the main entry point. The calling thread works on the
+ * loop too, so it's safe to call from inside a task (nested loops just run
+ * with less help) and it never deadlocks on a busy pool.
+ */
+class ThreadPool {
+public:
+    // 0 threads means one per hardware thread, a negative count none at
+    // all (parallelFor() then runs everything on the caller)
+    explicit ThreadPool( int threads = 0 );
+    ~ThreadPool();
+
+    int size() const { return (int)workers.size(); }
+
+    // Runs fn(i) for every i in [0, n) and returns once all of them are done
+    void parallelFor( int n, const std::function< void( int ) >& fn );
+
+    // Queues task to run on some worker, returns straight away
+    void submit( const std::function< void() >& task );
+
+    // The pool most of the program shares
+    static ThreadPool& shared();
+
+private:
+    ThreadPool( const ThreadPool& );
+    ThreadPool& operator=( const ThreadPool& );
+
+    void run();
+
+    std::vector< std::thread > workers;
+    std::deque< std::function< void() > > tasks;
+    std::mutex lock;
+    std::condition_variable wake;
+    bool stopping;
+};
+
+#endif
@@ -0,0 +1,53 @@
+#ifndef KINREG_TRIPLE_BUFFER_H
+#define KINREG_TRIPLE_BUFFER_H
+
+// --- C++ ---
+#include <atomic>
+
+/*
+ * Lock-free single producer / single consumer triple buffer.
+ *
+ * The producer always owns one slot (back) and the consumer one slot
+ * (front). The third slot sits in the middle and is swapped atomically
+ * with whichever side is done. Neither side ever waits: the producer
+ * overwrites stale frames nobody picked up, and the consumer keeps its
+ * current slot if nothing new has been published.
+ */
+template< typename T >
+class TripleBuffer {
+public:
+    TripleBuffer() : middle( 1 ), back( 0 ), front( 2 ) {}
+
+    // Producer side. Fill writeBuffer() then publish() it.
+    T& writeBuffer() { return slots[back]; }
+    void publish() {
+        unsigned prev = middle.exchange( back | FRESH, std::memory_order_acq_rel );
+        back = prev & INDEX;
+    }
+
+    // Consumer side. update() swaps in the newest published slot and
+    // returns true, or returns false and leaves readBuffer() alone if
+    // nothing was published since the last call.
+    bool update() {
+        if( !( middle.load( std::memory_order_relaxed ) & FRESH ) )
+            return false;
+        unsigned prev = middle.exchange( front, std::memory_order_acq_rel );
+        front = prev & INDEX;
+        return true;
+    }
+    const T& readBuffer() const { return slots[front]; }
+    T& readBuffer() { return slots[front]; }
+
+private:
+    enum { INDEX = 3, FRESH = 4 };
+
+    TripleBuffer( const TripleBuffer& );
+    TripleBuffer& operator=( const TripleBuffer& );
+
+    T slots[3];
+    std::atomic< unsigned > middle; // slot index | FRESH
+    unsigned back;                  // only touched by the producer
+    unsigned front;                 // only touched by the consumer
+};
+
+#endif
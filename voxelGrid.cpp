@@ -0,0 +1,73 @@
+#include "voxelGrid.h"
+// --- C++ ---
+#include <math.h>
+#include <stdint.h>
+#include <unordered_map>
+
+// Cell coordinates packed 21 bits each, which covers +-1 km at 1 mm leaves
+static inline uint64_t cellKey( float x, float y, float z, float inv ) {
+    const int64_t bias = 1 << 20;
+    uint64_t cx = (uint64_t)( (int64_t)floorf( x*inv ) + bias ) & 0x1FFFFF;
+    uint64_t cy = (uint64_t)( (int64_t)floorf( y*inv ) + bias ) & 0x1FFFFF;
+    uint64_t cz = (uint64_t)( (int64_t)floorf( z*inv ) + bias ) & 0x1FFFFF;
+    return cx | ( cy << 21 ) | ( cz << 42 );
+}
+
+struct Cell { float x, y, z; int count; };
+
+// Point i is ( x[i*stride], y[i*stride], z[i*stride] )
+static void accumulate( const float* x, const float* y, const float* z, int stride, int n, 
+                        float leaf, std::vector< Cell >& sums ) {
+
+    std::unordered_map< uint64_t, int > cells;
+    cells.reserve( n/4 + 1 );
+    sums.clear();
+
+    float inv = 1/leaf;
+    for( int i = 0; i < n; i++ ) {
+        size_t k = (size_t)i*stride;
+        const float p[3] = { x[k], y[k], z[k] };
+        if( !( p[0] == p[0] && p[1] == p[1] && p[2] == p[2] ) )
+            continue;
+        std::pair< std::unordered_map< uint64_t, int >::iterator, bool > it = 
+            cells.insert( std::make_pair( cellKey( p[0], p[1], p[2], inv ), (int)sums.size() ) );
+        if( it.second ) {
+            Cell c = { 0, 0, 0, 0 };
+            sums.push_back( c );
+        }
+        Cell& c = sums[it.first->second];
+        c.x += p[0];
+        c.y += p[1];
+        c.z += p[2];
+        c.count++;
+    }
+}
+
+int voxelDownsample( const float* xyz, int n, float leaf, std::vector< float >& out ) {
+
+    std::vector< Cell > sums;
+    accumulate( xyz, xyz + 1, xyz + 2, 3, n, leaf, sums );
+    out.resize( 3*sums.size() );
+    for( int k = 0; k < (int)sums.size(); k++ ) {
+        out[3*k]   = sums[k].x/sums[k].count;
+        out[3*k+1] = sums[k].y/sums[k].count;
+        out[3*k+2] = sums[k].z/sums[k].count;
+    }
+    return (int)sums.size();
+}
+
+int voxelDownsample( const PointCloud& in, float leaf, PointCloud& out ) {
+
+    std::vector< Cell > sums;
+    accumulate( in.x(), in.y(), in.z(), 1, in.size(), leaf, sums );
+    out.resize( (int)sums.size() );
+    float* x = out.x();
+    float* y = out.y();
+    float* z = out.z();
+    for( int k = 0; k < (int)sums.size(); k++ ) {
+        x[k] = sums[k].x/sums[k].count;
+        y[k] = sums[k].y/sums[k].count;
+        z[k] = sums[k].z/sums[k].count;
+    }
+    return (int)sums.size();
+}
@@ -0,0 +1,18 @@
+#ifndef KINREG_VOXEL_GRID_H
+#define KINREG_VOXEL_GRID_H
+
+#include "pointCloud.h"
+// --- C++ ---
+#include <vector>
+
+/*
+ * Voxel grid downsampling: every occupied leaf x leaf x leaf cell becomes
+ * the centroid of the points that fell in it. Points with NaN coordinates
+ * are skipped. out gets packed xyz, the return value is the point count.
+ */
+int voxelDownsample( const float* xyz, int n, float leaf, std::vector< float >& out );
+
+// Same from and into SoA clouds, out becomes unorganised
+int voxelDownsample( const PointCloud& in, float leaf, PointCloud& out );
+
+#endif